@@ -20,11 +20,321 @@
      to skip the JTAG and TAP modules altogether and provide some direct
      link between the GDB protocol and the core's debugging system.
 
+   Protocol extensions:
+
+     The original byte protocol is still fully supported, as adv_jtag_bridge relies on it.
+     On top of it, this module understands a few extra commands that the original
+     VPI module does not know about. A client should send CMD_QUERY_EXTENSIONS (0x82) first.
+     The reply is a 32-bit little-endian bit mask with the supported extensions (see the EXT_xxx constants).
+     An older module will reject the unknown command and close the connection,
+     in which case the client should reconnect and fall back to the plain byte protocol.
+
+     Vector scan (0x83), available if EXT_VECTOR_SCAN is set:
+
+       Request: 0x83, flags byte, 32-bit little-endian bit count,
+                ceil(bit count / 8) bytes of TMS values, followed by the same number of bytes of TDI values.
+                Bit n is stored in byte n / 8, bit position n % 8 (the LSB goes first).
+                Flag VECTOR_SCAN_FLAG_CAPTURE_TDO (0x01) asks for the TDO values to be sent back.
+
+       For each bit, this module drives TCK low together with the TMS and TDI values,
+       waits for half a TCK period, drives TCK high, waits for another half period, and then samples TDO.
+       That is the same sequence that adv_jtag_bridge generates with the byte protocol
+       (2 data bytes, 2 clock notifications and 1 TDO read), but without the socket round trips.
+       TRST remains deasserted (high) during the whole scan.
+
+       Reply, once the last bit has been clocked: if TDO capture was requested, ceil(bit count / 8) bytes
+       with the TDO values packed as above. Otherwise, a single byte with the value 0x83.
+
+     Streaming mode (0x84), available if EXT_STREAMING is set:
+
+       In the normal protocol, the client must wait for the acknowledge and the clock notification
+       after each data byte, so the throughput depends solely on the socket round-trip time.
+       In streaming mode, the client sends data bytes without waiting.
+       This module applies one data byte per TCK half period, so the pin timing
+       is the same as with a client that waits for each clock notification.
+
+       Request: 0x84. Reply: 0x84 followed by the 16-bit little-endian window size in bytes.
+
+       While streaming, the client may send the following bytes:
+         - JTAG data bytes (0x00 - 0x0F), as in the normal protocol.
+           They are not acknowledged individually.
+         - 0x80 to read TDO. The value is sampled after the half period of the previous data byte has elapsed,
+           and the reply is 0x00 or 0x01 as in the normal protocol.
+         - 0x85 to leave streaming mode. Once all previous bytes have been processed, and the half period
+           of the last data byte has elapsed, this module replies with 0x85 and the normal protocol resumes.
+
+       Every now and then, this module sends a credit message: 0xFD followed by a 16-bit little-endian count
+       of the data bytes and 0x80 commands processed since the last credit message. The client must not
+       have more than 'window size' such bytes outstanding (sent but not yet credited back).
+       All pending credits are sent before the 0x85 reply.
+
+     TAP engine (0x86 - 0x8A), available if EXT_TAP_ENGINE is set:
+
+       This module tracks the state of the IEEE 1149.1 TAP controller from all JTAG pin values it applies,
+       whichever command generated them. The state is unknown until TRST is asserted or TMS
+       has been high for 5 consecutive TCK cycles. The following commands generate
+       the necessary TMS sequences here, which avoids one round trip per TAP state transition.
+       If the current TAP state is unknown, they start with a TAP reset (5 cycles with TMS high).
+       TAP states are encoded as in tap_state_enum below (0 = Test-Logic-Reset, 1 = Run-Test/Idle,
+       4 = Shift-DR, 6 = Pause-DR, 11 = Shift-IR, 13 = Pause-IR, and so on).
+
+       0x86, state: Go to the given state along the shortest path. Reply: 0x86.
+
+       0x87 (IR) or 0x88 (DR), flags byte, end state, 32-bit little-endian bit count,
+       ceil(bit count / 8) bytes of TDI values:
+         Go to Shift-IR or Shift-DR, shift the given bits, leave the Shift state with the last bit
+         and then go to the end state. If the end state is the Shift state itself, the TAP stays there.
+         Flag SCAN_XR_FLAG_CAPTURE_TDO (0x01) asks for the TDO values of the shifted bits.
+         Reply: the TDO values packed as in a vector scan, or a single byte with the command value.
+
+       0x89, 32-bit little-endian cycle count: Go to Run-Test/Idle and stay there for the given number
+         of TCK cycles. Reply: 0x89.
+
+       0x8A: Reply with the current TAP state, or 0xFF if it is unknown.
+
+     Statistics (0x8B), available if EXT_STATISTICS is set:
+
+       Reply: 0x8B, a byte with the number of counters N, and then N 64-bit little-endian counters
+       for the current connection, in the order of the fields in struct link_statistics:
+       connection count (always 1), connected time in microseconds, connected ticks, bytes received,
+       bytes sent, pin updates, TDO reads, clock notification waits, ticks spent waiting for clock notifications,
+       system calls made by the simulation thread, how many of them found no data or no room,
+       and a histogram with the number of ticks between client commands (see TICKS_BETWEEN_COMMANDS_BUCKET_COUNT).
+       Future versions may append more counters. If the number of ticks spent waiting for clock notifications
+       dominates, the simulation is the bottleneck. If most ticks between commands land in the higher buckets,
+       the client or the socket round trips are.
+
+       The same statistics are printed when a connection closes, and the totals for all connections
+       in jtag_dpi_terminate(), as long as informational messages are enabled.
+       jtag_dpi.v calls jtag_dpi_terminate() from a 'final' block at the end of the simulation.
+
+     Backdoor memory access (0x8C - 0x8D), available if EXT_BACKDOOR_MEMORY is set:
+
+       These commands read and write the simulated memory directly, without going through the JTAG pins,
+       the debug interface or the Wishbone bus, and they take no simulated time at all. They are meant
+       for loading and dumping large firmware images, see tools/jtag_dpi_memory.cpp. The main program
+       must provide the memory access routine with jtag_dpi_set_backdoor_memory_access(),
+       otherwise EXT_BACKDOOR_MEMORY is not set. Backdoor writes are not recorded in a session log,
+       so a session that uses them will not replay faithfully.
+
+       0x8C, 32-bit little-endian address, 32-bit little-endian byte count, followed by the data bytes:
+         Write the data at the given address. Reply: 0x8C followed by a status byte.
+
+       0x8D, 32-bit little-endian address, 32-bit little-endian byte count:
+         Reply: 0x8D followed by a status byte, and then, if the status is 0, the given number of data bytes.
+
+       The status is 0 on success, or 1 if the address range is not backed by simulated memory.
+       A single command can transfer up to MAX_BACKDOOR_BYTE_COUNT bytes.
+
+     Wait for TDO (0x8E), available if EXT_WAIT_FOR_TDO is set:
+
+       Debug clients spend much of their time polling, for example reading the CPU stall status
+       over and over until the CPU hits a breakpoint. With this command, the polling loop runs here,
+       and the socket stays quiet until the condition is met.
+
+       Request: 0x8E, 32-bit little-endian bit count, 32-bit little-endian interval in TCK cycles,
+                32-bit little-endian maximum number of attempts, followed by 4 vectors of
+                ceil(bit count / 8) bytes each, packed as in a vector scan: the TMS values, the TDI values,
+                the TDO mask and the expected TDO values.
+
+       Each attempt clocks the TMS and TDI values like a vector scan and captures all TDO values.
+       The wait is over when the captured values match the expected ones in all bits set in the mask,
+       or when the maximum number of attempts has been made. Otherwise, the pins stay unchanged
+       for the given number of TCK cycles, and then the next attempt starts. The sequence should
+       therefore end in the same TAP state it starts in, normally Run-Test/Idle.
+       If the client sends anything before the next attempt starts, the wait is cancelled,
+       and the data is then processed as usual. This way, a client can still stop the CPU
+       when the user presses Ctrl+C in GDB.
+
+       Reply: 0x8E, a status byte, the number of attempts made as a 32-bit little-endian value,
+              and the TDO values of the last attempt, packed as above. The status is 0 if the TDO values matched,
+              1 if the maximum number of attempts was reached, and 2 if the client cancelled the wait.
+
+   Built-in GDB server:
+
+     If gdb_tcp_port is not zero, this module listens on that port for GDB's Remote Serial Protocol
+     and implements a GDB stub for the OpenRISC core behind the Advanced Debug Interface (adv_dbg_if),
+     which makes adv_jtag_bridge unnecessary. The GDB packets are translated into adv_dbg_if commands
+     (module select, burst read/write with CRC, CPU stall control) that are shifted through
+     the TAP engine described above, at the normal TCK rate.
+
+     A GDB command normally needs several scans, for example reading the registers needs one burst
+     for the GPRs and another one for NPC, SR and PPC. Each step is a "job": a queue of scans
+     and a continuation routine that runs after the last scan has completed. The continuation
+     checks the captured TDO data (retrying on CRC errors) and starts the next job or replies to GDB.
+
+     Supported packets: ?, g, G, p, P, m, M, c, s, Z0/z0 (software breakpoints with l.trap), D, k,
+     H, qSupported and qAttached. All others get an empty reply, which means "not supported".
+     A request that fails, for example because it is malformed, or because a memory address
+     does not answer on the Wishbone bus, gets the error reply E01, and the session goes on.
+     Only socket errors and broken packet framing close the connection.
+
+     Only one connection can drive the JTAG pins at a time. A GDB connection is only accepted
+     while no JTAG client is connected, and JTAG clients wait while a GDB session is active.
+
+     When GDB detaches with 'D', or the connection ends in any other way (GDB crashed, 'k',
+     a socket error), the original instructions are written back at all breakpoint addresses,
+     single-stepping is turned off, and the CPU is unstalled. If the connection is already gone,
+     these jobs keep running without it, and new connections wait until they are finished.
+     Other memory and register changes are not undone. See gdb_start_cleanup() for details.
+
+   Record and replay:
+
+     If record_file_name is not empty, every JTAG data byte applied to the pins and every TDO value
+     sampled for a client (or for the GDB server) is written to a session log, stamped with the tick count.
+     See SESSION_LOG_MAGIC for the format, which takes 2 bytes per event for a typical session.
+
+     If replay_file_name is not empty, no socket is opened at all. Instead, the recorded data bytes
+     are applied to the pins at the recorded ticks, and the recorded TDO values are compared against
+     the current ones at the same ticks. Mismatches are reported as divergences on stderr.
+     This is only meaningful if the simulation starts from the same state and is deterministic,
+     but then a fixed debug sequence runs at full simulation speed without adv_jtag_bridge and GDB.
+
+   Binary trace:
+
+     If trace_file_name is not empty, every JTAG data byte applied to the pins, every TDO value sampled
+     for a client and every connection opened or closed is logged to a trace file, in fixed-size records
+     with the tick count (see TRACE_FILE_MAGIC for the format). Unlike the session log above, the trace
+     is meant to stay enabled in normal runs: the simulation thread only stores each record in a lock-free,
+     single-producer, single-consumer ring, and a background thread writes the records to disk.
+     If that thread falls behind and the ring fills up, records are dropped instead of stalling
+     the simulation, and a TRACE_EVENT_RECORDS_DROPPED record notes how many.
+     The TDO values sampled during a pin batch (see jtag_dpi_tick_batch) are only known on the next call,
+     so their records come after the pin updates that followed them, but they carry the right tick.
+     Tool tools/jtag_dpi_trace_decode turns a trace file into text.
+     The records still in the ring are only written out by jtag_dpi_terminate(), which jtag_dpi.v calls
+     from a 'final' block. If the process exits without it, the trace may end with an incomplete record.
+
+   Transports:
+
+     By default (transport TRANSPORT_TCP), this module listens on a TCP port. With TRANSPORT_UNIX,
+     it listens on a Unix-domain stream socket at unix_socket_path instead, which saves
+     the TCP/IP stack overhead on every round trip. The byte protocol is the same.
+
+     With TRANSPORT_SHM, the client also connects to the Unix socket at unix_socket_path,
+     but this module then creates a shared-memory area with memfd_create() and passes
+     its file descriptor to the client with SCM_RIGHTS, together with a doorbell eventfd.
+     The shared-memory area holds two single-producer, single-consumer byte rings,
+     one in each direction (see jtag_dpi_shm.h), and the byte protocol runs over them.
+     This module reads the incoming ring on every tick, which costs no system call at all,
+     and only writes to the doorbell if the client has announced that it is about to block waiting for data.
+     The socket stays open, only so that each side can tell when the other one goes away.
+     This module checks it every accept_poll_interval_tick_count ticks. Clients should use
+     the companion library in jtag_dpi_shm_client.cpp. This transport requires IO_MODE_POLL.
+
+   TCP port selection:
+
+     With tcp_port 0, the operating system picks a free TCP port, so that many simulations can run
+     side by side on the same host without any port planning. If port_file_name is not empty, the port
+     actually listened on is written to that file as a decimal number, as soon as the listening socket
+     exists, and the informational message about listening shows it as well. A script starting
+     the simulation can wait for the file to appear and then point the client to that port.
+     jtag_dpi.v reads plusargs that override the port and the port file at run time, see PORT_PLUSARG there.
+     The port stays the same for the rest of the simulation, even if the listening socket is created again.
+
+   OpenOCD jtag_vpi protocol:
+
+     With socket_protocol SOCKET_PROTOCOL_JTAG_VPI, an instance speaks the protocol of OpenOCD's
+     jtag_vpi adapter driver instead of the adv_jtag_bridge byte protocol. Each command is a fixed-size
+     structure of JTAG_VPI_CMD_LEN bytes: the 32-bit command, 512 bytes of output data, 512 bytes of input data,
+     the 32-bit byte count and the 32-bit bit count. All integers are little-endian, as in current OpenOCD
+     versions (older versions sent them in host byte order, which is the same on x86 hosts).
+     This module turns each command into a vector scan, so the whole TMS sequence or scan runs inside
+     the simulation at the normal TCK rate, without a socket round trip per bit:
+
+       JTAG_VPI_CMD_RESET (0): 5 clock cycles with TMS high, then one with TMS low,
+                               which ends up in Run-Test/Idle. No reply.
+       JTAG_VPI_CMD_TMS_SEQ (1): Clock out the TMS bits in the output data, with TDI low. No reply.
+       JTAG_VPI_CMD_SCAN_CHAIN (2): Clock out the TDI bits in the output data with TMS low, and capture TDO.
+       JTAG_VPI_CMD_SCAN_CHAIN_FLIP_TMS (3): The same, but TMS goes high on the last bit, which leaves the Shift state.
+       JTAG_VPI_CMD_STOP_SIMU (4): End the simulation. jtag_dpi_tick() returns RET_FINISH_REQUESTED,
+                                   and jtag_dpi.v calls $finish.
+
+     The reply to a scan is the whole command structure, with the captured TDO values in the input data.
+     Bits are packed as in the vector scan extension, LSB first. The protocol extensions are not available
+     on such an instance, but the GDB server, the transports and record and replay are.
+
    About this socket protocol implementation:
 
-     The current implementation polls the socket at least one per clock cycle.
-     It would be faster to create a second thread to deal with the socket communications,
-     or to use asynchronous I/O on the socket.
+     By default (io_mode IO_MODE_POLL), this module polls the socket at least once per clock cycle
+     from the simulation thread, which costs at least one system call per cycle.
+     A single recv() call fetches all data available, so a client that pipelines its commands
+     does not cost one system call per byte. All replies generated during a tick are sent together
+     at the end of the tick. If the socket's send buffer is full, the rest is sent on the next ticks,
+     and no further commands are processed until the backlog drops below SEND_BUFFER_HIGH_WATER_MARK.
+
+     Each jtag_dpi Verilog module instance has its own jtag_dpi_instance structure. The chandle that
+     jtag_dpi_init() returns is an index into a table of instances, and jtag_dpi_tick() looks it up
+     on every call. In IO_MODE_POLL mode, the connection sockets of all instances are registered
+     in a shared epoll set, and the first instance to tick in a new clock cycle polls them all at once.
+     Afterwards, each instance only calls recv() if its socket was reported as readable.
+
+     With io_mode IO_MODE_THREAD, a background I/O thread owns the listening and the connection sockets.
+     It pushes the received bytes into a single-producer, single-consumer ring, and sends
+     whatever the simulation thread places in a second ring. When no data arrives, jtag_dpi_tick()
+     only needs to read a couple of atomic variables. The simulation thread only makes a system call
+     when it needs to wake up the I/O thread in order to send a reply.
+     You need to link with -pthread in this mode.
+
+     With io_mode IO_MODE_URING, each instance has its own io_uring instance (Linux 6.0 or later),
+     and there is no extra thread. A multishot receive request stays armed on the connection socket,
+     and the kernel places the incoming data in a ring of provided buffers. Checking for data
+     is then just a read of the completion ring's head and tail, so an idle jtag_dpi_tick() makes
+     no system call at all. All replies generated during a tick go out with a single send request.
+     Replies generated while that request is still in flight go out together with the next one,
+     so a busy client costs about one io_uring_enter() call per tick with replies. While no client is connected,
+     an accept request waits on the listening socket, and the simulation notices the new connection
+     in the same way. If the kernel does not support io_uring, or the system does not allow it,
+     or the kernel headers were too old at compile time, the instance falls back to IO_MODE_POLL.
+
+   Batched DPI calls:
+
+     Even an idle jtag_dpi_tick() call costs the simulator a DPI round trip on every clock cycle.
+     With jtag_dpi.v's BATCHED_DPI_CALLS parameter, the RTL calls jtag_dpi_tick_batch() instead,
+     which tells the RTL how many cycles it can skip before the next call. While no client is connected,
+     that is the time until the next accept poll. While connected, it is the rest of the current
+     TCK half period, because the pins cannot change before then anyway, and a command that arrives
+     in the meantime is just processed a little later. During a vector scan (including the TAP engine
+     commands), the next data bytes are known in advance, so the call returns up to PIN_BATCH_MAX_LENGTH
+     of them, and the RTL clocks them out on its own, one per half period, exactly as
+     jtag_dpi_tick() would have done. The RTL samples TDO in between, and passes the values
+     on the next call. The tick count and the statistics still account for every cycle,
+     so the ticks in a recorded session log are correct too.
+
+     The GDB server and replay mode still need a call on every cycle, and the pre-roll wait for
+     activity tracking too. Pin batches are not used while recording a session.
+
+   Checkpoints:
+
+     A simulation that has booted once can be saved and restored later, for example with
+     Verilator's --savable option, see verilator_main.cpp. The Verilog side holds nothing but
+     the instance handle, which remains valid, but the state in this module must be saved as well,
+     with jtag_dpi_save_state(), and restored with jtag_dpi_restore_state() before the first tick
+     in the new process. The restored model does not run its initial blocks again, so that routine
+     recreates the instances with their original configuration and opens new listening sockets.
+     The main program can override the TCP port and the port file of each instance, because
+     the plusargs for them are only read in those initial blocks.
+     The TAP state tracking, the clock notification counter, the tick count and the statistics
+     are restored too. If the instance was writing a binary trace, the restored one writes a new trace
+     to the same file name, whose tick counts carry on from the checkpoint. A client or GDB connection
+     cannot survive a restore, so a checkpoint is best taken while the simulation is waiting for
+     the debugger to connect. If a connection was open, the client just needs to connect again.
+     Checkpoints are not supported while recording or replaying a session log.
+
+   Multithreaded simulations:
+
+     Verilator's --threads option runs the model on several worker threads, and with --threads-dpi all,
+     it may also call the DPI routines of different instances at the same time. Verilator still
+     serialises the calls for a single instance, as they come from the same always block, but not
+     necessarily on the same thread from one clock cycle to the next. Therefore, all state lives
+     in each instance's jtag_dpi_instance structure, and this module does not care which thread
+     calls it. The little state shared between instances (the instance table and the shared epoll set)
+     uses atomic variables, so jtag_dpi_tick() never takes a lock. Only jtag_dpi_init() and
+     jtag_dpi_terminate() lock a mutex.
+
+     With the default --threads-dpi pure, Verilator runs all calls to non-pure DPI routines,
+     like the ones in this module, one after the other, which is also safe, but then
+     several instances cannot tick in parallel.
 
    License:
 
@@ -61,13 +371,44 @@
 
 #include <unistd.h>  // For close().
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <errno.h>
 #include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+
+// IO_MODE_URING needs the multishot receive and the provided buffer rings of Linux 6.0.
+// With older kernel headers, it just falls back to IO_MODE_POLL at run time.
+#if defined( __has_include )
+  #if __has_include( <linux/io_uring.h> )
+    #include <linux/io_uring.h>
+  #endif
+#endif
+
+#if defined( IORING_RECV_MULTISHOT ) && defined( __NR_io_uring_setup )
+  #define JTAG_DPI_HAVE_IO_URING
+#endif
 
 #include <stdexcept>
 #include <sstream>
+#include <vector>
+#include <deque>
+#include <map>
+#include <string>
+#include <algorithm>
+#include <limits>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <chrono>
+
+#include "jtag_dpi_shm.h"
 
 
 // We may have more error codes in the future, that's why the success value is zero.
@@ -75,40 +416,580 @@
 // does not have good support for variable-length strings.
 static const int RET_SUCCESS = 0;
 static const int RET_FAILURE = 1;
+static const int RET_FINISH_REQUESTED = 2;  // The client has asked to end the simulation.
 
 static const char INFO_MSG_PREFIX[]       = "JTAG DPI module: ";
 static const char ERROR_MSG_PREFIX_INIT[] = "Error initializing the JTAG DPI module: ";
 static const char ERROR_MSG_PREFIX_TICK[] = "Error in the JTAG DPI module: ";
 
-static bool s_already_initialized = false;
+enum connection_state_enum
+{
+  cs_invalid,
+  cs_waiting_to_receive_commands,
+  cs_waiting_to_send_clock_notification,
+  cs_receiving_command_payload,
+  cs_executing_vector_scan,
+  cs_waiting_between_tdo_polls,
+  cs_streaming
+};
 
-static uint16_t s_listening_tcp_port;
-static int      s_listeningSocket;
-static bool     s_listen_on_local_addr_only;
+enum io_mode_enum
+{
+  IO_MODE_POLL   = 0,
+  IO_MODE_THREAD = 1,
+  IO_MODE_URING  = 2
+};
 
-static bool s_print_informational_messages;
-static bool s_listening_message_already_printed;
+enum socket_protocol_enum
+{
+  SOCKET_PROTOCOL_ADV_JTAG_BRIDGE = 0,
+  SOCKET_PROTOCOL_JTAG_VPI        = 1
+};
 
+enum transport_enum
+{
+  TRANSPORT_TCP  = 0,
+  TRANSPORT_UNIX = 1,
+  TRANSPORT_SHM  = 2
+};
 
-enum connection_state_enum
+// The link state is the handshake between the simulation thread and the I/O thread.
+// Whoever owns the current state is the only one allowed to change it:
+//   ls_listening       : owned by the I/O thread, the rings are not in use.
+//   ls_connected       : owned by the simulation thread, which may switch to ls_close_requested.
+//                        The I/O thread keeps moving data between the socket and the rings.
+//   ls_close_requested : owned by the I/O thread, which closes the socket, resets the rings
+//                        and goes back to ls_listening.
+enum link_state_enum
 {
-  cs_invalid,
-  cs_waiting_to_receive_commands,
-  cs_waiting_to_send_clock_notification
+  ls_listening,
+  ls_connected,
+  ls_close_requested
+};
+
+// This structure is allocated on the heap and never destroyed while the thread is running,
+// because a simulation may exit without calling jtag_dpi_terminate(), and destroying
+// a running std::thread object would abort the process on exit.
+
+struct io_thread_data
+{
+  std::thread thread;
+  int wakeup_event_fd;
+
+  std::atomic< int  > link_state;
+  std::atomic< bool > peer_closed;     // Set by the I/O thread after pushing the last received byte.
+  std::atomic< bool > stop_requested;
+  std::atomic< bool > failed;          // Set by the I/O thread after storing error_msg.
+  std::string error_msg;
+
+  spsc_byte_ring rx_ring;  // From the socket to the simulation.
+  spsc_byte_ring tx_ring;  // From the simulation to the socket.
+
+  // The system calls made by the I/O thread while waiting for connections. Only the I/O thread
+  // updates them, and the simulation thread only reads them after joining it, see jtag_dpi_terminate().
+  // They are not part of the link statistics, which only count the calls made by the simulation thread.
+  uint64_t accept_syscalls;
+  uint64_t accept_empty_syscalls;
+
+  // Only accessed by the simulation thread.
+  bool is_connection_open;
+};
+
+
+// These kernel structures are only used through pointers here, and they are not known
+// without io_uring support in the kernel headers.
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct io_uring_buf_ring;
+
+// Data that a multishot receive request has placed in one of the provided buffers.
+struct uring_received_chunk
+{
+  uint16_t buffer_id;
+  uint32_t len;
+  uint32_t pos;  // How much the simulation has already consumed.
+};
+
+// The io_uring instance of an instance in IO_MODE_URING mode. Only the simulation thread touches it.
+
+struct uring_data
+{
+  int ring_fd;
+
+  // The submission and completion rings share a single mapping (IORING_FEAT_SINGLE_MMAP).
+  // The kernel updates the head of the first and the tail of the second one at any time.
+  void *   rings;
+  size_t   rings_size;
+  io_uring_sqe * sqes;
+  size_t   sqes_size;
+  unsigned * sq_tail;
+  unsigned   sq_mask;
+  unsigned * cq_head;
+  unsigned * cq_tail;
+  unsigned   cq_mask;
+  io_uring_cqe * cqes;
+
+  // The kernel picks the buffers for the received data from this ring, and the simulation
+  // hands each one back once it has consumed its data.
+  io_uring_buf_ring * buf_ring;
+  uint16_t buf_ring_tail;
+  std::vector< uint8_t > receive_buffers;
+  std::deque< uring_received_chunk > received_chunks;
+
+  // Completions for an older connection are recognised by the generation in their user_data field.
+  uint32_t connection_generation;
+  bool     is_recv_armed;
+  bool     peer_closed;
+
+  // Filled by the accept request. The kernel writes to these fields, so they must stay put.
+  sockaddr_storage accept_addr;
+  socklen_t        accept_addr_len;
+  bool             is_accept_complete;
+  int              accept_result;  // The connection socket, or a negative errno value.
+
+  // The kernel reads this buffer until the send request completes, so it is never reallocated.
+  // Only one send request is in flight at a time.
+  std::vector< uint8_t > send_buffer;
+  size_t send_len;
+  size_t send_pos;
+  bool   is_send_in_flight;
 };
 
-static int s_connectionSocket;
-static connection_state_enum s_connectionState;
 
-// The clock notification message provides an indication that at least
-// the given number of ticks have elapsed since the last command
-// that wrote data to the JTAG signals. Since the passing of time is also simulated,
-// the client needs this indication in order to synchronise itself with the
-// simulation's master clock. Otherwise, the client could send over the TCP/IP socket
-// JTAG data faster than the simulated clock, and the simulation would miss JTAG signal changes.
-static int s_jtag_tck_half_period_tick_count;
+// Stop processing commands while this much data is waiting to be sent.
+static const size_t SEND_BUFFER_HIGH_WATER_MARK = 64 * 1024;
+
 static const uint8_t CLOCK_NOTIFICATION_MSG = 0xFF;
-static int s_clock_notification_counter;
+
+// Bits in a JTAG data byte.
+static const uint8_t JTAG_TCK_BIT  = 0x01;
+static const uint8_t JTAG_TRST_BIT = 0x02;
+static const uint8_t JTAG_TDI_BIT  = 0x04;
+static const uint8_t JTAG_TMS_BIT  = 0x08;
+
+static const uint8_t CMD_READ_TDO                = 0x80;
+static const uint8_t CMD_WAIT_CLOCK_NOTIFICATION = 0x81;
+static const uint8_t CMD_QUERY_EXTENSIONS        = 0x82;
+static const uint8_t CMD_VECTOR_SCAN             = 0x83;
+static const uint8_t CMD_START_STREAMING         = 0x84;
+static const uint8_t CMD_STOP_STREAMING          = 0x85;
+static const uint8_t CMD_GO_TO_TAP_STATE         = 0x86;
+static const uint8_t CMD_SCAN_IR                 = 0x87;
+static const uint8_t CMD_SCAN_DR                 = 0x88;
+static const uint8_t CMD_RUN_TEST_IDLE           = 0x89;
+static const uint8_t CMD_GET_TAP_STATE           = 0x8A;
+static const uint8_t CMD_GET_STATISTICS          = 0x8B;
+static const uint8_t CMD_BACKDOOR_WRITE          = 0x8C;
+static const uint8_t CMD_BACKDOOR_READ           = 0x8D;
+static const uint8_t CMD_WAIT_FOR_TDO            = 0x8E;
+
+static const uint32_t EXT_VECTOR_SCAN = 0x00000001;
+static const uint32_t EXT_STREAMING   = 0x00000002;
+static const uint32_t EXT_TAP_ENGINE  = 0x00000004;
+static const uint32_t EXT_STATISTICS  = 0x00000008;
+static const uint32_t EXT_BACKDOOR_MEMORY = 0x00000010;  // Only if the main program provides the access routine.
+static const uint32_t EXT_WAIT_FOR_TDO    = 0x00000020;
+
+static const uint32_t SUPPORTED_EXTENSIONS = EXT_VECTOR_SCAN |
+                                             EXT_STREAMING   |
+                                             EXT_TAP_ENGINE  |
+                                             EXT_STATISTICS  |
+                                             EXT_WAIT_FOR_TDO;
+
+// The flags byte, the end state and the 32-bit bit count.
+static const size_t SCAN_XR_HEADER_LEN = 6;
+
+static const uint8_t SCAN_XR_FLAG_CAPTURE_TDO = 0x01;
+
+// The 32-bit address and the 32-bit byte count.
+static const size_t BACKDOOR_HEADER_LEN = 8;
+
+// Larger images must be transferred in several commands.
+static const uint32_t MAX_BACKDOOR_BYTE_COUNT = 1024 * 1024;
+
+static const uint8_t BACKDOOR_STATUS_OK     = 0;
+static const uint8_t BACKDOOR_STATUS_FAILED = 1;
+
+// The 32-bit bit count, the 32-bit interval and the 32-bit maximum attempt count.
+static const size_t WAIT_FOR_TDO_HEADER_LEN = 12;
+
+static const uint8_t WAIT_FOR_TDO_STATUS_MATCHED   = 0;
+static const uint8_t WAIT_FOR_TDO_STATUS_TIMED_OUT = 1;
+static const uint8_t WAIT_FOR_TDO_STATUS_CANCELLED = 2;
+
+// See "OpenOCD jtag_vpi protocol" above. These values are part of that protocol.
+static const uint32_t JTAG_VPI_CMD_RESET               = 0;
+static const uint32_t JTAG_VPI_CMD_TMS_SEQ             = 1;
+static const uint32_t JTAG_VPI_CMD_SCAN_CHAIN          = 2;
+static const uint32_t JTAG_VPI_CMD_SCAN_CHAIN_FLIP_TMS = 3;
+static const uint32_t JTAG_VPI_CMD_STOP_SIMU           = 4;
+
+static const size_t JTAG_VPI_BUFFER_LEN     = 512;
+static const size_t JTAG_VPI_BUFFER_OUT_POS = 4;
+static const size_t JTAG_VPI_BUFFER_IN_POS  = JTAG_VPI_BUFFER_OUT_POS + JTAG_VPI_BUFFER_LEN;
+static const size_t JTAG_VPI_LENGTH_POS     = JTAG_VPI_BUFFER_IN_POS  + JTAG_VPI_BUFFER_LEN;
+static const size_t JTAG_VPI_NB_BITS_POS    = JTAG_VPI_LENGTH_POS + 4;
+static const size_t JTAG_VPI_CMD_LEN        = JTAG_VPI_NB_BITS_POS + 4;
+
+// Not a command of the byte protocol. In received_command, it means that command_payload holds a jtag_vpi command.
+static const uint8_t CMD_JTAG_VPI = 0x00;
+
+
+// The values are part of the socket protocol.
+enum tap_state_enum
+{
+  tap_test_logic_reset = 0,
+  tap_run_test_idle    = 1,
+  tap_select_dr_scan   = 2,
+  tap_capture_dr       = 3,
+  tap_shift_dr         = 4,
+  tap_exit1_dr         = 5,
+  tap_pause_dr         = 6,
+  tap_exit2_dr         = 7,
+  tap_update_dr        = 8,
+  tap_select_ir_scan   = 9,
+  tap_capture_ir       = 10,
+  tap_shift_ir         = 11,
+  tap_exit1_ir         = 12,
+  tap_pause_ir         = 13,
+  tap_exit2_ir         = 14,
+  tap_update_ir        = 15,
+
+  TAP_STATE_COUNT      = 16,
+
+  tap_unknown          = 0xFF
+};
+
+static const uint8_t STREAMING_CREDIT_MSG = 0xFD;
+
+// The window must fit comfortably in the receive buffer and in the I/O thread's receive ring.
+static const uint16_t STREAMING_WINDOW_SIZE = 4096;
+
+// Credits are returned in batches, or earlier if the client has nothing else in flight.
+static const uint16_t STREAMING_CREDIT_BATCH_SIZE = STREAMING_WINDOW_SIZE / 4;
+
+static const uint8_t VECTOR_SCAN_FLAG_CAPTURE_TDO = 0x01;
+
+// The flags byte and the 32-bit bit count.
+static const size_t VECTOR_SCAN_HEADER_LEN = 5;
+
+// Limit the amount of memory a misbehaving client can make us allocate.
+static const uint32_t MAX_VECTOR_SCAN_BIT_COUNT = 64 * 1024;
+
+// All commands that clock TCK are turned into a vector scan, which advance_vector_scan()
+// then executes at the normal TCK rate.
+
+struct vector_scan
+{
+  uint8_t  reply_command;  // The reply if no TDO values are captured.
+  uint32_t bit_count;
+
+  std::vector< uint8_t > tms;
+  std::vector< uint8_t > tdi;
+
+  // TDO values are captured for bits [capture_first_bit, capture_first_bit + capture_bit_count).
+  bool     capture_tdo;
+  uint32_t capture_first_bit;
+  uint32_t capture_bit_count;
+  std::vector< uint8_t > tdo;
+
+  uint32_t next_bit;
+  bool     tck_low_driven;  // Whether the first half period of the current bit has started.
+  bool     tck_is_high;     // Whether the second half period of the current bit has started.
+};
+
+
+// jtag_dpi_tick_batch() hands over up to this many JTAG data bytes at once, 4 bits each in a 32-bit integer.
+static const int PIN_BATCH_MAX_LENGTH = 8;
+
+// While the RTL clocks out a pin batch on its own, it samples TDO before applying each data byte
+// after the first one, and the next jtag_dpi_tick_batch() call delivers those TDO values.
+// Until then, this notes which vector scan bit each one belongs to.
+struct deferred_tdo_sample
+{
+  vector_scan * scan;
+  uint32_t      tdo_bit;
+  int           history_bit;  // In jtag_dpi_tick_batch()'s tdo_history argument.
+  uint64_t      tick;         // For the binary trace.
+};
+
+struct gdb_server_data;
+
+
+// Session log for record and replay. After the header, each record is the number of ticks since
+// the previous record (or since the simulation start), LEB128-encoded, followed by one event byte:
+// a JTAG data byte (0x00 - 0x0F) that was applied to the pins, or LOG_EVENT_TDO_SAMPLE with the
+// sampled TDO value in bit 0. The first tick is tick 1.
+static const char    SESSION_LOG_MAGIC[] = "JDPILOG1";  // The null terminator is not written.
+static const uint8_t LOG_EVENT_TDO_SAMPLE = 0x10;
+
+// Binary trace. After the header, each record takes TRACE_RECORD_LEN bytes: the 64-bit tick count,
+// the event type, the JTAG data byte on the pins at that point, the TDO value (only meaningful
+// for TRACE_EVENT_TDO_SAMPLE), a reserved byte and a 32-bit argument. All integers are little-endian.
+// The event types and the layout are also known to tools/jtag_dpi_trace_decode.cpp.
+static const char    TRACE_FILE_MAGIC[] = "JDPITRC1";  // The null terminator is not written.
+static const size_t  TRACE_RECORD_LEN = 16;
+
+static const uint8_t TRACE_EVENT_PIN_UPDATE        = 1;
+static const uint8_t TRACE_EVENT_TDO_SAMPLE        = 2;
+static const uint8_t TRACE_EVENT_CONNECTION_OPENED = 3;
+static const uint8_t TRACE_EVENT_CONNECTION_CLOSED = 4;
+static const uint8_t TRACE_EVENT_RECORDS_DROPPED   = 5;  // The argument is the number of records lost before this one.
+
+struct trace_record
+{
+  uint64_t tick;
+  uint8_t  event;
+  uint8_t  pins;
+  uint8_t  tdo;
+  uint32_t argument;
+};
+
+// The trace ring works like spsc_byte_ring, but each slot holds a whole record, so that
+// logging an event only costs a few memory stores. The simulation thread is the producer,
+// and the trace writer thread the consumer, which also owns the file.
+
+struct trace_writer_data
+{
+  static const uint32_t RING_CAPACITY = 64 * 1024;  // In records. Must be a power of 2.
+
+  std::thread thread;
+  FILE * file;
+  std::string file_name;
+
+  std::atomic< bool > stop_requested;
+  std::atomic< bool > failed;  // Set by the writer thread after storing error_msg.
+  std::string error_msg;
+
+  std::atomic< uint32_t > head;
+  uint8_t padding1[ 64 - sizeof( std::atomic< uint32_t > ) ];
+  std::atomic< uint32_t > tail;
+  uint8_t padding2[ 64 - sizeof( std::atomic< uint32_t > ) ];
+  trace_record ring[ RING_CAPACITY ];
+
+  // Only accessed by the simulation thread.
+  uint32_t pending_dropped_record_count;  // Not yet reported with TRACE_EVENT_RECORDS_DROPPED.
+  uint64_t record_count;
+  uint64_t dropped_record_count;
+};
+
+// Checkpoint data, see jtag_dpi_save_state(). All integers are little-endian.
+static const char CHECKPOINT_MAGIC[] = "JDPICKP4";  // The null terminator is not written.
+
+// Do not flood the console if the replay goes completely wrong.
+static const uint64_t MAX_REPORTED_REPLAY_DIVERGENCES = 20;
+
+
+// Bucket 0 counts the client commands that arrived in the same tick as the previous one,
+// bucket n counts the gaps from 2^(n-1) to 2^n - 1 ticks, and the last bucket also counts all longer gaps.
+static const int TICKS_BETWEEN_COMMANDS_BUCKET_COUNT = 16;
+
+// Counters about the cost of the virtual JTAG cable. The system call counts only include
+// the calls made by the simulation thread, because those are the ones that slow the simulation down.
+// All fields are 64-bit counters, so that CMD_GET_STATISTICS can send them in field order.
+
+struct link_statistics
+{
+  uint64_t connection_count;
+  uint64_t connected_time_us;
+  uint64_t connected_ticks;
+  uint64_t bytes_received;
+  uint64_t bytes_sent;
+  uint64_t pin_updates;
+  uint64_t tdo_reads;
+  uint64_t clock_notification_waits;
+  uint64_t ticks_waiting_for_clock_notification;
+  uint64_t syscalls;
+  uint64_t empty_syscalls;  // Those that found no data or no room (EAGAIN, or epoll_wait() without events).
+  uint64_t ticks_between_commands[ TICKS_BETWEEN_COMMANDS_BUCKET_COUNT ];
+};
+
+// All the state of one jtag_dpi Verilog module instance. Each instance has its own
+// listening port, connection, JTAG pins and TAP, and optionally its own GDB server.
+
+struct jtag_dpi_instance
+{
+  uint32_t index;  // In s_instances.
+
+  socket_protocol_enum socket_protocol;
+  transport_enum transport;
+
+  uint16_t    listening_tcp_port;  // 0 lets the operating system pick one.
+  uint16_t    bound_tcp_port;      // The port actually listened on, 0 until the first listening socket exists.
+  std::string port_file_name;      // Where to write bound_tcp_port. Empty if not wanted.
+  std::string unix_socket_path;  // For TRANSPORT_UNIX and TRANSPORT_SHM.
+  int         listeningSocket;
+  bool        listen_on_local_addr_only;
+
+  bool print_informational_messages;
+  bool listening_message_already_printed;
+
+  // While no client is connected, only check for incoming connections every so many ticks.
+  // Simulations that never get a client then only pay for decrementing the counter.
+  int accept_poll_interval_tick_count;
+  int accept_poll_countdown;
+
+  int connectionSocket;
+  connection_state_enum connectionState;
+
+  io_mode_enum io_mode;
+
+  io_thread_data * io_thread;
+
+  uring_data * uring;  // Only in IO_MODE_URING mode, otherwise NULL.
+
+  // In IO_MODE_POLL mode, recv() is only called after the shared epoll set
+  // has reported the connection socket as readable. Another instance may set this flag
+  // from a different thread in a multithreaded simulation, hence the atomic type.
+  std::atomic< bool > is_socket_readable;
+  unsigned seen_socket_poll_generation;
+
+  // In IO_MODE_POLL mode, a single recv() call fetches all data available in the socket,
+  // instead of making one system call per byte.
+  uint8_t receive_buffer[ 64 * 1024 ];
+  size_t  receive_buffer_pos;
+  size_t  receive_buffer_len;
+
+  // All replies generated during a tick are sent together at the end of the tick.
+  // The socket is non-blocking, so a partial send leaves the rest here for the next tick.
+  std::vector< uint8_t > send_buffer;
+  size_t send_buffer_pos;
+
+  // The clock notification message provides an indication that at least
+  // the given number of ticks have elapsed since the last command
+  // that wrote data to the JTAG signals. Since the passing of time is also simulated,
+  // the client needs this indication in order to synchronise itself with the
+  // simulation's master clock. Otherwise, the client could send over the TCP/IP socket
+  // JTAG data faster than the simulated clock, and the simulation would miss JTAG signal changes.
+  int jtag_tck_half_period_tick_count;
+  int clock_notification_counter;
+
+  // The TAP state is tracked from the pin values actually applied, regardless of which command generated them.
+  tap_state_enum tap_state;
+  bool           tap_tck_level;
+  int            tap_consecutive_tms_high_count;
+
+  uint16_t streaming_uncredited_byte_count;
+
+  // With TRANSPORT_SHM, the data travels through these rings, and the connection socket
+  // only serves to detect when the client goes away. The doorbell eventfd wakes up
+  // a client that is blocked waiting for data.
+  jtag_dpi_shm_area * shm_area;  // NULL if no shared-memory session is active.
+  int shm_doorbell_fd;
+  int shm_close_check_countdown;
+
+  vector_scan client_vector_scan;
+
+  // CMD_WAIT_FOR_TDO repeats client_vector_scan until the captured TDO values match.
+  std::vector< uint8_t > tdo_wait_mask;
+  std::vector< uint8_t > tdo_wait_value;
+  uint32_t tdo_wait_interval_cycle_count;
+  uint32_t tdo_wait_max_attempt_count;
+  uint32_t tdo_wait_attempt_count;
+  uint64_t tdo_wait_countdown;  // Ticks until the next attempt starts.
+  uint8_t  tdo_wait_status;     // For the reply, see WAIT_FOR_TDO_STATUS_xxx.
+
+  // Set by JTAG_VPI_CMD_STOP_SIMU.
+  bool is_finish_requested;
+
+  // Commands with a payload are collected here before executing them,
+  // because the payload may arrive over several ticks.
+  uint8_t received_command;
+  std::vector< uint8_t > command_payload;
+  size_t command_payload_expected_len;
+  bool   command_payload_header_complete;
+
+  // 'stats' collects the counters for the current connection. They are added to 'total_stats'
+  // when the connection closes, and both are printed at that point and in jtag_dpi_terminate().
+  link_statistics stats;
+  link_statistics total_stats;
+  std::chrono::steady_clock::time_point connection_start_time;
+  uint64_t tick_count;
+  uint64_t last_client_command_tick;
+
+  // See jtag_dpi_enable_tick_profiling().
+  int      tick_profiling_countdown;
+  uint64_t sampled_tick_time_ns;
+
+  // See jtag_dpi_enable_activity_tracking().
+  uint64_t last_activity_tick;
+  uint64_t activity_pre_roll_countdown;
+  bool     was_link_open;
+
+  // See jtag_dpi_tick_batch().
+  uint32_t pending_idle_tick_count;  // The ticks the RTL skips after the current pin batch.
+  bool     is_extending_pin_batch;
+  int      pin_batch_length;
+  deferred_tdo_sample deferred_tdo_samples[ PIN_BATCH_MAX_LENGTH ];
+  int      deferred_tdo_sample_count;
+
+  uint16_t gdb_tcp_port;  // 0 if the GDB server is disabled.
+  gdb_server_data * gdb;  // NULL if the GDB server is disabled.
+
+  // Recording writes all pin updates and TDO samples to this file. NULL if not recording.
+  FILE *   record_file;
+  uint64_t last_record_tick;
+
+  // In replay mode, the pin updates come from this file instead of from a client,
+  // and there are no sockets at all. NULL if not replaying.
+  FILE *   replay_file;
+  bool     replay_finished;
+  uint64_t replay_next_tick;
+  uint8_t  replay_next_event;
+  uint64_t replay_pin_update_count;
+  uint64_t replay_tdo_sample_count;
+  uint64_t replay_divergence_count;
+
+  // See "Binary trace" above. NULL if not tracing.
+  trace_writer_data * trace;
+  uint8_t trace_pins;  // The last JTAG data byte applied to the pins.
+};
+
+
+// The DPI handle passed to Verilog is the index in this table plus one, and not a pointer,
+// so that it remains valid if the simulator saves and restores its state.
+// A slot is set to NULL when its instance terminates, and slots are never reused.
+//
+// The table has a fixed size, so that jtag_dpi_tick() can look up its instance without a lock,
+// even if another thread is adding an instance at the same time. Only jtag_dpi_init() and
+// jtag_dpi_terminate() take s_instance_table_mutex, never the tick path.
+static const uint32_t MAX_INSTANCE_COUNT = 256;
+static std::atomic< jtag_dpi_instance * > s_instances[ MAX_INSTANCE_COUNT ];
+static std::atomic< uint32_t > s_instance_count( 0 );
+static std::mutex s_instance_table_mutex;
+
+// In IO_MODE_POLL mode, the connection sockets of all instances are registered in a single epoll set.
+// Whichever instance ticks first in a simulation cycle checks them all with one epoll_wait() call,
+// so that N connected instances do not cost N system calls per cycle.
+// In a multithreaded simulation, two instances may occasionally poll in the same cycle,
+// which costs one extra system call but is otherwise harmless.
+static int s_epoll_fd = -1;  // Only changes while no instance in IO_MODE_POLL is alive.
+static std::atomic< unsigned > s_socket_poll_generation( 0 );
+
+// Reading the clock costs several times as much as a normal tick, so when profiling is enabled,
+// only one tick out of this many is timed, and its duration counts for all of them.
+// The number is prime, so that the samples do not keep landing on the ticks that poll for
+// incoming connections, as ACCEPT_POLL_INTERVAL_TICK_COUNT is normally a round number.
+static const int TICK_PROFILING_SAMPLE_INTERVAL = 127;
+
+static std::atomic< bool > s_is_tick_profiling_enabled( false );
+
+// See jtag_dpi_enable_activity_tracking().
+static std::atomic< bool > s_is_activity_tracking_enabled( false );
+static uint64_t s_activity_pre_roll_tick_count = 0;
+static uint64_t s_activity_idle_tick_count = 0;
+static std::atomic< uint64_t > s_activity_count( 0 );
+static uint64_t s_clock_read_overhead_ns = 0;  // Subtracted from each sample, see jtag_dpi_enable_tick_profiling().
+static uint64_t s_terminated_instances_tick_time_ns = 0;  // Protected by s_instance_table_mutex.
+
+// See jtag_dpi_set_backdoor_memory_access().
+typedef bool ( * jtag_dpi_backdoor_memory_access_fn ) ( void * context,
+                                                        bool is_write,
+                                                        uint32_t address,
+                                                        uint8_t * data,
+                                                        uint32_t byte_count );
+static jtag_dpi_backdoor_memory_access_fn s_backdoor_memory_access = NULL;
+static void * s_backdoor_memory_access_context = NULL;
 
 
 static std::string get_error_message ( const char * const prefix_msg,
@@ -160,635 +1041,7110 @@ static void close_a ( const int fd )
 }
 
 
-static void close_current_connection ( void )
+static void add_statistics ( link_statistics & total, const link_statistics & stats )
 {
-  assert( s_connectionSocket != -1 );
-
-  close_a( s_connectionSocket );
+  const uint64_t * const src = reinterpret_cast< const uint64_t * >( &stats );
+  uint64_t * const dest = reinterpret_cast< uint64_t * >( &total );
 
-  s_connectionSocket = -1;
+  for ( size_t i = 0; i < sizeof( link_statistics ) / sizeof( uint64_t ); ++i )
+  {
+    dest[ i ] += src[ i ];
+  }
 }
 
 
-static ssize_t send_eintr ( const int sockfd,
-                            const void * const buf,
-                            const size_t len,
-                            const int flags )
+static void record_client_command ( jtag_dpi_instance & inst )
 {
-  for ( ; ; )
-  {
-    const ssize_t ret = send( sockfd, buf, len, flags );
+  uint64_t gap = inst.tick_count - inst.last_client_command_tick;
+  inst.last_client_command_tick = inst.tick_count;
 
-    if ( ret == -1 && errno == EINTR )
-      continue;
+  int bucket = 0;
 
-    return ret;
+  while ( gap != 0 && bucket < TICKS_BETWEEN_COMMANDS_BUCKET_COUNT - 1 )
+  {
+    gap >>= 1;
+    ++bucket;
   }
+
+  ++inst.stats.ticks_between_commands[ bucket ];
 }
 
 
-static ssize_t recv_eintr ( const int sockfd,
-                            void * const buf,
-                            const size_t len,
-                            const int flags )
+static void print_statistics ( const char * const title,
+                               const link_statistics & stats )
 {
-  for ( ; ; )
-  {
-    const ssize_t ret = recv( sockfd, buf, len, flags );
+  printf( "%s%s:\n", INFO_MSG_PREFIX, title );
 
-    if ( ret == -1 && errno == EINTR )
+  const double seconds = double( stats.connected_time_us ) / 1000000;
+
+  printf( "%s  Connections: %llu, connected for %.3f s and %llu ticks",
+          INFO_MSG_PREFIX,
+          (unsigned long long) stats.connection_count,
+          seconds,
+          (unsigned long long) stats.connected_ticks );
+
+  if ( stats.connected_time_us != 0 )
+    printf( " (%.0f ticks/s)", double( stats.connected_ticks ) / seconds );
+
+  printf( ".\n" );
+
+  printf( "%s  Bytes received: %llu, bytes sent: %llu.\n",
+          INFO_MSG_PREFIX,
+          (unsigned long long) stats.bytes_received,
+          (unsigned long long) stats.bytes_sent );
+
+  printf( "%s  Pin updates: %llu, TDO reads: %llu.\n",
+          INFO_MSG_PREFIX,
+          (unsigned long long) stats.pin_updates,
+          (unsigned long long) stats.tdo_reads );
+
+  printf( "%s  Clock notification waits: %llu, ticks spent waiting for them: %llu.\n",
+          INFO_MSG_PREFIX,
+          (unsigned long long) stats.clock_notification_waits,
+          (unsigned long long) stats.ticks_waiting_for_clock_notification );
+
+  printf( "%s  System calls: %llu, %llu of which found no data or no room.\n",
+          INFO_MSG_PREFIX,
+          (unsigned long long) stats.syscalls,
+          (unsigned long long) stats.empty_syscalls );
+
+  printf( "%s  Ticks between client commands:", INFO_MSG_PREFIX );
+
+  for ( int i = 0; i < TICKS_BETWEEN_COMMANDS_BUCKET_COUNT; ++i )
+  {
+    if ( stats.ticks_between_commands[ i ] == 0 )
       continue;
 
-    return ret;
+    if ( i == 0 )
+      printf( " 0:" );
+    else if ( i == 1 )
+      printf( " 1:" );
+    else if ( i == TICKS_BETWEEN_COMMANDS_BUCKET_COUNT - 1 )
+      printf( " %llu+:", 1ULL << ( i - 1 ) );
+    else
+      printf( " %llu-%llu:", 1ULL << ( i - 1 ), ( 1ULL << i ) - 1 );
+
+    printf( " %llu", (unsigned long long) stats.ticks_between_commands[ i ] );
   }
+
+  printf( "\n" );
+  fflush( stdout );
 }
 
 
-static int accept4_eintr ( const int sockfd,
-                           struct sockaddr * const addr,
-                           socklen_t * const addrlen,
-                           const int flags )
+// Adds a record to the binary trace. This never blocks and makes no system calls. If the ring is full,
+// the record is dropped, and the next one that fits is preceded by a TRACE_EVENT_RECORDS_DROPPED record.
+
+static void write_trace_record ( jtag_dpi_instance & inst,
+                                 const uint64_t tick,
+                                 const uint8_t event,
+                                 const uint8_t tdo,
+                                 const uint32_t argument )
 {
-  for ( ; ; )
+  trace_writer_data & trace = *inst.trace;
+
+  uint32_t head = trace.head.load( std::memory_order_relaxed );
+  const uint32_t tail = trace.tail.load( std::memory_order_acquire );
+
+  const uint32_t free_slot_count = trace_writer_data::RING_CAPACITY - ( head - tail );
+
+  if ( free_slot_count < ( trace.pending_dropped_record_count == 0 ? 1u : 2u ) )
   {
-    const ssize_t ret = accept4( sockfd, addr, addrlen, flags );
+    // A writer thread that has given up never empties the ring again, so this is the right place to notice.
+    if ( trace.failed.load( std::memory_order_acquire ) )
+    {
+      throw std::runtime_error( trace.error_msg );
+    }
 
-    if ( ret == -1 && errno == EINTR )
-      continue;
+    if ( trace.pending_dropped_record_count != UINT32_MAX )
+      ++trace.pending_dropped_record_count;
 
-    return ret;
+    ++trace.dropped_record_count;
+    return;
+  }
+
+  if ( trace.pending_dropped_record_count != 0 )
+  {
+    trace_record & dropped = trace.ring[ head & ( trace_writer_data::RING_CAPACITY - 1 ) ];
+    dropped.tick     = tick;
+    dropped.event    = TRACE_EVENT_RECORDS_DROPPED;
+    dropped.pins     = inst.trace_pins;
+    dropped.tdo      = 0;
+    dropped.argument = trace.pending_dropped_record_count;
+    ++head;
+
+    ++trace.record_count;
+
+    trace.pending_dropped_record_count = 0;
   }
+
+  trace_record & record = trace.ring[ head & ( trace_writer_data::RING_CAPACITY - 1 ) ];
+  record.tick     = tick;
+  record.event    = event;
+  record.pins     = inst.trace_pins;
+  record.tdo      = tdo;
+  record.argument = argument;
+  ++head;
+
+  trace.head.store( head, std::memory_order_release );
+
+  ++trace.record_count;
 }
 
 
-static void send_byte ( const uint8_t data )
+// The counters collected outside of a connection, like the accept() calls,
+// go into the totals, but not into the next connection's statistics.
+
+static void start_connection_statistics ( jtag_dpi_instance & inst )
 {
-  // Note that the socket has been opened with SOCK_NONBLOCK,
-  // which means that this send() call could theoretically fail
-  // if the socket's send buffer were full.
-  // However, we know that adv_jtag_bridge always waits
-  // for a reply before sending the next command, so we're safe here.
+  add_statistics( inst.total_stats, inst.stats );
+  memset( &inst.stats, 0, sizeof( inst.stats ) );
+
+  inst.stats.connection_count = 1;
+  inst.connection_start_time = std::chrono::steady_clock::now();
+  inst.last_client_command_tick = inst.tick_count;
 
-  if ( -1 == send_eintr( s_connectionSocket,
-                         &data,
-                         sizeof(data),
-                         0  // No special flags.
-                         ) )
+  if ( inst.trace != NULL )
   {
-    throw std::runtime_error( get_error_message( "Error sending data: ", errno ) );
+    write_trace_record( inst, inst.tick_count, TRACE_EVENT_CONNECTION_OPENED, 0, 0 );
   }
 }
 
 
-static std::string ip_address_to_text ( const in_addr * const addr )
+static void update_connected_time ( jtag_dpi_instance & inst )
 {
-  char ip_addr_buffer[80];
+  inst.stats.connected_time_us = uint64_t( std::chrono::duration_cast< std::chrono::microseconds >(
+                                             std::chrono::steady_clock::now() - inst.connection_start_time ).count() );
+}
 
-  const char * const str = inet_ntop( AF_INET,
-                                      addr,
-                                      ip_addr_buffer,
-                                      sizeof(ip_addr_buffer) );
-  if ( str == NULL )
+
+static void end_connection_statistics ( jtag_dpi_instance & inst )
+{
+  update_connected_time( inst );
+
+  if ( inst.trace != NULL )
   {
-    throw std::runtime_error( get_error_message( "Error formatting the IP address: ", errno ) );
+    write_trace_record( inst, inst.tick_count, TRACE_EVENT_CONNECTION_CLOSED, 0, 0 );
   }
 
-  assert( strlen(str) <= strlen("123.123.123.123") );
-  assert( strlen(str) <= sizeof(ip_addr_buffer) );
+  if ( inst.print_informational_messages )
+  {
+    print_statistics( "Statistics for this connection", inst.stats );
+  }
 
-  return str;
+  add_statistics( inst.total_stats, inst.stats );
+  memset( &inst.stats, 0, sizeof( inst.stats ) );
 }
 
 
-static void close_listening_socket ( void )
+static void reset_connection_buffers ( jtag_dpi_instance & inst )
 {
-  assert( s_listeningSocket != -1 );
-
-  close_a( s_listeningSocket );
+  inst.receive_buffer_pos = 0;
+  inst.receive_buffer_len = 0;
 
-  s_listeningSocket = -1;
+  inst.send_buffer.clear();
+  inst.send_buffer_pos = 0;
 }
 
 
-static void create_listening_socket ( void )
+static void signal_event_fd ( const int event_fd )
 {
-  assert( s_listeningSocket == -1 );
+  const uint64_t increment = 1;
 
-  s_listeningSocket = socket( PF_INET,
-                              SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
-                              0 );
-
-  if ( s_listeningSocket == -1 )
+  for ( ; ; )
   {
-    throw std::runtime_error( get_error_message( "Error creating the listening socket: ", errno ) );
+    const ssize_t res = write( event_fd, &increment, sizeof(increment) );
+
+    if ( res == -1 && errno == EINTR )
+      continue;
+
+    // The only possible error is an overflow of the eventfd counter, which would only
+    // mean that the other side already has a wake-up call pending.
+    assert( res == sizeof(increment) || errno == EAGAIN );
+    break;
   }
+}
 
-  try
-  {
-    // If this process terminates abruptly, the TCP/IP stack does not release
-    // the listening ports immediately, at least under Linux (I've seen comments
-    // about this issue under Windows too). Therefore, if you restart the simulation
-    // whithin a few seconds, you'll get an annoying "address already in use" error message.
-    // The SO_REUSEADDR prevents this from happening.
-    const int set_reuse_to_yes = 1;
-    if ( setsockopt( s_listeningSocket,
-                     SOL_SOCKET,
-                     SO_REUSEADDR,
-                     &set_reuse_to_yes,
-                     sizeof(set_reuse_to_yes) ) == -1 )
-    {
-      throw std::runtime_error( get_error_message( "Error setting the listen socket options: ", errno ) );
-    }
 
-    sockaddr_in addr;
-    memset( &addr, 0, sizeof(addr) );
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons( s_listening_tcp_port );
-    addr.sin_addr.s_addr = ntohl( s_listen_on_local_addr_only ? INADDR_LOOPBACK : INADDR_ANY );
+// The caller counts the system call. When handing the connection over to the I/O thread,
+// the counters must be updated before the link state changes.
 
-    if ( bind( s_listeningSocket,
-               (struct sockaddr *)&addr,
-               sizeof(addr) ) == -1 )
-    {
-      throw std::runtime_error( get_error_message( "Error binding the socket: ", errno ) );
-    }
+static void wake_up_io_thread ( jtag_dpi_instance & inst )
+{
+  signal_event_fd( inst.io_thread->wakeup_event_fd );
+}
 
-    // The listening IP address and listening port do not change, so print this information
-    // only once at the beginning. Printing the message again just clutters
-    // the screen with unnecessary information.
-    if ( !s_listening_message_already_printed )
-    {
-      s_listening_message_already_printed = true;
 
-      if ( s_print_informational_messages )
-      {
-        const std::string addr_str = ip_address_to_text( &addr.sin_addr );
+// Wakes up the shared-memory client, but only if it is blocked waiting for data.
+// A busy client never sees the doorbell, so we save a system call per reply.
 
-        printf( "%sListening on IP address %s (%s), TCP port %d.\n",
-                INFO_MSG_PREFIX,
-                addr_str.c_str(),
-                s_listen_on_local_addr_only ? "local only" : "all",
-                s_listening_tcp_port );
-        fflush( stdout );
-      }
-    }
+static void ring_shm_doorbell ( jtag_dpi_instance & inst )
+{
+  // This barrier pairs with the one in the client between setting 'client_waiting'
+  // and checking the ring again. Without it, the load below could be reordered
+  // before the ring update, and the client would sleep with data in the ring.
+  std::atomic_thread_fence( std::memory_order_seq_cst );
 
-    if ( listen( s_listeningSocket, 1 ) == -1 )
-    {
-      throw std::runtime_error( get_error_message( "Error listening on the socket: ", errno ) );
-    }
-  }
-  catch ( ... )
+  if ( inst.shm_area->client_waiting.load( std::memory_order_relaxed ) != 0 )
   {
-    close_listening_socket();
-    throw;
+    ++inst.stats.syscalls;
+    signal_event_fd( inst.shm_doorbell_fd );
   }
 }
 
 
-static void accept_connection ( void )
+static void close_shm_session ( jtag_dpi_instance & inst )
 {
-  assert( s_listeningSocket != -1 );
-
-  for ( ; ; )
+  if ( inst.shm_area != NULL )
   {
-    pollfd polled_fd;
+    const int res = munmap( inst.shm_area, sizeof( jtag_dpi_shm_area ) );
+    assert( res == 0 );
+    (void) res;
 
-    polled_fd.fd      = s_listeningSocket;
-    polled_fd.events  = POLLIN | POLLERR;
-    polled_fd.revents = 0;
+    inst.shm_area = NULL;
+  }
 
-    const int poll_res = poll( &polled_fd, 1, 0 );
+  if ( inst.shm_doorbell_fd != -1 )
+  {
+    close_a( inst.shm_doorbell_fd );
+    inst.shm_doorbell_fd = -1;
+  }
+}
 
-    if ( poll_res == 0 )
-    {
-      // No incoming connection is yet there.
-      return;
-    }
 
-    if ( poll_res == -1 )
-    {
-      if ( errno == EINTR )
-        continue;
+// ----------- io_uring -----------
+//
+// See io_mode IO_MODE_URING above. The routines below submit each request straight away
+// with a single io_uring_enter() call, and reap the completions with plain memory reads.
 
-      throw std::runtime_error( get_error_message( "Error polling the listening socket: ", errno ) );
-    }
+// The kernel rounds the completion ring up to twice this size, which is more than
+// the few requests in flight at any time (one accept or receive, one send and one
+// completion per receive buffer) can ever fill.
+static const unsigned URING_ENTRY_COUNT = 64;
 
-    assert( poll_res == 1 );
-    break;
-  }
+// Together as large as receive_buffer in IO_MODE_POLL mode. The count must be a power of 2.
+static const unsigned URING_RECEIVE_BUFFER_COUNT = 16;
+static const size_t   URING_RECEIVE_BUFFER_SIZE  = 4 * 1024;
+static const uint16_t URING_BUFFER_GROUP_ID      = 0;
 
-  if ( s_print_informational_messages )
-  {
-    // printf( "%sPoll result flags: 0x%02X\n", polledFd.revents, INFO_MSG_PREFIX );
-    // fflush( stdout );
-  }
+static const size_t URING_SEND_BUFFER_SIZE = SEND_BUFFER_HIGH_WATER_MARK;
 
-  sockaddr_in remoteAddr;
-  socklen_t remoteAddrLen = sizeof( remoteAddr );
+// The request type goes into the lowest byte of the user_data field, and the connection generation above it.
+static const uint64_t URING_REQUEST_ACCEPT = 1;
+static const uint64_t URING_REQUEST_RECV   = 2;
+static const uint64_t URING_REQUEST_SEND   = 3;
 
-  const int connectionSocket = accept4_eintr( s_listeningSocket,
-                                              (sockaddr *) &remoteAddr,
-                                              &remoteAddrLen,
-                                              SOCK_NONBLOCK | SOCK_CLOEXEC );
+#ifdef JTAG_DPI_HAVE_IO_URING
 
-  // Any errors accepting a connection are considered non-critical and do not normally stop the simulation,
-  // as the remote client can try to reconnect at a later point in time.
-  try
-  {
-    if ( connectionSocket == -1 )
-    {
-      throw std::runtime_error( get_error_message( NULL, errno ) );
-    }
+// The rings are shared with the kernel, and they are not std::atomic objects,
+// so use the compiler's atomic built-ins to access the head and tail indexes.
 
-    if ( remoteAddrLen > sizeof( remoteAddr ) )
-    {
-      throw std::runtime_error( "The address buffer is too small." );
-    }
+static unsigned load_acquire ( const unsigned * const p )
+{
+  return __atomic_load_n( p, __ATOMIC_ACQUIRE );
+}
 
-    if ( s_print_informational_messages )
-    {
-      const std::string addr_str = ip_address_to_text( &remoteAddr.sin_addr );
 
-      printf( "%sAccepted an incoming connection from IP address %s, TCP port %d.\n",
+static void store_release ( unsigned * const p, const unsigned value )
+{
+  __atomic_store_n( p, value, __ATOMIC_RELEASE );
+}
+
+
+static void destroy_uring ( jtag_dpi_instance & inst )
+{
+  uring_data * const uring = inst.uring;
+
+  if ( uring == NULL )
+    return;
+
+  // Closing the ring cancels all requests still in flight.
+  if ( uring->ring_fd != -1 )
+    close_a( uring->ring_fd );
+
+  if ( uring->rings != NULL )
+    munmap( uring->rings, uring->rings_size );
+
+  if ( uring->sqes != NULL )
+    munmap( uring->sqes, uring->sqes_size );
+
+  if ( uring->buf_ring != NULL )
+    munmap( uring->buf_ring, URING_RECEIVE_BUFFER_COUNT * sizeof( io_uring_buf ) );
+
+  delete uring;
+  inst.uring = NULL;
+}
+
+
+// Hands a receive buffer back to the kernel.
+
+static void recycle_uring_buffer ( uring_data & uring, const uint16_t buffer_id )
+{
+  // Do not use the 'bufs' member of io_uring_buf_ring. The kernel header declares that flexible array
+  // in a way that places it at the wrong offset when compiling as C++.
+  io_uring_buf & buf = reinterpret_cast< io_uring_buf * >( uring.buf_ring )[ uring.buf_ring_tail & ( URING_RECEIVE_BUFFER_COUNT - 1 ) ];
+
+  buf.addr = uint64_t( uintptr_t( &uring.receive_buffers[ buffer_id * URING_RECEIVE_BUFFER_SIZE ] ) );
+  buf.len  = uint32_t( URING_RECEIVE_BUFFER_SIZE );
+  buf.bid  = buffer_id;
+
+  ++uring.buf_ring_tail;
+
+  // The tail shares its memory location with a reserved field of the first buffer entry.
+  __atomic_store_n( &uring.buf_ring->tail, uring.buf_ring_tail, __ATOMIC_RELEASE );
+}
+
+
+// Throws if the kernel does not support io_uring, or not the features this module needs.
+// The caller then falls back to IO_MODE_POLL.
+
+static void setup_uring ( jtag_dpi_instance & inst )
+{
+  assert( inst.uring == NULL );
+
+  uring_data * const uring = new uring_data();
+  uring->ring_fd  = -1;
+  uring->rings    = NULL;
+  uring->sqes     = NULL;
+  uring->buf_ring = NULL;
+  inst.uring = uring;
+
+  try
+  {
+    io_uring_params params;
+    memset( &params, 0, sizeof(params) );
+
+    uring->ring_fd = int( syscall( __NR_io_uring_setup, URING_ENTRY_COUNT, &params ) );
+
+    if ( uring->ring_fd == -1 )
+    {
+      throw std::runtime_error( get_error_message( "Error creating the io_uring instance: ", errno ) );
+    }
+
+    if ( 0 == ( params.features & IORING_FEAT_SINGLE_MMAP ) )
+    {
+      throw std::runtime_error( "The io_uring implementation in the kernel is too old." );
+    }
+
+    uring->rings_size = std::max( params.sq_off.array + params.sq_entries * sizeof( unsigned ),
+                                  params.cq_off.cqes  + params.cq_entries * sizeof( io_uring_cqe ) );
+
+    void * const rings = mmap( NULL, uring->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                               uring->ring_fd, IORING_OFF_SQ_RING );
+    if ( rings == MAP_FAILED )
+    {
+      throw std::runtime_error( get_error_message( "Error mapping the io_uring rings: ", errno ) );
+    }
+
+    uring->rings = rings;
+
+    uring->sqes_size = params.sq_entries * sizeof( io_uring_sqe );
+
+    void * const sqes = mmap( NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                              uring->ring_fd, IORING_OFF_SQES );
+    if ( sqes == MAP_FAILED )
+    {
+      throw std::runtime_error( get_error_message( "Error mapping the io_uring submission entries: ", errno ) );
+    }
+
+    uring->sqes = static_cast< io_uring_sqe * >( sqes );
+
+    uint8_t * const ring_base = static_cast< uint8_t * >( rings );
+
+    uring->sq_tail = reinterpret_cast< unsigned * >( ring_base + params.sq_off.tail );
+    uring->sq_mask = *reinterpret_cast< const unsigned * >( ring_base + params.sq_off.ring_mask );
+    uring->cq_head = reinterpret_cast< unsigned * >( ring_base + params.cq_off.head );
+    uring->cq_tail = reinterpret_cast< unsigned * >( ring_base + params.cq_off.tail );
+    uring->cq_mask = *reinterpret_cast< const unsigned * >( ring_base + params.cq_off.ring_mask );
+    uring->cqes    = reinterpret_cast< io_uring_cqe * >( ring_base + params.cq_off.cqes );
+
+    // Submission entry n always sits in slot n of the indirection array.
+    unsigned * const sq_array = reinterpret_cast< unsigned * >( ring_base + params.sq_off.array );
+
+    for ( unsigned i = 0; i < params.sq_entries; ++i )
+      sq_array[ i ] = i;
+
+
+    // The provided buffer ring must be page-aligned.
+    void * const buf_ring = mmap( NULL, URING_RECEIVE_BUFFER_COUNT * sizeof( io_uring_buf ), PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if ( buf_ring == MAP_FAILED )
+    {
+      throw std::runtime_error( get_error_message( "Error allocating the io_uring buffer ring: ", errno ) );
+    }
+
+    uring->buf_ring = static_cast< io_uring_buf_ring * >( buf_ring );
+
+    io_uring_buf_reg buf_reg;
+    memset( &buf_reg, 0, sizeof(buf_reg) );
+    buf_reg.ring_addr    = uint64_t( uintptr_t( buf_ring ) );
+    buf_reg.ring_entries = URING_RECEIVE_BUFFER_COUNT;
+    buf_reg.bgid         = URING_BUFFER_GROUP_ID;
+
+    if ( syscall( __NR_io_uring_register, uring->ring_fd, IORING_REGISTER_PBUF_RING, &buf_reg, 1 ) == -1 )
+    {
+      throw std::runtime_error( get_error_message( "Error registering the io_uring buffer ring: ", errno ) );
+    }
+
+    uring->receive_buffers.resize( URING_RECEIVE_BUFFER_COUNT * URING_RECEIVE_BUFFER_SIZE );
+    uring->buf_ring_tail = 0;
+
+    for ( unsigned i = 0; i < URING_RECEIVE_BUFFER_COUNT; ++i )
+      recycle_uring_buffer( *uring, uint16_t( i ) );
+
+    uring->send_buffer.resize( URING_SEND_BUFFER_SIZE );
+    uring->send_len = 0;
+    uring->send_pos = 0;
+    uring->is_send_in_flight = false;
+
+    uring->connection_generation = 0;
+    uring->is_recv_armed         = false;
+    uring->peer_closed           = false;
+    uring->is_accept_complete    = false;
+    uring->accept_result         = -1;
+  }
+  catch ( ... )
+  {
+    destroy_uring( inst );
+    throw;
+  }
+}
+
+
+// The submission ring always has room, because each entry is submitted straight away.
+
+static io_uring_sqe * get_uring_sqe ( uring_data & uring )
+{
+  io_uring_sqe * const sqe = &uring.sqes[ *uring.sq_tail & uring.sq_mask ];
+
+  memset( sqe, 0, sizeof( *sqe ) );
+
+  return sqe;
+}
+
+
+static void submit_uring_sqe ( jtag_dpi_instance & inst )
+{
+  uring_data & uring = *inst.uring;
+
+  store_release( uring.sq_tail, *uring.sq_tail + 1 );
+
+  for ( ; ; )
+  {
+    const long res = syscall( __NR_io_uring_enter, uring.ring_fd, 1, 0, 0, NULL, 0 );
+
+    if ( res == -1 && errno == EINTR )
+      continue;
+
+    ++inst.stats.syscalls;
+
+    if ( res == -1 )
+    {
+      throw std::runtime_error( get_error_message( "Error submitting an io_uring request: ", errno ) );
+    }
+
+    if ( res != 1 )
+    {
+      throw std::runtime_error( "The kernel did not accept the io_uring request." );
+    }
+
+    break;
+  }
+}
+
+
+static uint64_t make_uring_user_data ( uring_data & uring, const uint64_t request_type )
+{
+  return ( uint64_t( uring.connection_generation ) << 8 ) | request_type;
+}
+
+
+// This module serves a single client and closes the listening socket as soon as a connection
+// has been accepted (see accept_connection()), so a single-shot accept request is enough.
+
+static void arm_uring_accept ( jtag_dpi_instance & inst )
+{
+  uring_data & uring = *inst.uring;
+
+  assert( inst.listeningSocket != -1 && !uring.is_accept_complete );
+
+  uring.accept_addr_len = sizeof( uring.accept_addr );
+
+  io_uring_sqe * const sqe = get_uring_sqe( uring );
+  sqe->opcode       = IORING_OP_ACCEPT;
+  sqe->fd           = inst.listeningSocket;
+  sqe->addr         = uint64_t( uintptr_t( &uring.accept_addr ) );
+  sqe->addr2        = uint64_t( uintptr_t( &uring.accept_addr_len ) );
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  sqe->user_data    = URING_REQUEST_ACCEPT;
+
+  submit_uring_sqe( inst );
+}
+
+
+// The multishot receive request keeps producing completions, each one with a new buffer,
+// until the connection closes, an error occurs or the kernel runs out of buffers.
+
+static void arm_uring_recv ( jtag_dpi_instance & inst )
+{
+  uring_data & uring = *inst.uring;
+
+  io_uring_sqe * const sqe = get_uring_sqe( uring );
+  sqe->opcode    = IORING_OP_RECV;
+  sqe->fd        = inst.connectionSocket;
+  sqe->ioprio    = IORING_RECV_MULTISHOT;
+  sqe->flags     = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUFFER_GROUP_ID;
+  sqe->user_data = make_uring_user_data( uring, URING_REQUEST_RECV );
+
+  submit_uring_sqe( inst );
+
+  uring.is_recv_armed = true;
+}
+
+
+static void queue_uring_send ( jtag_dpi_instance & inst )
+{
+  uring_data & uring = *inst.uring;
+
+  io_uring_sqe * const sqe = get_uring_sqe( uring );
+  sqe->opcode    = IORING_OP_SEND;
+  sqe->fd        = inst.connectionSocket;
+  sqe->addr      = uint64_t( uintptr_t( &uring.send_buffer[ uring.send_pos ] ) );
+  sqe->len       = uint32_t( uring.send_len - uring.send_pos );
+  sqe->msg_flags = MSG_NOSIGNAL;  // See send_eintr().
+  sqe->user_data = make_uring_user_data( uring, URING_REQUEST_SEND );
+
+  submit_uring_sqe( inst );
+
+  uring.is_send_in_flight = true;
+}
+
+
+// Returns how many bytes have been handed over to the kernel. While the previous send request
+// is still in flight, the data stays in the caller's send buffer, and goes out together
+// with whatever else accumulates in the meantime.
+
+static size_t submit_uring_send ( jtag_dpi_instance & inst,
+                                  const uint8_t * const data,
+                                  const size_t len )
+{
+  uring_data & uring = *inst.uring;
+
+  if ( uring.is_send_in_flight )
+    return 0;
+
+  const size_t byte_count = std::min( len, URING_SEND_BUFFER_SIZE );
+
+  memcpy( &uring.send_buffer[ 0 ], data, byte_count );
+  uring.send_len = byte_count;
+  uring.send_pos = 0;
+
+  queue_uring_send( inst );
+
+  return byte_count;
+}
+
+
+// Forgets about the current connection. The requests still in flight complete
+// with the old connection generation, so their completions are discarded.
+
+static void retire_uring_connection ( jtag_dpi_instance & inst )
+{
+  uring_data & uring = *inst.uring;
+
+  // The multishot receive request holds a reference to the socket, so closing the file descriptor
+  // alone would not end the connection. The shutdown makes the pending requests complete.
+  shutdown( inst.connectionSocket, SHUT_RDWR );
+
+  ++uring.connection_generation;
+
+  for ( ; !uring.received_chunks.empty(); uring.received_chunks.pop_front() )
+    recycle_uring_buffer( uring, uring.received_chunks.front().buffer_id );
+
+  uring.is_recv_armed = false;
+  uring.peer_closed   = false;
+}
+
+
+static size_t read_uring_data ( jtag_dpi_instance & inst,
+                                void * const buf,
+                                const size_t len )
+{
+  uring_data & uring = *inst.uring;
+
+  uint8_t * const dest = static_cast< uint8_t * >( buf );
+  size_t byte_count = 0;
+
+  while ( byte_count < len && !uring.received_chunks.empty() )
+  {
+    uring_received_chunk & chunk = uring.received_chunks.front();
+
+    const size_t chunk_byte_count = std::min( len - byte_count, size_t( chunk.len - chunk.pos ) );
+
+    memcpy( dest + byte_count,
+            &uring.receive_buffers[ chunk.buffer_id * URING_RECEIVE_BUFFER_SIZE + chunk.pos ],
+            chunk_byte_count );
+
+    byte_count += chunk_byte_count;
+    chunk.pos  += uint32_t( chunk_byte_count );
+
+    if ( chunk.pos == chunk.len )
+    {
+      recycle_uring_buffer( uring, chunk.buffer_id );
+      uring.received_chunks.pop_front();
+    }
+  }
+
+  inst.stats.bytes_received += byte_count;
+
+  return byte_count;
+}
+
+
+// Like is_input_pending(), this may return true if it is not known yet,
+// because there are completions of any kind waiting to be reaped.
+
+static bool is_uring_input_pending ( jtag_dpi_instance & inst )
+{
+  uring_data & uring = *inst.uring;
+
+  return !uring.received_chunks.empty() ||
+         uring.peer_closed ||
+         *uring.cq_head != load_acquire( uring.cq_tail );
+}
+
+
+static void process_uring_completion ( jtag_dpi_instance & inst, const io_uring_cqe & cqe )
+{
+  uring_data & uring = *inst.uring;
+
+  const uint64_t request_type = cqe.user_data & 0xFF;
+  const bool is_current_connection = uint32_t( cqe.user_data >> 8 ) == uring.connection_generation;
+
+  switch ( request_type )
+  {
+  case URING_REQUEST_ACCEPT:
+    uring.is_accept_complete = true;
+    uring.accept_result = cqe.res;
+    break;
+
+  case URING_REQUEST_RECV:
+    if ( 0 != ( cqe.flags & IORING_CQE_F_BUFFER ) )
+    {
+      const uint16_t buffer_id = uint16_t( cqe.flags >> IORING_CQE_BUFFER_SHIFT );
+
+      if ( is_current_connection && cqe.res > 0 )
+      {
+        uring_received_chunk chunk;
+        chunk.buffer_id = buffer_id;
+        chunk.len       = uint32_t( cqe.res );
+        chunk.pos       = 0;
+        uring.received_chunks.push_back( chunk );
+      }
+      else
+      {
+        recycle_uring_buffer( uring, buffer_id );
+      }
+    }
+
+    if ( !is_current_connection )
+      break;
+
+    if ( 0 == ( cqe.flags & IORING_CQE_F_MORE ) )
+      uring.is_recv_armed = false;
+
+    // ENOBUFS means that the simulation has not consumed the data fast enough.
+    // reap_uring_completions() arms the request again once a buffer is free.
+    if ( cqe.res == 0 )
+    {
+      uring.peer_closed = true;
+    }
+    else if ( cqe.res < 0 && cqe.res != -ENOBUFS )
+    {
+      throw std::runtime_error( get_error_message( "Error receiving data: ", -cqe.res ) );
+    }
+    break;
+
+  case URING_REQUEST_SEND:
+    // A send request for an old connection must complete before the next one starts,
+    // because they share the send buffer.
+    uring.is_send_in_flight = false;
+
+    if ( !is_current_connection )
+      break;
+
+    if ( cqe.res < 0 )
+    {
+      throw std::runtime_error( get_error_message( "Error sending data: ", -cqe.res ) );
+    }
+
+    uring.send_pos += size_t( cqe.res );
+
+    if ( uring.send_pos != uring.send_len )
+      queue_uring_send( inst );
+
+    break;
+
+  default:
+    assert( false );
+    break;
+  }
+}
+
+
+// Unless a request has completed, this costs just two memory reads, and no system call at all.
+
+static void reap_uring_completions ( jtag_dpi_instance & inst )
+{
+  uring_data & uring = *inst.uring;
+
+  for ( ; ; )
+  {
+    const unsigned head = *uring.cq_head;
+
+    if ( head == load_acquire( uring.cq_tail ) )
+      break;
+
+    const io_uring_cqe cqe = uring.cqes[ head & uring.cq_mask ];
+
+    // Release the entry before processing it, as processing may throw.
+    store_release( uring.cq_head, head + 1 );
+
+    process_uring_completion( inst, cqe );
+  }
+
+  if ( inst.connectionSocket != -1 &&
+       !uring.is_recv_armed &&
+       !uring.peer_closed &&
+       uring.received_chunks.size() < URING_RECEIVE_BUFFER_COUNT )
+  {
+    arm_uring_recv( inst );
+  }
+}
+
+#else  // #ifdef JTAG_DPI_HAVE_IO_URING
+
+// Without io_uring support, setup_uring() always fails, IO_MODE_URING falls back to IO_MODE_POLL,
+// and the other routines are never called.
+
+static void setup_uring ( jtag_dpi_instance & )
+{
+  throw std::runtime_error( "This module was compiled without io_uring support." );
+}
+
+static void destroy_uring ( jtag_dpi_instance & ) {}
+static void arm_uring_accept ( jtag_dpi_instance & ) { assert( false ); }
+static void arm_uring_recv ( jtag_dpi_instance & ) { assert( false ); }
+static size_t submit_uring_send ( jtag_dpi_instance &, const uint8_t *, size_t ) { assert( false ); return 0; }
+static void retire_uring_connection ( jtag_dpi_instance & ) { assert( false ); }
+static size_t read_uring_data ( jtag_dpi_instance &, void *, size_t ) { assert( false ); return 0; }
+static bool is_uring_input_pending ( jtag_dpi_instance & ) { assert( false ); return false; }
+static void reap_uring_completions ( jtag_dpi_instance & ) { assert( false ); }
+
+#endif  // #ifdef JTAG_DPI_HAVE_IO_URING
+
+
+static bool is_connection_open ( jtag_dpi_instance & inst )
+{
+  if ( inst.io_mode == IO_MODE_THREAD )
+    return inst.io_thread->is_connection_open;
+  else
+    return inst.connectionSocket != -1;
+}
+
+
+static void close_current_connection ( jtag_dpi_instance & inst )
+{
+  end_connection_statistics( inst );
+
+  // Make sure that a complete session ends up on disk, even if the simulation gets killed later on.
+  if ( inst.record_file != NULL )
+  {
+    fflush( inst.record_file );
+  }
+
+  if ( inst.io_mode == IO_MODE_THREAD )
+  {
+    assert( inst.io_thread->is_connection_open );
+
+    inst.io_thread->is_connection_open = false;
+    ++inst.stats.syscalls;
+    inst.io_thread->link_state.store( ls_close_requested, std::memory_order_release );
+    wake_up_io_thread( inst );
+    return;
+  }
+
+  assert( inst.connectionSocket != -1 );
+
+  if ( inst.io_mode == IO_MODE_URING )
+  {
+    retire_uring_connection( inst );
+  }
+
+  close_shm_session( inst );
+
+  // Closing the socket also removes it from the epoll set.
+  close_a( inst.connectionSocket );
+
+  inst.connectionSocket = -1;
+}
+
+
+static void add_connection_socket_to_epoll_set ( jtag_dpi_instance & inst )
+{
+  epoll_event event;
+  memset( &event, 0, sizeof(event) );
+  event.events   = EPOLLIN;
+  event.data.u32 = inst.index;
+
+  if ( epoll_ctl( s_epoll_fd, EPOLL_CTL_ADD, inst.connectionSocket, &event ) == -1 )
+  {
+    throw std::runtime_error( get_error_message( "Error adding the connection socket to the epoll set: ", errno ) );
+  }
+
+  // Data may have arrived together with the connection.
+  inst.is_socket_readable.store( true, std::memory_order_relaxed );
+  inst.seen_socket_poll_generation = s_socket_poll_generation.load( std::memory_order_acquire );
+}
+
+
+// The epoll set is level-triggered, so a socket that still has data
+// will be reported again on the next simulation cycle.
+
+static void poll_connection_sockets ( jtag_dpi_instance & inst )
+{
+  unsigned generation = s_socket_poll_generation.load( std::memory_order_acquire );
+
+  if ( inst.seen_socket_poll_generation == generation )
+  {
+    // This instance has already seen the last results, so a new simulation cycle has started.
+
+    epoll_event events[ 64 ];
+    int event_count;
+
+    for ( ; ; )
+    {
+      event_count = epoll_wait( s_epoll_fd, events, sizeof(events) / sizeof(events[0]), 0 );
+
+      if ( event_count == -1 && errno == EINTR )
+        continue;
+
+      break;
+    }
+
+    if ( event_count == -1 )
+    {
+      throw std::runtime_error( get_error_message( "Error polling the connection sockets: ", errno ) );
+    }
+
+    ++inst.stats.syscalls;
+
+    if ( event_count == 0 )
+      ++inst.stats.empty_syscalls;
+
+    for ( int i = 0; i < event_count; ++i )
+    {
+      const uint32_t index = events[ i ].data.u32;
+
+      jtag_dpi_instance * const readable_inst = index < MAX_INSTANCE_COUNT
+                                                  ? s_instances[ index ].load( std::memory_order_acquire )
+                                                  : NULL;
+      if ( readable_inst != NULL )
+      {
+        // The epoll set is level-triggered, so if the owner clears the flag at the same time,
+        // the next poll reports the socket again.
+        readable_inst->is_socket_readable.store( true, std::memory_order_relaxed );
+      }
+    }
+
+    // The release ordering publishes the flags above to the instances that see the new generation.
+    generation = s_socket_poll_generation.fetch_add( 1, std::memory_order_acq_rel ) + 1;
+  }
+
+  inst.seen_socket_poll_generation = generation;
+}
+
+
+// Pass MSG_NOSIGNAL, so that a client that disconnects does not raise SIGPIPE.
+// The main program normally ignores that signal, but in a multithreaded simulation, jtag_dpi_tick()
+// may run on any of Verilator's worker threads, and this module should not depend on how
+// the program has configured the signal handling for each of them.
+
+static ssize_t send_eintr ( const int sockfd,
+                            const void * const buf,
+                            const size_t len,
+                            const int flags )
+{
+  for ( ; ; )
+  {
+    const ssize_t ret = send( sockfd, buf, len, flags );
+
+    if ( ret == -1 && errno == EINTR )
+      continue;
+
+    return ret;
+  }
+}
+
+
+static ssize_t recv_eintr ( const int sockfd,
+                            void * const buf,
+                            const size_t len,
+                            const int flags )
+{
+  for ( ; ; )
+  {
+    const ssize_t ret = recv( sockfd, buf, len, flags );
+
+    if ( ret == -1 && errno == EINTR )
+      continue;
+
+    return ret;
+  }
+}
+
+
+static int accept4_eintr ( const int sockfd,
+                           struct sockaddr * const addr,
+                           socklen_t * const addrlen,
+                           const int flags )
+{
+  for ( ; ; )
+  {
+    const ssize_t ret = accept4( sockfd, addr, addrlen, flags );
+
+    if ( ret == -1 && errno == EINTR )
+      continue;
+
+    return ret;
+  }
+}
+
+
+// Replies are collected in the send buffer and flushed once per tick with flush_send_buffer().
+
+static void send_data ( jtag_dpi_instance & inst,
+                        const void * const data,
+                        const size_t len )
+{
+  const uint8_t * const bytes = static_cast< const uint8_t * >( data );
+
+  inst.send_buffer.insert( inst.send_buffer.end(), bytes, bytes + len );
+}
+
+
+// Sends as much of the send buffer as the socket (or the I/O thread's ring, the io_uring send request
+// or the shared-memory ring) accepts.
+// Whatever does not fit stays in the buffer for the next tick.
+
+static void flush_send_buffer ( jtag_dpi_instance & inst )
+{
+  const size_t pending_len = inst.send_buffer.size() - inst.send_buffer_pos;
+
+  if ( pending_len == 0 )
+    return;
+
+  size_t sent_byte_count;
+
+  if ( inst.io_mode == IO_MODE_THREAD )
+  {
+    sent_byte_count = ring_write( &inst.io_thread->tx_ring, &inst.send_buffer[ inst.send_buffer_pos ], pending_len );
+
+    if ( sent_byte_count != 0 )
+    {
+      ++inst.stats.syscalls;
+      wake_up_io_thread( inst );
+    }
+  }
+  else if ( inst.io_mode == IO_MODE_URING )
+  {
+    sent_byte_count = submit_uring_send( inst, &inst.send_buffer[ inst.send_buffer_pos ], pending_len );
+  }
+  else if ( inst.shm_area != NULL )
+  {
+    sent_byte_count = ring_write( &inst.shm_area->to_client, &inst.send_buffer[ inst.send_buffer_pos ], pending_len );
+
+    if ( sent_byte_count != 0 )
+    {
+      ring_shm_doorbell( inst );
+    }
+  }
+  else
+  {
+    const ssize_t res = send_eintr( inst.connectionSocket,
+                                    &inst.send_buffer[ inst.send_buffer_pos ],
+                                    pending_len,
+                                    MSG_NOSIGNAL  // See send_eintr().
+                                    );
+    ++inst.stats.syscalls;
+
+    if ( res == -1 )
+    {
+      if ( errno != EAGAIN && errno != EWOULDBLOCK )
+      {
+        throw std::runtime_error( get_error_message( "Error sending data: ", errno ) );
+      }
+
+      // The socket's send buffer is full, try again on the next tick.
+      ++inst.stats.empty_syscalls;
+      sent_byte_count = 0;
+    }
+    else
+    {
+      sent_byte_count = size_t( res );
+    }
+  }
+
+  inst.send_buffer_pos += sent_byte_count;
+  inst.stats.bytes_sent += sent_byte_count;
+
+  if ( inst.send_buffer_pos == inst.send_buffer.size() )
+  {
+    inst.send_buffer.clear();
+    inst.send_buffer_pos = 0;
+  }
+}
+
+
+// A client that keeps sending commands without reading the replies
+// should not make us buffer an unlimited amount of data.
+
+static bool is_send_buffer_full ( jtag_dpi_instance & inst )
+{
+  return inst.send_buffer.size() - inst.send_buffer_pos >= SEND_BUFFER_HIGH_WATER_MARK;
+}
+
+
+static void send_byte ( jtag_dpi_instance & inst, const uint8_t data )
+{
+  send_data( inst, &data, sizeof(data) );
+}
+
+
+static void print_connection_closed_at_the_other_end ( jtag_dpi_instance & inst )
+{
+  if ( inst.print_informational_messages )
+  {
+    printf( "%sConnection closed at the other end.\n", INFO_MSG_PREFIX );
+    fflush( stdout );
+  }
+}
+
+
+// Whether receive_data() would find something to return, without consuming any data.
+// In IO_MODE_POLL mode with a socket, it may also return true if it is not known yet,
+// for example straight after accepting a connection.
+
+static bool is_input_pending ( jtag_dpi_instance & inst )
+{
+  if ( inst.io_mode == IO_MODE_THREAD )
+    return !ring_is_empty( &inst.io_thread->rx_ring );
+
+  if ( inst.io_mode == IO_MODE_URING )
+    return is_uring_input_pending( inst );
+
+  if ( inst.shm_area != NULL )
+    return !ring_is_empty( &inst.shm_area->to_simulation );
+
+  return inst.receive_buffer_pos != inst.receive_buffer_len ||
+         inst.is_socket_readable.load( std::memory_order_relaxed );
+}
+
+
+// Returns the number of bytes received, 0 if no data is available yet,
+// or -1 if the connection has been closed (and the connection has been closed on this end too).
+
+static ssize_t receive_data ( jtag_dpi_instance & inst,
+                              void * const buf,
+                              const size_t len )
+{
+  if ( inst.io_mode == IO_MODE_THREAD )
+  {
+    const size_t received_byte_count = ring_read( &inst.io_thread->rx_ring, buf, len );
+
+    if ( received_byte_count != 0 )
+    {
+      inst.stats.bytes_received += received_byte_count;
+      return received_byte_count;
+    }
+
+    if ( !inst.io_thread->peer_closed.load( std::memory_order_acquire ) )
+      return 0;
+
+    // The I/O thread sets the peer_closed flag after pushing the last bytes,
+    // so look at the ring once more.
+    const size_t last_byte_count = ring_read( &inst.io_thread->rx_ring, buf, len );
+
+    if ( last_byte_count != 0 )
+    {
+      inst.stats.bytes_received += last_byte_count;
+      return last_byte_count;
+    }
+
+    print_connection_closed_at_the_other_end( inst );
+    close_current_connection( inst );
+    return -1;
+  }
+
+  if ( inst.io_mode == IO_MODE_URING )
+  {
+    // The peer_closed flag is only set after all received data has been queued.
+    const size_t received_byte_count = read_uring_data( inst, buf, len );
+
+    if ( received_byte_count != 0 || !inst.uring->peer_closed )
+      return received_byte_count;
+
+    print_connection_closed_at_the_other_end( inst );
+    close_current_connection( inst );
+    return -1;
+  }
+
+  if ( inst.shm_area != NULL )
+  {
+    // serve_connection() detects when the client goes away.
+    const size_t received_byte_count = ring_read( &inst.shm_area->to_simulation, buf, len );
+    inst.stats.bytes_received += received_byte_count;
+    return received_byte_count;
+  }
+
+  if ( inst.receive_buffer_pos == inst.receive_buffer_len )
+  {
+    if ( !inst.is_socket_readable.load( std::memory_order_relaxed ) )
+      return 0;
+
+    inst.is_socket_readable.store( false, std::memory_order_relaxed );
+
+    // Drain everything the socket has got with a single recv() call.
+
+    const ssize_t received_byte_count = recv_eintr( inst.connectionSocket,
+                                                    inst.receive_buffer,
+                                                    sizeof( inst.receive_buffer ),
+                                                    0  // No special flags.
+                                                    );
+    ++inst.stats.syscalls;
+
+    if ( received_byte_count == 0 )
+    {
+      print_connection_closed_at_the_other_end( inst );
+      close_current_connection( inst );
+      return -1;
+    }
+
+    if ( received_byte_count == -1 )
+    {
+      if ( errno == EAGAIN || errno == EWOULDBLOCK )
+      {
+        // No data available yet.
+        ++inst.stats.empty_syscalls;
+        return 0;
+      }
+
+      throw std::runtime_error( get_error_message( "Error receiving data: ", errno ) );
+    }
+
+    inst.receive_buffer_pos = 0;
+    inst.receive_buffer_len = size_t( received_byte_count );
+    inst.stats.bytes_received += inst.receive_buffer_len;
+
+    // If the buffer was not big enough, there is more data waiting.
+    if ( inst.receive_buffer_len == sizeof( inst.receive_buffer ) )
+      inst.is_socket_readable.store( true, std::memory_order_relaxed );
+  }
+
+  const size_t byte_count = std::min( len, inst.receive_buffer_len - inst.receive_buffer_pos );
+
+  memcpy( buf, &inst.receive_buffer[ inst.receive_buffer_pos ], byte_count );
+
+  inst.receive_buffer_pos += byte_count;
+
+  return byte_count;
+}
+
+
+static std::string ip_address_to_text ( const in_addr * const addr )
+{
+  char ip_addr_buffer[80];
+
+  const char * const str = inet_ntop( AF_INET,
+                                      addr,
+                                      ip_addr_buffer,
+                                      sizeof(ip_addr_buffer) );
+  if ( str == NULL )
+  {
+    throw std::runtime_error( get_error_message( "Error formatting the IP address: ", errno ) );
+  }
+
+  assert( strlen(str) <= strlen("123.123.123.123") );
+  assert( strlen(str) <= sizeof(ip_addr_buffer) );
+
+  return str;
+}
+
+
+static void close_listening_socket ( jtag_dpi_instance & inst )
+{
+  assert( inst.listeningSocket != -1 );
+
+  close_a( inst.listeningSocket );
+
+  inst.listeningSocket = -1;
+}
+
+
+// Creates a non-blocking TCP socket listening on the given port, on the address
+// selected by LISTEN_ON_LOCAL_ADDR_ONLY. The description is only used in messages.
+// If *tcp_port is 0, the operating system picks a free port, and *tcp_port returns it.
+
+static int open_listening_socket ( jtag_dpi_instance & inst,
+                                   uint16_t * const tcp_port,
+                                   const char * const description,
+                                   const bool print_listening_message )
+{
+  const int listening_socket = socket( PF_INET,
+                                       SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                                       0 );
+
+  if ( listening_socket == -1 )
+  {
+    throw std::runtime_error( get_error_message( "Error creating the listening socket: ", errno ) );
+  }
+
+  try
+  {
+    // If this process terminates abruptly, the TCP/IP stack does not release
+    // the listening ports immediately, at least under Linux (I've seen comments
+    // about this issue under Windows too). Therefore, if you restart the simulation
+    // whithin a few seconds, you'll get an annoying "address already in use" error message.
+    // The SO_REUSEADDR prevents this from happening.
+    const int set_reuse_to_yes = 1;
+    if ( setsockopt( listening_socket,
+                     SOL_SOCKET,
+                     SO_REUSEADDR,
+                     &set_reuse_to_yes,
+                     sizeof(set_reuse_to_yes) ) == -1 )
+    {
+      throw std::runtime_error( get_error_message( "Error setting the listen socket options: ", errno ) );
+    }
+
+    sockaddr_in addr;
+    memset( &addr, 0, sizeof(addr) );
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons( *tcp_port );
+    addr.sin_addr.s_addr = ntohl( inst.listen_on_local_addr_only ? INADDR_LOOPBACK : INADDR_ANY );
+
+    if ( bind( listening_socket,
+               (struct sockaddr *)&addr,
+               sizeof(addr) ) == -1 )
+    {
+      throw std::runtime_error( get_error_message( "Error binding the socket: ", errno ) );
+    }
+
+    if ( *tcp_port == 0 )
+    {
+      socklen_t addr_len = sizeof(addr);
+
+      if ( getsockname( listening_socket, (struct sockaddr *)&addr, &addr_len ) == -1 )
+      {
+        throw std::runtime_error( get_error_message( "Error getting the listening port: ", errno ) );
+      }
+
+      *tcp_port = ntohs( addr.sin_port );
+    }
+
+    if ( print_listening_message && inst.print_informational_messages )
+    {
+      const std::string addr_str = ip_address_to_text( &addr.sin_addr );
+
+      printf( "%sListening%s on IP address %s (%s), TCP port %d.\n",
+              INFO_MSG_PREFIX,
+              description,
+              addr_str.c_str(),
+              inst.listen_on_local_addr_only ? "local only" : "all",
+              *tcp_port );
+      fflush( stdout );
+    }
+
+    if ( listen( listening_socket, 1 ) == -1 )
+    {
+      throw std::runtime_error( get_error_message( "Error listening on the socket: ", errno ) );
+    }
+  }
+  catch ( ... )
+  {
+    close_a( listening_socket );
+    throw;
+  }
+
+  return listening_socket;
+}
+
+
+// Creates a non-blocking Unix-domain stream socket listening on inst.unix_socket_path.
+// A socket file left behind by an earlier simulation run is removed first,
+// but any other kind of file at that path is left alone.
+
+static int open_unix_listening_socket ( jtag_dpi_instance & inst,
+                                        const bool print_listening_message )
+{
+  const char * const path = inst.unix_socket_path.c_str();
+
+  struct stat file_status;
+
+  if ( lstat( path, &file_status ) == 0 )
+  {
+    if ( !S_ISSOCK( file_status.st_mode ) )
+    {
+      throw std::runtime_error( "The Unix socket path already exists and is not a socket: " + inst.unix_socket_path );
+    }
+
+    if ( unlink( path ) == -1 )
+    {
+      throw std::runtime_error( get_error_message( "Error removing the old Unix socket file: ", errno ) );
+    }
+  }
+  else if ( errno != ENOENT )
+  {
+    throw std::runtime_error( get_error_message( "Error checking the Unix socket path: ", errno ) );
+  }
+
+  const int listening_socket = socket( PF_UNIX,
+                                       SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                                       0 );
+
+  if ( listening_socket == -1 )
+  {
+    throw std::runtime_error( get_error_message( "Error creating the listening socket: ", errno ) );
+  }
+
+  try
+  {
+    sockaddr_un addr;
+    memset( &addr, 0, sizeof(addr) );
+    addr.sun_family = AF_UNIX;
+
+    // jtag_dpi_init() has already checked the path length.
+    assert( inst.unix_socket_path.size() < sizeof( addr.sun_path ) );
+    strcpy( addr.sun_path, path );
+
+    if ( bind( listening_socket,
+               (struct sockaddr *)&addr,
+               sizeof(addr) ) == -1 )
+    {
+      throw std::runtime_error( get_error_message( "Error binding the socket: ", errno ) );
+    }
+
+    if ( print_listening_message && inst.print_informational_messages )
+    {
+      printf( "%sListening on Unix socket %s%s.\n",
+              INFO_MSG_PREFIX,
+              path,
+              inst.transport == TRANSPORT_SHM ? " (shared-memory transport)" : "" );
+      fflush( stdout );
+    }
+
+    if ( listen( listening_socket, 1 ) == -1 )
+    {
+      throw std::runtime_error( get_error_message( "Error listening on the socket: ", errno ) );
+    }
+  }
+  catch ( ... )
+  {
+    close_a( listening_socket );
+    throw;
+  }
+
+  return listening_socket;
+}
+
+
+// Writes the TCP port actually listened on, followed by a new-line character, to the port file.
+// The file appears under its final name only when complete, so a script waiting for it never reads half a number.
+
+static void write_port_file ( jtag_dpi_instance & inst )
+{
+  const std::string tmp_file_name = inst.port_file_name + ".tmp";
+
+  FILE * const f = fopen( tmp_file_name.c_str(), "w" );
+
+  if ( f == NULL )
+  {
+    throw std::runtime_error( get_error_message( ( "Error creating port file \"" + tmp_file_name + "\": " ).c_str(), errno ) );
+  }
+
+  const bool write_failed = fprintf( f, "%u\n", unsigned( inst.bound_tcp_port ) ) < 0;
+
+  if ( fclose( f ) != 0 || write_failed )
+  {
+    unlink( tmp_file_name.c_str() );
+    throw std::runtime_error( "Error writing port file \"" + tmp_file_name + "\"." );
+  }
+
+  if ( rename( tmp_file_name.c_str(), inst.port_file_name.c_str() ) != 0 )
+  {
+    const int errno_val = errno;
+    unlink( tmp_file_name.c_str() );
+    throw std::runtime_error( get_error_message( ( "Error renaming the port file to \"" + inst.port_file_name + "\": " ).c_str(), errno_val ) );
+  }
+}
+
+
+static void create_listening_socket ( jtag_dpi_instance & inst )
+{
+  assert( inst.listeningSocket == -1 );
+
+  // The listening IP address and listening port do not change, so print this information
+  // only once at the beginning. Printing the message again just clutters
+  // the screen with unnecessary information.
+  if ( inst.transport == TRANSPORT_TCP )
+  {
+    // If the operating system picked the port, keep using the same one, as the client
+    // has been told about it. Another process could grab it while no socket is listening on it,
+    // but that is unlikely, because the kernel hands out ephemeral ports in turn.
+    uint16_t tcp_port = inst.bound_tcp_port != 0 ? inst.bound_tcp_port : inst.listening_tcp_port;
+
+    inst.listeningSocket = open_listening_socket( inst,
+                                                  &tcp_port,
+                                                  inst.socket_protocol == SOCKET_PROTOCOL_JTAG_VPI
+                                                    ? " for OpenOCD jtag_vpi"
+                                                    : "",
+                                                  !inst.listening_message_already_printed );
+
+    if ( inst.bound_tcp_port == 0 )
+    {
+      inst.bound_tcp_port = tcp_port;
+
+      if ( !inst.port_file_name.empty() )
+      {
+        write_port_file( inst );
+      }
+    }
+  }
+  else
+  {
+    inst.listeningSocket = open_unix_listening_socket( inst, !inst.listening_message_already_printed );
+  }
+
+  inst.listening_message_already_printed = true;
+
+  if ( inst.io_mode == IO_MODE_URING )
+  {
+    try
+    {
+      arm_uring_accept( inst );
+    }
+    catch ( ... )
+    {
+      close_listening_socket( inst );
+      throw;
+    }
+  }
+}
+
+
+// Finishes accepting a connection, whether accept4() or an io_uring accept request produced it.
+// If accepting failed, connectionSocket is -1, and accept_errno says why.
+
+static void take_accepted_connection ( jtag_dpi_instance & inst,
+                                       const int connectionSocket,
+                                       const int accept_errno,
+                                       const sockaddr_storage & remoteAddr,
+                                       const socklen_t remoteAddrLen )
+{
+  // Any errors accepting a connection are considered non-critical and do not normally stop the simulation,
+  // as the remote client can try to reconnect at a later point in time.
+  try
+  {
+    if ( connectionSocket == -1 )
+    {
+      throw std::runtime_error( get_error_message( NULL, accept_errno ) );
+    }
+
+    if ( remoteAddrLen > sizeof( remoteAddr ) )
+    {
+      throw std::runtime_error( "The address buffer is too small." );
+    }
+
+    if ( remoteAddr.ss_family == AF_INET )
+    {
+      // The replies are sent as soon as they are ready, at most once per tick. With Nagle's algorithm,
+      // a small reply would wait for the client to acknowledge the previous one, and with
+      // streaming mode, where the client does not wait for each reply, that costs whole delayed-ACK timeouts.
+      const int set_to_yes = 1;
+      if ( setsockopt( connectionSocket, IPPROTO_TCP, TCP_NODELAY, &set_to_yes, sizeof(set_to_yes) ) == -1 )
+      {
+        throw std::runtime_error( get_error_message( "Error disabling Nagle's algorithm: ", errno ) );
+      }
+    }
+
+    if ( inst.print_informational_messages )
+    {
+      if ( remoteAddr.ss_family == AF_INET )
+      {
+        const sockaddr_in * const remoteInetAddr = (const sockaddr_in *) &remoteAddr;
+
+        const std::string addr_str = ip_address_to_text( &remoteInetAddr->sin_addr );
+
+        printf( "%sAccepted an incoming connection from IP address %s, TCP port %d.\n",
+                INFO_MSG_PREFIX,
+                addr_str.c_str(),
+                ntohs( remoteInetAddr->sin_port ) );
+      }
+      else
+      {
+        // Unix-domain clients are normally unnamed, so there is no address worth printing.
+        printf( "%sAccepted an incoming connection on Unix socket %s.\n",
+                INFO_MSG_PREFIX,
+                inst.unix_socket_path.c_str() );
+      }
+
+      fflush( stdout );
+    }
+  }
+  catch ( const std::exception & e )
+  {
+    fprintf( stderr,
+             "%sError accepting a connection on the listening socket: %s\n",
+             ERROR_MSG_PREFIX_TICK,
+             e.what() );
+    fflush( stderr );
+
+    if ( connectionSocket != -1 )
+    {
+      close_a( connectionSocket );
+    }
+
+    return;
+  }
+
+  inst.connectionSocket = connectionSocket;
+
+  // If somebody else attempts to connect, he should get an error straight away.
+  // However, if the listening socket is still active, the client will land in the accept queue
+  // and he'll hopefully time-out eventually.
+  close_listening_socket( inst );
+}
+
+
+// The system calls are counted in the given variables, because this also runs on the I/O thread,
+// which must not touch inst.stats.
+
+static void accept_connection ( jtag_dpi_instance & inst,
+                                uint64_t & syscalls,
+                                uint64_t & empty_syscalls )
+{
+  assert( inst.listeningSocket != -1 );
+
+  for ( ; ; )
+  {
+    pollfd polled_fd;
+
+    polled_fd.fd      = inst.listeningSocket;
+    polled_fd.events  = POLLIN | POLLERR;
+    polled_fd.revents = 0;
+
+    const int poll_res = poll( &polled_fd, 1, 0 );
+
+    ++syscalls;
+
+    if ( poll_res == 0 )
+    {
+      // No incoming connection is yet there.
+      ++empty_syscalls;
+      return;
+    }
+
+    if ( poll_res == -1 )
+    {
+      if ( errno == EINTR )
+        continue;
+
+      throw std::runtime_error( get_error_message( "Error polling the listening socket: ", errno ) );
+    }
+
+    assert( poll_res == 1 );
+    break;
+  }
+
+  if ( inst.print_informational_messages )
+  {
+    // printf( "%sPoll result flags: 0x%02X\n", polledFd.revents, INFO_MSG_PREFIX );
+    // fflush( stdout );
+  }
+
+  sockaddr_storage remoteAddr;
+  socklen_t remoteAddrLen = sizeof( remoteAddr );
+
+  const int connectionSocket = accept4_eintr( inst.listeningSocket,
+                                              (sockaddr *) &remoteAddr,
+                                              &remoteAddrLen,
+                                              SOCK_NONBLOCK | SOCK_CLOEXEC );
+  ++syscalls;
+
+  take_accepted_connection( inst,
+                            connectionSocket,
+                            connectionSocket == -1 ? errno : 0,
+                            remoteAddr,
+                            remoteAddrLen );
+}
+
+
+// Creates the shared-memory area and the doorbell eventfd for a newly-accepted
+// TRANSPORT_SHM client, and passes both file descriptors to the client over the
+// Unix socket (SCM_RIGHTS), together with a single byte with JTAG_DPI_SHM_VERSION.
+// Like errors accepting a connection, errors here just close the connection.
+
+static void start_shm_session ( jtag_dpi_instance & inst )
+{
+  assert( inst.shm_area == NULL && inst.shm_doorbell_fd == -1 );
+
+  int memfd = -1;
+
+  try
+  {
+    memfd = memfd_create( "jtag_dpi_shm", MFD_CLOEXEC );
+
+    if ( memfd == -1 )
+    {
+      throw std::runtime_error( get_error_message( "Error creating the shared-memory file: ", errno ) );
+    }
+
+    if ( ftruncate( memfd, sizeof( jtag_dpi_shm_area ) ) == -1 )
+    {
+      throw std::runtime_error( get_error_message( "Error setting the shared-memory file size: ", errno ) );
+    }
+
+    void * const mem = mmap( NULL, sizeof( jtag_dpi_shm_area ), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0 );
+
+    if ( mem == MAP_FAILED )
+    {
+      throw std::runtime_error( get_error_message( "Error mapping the shared-memory file: ", errno ) );
+    }
+
+    // A new memfd file is zero-filled, which is a valid initial state for the atomic variables too.
+    inst.shm_area = static_cast< jtag_dpi_shm_area * >( mem );
+    inst.shm_area->magic   = JTAG_DPI_SHM_MAGIC;
+    inst.shm_area->version = JTAG_DPI_SHM_VERSION;
+    inst.shm_area->client_waiting.store( 0, std::memory_order_relaxed );
+    ring_reset( &inst.shm_area->to_simulation );
+    ring_reset( &inst.shm_area->to_client );
+
+    inst.shm_doorbell_fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+
+    if ( inst.shm_doorbell_fd == -1 )
+    {
+      throw std::runtime_error( get_error_message( "Error creating the doorbell eventfd: ", errno ) );
+    }
+
+    const int fds_to_pass[ 2 ] = { memfd, inst.shm_doorbell_fd };
+
+    uint8_t version = uint8_t( JTAG_DPI_SHM_VERSION );
+    iovec iov;
+    iov.iov_base = &version;
+    iov.iov_len  = sizeof( version );
+
+    union
+    {
+      cmsghdr header;
+      uint8_t buffer[ CMSG_SPACE( sizeof( fds_to_pass ) ) ];
+    } control;
+    memset( &control, 0, sizeof(control) );
+
+    msghdr msg;
+    memset( &msg, 0, sizeof(msg) );
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control.buffer;
+    msg.msg_controllen = sizeof( control.buffer );
+
+    cmsghdr * const cmsg = CMSG_FIRSTHDR( &msg );
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN( sizeof( fds_to_pass ) );
+    memcpy( CMSG_DATA( cmsg ), fds_to_pass, sizeof( fds_to_pass ) );
+
+    // The socket is new, so its send buffer cannot be full.
+    ssize_t res;
+    do
+    {
+      res = sendmsg( inst.connectionSocket, &msg, MSG_NOSIGNAL );
+    }
+    while ( res == -1 && errno == EINTR );
+
+    if ( res != ssize_t( sizeof( version ) ) )
+    {
+      throw std::runtime_error( get_error_message( "Error passing the shared memory to the client: ", errno ) );
+    }
+  }
+  catch ( const std::exception & e )
+  {
+    fprintf( stderr,
+             "%sError starting a shared-memory session: %s\n",
+             ERROR_MSG_PREFIX_TICK,
+             e.what() );
+    fflush( stderr );
+
+    if ( memfd != -1 )
+    {
+      close_a( memfd );
+    }
+
+    close_current_connection( inst );
+    return;
+  }
+
+  // The mapping remains valid after closing the file descriptor, and the client has got its own copy.
+  close_a( memfd );
+
+  inst.shm_close_check_countdown = inst.accept_poll_interval_tick_count;
+}
+
+
+// With TRANSPORT_SHM, the client does not send anything over the socket after the handshake,
+// so the socket only becomes readable when the client closes it. Checking costs a system call,
+// so it only happens every accept_poll_interval_tick_count ticks.
+
+static bool has_shm_client_disconnected ( jtag_dpi_instance & inst )
+{
+  if ( --inst.shm_close_check_countdown > 0 )
+    return false;
+
+  inst.shm_close_check_countdown = inst.accept_poll_interval_tick_count;
+
+  uint8_t data;
+  const ssize_t res = recv_eintr( inst.connectionSocket, &data, sizeof(data), MSG_DONTWAIT );
+
+  ++inst.stats.syscalls;
+
+  if ( res == 0 )
+    return true;
+
+  if ( res == -1 )
+  {
+    if ( errno == EAGAIN || errno == EWOULDBLOCK )
+    {
+      ++inst.stats.empty_syscalls;
+      return false;
+    }
+
+    throw std::runtime_error( get_error_message( "Error checking the shared-memory client connection: ", errno ) );
+  }
+
+  throw std::runtime_error( "The shared-memory client sent unexpected data over the socket." );
+}
+
+
+static void poll_eintr ( pollfd * const fds,
+                         const nfds_t nfds,
+                         const int timeout )
+{
+  for ( ; ; )
+  {
+    const int poll_res = poll( fds, nfds, timeout );
+
+    if ( poll_res == -1 )
+    {
+      if ( errno == EINTR )
+        continue;
+
+      throw std::runtime_error( get_error_message( "Error polling the sockets: ", errno ) );
+    }
+
+    break;
+  }
+}
+
+
+static void drain_wakeup_event ( jtag_dpi_instance & inst )
+{
+  uint64_t counter;
+
+  for ( ; ; )
+  {
+    const ssize_t res = read( inst.io_thread->wakeup_event_fd, &counter, sizeof(counter) );
+
+    if ( res == -1 && errno == EINTR )
+      continue;
+
+    assert( res == sizeof(counter) || errno == EAGAIN );
+    break;
+  }
+}
+
+
+// The I/O thread never touches the simulation side of the connection state machine.
+// It only moves bytes between the socket and the rings.
+
+static void io_thread_wait_for_connection ( jtag_dpi_instance & inst )
+{
+  if ( inst.listeningSocket == -1 )
+  {
+    create_listening_socket( inst );
+  }
+
+  pollfd polled_fds[ 2 ];
+
+  polled_fds[0].fd      = inst.listeningSocket;
+  polled_fds[0].events  = POLLIN;
+  polled_fds[0].revents = 0;
+
+  polled_fds[1].fd      = inst.io_thread->wakeup_event_fd;
+  polled_fds[1].events  = POLLIN;
+  polled_fds[1].revents = 0;
+
+  poll_eintr( polled_fds, 2, -1 );
+
+  if ( polled_fds[1].revents != 0 )
+  {
+    drain_wakeup_event( inst );
+  }
+
+  if ( polled_fds[0].revents == 0 )
+    return;
+
+  accept_connection( inst, inst.io_thread->accept_syscalls, inst.io_thread->accept_empty_syscalls );
+
+  if ( inst.connectionSocket == -1 )
+    return;
+
+  ring_reset( &inst.io_thread->rx_ring );
+  ring_reset( &inst.io_thread->tx_ring );
+  inst.io_thread->peer_closed.store( false, std::memory_order_relaxed );
+
+  inst.io_thread->link_state.store( ls_connected, std::memory_order_release );
+}
+
+
+static void io_thread_transfer_data ( jtag_dpi_instance & inst )
+{
+  bool is_rx_ring_full = false;
+
+  // Send first, the wake-up call may have been for data in the send ring.
+  // Otherwise, we could block in poll() below with pending data.
+
+  if ( !inst.io_thread->peer_closed.load( std::memory_order_relaxed ) )
+  {
+    for ( ; ; )
+    {
+      size_t len;
+      const uint8_t * const data = ring_get_read_area( &inst.io_thread->tx_ring, &len );
+
+      if ( len == 0 )
+        break;
+
+      const ssize_t sent_byte_count = send_eintr( inst.connectionSocket, data, len, MSG_NOSIGNAL );
+
+      if ( sent_byte_count == -1 )
+      {
+        if ( errno == EAGAIN || errno == EWOULDBLOCK )
+          break;
+
+        // The simulation thread will find out when it sees the peer_closed flag.
+        fprintf( stderr, "%s%s\n", ERROR_MSG_PREFIX_TICK, get_error_message( "Error sending data: ", errno ).c_str() );
+        fflush( stderr );
+        inst.io_thread->peer_closed.store( true, std::memory_order_release );
+        break;
+      }
+
+      ring_commit_read( &inst.io_thread->tx_ring, sent_byte_count );
+    }
+  }
+
+  pollfd polled_fds[ 2 ];
+
+  polled_fds[0].fd      = -1;  // poll() ignores negative file descriptors.
+  polled_fds[0].events  = 0;
+  polled_fds[0].revents = 0;
+
+  if ( !inst.io_thread->peer_closed.load( std::memory_order_relaxed ) )
+  {
+    polled_fds[0].fd = inst.connectionSocket;
+
+    size_t free_space;
+    ring_get_write_area( &inst.io_thread->rx_ring, &free_space );
+
+    if ( free_space == 0 )
+      is_rx_ring_full = true;
+    else
+      polled_fds[0].events |= POLLIN;
+
+    if ( !ring_is_empty( &inst.io_thread->tx_ring ) )
+      polled_fds[0].events |= POLLOUT;
+  }
+
+  polled_fds[1].fd      = inst.io_thread->wakeup_event_fd;
+  polled_fds[1].events  = POLLIN;
+  polled_fds[1].revents = 0;
+
+  // The simulation thread does not wake us up when it makes room in the receive ring,
+  // because that would cost a system call per read. Poll again a little later instead.
+  poll_eintr( polled_fds, 2, is_rx_ring_full ? 1 : -1 );
+
+  if ( polled_fds[1].revents != 0 )
+  {
+    drain_wakeup_event( inst );
+  }
+
+  if ( 0 == ( polled_fds[0].revents & ( POLLIN | POLLHUP | POLLERR ) ) )
+    return;
+
+  size_t len;
+  uint8_t * const buffer = ring_get_write_area( &inst.io_thread->rx_ring, &len );
+
+  if ( len == 0 )
+    return;
+
+  const ssize_t received_byte_count = recv_eintr( inst.connectionSocket, buffer, len, 0 );
+
+  if ( received_byte_count == -1 )
+  {
+    if ( errno == EAGAIN || errno == EWOULDBLOCK )
+      return;
+
+    fprintf( stderr, "%s%s\n", ERROR_MSG_PREFIX_TICK, get_error_message( "Error receiving data: ", errno ).c_str() );
+    fflush( stderr );
+    inst.io_thread->peer_closed.store( true, std::memory_order_release );
+    return;
+  }
+
+  if ( received_byte_count == 0 )
+  {
+    inst.io_thread->peer_closed.store( true, std::memory_order_release );
+    return;
+  }
+
+  ring_commit_write( &inst.io_thread->rx_ring, received_byte_count );
+}
+
+
+static void io_thread_main ( jtag_dpi_instance * const instance )
+{
+  jtag_dpi_instance & inst = *instance;
+
+  try
+  {
+    while ( !inst.io_thread->stop_requested.load( std::memory_order_acquire ) )
+    {
+      switch ( inst.io_thread->link_state.load( std::memory_order_acquire ) )
+      {
+      case ls_listening:
+        io_thread_wait_for_connection( inst );
+        break;
+
+      case ls_connected:
+        io_thread_transfer_data( inst );
+        break;
+
+      case ls_close_requested:
+        close_a( inst.connectionSocket );
+        inst.connectionSocket = -1;
+
+        ring_reset( &inst.io_thread->rx_ring );
+        ring_reset( &inst.io_thread->tx_ring );
+
+        inst.io_thread->link_state.store( ls_listening, std::memory_order_release );
+        break;
+
+      default:
+        assert( false );
+      }
+    }
+  }
+  catch ( const std::exception & e )
+  {
+    // The simulation thread reports the error on its next tick.
+    inst.io_thread->error_msg = e.what();
+    inst.io_thread->failed.store( true, std::memory_order_release );
+  }
+  catch ( ... )
+  {
+    inst.io_thread->error_msg = "Unexpected C++ exception in the I/O thread.";
+    inst.io_thread->failed.store( true, std::memory_order_release );
+  }
+}
+
+
+static void start_io_thread ( jtag_dpi_instance & inst )
+{
+  if ( inst.io_thread == NULL )
+  {
+    inst.io_thread = new io_thread_data();
+    inst.io_thread->wakeup_event_fd = -1;
+  }
+
+  assert( inst.io_thread->wakeup_event_fd == -1 );
+
+  inst.io_thread->wakeup_event_fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+
+  if ( inst.io_thread->wakeup_event_fd == -1 )
+  {
+    throw std::runtime_error( get_error_message( "Error creating the eventfd for the I/O thread: ", errno ) );
+  }
+
+  inst.io_thread->link_state.store( ls_listening, std::memory_order_relaxed );
+  inst.io_thread->peer_closed.store( false, std::memory_order_relaxed );
+  inst.io_thread->stop_requested.store( false, std::memory_order_relaxed );
+  inst.io_thread->failed.store( false, std::memory_order_relaxed );
+  inst.io_thread->error_msg.clear();
+  inst.io_thread->is_connection_open = false;
+
+  ring_reset( &inst.io_thread->rx_ring );
+  ring_reset( &inst.io_thread->tx_ring );
+
+  try
+  {
+    inst.io_thread->thread = std::thread( io_thread_main, &inst );
+  }
+  catch ( ... )
+  {
+    close_a( inst.io_thread->wakeup_event_fd );
+    inst.io_thread->wakeup_event_fd = -1;
+    throw;
+  }
+}
+
+
+static void stop_io_thread ( jtag_dpi_instance & inst )
+{
+  ++inst.stats.syscalls;
+  inst.io_thread->stop_requested.store( true, std::memory_order_release );
+  wake_up_io_thread( inst );
+
+  inst.io_thread->thread.join();
+
+  close_a( inst.io_thread->wakeup_event_fd );
+  inst.io_thread->wakeup_event_fd = -1;
+}
+
+
+// Called on every tick in IO_MODE_THREAD mode instead of accept_connection().
+
+static void check_io_thread ( jtag_dpi_instance & inst )
+{
+  if ( inst.io_thread->failed.load( std::memory_order_acquire ) )
+  {
+    throw std::runtime_error( inst.io_thread->error_msg );
+  }
+
+  if ( !inst.io_thread->is_connection_open &&
+       inst.io_thread->link_state.load( std::memory_order_acquire ) == ls_connected )
+  {
+    inst.io_thread->is_connection_open = true;
+    inst.connectionState = cs_waiting_to_receive_commands;
+    reset_connection_buffers( inst );
+    start_connection_statistics( inst );
+  }
+}
+
+
+// Called on every tick in IO_MODE_URING mode instead of accept_connection(), while no client is connected.
+// The accept request is always armed, so unless it has completed, this only costs a couple of memory reads.
+
+static void check_uring_accept ( jtag_dpi_instance & inst )
+{
+  // If a connection is lost, the listening socket must be created again,
+  // which arms a new accept request too.
+  if ( inst.listeningSocket == -1 )
+  {
+    create_listening_socket( inst );
+  }
+
+  reap_uring_completions( inst );
+
+  if ( !inst.uring->is_accept_complete )
+    return;
+
+  inst.uring->is_accept_complete = false;
+
+  const int accept_result = inst.uring->accept_result;
+
+  take_accepted_connection( inst,
+                            accept_result >= 0 ? accept_result : -1,
+                            accept_result >= 0 ? 0 : -accept_result,
+                            inst.uring->accept_addr,
+                            inst.uring->accept_addr_len );
+
+  if ( inst.connectionSocket == -1 )
+  {
+    // The listening socket is still open, so wait for the next client.
+    arm_uring_accept( inst );
+    return;
+  }
+
+  inst.connectionState = cs_waiting_to_receive_commands;
+  reset_connection_buffers( inst );
+  start_connection_statistics( inst );
+  arm_uring_recv( inst );
+}
+
+
+static tap_state_enum get_next_tap_state ( const tap_state_enum state, const bool tms )
+{
+  // Indexed by the current state, first with TMS = 0 and then with TMS = 1.
+  static const tap_state_enum transitions[ TAP_STATE_COUNT ][ 2 ] =
+  {
+    { tap_run_test_idle, tap_test_logic_reset },  // tap_test_logic_reset
+    { tap_run_test_idle, tap_select_dr_scan   },  // tap_run_test_idle
+    { tap_capture_dr   , tap_select_ir_scan   },  // tap_select_dr_scan
+    { tap_shift_dr     , tap_exit1_dr         },  // tap_capture_dr
+    { tap_shift_dr     , tap_exit1_dr         },  // tap_shift_dr
+    { tap_pause_dr     , tap_update_dr        },  // tap_exit1_dr
+    { tap_pause_dr     , tap_exit2_dr         },  // tap_pause_dr
+    { tap_shift_dr     , tap_update_dr        },  // tap_exit2_dr
+    { tap_run_test_idle, tap_select_dr_scan   },  // tap_update_dr
+    { tap_capture_ir   , tap_test_logic_reset },  // tap_select_ir_scan
+    { tap_shift_ir     , tap_exit1_ir         },  // tap_capture_ir
+    { tap_shift_ir     , tap_exit1_ir         },  // tap_shift_ir
+    { tap_pause_ir     , tap_update_ir        },  // tap_exit1_ir
+    { tap_pause_ir     , tap_exit2_ir         },  // tap_pause_ir
+    { tap_shift_ir     , tap_update_ir        },  // tap_exit2_ir
+    { tap_run_test_idle, tap_select_dr_scan   }   // tap_update_ir
+  };
+
+  assert( state < TAP_STATE_COUNT );
+
+  return transitions[ state ][ tms ? 1 : 0 ];
+}
+
+
+static void reset_tap_state_tracking ( jtag_dpi_instance & inst )
+{
+  inst.tap_state = tap_unknown;
+  inst.tap_tck_level = false;
+  inst.tap_consecutive_tms_high_count = 0;
+}
+
+
+// The TAP samples TMS on the rising edge of TCK.
+
+static void track_tap_state ( jtag_dpi_instance & inst, const uint8_t data )
+{
+  const bool tck = 0 != ( data & JTAG_TCK_BIT );
+  const bool tms = 0 != ( data & JTAG_TMS_BIT );
+
+  if ( 0 == ( data & JTAG_TRST_BIT ) )
+  {
+    inst.tap_state = tap_test_logic_reset;
+  }
+  else if ( tck && !inst.tap_tck_level )
+  {
+    if ( tms )
+      ++inst.tap_consecutive_tms_high_count;
+    else
+      inst.tap_consecutive_tms_high_count = 0;
+
+    if ( inst.tap_state != tap_unknown )
+    {
+      inst.tap_state = get_next_tap_state( inst.tap_state, tms );
+    }
+    else if ( inst.tap_consecutive_tms_high_count >= 5 )
+    {
+      // 5 clock cycles with TMS high reach Test-Logic-Reset from any state.
+      inst.tap_state = tap_test_logic_reset;
+    }
+  }
+
+  inst.tap_tck_level = tck;
+}
+
+
+static void write_log_record ( jtag_dpi_instance & inst, const uint8_t event )
+{
+  uint64_t tick_delta = inst.tick_count - inst.last_record_tick;
+  inst.last_record_tick = inst.tick_count;
+
+  uint8_t record[ 11 ];  // A 64-bit LEB128 value needs at most 10 bytes.
+  size_t  len = 0;
+
+  do
+  {
+    record[ len ] = uint8_t( tick_delta & 0x7F );
+    tick_delta >>= 7;
+
+    if ( tick_delta != 0 )
+      record[ len ] |= 0x80;
+
+    ++len;
+  }
+  while ( tick_delta != 0 );
+
+  record[ len++ ] = event;
+
+  if ( fwrite( record, 1, len, inst.record_file ) != len )
+  {
+    throw std::runtime_error( get_error_message( "Error writing to the session log file: ", errno ) );
+  }
+}
+
+
+// Called whenever a TDO value is sampled on behalf of a client.
+
+// The tick is not the current one for the TDO values sampled during a pin batch.
+
+static void note_tdo_read ( jtag_dpi_instance & inst, const unsigned char jtag_tdo, const uint64_t tick )
+{
+  ++inst.stats.tdo_reads;
+
+  if ( inst.record_file != NULL )
+  {
+    write_log_record( inst, LOG_EVENT_TDO_SAMPLE | ( jtag_tdo ? 1 : 0 ) );
+  }
+
+  if ( inst.trace != NULL )
+  {
+    write_trace_record( inst, tick, TRACE_EVENT_TDO_SAMPLE, jtag_tdo ? 1 : 0, 0 );
+  }
+}
+
+
+static void apply_jtag_data_byte ( jtag_dpi_instance & inst,
+                                   const uint8_t data,
+                                   unsigned char * const jtag_tms,
+                                   unsigned char * const jtag_tck,
+                                   unsigned char * const jtag_trst,
+                                   unsigned char * const jtag_tdi,
+                                   unsigned char * const jtag_new_data_available )
+{
+  *jtag_tck  = ( data & JTAG_TCK_BIT  ) ? 1 : 0;
+  *jtag_trst = ( data & JTAG_TRST_BIT ) ? 1 : 0;
+  *jtag_tdi  = ( data & JTAG_TDI_BIT  ) ? 1 : 0;
+  *jtag_tms  = ( data & JTAG_TMS_BIT  ) ? 1 : 0;
+
+  *jtag_new_data_available = 1;
+
+  inst.clock_notification_counter = inst.jtag_tck_half_period_tick_count;
+
+  ++inst.stats.pin_updates;
+
+  if ( inst.record_file != NULL )
+  {
+    write_log_record( inst, data );
+  }
+
+  inst.trace_pins = data;
+
+  if ( inst.trace != NULL )
+  {
+    write_trace_record( inst, inst.tick_count, TRACE_EVENT_PIN_UPDATE, 0, 0 );
+  }
+
+  track_tap_state( inst, data );
+}
+
+
+static bool get_packed_bit ( const uint8_t * const data, const uint32_t bit_index )
+{
+  return 0 != ( data[ bit_index / 8 ] & ( 1 << ( bit_index % 8 ) ) );
+}
+
+
+static uint32_t get_uint32_le ( const uint8_t * const data )
+{
+  return uint32_t( data[0] )       |
+         uint32_t( data[1] ) <<  8 |
+         uint32_t( data[2] ) << 16 |
+         uint32_t( data[3] ) << 24;
+}
+
+
+static void start_vector_scan ( vector_scan & scan,
+                                const uint8_t reply_command )
+{
+  scan.reply_command = reply_command;
+  scan.bit_count = 0;
+  scan.tms.clear();
+  scan.tdi.clear();
+  scan.capture_tdo = false;
+  scan.capture_first_bit = 0;
+  scan.capture_bit_count = 0;
+  scan.tdo.clear();
+}
+
+
+static void append_vector_scan_bit ( vector_scan & scan,
+                                     const bool tms,
+                                     const bool tdi )
+{
+  if ( scan.bit_count % 8 == 0 )
+  {
+    scan.tms.push_back( 0 );
+    scan.tdi.push_back( 0 );
+  }
+
+  const uint8_t mask = uint8_t( 1 << ( scan.bit_count % 8 ) );
+
+  if ( tms )
+    scan.tms.back() |= mask;
+
+  if ( tdi )
+    scan.tdi.back() |= mask;
+
+  ++scan.bit_count;
+}
+
+
+// The generated TMS sequences can get long if the client keeps asking for long scans
+// or many Run-Test/Idle cycles.
+
+static void check_vector_scan_length ( const vector_scan & scan )
+{
+  if ( scan.bit_count > MAX_VECTOR_SCAN_BIT_COUNT )
+  {
+    throw std::runtime_error( "The generated JTAG sequence is too long." );
+  }
+}
+
+
+// Appends the shortest TMS sequence between the given TAP states.
+// If the starting state is unknown, the sequence begins with a TAP reset.
+
+static void append_tap_state_transition ( vector_scan & scan,
+                                          const tap_state_enum from_state,
+                                          const tap_state_enum to_state )
+{
+  tap_state_enum current = from_state;
+
+  if ( current == tap_unknown )
+  {
+    for ( int i = 0; i < 5; ++i )
+      append_vector_scan_bit( scan, true, false );
+
+    current = tap_test_logic_reset;
+  }
+
+  if ( current == to_state )
+    return;
+
+  // Breadth-first search on the 16-state graph.
+
+  tap_state_enum prev_state[ TAP_STATE_COUNT ];
+  bool           prev_tms  [ TAP_STATE_COUNT ];
+  bool           visited   [ TAP_STATE_COUNT ];
+
+  for ( int i = 0; i < TAP_STATE_COUNT; ++i )
+    visited[ i ] = false;
+
+  tap_state_enum queue[ TAP_STATE_COUNT ];
+  int queue_begin = 0;
+  int queue_end   = 0;
+
+  queue[ queue_end++ ] = current;
+  visited[ current ] = true;
+
+  while ( !visited[ to_state ] )
+  {
+    assert( queue_begin < queue_end );
+    const tap_state_enum state = queue[ queue_begin++ ];
+
+    for ( int tms = 0; tms < 2; ++tms )
+    {
+      const tap_state_enum next = get_next_tap_state( state, tms != 0 );
+
+      if ( !visited[ next ] )
+      {
+        visited[ next ]    = true;
+        prev_state[ next ] = state;
+        prev_tms  [ next ] = tms != 0;
+        queue[ queue_end++ ] = next;
+      }
+    }
+  }
+
+  bool path[ TAP_STATE_COUNT ];
+  int path_len = 0;
+
+  for ( tap_state_enum state = to_state; state != current; state = prev_state[ state ] )
+  {
+    path[ path_len++ ] = prev_tms[ state ];
+  }
+
+  while ( path_len > 0 )
+  {
+    append_vector_scan_bit( scan, path[ --path_len ], false );
+  }
+}
+
+
+static tap_state_enum parse_tap_state ( const uint8_t value )
+{
+  if ( value >= TAP_STATE_COUNT )
+  {
+    throw std::runtime_error( "Invalid TAP state received." );
+  }
+
+  return tap_state_enum( value );
+}
+
+
+// Appends the TMS and TDI sequences for an IR or DR scan, starting at the given TAP state.
+// Only the TDO values of the shifted bits are captured.
+
+static void append_xr_scan ( vector_scan & scan,
+                             const tap_state_enum from_state,
+                             const bool is_ir,
+                             const uint8_t * const tdi,
+                             const uint32_t shift_bit_count,
+                             const tap_state_enum end_state )
+{
+  const tap_state_enum shift_state = is_ir ? tap_shift_ir : tap_shift_dr;
+  const tap_state_enum exit1_state = is_ir ? tap_exit1_ir : tap_exit1_dr;
+
+  append_tap_state_transition( scan, from_state, shift_state );
+
+  scan.capture_first_bit = scan.bit_count;
+  scan.capture_bit_count = shift_bit_count;
+
+  // Leave the Shift state with the last bit, unless the caller wants to stay there.
+  const bool stay_in_shift_state = end_state == shift_state;
+
+  for ( uint32_t i = 0; i < shift_bit_count; ++i )
+  {
+    const bool is_last_bit = i == shift_bit_count - 1;
+
+    append_vector_scan_bit( scan,
+                            is_last_bit && !stay_in_shift_state,
+                            get_packed_bit( tdi, i ) );
+  }
+
+  if ( !stay_in_shift_state )
+  {
+    append_tap_state_transition( scan, exit1_state, end_state );
+  }
+
+  check_vector_scan_length( scan );
+}
+
+
+static void build_xr_scan ( jtag_dpi_instance & inst,
+                            const bool is_ir,
+                            const uint8_t * const payload )
+{
+  const uint8_t flags = payload[ 0 ];
+  const tap_state_enum end_state = parse_tap_state( payload[ 1 ] );
+  const uint32_t shift_bit_count = get_uint32_le( &payload[ 2 ] );
+
+  start_vector_scan( inst.client_vector_scan, is_ir ? CMD_SCAN_IR : CMD_SCAN_DR );
+
+  inst.client_vector_scan.capture_tdo = 0 != ( flags & SCAN_XR_FLAG_CAPTURE_TDO );
+
+  append_xr_scan( inst.client_vector_scan,
+                  inst.tap_state,
+                  is_ir,
+                  &payload[ SCAN_XR_HEADER_LEN ],
+                  shift_bit_count,
+                  end_state );
+}
+
+
+static void build_run_test_idle ( jtag_dpi_instance & inst, const uint8_t * const payload )
+{
+  const uint32_t cycle_count = get_uint32_le( payload );
+
+  if ( cycle_count > MAX_VECTOR_SCAN_BIT_COUNT )
+  {
+    throw std::runtime_error( "Invalid Run-Test/Idle cycle count received." );
+  }
+
+  start_vector_scan( inst.client_vector_scan, CMD_RUN_TEST_IDLE );
+
+  append_tap_state_transition( inst.client_vector_scan, inst.tap_state, tap_run_test_idle );
+
+  for ( uint32_t i = 0; i < cycle_count; ++i )
+  {
+    append_vector_scan_bit( inst.client_vector_scan, false, false );
+  }
+
+  check_vector_scan_length( inst.client_vector_scan );
+}
+
+
+static void build_client_vector_scan ( jtag_dpi_instance & inst, const uint8_t * const payload )
+{
+  const uint8_t  flags     = payload[ 0 ];
+  const uint32_t bit_count = get_uint32_le( &payload[ 1 ] );
+  const size_t   vector_len = ( bit_count + 7 ) / 8;
+
+  vector_scan & scan = inst.client_vector_scan;
+
+  start_vector_scan( scan, CMD_VECTOR_SCAN );
+
+  scan.bit_count = bit_count;
+  scan.tms.assign( &payload[ VECTOR_SCAN_HEADER_LEN ]             , &payload[ VECTOR_SCAN_HEADER_LEN ] + vector_len );
+  scan.tdi.assign( &payload[ VECTOR_SCAN_HEADER_LEN + vector_len ], &payload[ VECTOR_SCAN_HEADER_LEN ] + 2 * vector_len );
+
+  scan.capture_tdo       = 0 != ( flags & VECTOR_SCAN_FLAG_CAPTURE_TDO );
+  scan.capture_first_bit = 0;
+  scan.capture_bit_count = bit_count;
+}
+
+
+// The wait is a vector scan that captures all TDO values and gets repeated, see finish_tdo_wait_attempt().
+
+static void build_tdo_wait ( jtag_dpi_instance & inst, const uint8_t * const payload )
+{
+  const uint32_t bit_count  = get_uint32_le( &payload[ 0 ] );
+  const size_t   vector_len = ( bit_count + 7 ) / 8;
+  const uint8_t * const vectors = &payload[ WAIT_FOR_TDO_HEADER_LEN ];
+
+  vector_scan & scan = inst.client_vector_scan;
+
+  start_vector_scan( scan, CMD_WAIT_FOR_TDO );
+
+  scan.bit_count = bit_count;
+  scan.tms.assign( vectors                 , vectors +     vector_len );
+  scan.tdi.assign( vectors +     vector_len, vectors + 2 * vector_len );
+
+  scan.capture_tdo       = true;
+  scan.capture_first_bit = 0;
+  scan.capture_bit_count = bit_count;
+
+  inst.tdo_wait_mask .assign( vectors + 2 * vector_len, vectors + 3 * vector_len );
+  inst.tdo_wait_value.assign( vectors + 3 * vector_len, vectors + 4 * vector_len );
+
+  // The unused bits in the last byte never match, as their TDO values are always 0.
+  if ( bit_count % 8 != 0 )
+  {
+    inst.tdo_wait_mask.back() &= uint8_t( ( 1 << ( bit_count % 8 ) ) - 1 );
+  }
+
+  inst.tdo_wait_interval_cycle_count = get_uint32_le( &payload[ 4 ] );
+  inst.tdo_wait_max_attempt_count    = get_uint32_le( &payload[ 8 ] );
+  inst.tdo_wait_attempt_count        = 0;
+}
+
+
+static void prepare_vector_scan_execution ( vector_scan & scan )
+{
+  if ( scan.capture_tdo )
+  {
+    scan.tdo.assign( ( scan.capture_bit_count + 7 ) / 8, 0 );
+  }
+
+  scan.next_bit       = 0;
+  scan.tck_is_high    = false;
+  scan.tck_low_driven = false;
+}
+
+
+static void start_receiving_command_payload ( jtag_dpi_instance & inst,
+                                              const uint8_t command,
+                                              const size_t header_len )
+{
+  inst.received_command = command;
+  inst.command_payload.clear();
+  inst.command_payload_expected_len = header_len;
+  inst.command_payload_header_complete = false;
+
+  inst.connectionState = cs_receiving_command_payload;
+}
+
+
+// Once the fixed-size header has arrived, work out how long the whole payload is.
+
+static void parse_command_payload_header ( jtag_dpi_instance & inst )
+{
+  const uint8_t * const header = &inst.command_payload[ 0 ];
+
+  switch ( inst.received_command )
+  {
+  case CMD_VECTOR_SCAN:
+    {
+      const uint8_t  flags     = header[ 0 ];
+      const uint32_t bit_count = get_uint32_le( &header[ 1 ] );
+
+      if ( 0 != ( flags & ~VECTOR_SCAN_FLAG_CAPTURE_TDO ) )
+      {
+        throw std::runtime_error( "Invalid vector scan flags received." );
+      }
+
+      if ( bit_count == 0 || bit_count > MAX_VECTOR_SCAN_BIT_COUNT )
+      {
+        throw std::runtime_error( "Invalid vector scan bit count received." );
+      }
+
+      inst.command_payload_expected_len = VECTOR_SCAN_HEADER_LEN + 2 * ( ( bit_count + 7 ) / 8 );
+      break;
+    }
+
+  case CMD_SCAN_IR:
+  case CMD_SCAN_DR:
+    {
+      const uint8_t  flags     = header[ 0 ];
+      const uint32_t bit_count = get_uint32_le( &header[ 2 ] );
+
+      if ( 0 != ( flags & ~SCAN_XR_FLAG_CAPTURE_TDO ) )
+      {
+        throw std::runtime_error( "Invalid scan flags received." );
+      }
+
+      parse_tap_state( header[ 1 ] );
+
+      if ( bit_count == 0 || bit_count > MAX_VECTOR_SCAN_BIT_COUNT )
+      {
+        throw std::runtime_error( "Invalid scan bit count received." );
+      }
+
+      inst.command_payload_expected_len = SCAN_XR_HEADER_LEN + ( bit_count + 7 ) / 8;
+      break;
+    }
+
+  case CMD_WAIT_FOR_TDO:
+    {
+      const uint32_t bit_count         = get_uint32_le( &header[ 0 ] );
+      const uint32_t max_attempt_count = get_uint32_le( &header[ 8 ] );
+
+      if ( bit_count == 0 || bit_count > MAX_VECTOR_SCAN_BIT_COUNT )
+      {
+        throw std::runtime_error( "Invalid wait for TDO bit count received." );
+      }
+
+      if ( max_attempt_count == 0 )
+      {
+        throw std::runtime_error( "Invalid wait for TDO attempt count received." );
+      }
+
+      inst.command_payload_expected_len = WAIT_FOR_TDO_HEADER_LEN + 4 * ( ( bit_count + 7 ) / 8 );
+      break;
+    }
+
+  case CMD_GO_TO_TAP_STATE:
+  case CMD_RUN_TEST_IDLE:
+  case CMD_BACKDOOR_READ:
+    // These commands only have a header.
+    break;
+
+  case CMD_JTAG_VPI:
+    {
+      // The whole command structure is the header.
+      const uint32_t cmd     = get_uint32_le( &header[ 0 ] );
+      const uint32_t length  = get_uint32_le( &header[ JTAG_VPI_LENGTH_POS  ] );
+      const uint32_t nb_bits = get_uint32_le( &header[ JTAG_VPI_NB_BITS_POS ] );
+
+      if ( cmd > JTAG_VPI_CMD_STOP_SIMU )
+      {
+        char buffer[80];
+        if ( int(sizeof(buffer)) <= sprintf( buffer, "Invalid jtag_vpi command %u received.", unsigned( cmd ) ) )
+        {
+          assert( false );
+        }
+
+        throw std::runtime_error( buffer );
+      }
+
+      if ( ( cmd == JTAG_VPI_CMD_TMS_SEQ || cmd == JTAG_VPI_CMD_SCAN_CHAIN || cmd == JTAG_VPI_CMD_SCAN_CHAIN_FLIP_TMS ) &&
+           ( length > JTAG_VPI_BUFFER_LEN || nb_bits > 8 * length ) )
+      {
+        throw std::runtime_error( "Invalid jtag_vpi bit count received." );
+      }
+
+      break;
+    }
+
+  case CMD_BACKDOOR_WRITE:
+    {
+      const uint32_t byte_count = get_uint32_le( &header[ 4 ] );
+
+      if ( byte_count > MAX_BACKDOOR_BYTE_COUNT )
+      {
+        throw std::runtime_error( "Invalid backdoor write byte count received." );
+      }
+
+      inst.command_payload_expected_len = BACKDOOR_HEADER_LEN + byte_count;
+      break;
+    }
+
+  default:
+    assert( false );
+  }
+
+  inst.command_payload_header_complete = true;
+}
+
+
+// The memory access happens straight away, so it takes no simulated time at all.
+
+static void execute_backdoor_memory_access ( jtag_dpi_instance & inst )
+{
+  const bool     is_write   = inst.received_command == CMD_BACKDOOR_WRITE;
+  const uint32_t address    = get_uint32_le( &inst.command_payload[ 0 ] );
+  const uint32_t byte_count = get_uint32_le( &inst.command_payload[ 4 ] );
+
+  if ( !is_write && byte_count > MAX_BACKDOOR_BYTE_COUNT )
+  {
+    throw std::runtime_error( "Invalid backdoor read byte count received." );
+  }
+
+  // The data to write is already there, and the data read lands there too.
+  inst.command_payload.resize( BACKDOOR_HEADER_LEN + byte_count );
+  uint8_t * const data = &inst.command_payload[ 0 ] + BACKDOOR_HEADER_LEN;
+
+  const bool success = s_backdoor_memory_access != NULL &&
+                       s_backdoor_memory_access( s_backdoor_memory_access_context,
+                                                 is_write,
+                                                 address,
+                                                 data,
+                                                 byte_count );
+
+  send_byte( inst, inst.received_command );
+  send_byte( inst, success ? BACKDOOR_STATUS_OK : BACKDOOR_STATUS_FAILED );
+
+  if ( success && !is_write )
+  {
+    send_data( inst, data, byte_count );
+  }
+}
+
+
+// Returns false if the command does not clock TCK.
+
+static bool build_jtag_vpi_scan ( jtag_dpi_instance & inst, const uint8_t * const payload )
+{
+  const uint32_t cmd     = get_uint32_le( &payload[ 0 ] );
+  const uint32_t nb_bits = get_uint32_le( &payload[ JTAG_VPI_NB_BITS_POS ] );
+  const uint8_t * const buffer_out = &payload[ JTAG_VPI_BUFFER_OUT_POS ];
+
+  vector_scan & scan = inst.client_vector_scan;
+
+  start_vector_scan( scan, CMD_JTAG_VPI );
+
+  switch ( cmd )
+  {
+  case JTAG_VPI_CMD_RESET:
+    for ( int i = 0; i < 5; ++i )
+    {
+      append_vector_scan_bit( scan, true, false );
+    }
+
+    append_vector_scan_bit( scan, false, false );
+    break;
+
+  case JTAG_VPI_CMD_TMS_SEQ:
+    for ( uint32_t i = 0; i < nb_bits; ++i )
+    {
+      append_vector_scan_bit( scan, get_packed_bit( buffer_out, i ), false );
+    }
+    break;
+
+  case JTAG_VPI_CMD_SCAN_CHAIN:
+  case JTAG_VPI_CMD_SCAN_CHAIN_FLIP_TMS:
+    for ( uint32_t i = 0; i < nb_bits; ++i )
+    {
+      const bool tms = cmd == JTAG_VPI_CMD_SCAN_CHAIN_FLIP_TMS && i == nb_bits - 1;
+      append_vector_scan_bit( scan, tms, get_packed_bit( buffer_out, i ) );
+    }
+
+    scan.capture_tdo       = true;
+    scan.capture_first_bit = 0;
+    scan.capture_bit_count = nb_bits;
+    break;
+
+  case JTAG_VPI_CMD_STOP_SIMU:
+    if ( inst.print_informational_messages )
+    {
+      printf( "%sThe jtag_vpi client has asked to end the simulation.\n", INFO_MSG_PREFIX );
+      fflush( stdout );
+    }
+
+    inst.is_finish_requested = true;
+    return false;
+
+  default:
+    assert( false );
+  }
+
+  return true;
+}
+
+
+static void execute_command_payload ( jtag_dpi_instance & inst )
+{
+  const uint8_t * const payload = &inst.command_payload[ 0 ];
+
+  switch ( inst.received_command )
+  {
+  case CMD_JTAG_VPI:
+    record_client_command( inst );
+
+    if ( !build_jtag_vpi_scan( inst, payload ) )
+    {
+      inst.connectionState = cs_waiting_to_receive_commands;
+      return;
+    }
+    break;
+
+  case CMD_BACKDOOR_WRITE:
+  case CMD_BACKDOOR_READ:
+    execute_backdoor_memory_access( inst );
+    inst.connectionState = cs_waiting_to_receive_commands;
+    return;
+
+  case CMD_VECTOR_SCAN:
+    build_client_vector_scan( inst, payload );
+    break;
+
+  case CMD_WAIT_FOR_TDO:
+    build_tdo_wait( inst, payload );
+    break;
+
+  case CMD_GO_TO_TAP_STATE:
+    start_vector_scan( inst.client_vector_scan, CMD_GO_TO_TAP_STATE );
+    append_tap_state_transition( inst.client_vector_scan, inst.tap_state, parse_tap_state( payload[ 0 ] ) );
+    break;
+
+  case CMD_SCAN_IR:
+  case CMD_SCAN_DR:
+    build_xr_scan( inst, inst.received_command == CMD_SCAN_IR, payload );
+    break;
+
+  case CMD_RUN_TEST_IDLE:
+    build_run_test_idle( inst, payload );
+    break;
+
+  default:
+    assert( false );
+  }
+
+  prepare_vector_scan_execution( inst.client_vector_scan );
+
+  inst.connectionState = cs_executing_vector_scan;
+}
+
+
+// Returns false if the connection was closed at the other end.
+
+static bool receive_command_payload ( jtag_dpi_instance & inst )
+{
+  while ( inst.command_payload.size() < inst.command_payload_expected_len )
+  {
+    const size_t prev_len = inst.command_payload.size();
+
+    inst.command_payload.resize( inst.command_payload_expected_len );
+
+    const ssize_t received_byte_count = receive_data( inst,
+                                                      &inst.command_payload[ prev_len ],
+                                                      inst.command_payload_expected_len - prev_len );
+    if ( received_byte_count == -1 )
+    {
+      return false;
+    }
+
+    if ( received_byte_count == 0 )
+    {
+      // The rest of the command has not arrived yet.
+      inst.command_payload.resize( prev_len );
+      return true;
+    }
+
+    inst.command_payload.resize( prev_len + received_byte_count );
+
+    if ( inst.command_payload.size() == inst.command_payload_expected_len &&
+         !inst.command_payload_header_complete )
+    {
+      parse_command_payload_header( inst );
+    }
+  }
+
+  execute_command_payload( inst );
+
+  return true;
+}
+
+
+static void store_tdo_sample ( jtag_dpi_instance & inst,
+                               vector_scan & scan,
+                               const uint32_t tdo_bit,
+                               const unsigned char jtag_tdo,
+                               const uint64_t tick )
+{
+  note_tdo_read( inst, jtag_tdo, tick );
+
+  if ( jtag_tdo )
+  {
+    scan.tdo[ tdo_bit / 8 ] |= uint8_t( 1 << ( tdo_bit % 8 ) );
+  }
+}
+
+
+// Returns true when the last bit has been clocked and its TDO value sampled.
+
+static bool advance_vector_scan ( jtag_dpi_instance & inst,
+                                  vector_scan & scan,
+                                  unsigned char * const jtag_tms,
+                                  unsigned char * const jtag_tck,
+                                  unsigned char * const jtag_trst,
+                                  unsigned char * const jtag_tdi,
+                                  unsigned char * const jtag_new_data_available,
+                                  const unsigned char jtag_tdo )
+{
+  if ( inst.clock_notification_counter != 0 )
+    return false;
+
+  if ( scan.tck_is_high )
+  {
+    // The TCK high half period of the current bit has elapsed, so TDO is now valid.
+    if ( scan.capture_tdo &&
+         scan.next_bit >= scan.capture_first_bit &&
+         scan.next_bit - scan.capture_first_bit < scan.capture_bit_count )
+    {
+      const uint32_t tdo_bit = scan.next_bit - scan.capture_first_bit;
+
+      if ( inst.is_extending_pin_batch )
+      {
+        // The RTL will sample this TDO value just before applying the next data byte in the batch.
+        assert( inst.deferred_tdo_sample_count < PIN_BATCH_MAX_LENGTH );
+        deferred_tdo_sample & sample = inst.deferred_tdo_samples[ inst.deferred_tdo_sample_count++ ];
+        sample.scan        = &scan;
+        sample.tdo_bit     = tdo_bit;
+        sample.history_bit = inst.pin_batch_length - 1;
+        sample.tick        = inst.tick_count;
+      }
+      else
+      {
+        store_tdo_sample( inst, scan, tdo_bit, jtag_tdo, inst.tick_count );
+      }
+    }
+
+    ++scan.next_bit;
+    scan.tck_is_high    = false;
+    scan.tck_low_driven = false;
+  }
+
+  if ( scan.next_bit == scan.bit_count )
+    return true;
+
+  uint8_t data = JTAG_TRST_BIT;
+
+  if ( get_packed_bit( &scan.tms[0], scan.next_bit ) )
+    data |= JTAG_TMS_BIT;
+
+  if ( get_packed_bit( &scan.tdi[0], scan.next_bit ) )
+    data |= JTAG_TDI_BIT;
+
+  if ( scan.tck_low_driven )
+  {
+    data |= JTAG_TCK_BIT;
+    scan.tck_is_high = true;
+  }
+  else
+  {
+    scan.tck_low_driven = true;
+  }
+
+  apply_jtag_data_byte( inst, data, jtag_tms, jtag_tck, jtag_trst, jtag_tdi, jtag_new_data_available );
+
+  return false;
+}
+
+
+static void send_vector_scan_reply ( jtag_dpi_instance & inst )
+{
+  if ( inst.client_vector_scan.reply_command == CMD_JTAG_VPI )
+  {
+    // The jtag_vpi reply to a scan is the command structure itself, with the TDO values in the input buffer.
+    // The other jtag_vpi commands have no reply.
+    if ( inst.client_vector_scan.capture_tdo )
+    {
+      const std::vector< uint8_t > & tdo = inst.client_vector_scan.tdo;
+      uint8_t * const buffer_in = &inst.command_payload[ JTAG_VPI_BUFFER_IN_POS ];
+
+      memset( buffer_in, 0, JTAG_VPI_BUFFER_LEN );
+      std::copy( tdo.begin(), tdo.end(), buffer_in );
+
+      send_data( inst, &inst.command_payload[ 0 ], inst.command_payload.size() );
+    }
+  }
+  else if ( inst.client_vector_scan.reply_command == CMD_WAIT_FOR_TDO )
+  {
+    uint8_t header[ 6 ];
+
+    header[0] = CMD_WAIT_FOR_TDO;
+    header[1] = inst.tdo_wait_status;
+    header[2] = uint8_t( inst.tdo_wait_attempt_count       );
+    header[3] = uint8_t( inst.tdo_wait_attempt_count >>  8 );
+    header[4] = uint8_t( inst.tdo_wait_attempt_count >> 16 );
+    header[5] = uint8_t( inst.tdo_wait_attempt_count >> 24 );
+
+    send_data( inst, header, sizeof(header) );
+    send_data( inst, &inst.client_vector_scan.tdo[0], inst.client_vector_scan.tdo.size() );
+  }
+  else if ( !inst.client_vector_scan.capture_tdo )
+  {
+    send_byte( inst, inst.client_vector_scan.reply_command );
+  }
+  else
+  {
+    send_data( inst, &inst.client_vector_scan.tdo[0], inst.client_vector_scan.tdo.size() );
+  }
+}
+
+
+static bool does_tdo_wait_match ( const jtag_dpi_instance & inst )
+{
+  const std::vector< uint8_t > & tdo = inst.client_vector_scan.tdo;
+
+  for ( size_t i = 0; i < tdo.size(); ++i )
+  {
+    if ( 0 != ( ( tdo[ i ] ^ inst.tdo_wait_value[ i ] ) & inst.tdo_wait_mask[ i ] ) )
+      return false;
+  }
+
+  return true;
+}
+
+
+// Called after each CMD_WAIT_FOR_TDO attempt. Returns true if the wait is over,
+// and false if another attempt follows, in which case the pins stay as they are
+// for the requested interval, see cs_waiting_between_tdo_polls.
+
+static bool finish_tdo_wait_attempt ( jtag_dpi_instance & inst )
+{
+  ++inst.tdo_wait_attempt_count;
+
+  if ( does_tdo_wait_match( inst ) )
+  {
+    inst.tdo_wait_status = WAIT_FOR_TDO_STATUS_MATCHED;
+    return true;
+  }
+
+  if ( inst.tdo_wait_attempt_count == inst.tdo_wait_max_attempt_count )
+  {
+    inst.tdo_wait_status = WAIT_FOR_TDO_STATUS_TIMED_OUT;
+    return true;
+  }
+
+  if ( is_input_pending( inst ) )
+  {
+    inst.tdo_wait_status = WAIT_FOR_TDO_STATUS_CANCELLED;
+    return true;
+  }
+
+  inst.tdo_wait_countdown = uint64_t( inst.tdo_wait_interval_cycle_count ) * 2 * uint64_t( inst.jtag_tck_half_period_tick_count );
+
+  if ( inst.tdo_wait_countdown == 0 )
+    prepare_vector_scan_execution( inst.client_vector_scan );
+  else
+    inst.connectionState = cs_waiting_between_tdo_polls;
+
+  return false;
+}
+
+
+static void send_supported_extensions ( jtag_dpi_instance & inst )
+{
+  uint32_t extensions = SUPPORTED_EXTENSIONS;
+
+  if ( s_backdoor_memory_access != NULL )
+    extensions |= EXT_BACKDOOR_MEMORY;
+
+  uint8_t reply[ 4 ];
+
+  reply[0] = uint8_t( extensions       );
+  reply[1] = uint8_t( extensions >>  8 );
+  reply[2] = uint8_t( extensions >> 16 );
+  reply[3] = uint8_t( extensions >> 24 );
+
+  send_data( inst, reply, sizeof(reply) );
+}
+
+
+// The reply carries the counters of the current connection, including this command.
+
+static void send_statistics ( jtag_dpi_instance & inst )
+{
+  update_connected_time( inst );
+
+  const size_t counter_count = sizeof( link_statistics ) / sizeof( uint64_t );
+  const uint64_t * const counters = reinterpret_cast< const uint64_t * >( &inst.stats );
+
+  send_byte( inst, CMD_GET_STATISTICS );
+  send_byte( inst, uint8_t( counter_count ) );
+
+  for ( size_t i = 0; i < counter_count; ++i )
+  {
+    uint8_t data[ 8 ];
+
+    for ( int j = 0; j < 8; ++j )
+      data[ j ] = uint8_t( counters[ i ] >> ( 8 * j ) );
+
+    send_data( inst, data, sizeof(data) );
+  }
+}
+
+
+static void send_uint16 ( jtag_dpi_instance & inst, const uint16_t value )
+{
+  uint8_t data[ 2 ];
+
+  data[0] = uint8_t( value      );
+  data[1] = uint8_t( value >> 8 );
+
+  send_data( inst, data, sizeof(data) );
+}
+
+
+static void send_streaming_credits ( jtag_dpi_instance & inst )
+{
+  if ( inst.streaming_uncredited_byte_count == 0 )
+    return;
+
+  send_byte( inst, STREAMING_CREDIT_MSG );
+  send_uint16( inst, inst.streaming_uncredited_byte_count );
+
+  inst.streaming_uncredited_byte_count = 0;
+}
+
+
+static void start_streaming ( jtag_dpi_instance & inst )
+{
+  inst.streaming_uncredited_byte_count = 0;
+
+  send_byte( inst, CMD_START_STREAMING );
+  send_uint16( inst, STREAMING_WINDOW_SIZE );
+
+  inst.connectionState = cs_streaming;
+}
+
+
+static void process_stream ( jtag_dpi_instance & inst,
+                             unsigned char * const jtag_tms,
+                             unsigned char * const jtag_tck,
+                             unsigned char * const jtag_trst,
+                             unsigned char * const jtag_tdi,
+                             unsigned char * const jtag_new_data_available,
+                             const unsigned char   jtag_tdo )
+{
+  // Every byte in the stream waits for the half period of the previous data byte to elapse.
+  // Therefore, at most one data byte is applied per tick.
+
+  while ( inst.clock_notification_counter == 0 && !is_send_buffer_full( inst ) )
+  {
+    uint8_t received_data;
+
+    const ssize_t received_byte_count = receive_data( inst, &received_data, 1 );
+
+    if ( received_byte_count == -1 )
+    {
+      // The connection has been closed.
+      return;
+    }
+
+    if ( received_byte_count == 0 )
+    {
+      // The client has probably run out of credits, or it is waiting for a TDO value.
+      send_streaming_credits( inst );
+      return;
+    }
+
+    record_client_command( inst );
+
+    if ( received_data == CMD_STOP_STREAMING )
+    {
+      send_streaming_credits( inst );
+      send_byte( inst, CMD_STOP_STREAMING );
+      inst.connectionState = cs_waiting_to_receive_commands;
+      return;
+    }
+
+    if ( received_data == CMD_READ_TDO )
+    {
+      note_tdo_read( inst, jtag_tdo, inst.tick_count );
+      send_byte( inst, jtag_tdo ? 1 : 0 );
+    }
+    else if ( 0 == ( received_data & 0xf0 ) )
+    {
+      apply_jtag_data_byte( inst,
+                            received_data,
+                            jtag_tms,
+                            jtag_tck,
+                            jtag_trst,
+                            jtag_tdi,
+                            jtag_new_data_available );
+    }
+    else
+    {
+      char buffer[80];
+      if ( int(sizeof(buffer)) <= sprintf( buffer, "Invalid byte 0x%02X received in streaming mode.", received_data ) )
+      {
+        assert( false );
+      }
+      throw std::runtime_error( buffer );
+    }
+
+    ++inst.streaming_uncredited_byte_count;
+
+    if ( inst.streaming_uncredited_byte_count >= STREAMING_CREDIT_BATCH_SIZE )
+    {
+      send_streaming_credits( inst );
+    }
+  }
+}
+
+
+static void receive_commands ( jtag_dpi_instance & inst,
+                               unsigned char * const jtag_tms,
+                               unsigned char * const jtag_tck,
+                               unsigned char * const jtag_trst,
+                               unsigned char * const jtag_tdi,
+                               unsigned char * const jtag_new_data_available,
+                               const unsigned char   jtag_tdo )
+{
+  if ( inst.socket_protocol == SOCKET_PROTOCOL_JTAG_VPI )
+  {
+    // All jtag_vpi commands have the same size, so just start collecting the next one.
+    start_receiving_command_payload( inst, CMD_JTAG_VPI, JTAG_VPI_CMD_LEN );
+    return;
+  }
+
+  for ( ; ; )
+  {
+    if ( is_send_buffer_full( inst ) )
+    {
+      // Wait until the client reads some replies.
+      break;
+    }
+
+    uint8_t received_data;
+
+    const ssize_t received_byte_count = receive_data( inst,
+                                                      &received_data,
+                                                      1  // Receive just 1 byte.
+                                                      );
+    if ( received_byte_count == -1 )
+    {
+      // The connection has been closed.
+      break;
+    }
+
+    if ( received_byte_count == 0 )
+    {
+      // No data available yet.
+      break;
+    }
+
+    assert( received_byte_count == 1 );
+
+    record_client_command( inst );
+
+    if ( received_data & 0x80 )
+    {
+      if ( inst.print_informational_messages )
+      {
+        // printf( "%sReceived JTAG command: 0x%02X\n", INFO_MSG_PREFIX, received_data );
+        // fflush( stdout );
+      }
+
+      switch ( received_data )
+      {
+      case CMD_READ_TDO:
+        note_tdo_read( inst, jtag_tdo, inst.tick_count );
+        send_byte( inst, jtag_tdo ? 1 : 0 );
+        break;
+
+      case CMD_WAIT_CLOCK_NOTIFICATION:
+        ++inst.stats.clock_notification_waits;
+
+        if ( inst.clock_notification_counter == 0 )
+        {
+          send_byte( inst, CLOCK_NOTIFICATION_MSG );
+        }
+        else
+        {
+          inst.connectionState = cs_waiting_to_send_clock_notification;
+        }
+        break;
+
+      case CMD_QUERY_EXTENSIONS:
+        send_supported_extensions( inst );
+        break;
+
+      case CMD_VECTOR_SCAN:
+        start_receiving_command_payload( inst, received_data, VECTOR_SCAN_HEADER_LEN );
+        break;
+
+      case CMD_GO_TO_TAP_STATE:
+        start_receiving_command_payload( inst, received_data, 1 );
+        break;
+
+      case CMD_SCAN_IR:
+      case CMD_SCAN_DR:
+        start_receiving_command_payload( inst, received_data, SCAN_XR_HEADER_LEN );
+        break;
+
+      case CMD_RUN_TEST_IDLE:
+        start_receiving_command_payload( inst, received_data, 4 );
+        break;
+
+      case CMD_GET_TAP_STATE:
+        send_byte( inst, uint8_t( inst.tap_state ) );
+        break;
+
+      case CMD_GET_STATISTICS:
+        send_statistics( inst );
+        break;
+
+      case CMD_START_STREAMING:
+        start_streaming( inst );
+        break;
+
+      case CMD_BACKDOOR_WRITE:
+      case CMD_BACKDOOR_READ:
+        start_receiving_command_payload( inst, received_data, BACKDOOR_HEADER_LEN );
+        break;
+
+      case CMD_WAIT_FOR_TDO:
+        start_receiving_command_payload( inst, received_data, WAIT_FOR_TDO_HEADER_LEN );
+        break;
+
+      default:
+        {
+          char buffer[80];
+          if ( int(sizeof(buffer)) <= sprintf( buffer, "Invalid command 0x%02X received.", received_data ) )
+          {
+            assert( false );
+          }
+
+          throw std::runtime_error( buffer );
+        }
+      }
+
+      // We don't process new commands until the notification is due or the vector scan has finished.
+      // Note that the TAP engine commands are executed as vector scans too.
+      // In streaming mode, process_stream() takes over.
+      // We could decide otherwise, but the current clients do not need it,
+      // so keep things simple.
+      if ( inst.connectionState != cs_waiting_to_receive_commands )
+        break;
+    }
+    else
+    {
+      if ( 0 != ( received_data & 0xf0 ) )
+      {
+        char buffer[80];
+        if ( int(sizeof(buffer)) <= sprintf( buffer, "Invalid JTAG data byte 0x%02X received.", received_data ) )
+        {
+          assert( false );
+        }
+        throw std::runtime_error( buffer );
+      }
+
+      apply_jtag_data_byte( inst,
+                            received_data,
+                            jtag_tms,
+                            jtag_tck,
+                            jtag_trst,
+                            jtag_tdi,
+                            jtag_new_data_available );
+
+      if ( inst.print_informational_messages )
+      {
+        /*
+        printf( "%sReceived JTAG data 0x%02X, TCK: %d, TMS: %d, TDI: %d, TRST: %d.\n",
+                INFO_MSG_PREFIX,
+                received_data,
+                *jtag_tck,
+                *jtag_tms,
+                *jtag_tdi,
+                *jtag_trst );
+        fflush( stdout );
+        */
+      }
+
+      // Acknowledge the received data.
+      send_byte( inst, received_data | 0x10 );
+    }
+  }
+}
+
+
+static void serve_connection ( jtag_dpi_instance & inst,
+                               unsigned char * const jtag_tms,
+                               unsigned char * const jtag_tck,
+                               unsigned char * const jtag_trst,
+                               unsigned char * const jtag_tdi,
+                               unsigned char * const jtag_new_data_available,
+                               const unsigned char jtag_tdo )
+{
+  assert( is_connection_open( inst ) );
+
+  ++inst.stats.connected_ticks;
+
+  try
+  {
+    if ( inst.shm_area != NULL )
+    {
+      if ( has_shm_client_disconnected( inst ) )
+      {
+        print_connection_closed_at_the_other_end( inst );
+        close_current_connection( inst );
+        return;
+      }
+    }
+    else if ( inst.io_mode == IO_MODE_POLL )
+    {
+      poll_connection_sockets( inst );
+    }
+    else if ( inst.io_mode == IO_MODE_URING )
+    {
+      reap_uring_completions( inst );
+    }
+
+    if ( inst.activity_pre_roll_countdown != 0 )
+    {
+      // Hold the client's data back until the waveform trace has been running for the pre-roll time.
+      if ( --inst.activity_pre_roll_countdown != 0 )
+        return;
+    }
+    else if ( s_activity_pre_roll_tick_count != 0 &&
+              ( inst.connectionState == cs_waiting_to_receive_commands ||
+                ( inst.connectionState == cs_receiving_command_payload && inst.command_payload.empty() ) ) &&
+              inst.tick_count - inst.last_activity_tick > s_activity_idle_tick_count &&
+              is_input_pending( inst ) )
+    {
+      inst.activity_pre_roll_countdown = s_activity_pre_roll_tick_count;
+      return;
+    }
+
+    switch ( inst.connectionState )
+    {
+    case cs_waiting_to_receive_commands:
+      receive_commands( inst,
+                        jtag_tms,
+                        jtag_tck,
+                        jtag_trst,
+                        jtag_tdi,
+                        jtag_new_data_available,
+                        jtag_tdo );
+      break;
+
+    case cs_waiting_to_send_clock_notification:
+
+      if ( inst.clock_notification_counter != 0 )
+      {
+        ++inst.stats.ticks_waiting_for_clock_notification;
+      }
+      else
+      {
+        send_byte( inst, CLOCK_NOTIFICATION_MSG );
+        inst.connectionState = cs_waiting_to_receive_commands;
+
+        // In case there are already commands on the receive queue, process them right away.
+        receive_commands( inst,
+                          jtag_tms,
+                          jtag_tck,
+                          jtag_trst,
+                          jtag_tdi,
+                          jtag_new_data_available,
+                          jtag_tdo );
+      }
+      break;
+
+    case cs_receiving_command_payload:
+      if ( !receive_command_payload( inst ) )
+        break;
+
+      if ( inst.connectionState == cs_waiting_to_receive_commands )
+      {
+        // A backdoor memory access has already completed.
+        receive_commands( inst,
+                          jtag_tms,
+                          jtag_tck,
+                          jtag_trst,
+                          jtag_tdi,
+                          jtag_new_data_available,
+                          jtag_tdo );
+        break;
+      }
+
+      if ( inst.connectionState != cs_executing_vector_scan )
+        break;
+
+      // The first bit may start straight away.
+
+      // Fall through.
+
+    case cs_executing_vector_scan:
+
+      if ( advance_vector_scan( inst,
+                                inst.client_vector_scan,
+                                jtag_tms,
+                                jtag_tck,
+                                jtag_trst,
+                                jtag_tdi,
+                                jtag_new_data_available,
+                                jtag_tdo ) )
+      {
+        if ( inst.client_vector_scan.reply_command == CMD_WAIT_FOR_TDO && !finish_tdo_wait_attempt( inst ) )
+          break;
+
+        send_vector_scan_reply( inst );
+        inst.connectionState = cs_waiting_to_receive_commands;
+
+        receive_commands( inst,
+                          jtag_tms,
+                          jtag_tck,
+                          jtag_trst,
+                          jtag_tdi,
+                          jtag_new_data_available,
+                          jtag_tdo );
+      }
+      break;
+
+    case cs_waiting_between_tdo_polls:
+
+      if ( is_input_pending( inst ) )
+      {
+        // The client wants to do something else, like stopping the CPU on the user's request.
+        inst.tdo_wait_status = WAIT_FOR_TDO_STATUS_CANCELLED;
+        send_vector_scan_reply( inst );
+        inst.connectionState = cs_waiting_to_receive_commands;
+
+        receive_commands( inst,
+                          jtag_tms,
+                          jtag_tck,
+                          jtag_trst,
+                          jtag_tdi,
+                          jtag_new_data_available,
+                          jtag_tdo );
+        break;
+      }
+
+      if ( --inst.tdo_wait_countdown == 0 )
+      {
+        prepare_vector_scan_execution( inst.client_vector_scan );
+        inst.connectionState = cs_executing_vector_scan;
+      }
+      break;
+
+    case cs_streaming:
+      process_stream( inst,
+                      jtag_tms,
+                      jtag_tck,
+                      jtag_trst,
+                      jtag_tdi,
+                      jtag_new_data_available,
+                      jtag_tdo );
+
+      if ( inst.connectionState == cs_waiting_to_receive_commands )
+      {
+        receive_commands( inst,
+                          jtag_tms,
+                          jtag_tck,
+                          jtag_trst,
+                          jtag_tdi,
+                          jtag_new_data_available,
+                          jtag_tdo );
+      }
+      break;
+
+    default:
+      assert( false );
+    }
+
+    if ( is_connection_open( inst ) )
+    {
+      flush_send_buffer( inst );
+    }
+  }
+  catch ( const std::exception & e )
+  {
+    fprintf( stderr,
+             "%sConnection closed after error: %s\n",
+             ERROR_MSG_PREFIX_TICK,
+             e.what() );
+    fflush( stderr );
+
+    // Close the connection. The remote client can reconnect later.
+    if ( is_connection_open( inst ) )
+    {
+      close_current_connection( inst );
+    }
+  }
+}
+
+
+// ----------- Built-in GDB server -----------
+//
+// The GDB server drives the adv_dbg_if debug interface directly with the same vector scans
+// used by the TAP engine, see the "Built-in GDB server" section at the top.
+// All GDB operations are split into a chain of JTAG jobs. A job is a queue of scans,
+// and once the last scan has completed, the job's continuation routine
+// looks at the captured TDO data and queues the next job, or sends the reply to GDB.
+
+// These definitions come from adv_jtag_bridge, see adv_dbg_commands.h there.
+static const uint32_t ADBG_TAP_IR_LENGTH = 4;
+static const uint32_t ADBG_TAP_IR_DEBUG  = 0x8;
+
+static const uint32_t ADBG_MODULE_ID_LENGTH = 2;
+static const int      ADBG_MODULE_WISHBONE  = 0;
+static const int      ADBG_MODULE_CPU0      = 1;
+
+static const uint32_t ADBG_OPCODE_LENGTH = 4;
+static const uint32_t ADBG_CMD_BWRITE8   = 0x1;
+static const uint32_t ADBG_CMD_BWRITE32  = 0x3;
+static const uint32_t ADBG_CMD_BREAD8    = 0x5;
+static const uint32_t ADBG_CMD_BREAD32   = 0x7;
+static const uint32_t ADBG_CMD_IREG_WR   = 0x9;
+static const uint32_t ADBG_CMD_IREG_SEL  = 0xD;
+
+static const uint32_t ADBG_CPU0_REG_SEL_LENGTH = 1;
+static const uint32_t ADBG_CPU0_REG_STATUS     = 0;
+static const uint32_t ADBG_CPU0_STATUS_LENGTH  = 2;
+static const uint32_t ADBG_CPU0_STATUS_STALL   = 0x1;
+
+static const uint32_t ADBG_CRC_POLY = 0xEDB88320;
+
+// A burst read answers with a '1' status bit when the first word is ready.
+// The simulated bus is much faster than TCK, so a few bits of slack normally suffice.
+static const uint32_t ADBG_READ_STATUS_SLACK_BIT_COUNT = 64;
+static const uint32_t ADBG_MAX_BURST_WORD_COUNT = 256;
+static const int      ADBG_MAX_RETRY_COUNT = 3;
+
+// OpenRISC 1000 special-purpose registers.
+static const uint32_t OR1K_SPR_NPC  = 0x0010;
+static const uint32_t OR1K_SPR_SR   = 0x0011;
+static const uint32_t OR1K_SPR_PPC  = 0x0012;
+static const uint32_t OR1K_SPR_DMR1 = 0x3010;
+static const uint32_t OR1K_SPR_DSR  = 0x3014;
+static const uint32_t OR1K_SPR_DRR  = 0x3015;
+static const uint32_t OR1K_SPR_GPR0 = 0x0400;
+
+static const uint32_t OR1K_DMR1_ST = 0x00400000;  // Single step.
+static const uint32_t OR1K_DSR_TE  = 0x00002000;  // Trap exceptions stall the CPU.
+static const uint32_t OR1K_DRR_TE  = 0x00002000;  // A trap exception stalled the CPU.
+
+static const uint32_t OR1K_TRAP_INSTRUCTION = 0x21000001;  // l.trap 1
+
+static const int OR1K_GPR_COUNT = 32;
+static const int GDB_REGISTER_COUNT = OR1K_GPR_COUNT + 3;  // r0-r31, PPC, NPC and SR, as GDB's or1k port expects them.
+static const int GDB_REG_PPC = OR1K_GPR_COUNT;
+static const int GDB_REG_NPC = OR1K_GPR_COUNT + 1;
+static const int GDB_REG_SR  = OR1K_GPR_COUNT + 2;
+
+static const size_t GDB_MAX_PACKET_SIZE = 4096;
+static const char   GDB_INTERRUPT_CHAR  = 0x03;
+
+typedef void ( * gdb_continuation_t ) ( jtag_dpi_instance & inst );
+
+struct bit_vector
+{
+  std::vector< uint8_t > bytes;
+  uint32_t bit_count;
+};
+
+struct gdb_server_data
+{
+  int listening_socket;
+  int connection_socket;
+  int poll_countdown;
+
+  std::string receive_buffer;
+  std::string send_buffer;
+  std::string last_packet;  // For retransmission requests.
+  bool        close_requested;
+  bool        is_reply_pending;  // Whether GDB is waiting for the reply to its last packet.
+
+  // The current JTAG job.
+  std::deque< vector_scan > scans;
+  bool               is_scan_in_progress;
+  tap_state_enum     planned_tap_state;  // The TAP state after the last queued scan.
+  bool               is_debug_ir_selected;
+  int                selected_module;
+  std::vector< uint8_t > captured_tdo;   // From the last scan that captured TDO.
+  gdb_continuation_t continuation;
+  int                continuation_delay_tick_count;
+
+  // The current burst transfer.
+  int      burst_module;
+  bool     burst_is_write;
+  uint32_t burst_word_bit_count;
+  uint32_t burst_address;
+  uint32_t burst_word_count;
+  std::vector< uint32_t > burst_words;
+  int      burst_retry_count;
+  gdb_continuation_t burst_continuation;
+
+  // The current GDB command.
+  uint32_t op_address;
+  uint32_t op_length;
+  std::vector< uint8_t > op_data;
+  uint32_t op_register_number;
+  uint32_t registers[ GDB_REGISTER_COUNT ];
+  bool     is_cpu_running;
+  bool     is_stepping;
+  bool     interrupt_requested;
+  std::map< uint32_t, uint32_t > breakpoints;  // Address -> original instruction.
+
+  // Whether the target still needs to be restored when the session ends, see gdb_start_cleanup().
+  bool     is_target_attached;
+  gdb_continuation_t cleanup_continuation;
+};
+
+
+
+static void append_bits ( bit_vector & bits,
+                          const uint32_t value,
+                          const uint32_t bit_count )
+{
+  assert( bit_count <= 32 );
+
+  for ( uint32_t i = 0; i < bit_count; ++i )
+  {
+    if ( bits.bit_count % 8 == 0 )
+      bits.bytes.push_back( 0 );
+
+    if ( ( value >> i ) & 1 )
+      bits.bytes.back() |= uint8_t( 1 << ( bits.bit_count % 8 ) );
+
+    ++bits.bit_count;
+  }
+}
+
+
+static void append_zero_bits ( bit_vector & bits,
+                               const uint32_t bit_count )
+{
+  bits.bit_count += bit_count;
+  bits.bytes.resize( ( bits.bit_count + 7 ) / 8, 0 );
+}
+
+
+static uint32_t get_packed_bits ( const std::vector< uint8_t > & data,
+                                  const uint32_t first_bit,
+                                  const uint32_t bit_count )
+{
+  assert( bit_count <= 32 );
+  assert( first_bit + bit_count <= data.size() * 8 );
+
+  uint32_t value = 0;
+
+  for ( uint32_t i = 0; i < bit_count; ++i )
+  {
+    if ( get_packed_bit( &data[0], first_bit + i ) )
+      value |= uint32_t( 1 ) << i;
+  }
+
+  return value;
+}
+
+
+// The CRC is calculated bit by bit in the same order as the bits are shifted, LSB first.
+
+static uint32_t adbg_update_crc ( uint32_t crc,
+                                  const uint32_t value,
+                                  const uint32_t bit_count )
+{
+  for ( uint32_t i = 0; i < bit_count; ++i )
+  {
+    const uint32_t data_bit = ( value >> i ) & 1;
+    const uint32_t crc_bit  = crc & 1;
+
+    crc >>= 1;
+
+    if ( data_bit ^ crc_bit )
+      crc ^= ADBG_CRC_POLY;
+  }
+
+  return crc;
+}
+
+
+static bool is_gdb_connection_open ( jtag_dpi_instance & inst )
+{
+  return inst.gdb != NULL && inst.gdb->connection_socket != -1;
+}
+
+
+static bool is_gdb_job_pending ( jtag_dpi_instance & inst )
+{
+  return !inst.gdb->scans.empty() || inst.gdb->continuation != NULL;
+}
+
+
+// After the GDB connection has closed, the only job left is restoring the target.
+
+static bool is_gdb_cleanup_pending ( jtag_dpi_instance & inst )
+{
+  return inst.gdb != NULL && inst.gdb->connection_socket == -1 && is_gdb_job_pending( inst );
+}
+
+
+static void gdb_set_continuation ( jtag_dpi_instance & inst,
+                                   const gdb_continuation_t continuation,
+                                   const int delay_tick_count )
+{
+  assert( inst.gdb->continuation == NULL );
+
+  inst.gdb->continuation = continuation;
+  inst.gdb->continuation_delay_tick_count = delay_tick_count;
+}
+
+
+// Queues a scan that starts and ends in Run-Test/Idle.
+
+static void gdb_queue_xr_scan ( jtag_dpi_instance & inst,
+                                const bool is_ir,
+                                const bit_vector & tdi,
+                                const bool capture_tdo )
+{
+  if ( inst.gdb->scans.empty() )
+  {
+    // Nothing is running, so the tracked TAP state is accurate.
+    inst.gdb->planned_tap_state = inst.tap_state;
+  }
+
+  inst.gdb->scans.push_back( vector_scan() );
+  vector_scan & scan = inst.gdb->scans.back();
+
+  start_vector_scan( scan, 0 );
+  scan.capture_tdo = capture_tdo;
+
+  append_xr_scan( scan,
+                  inst.gdb->planned_tap_state,
+                  is_ir,
+                  &tdi.bytes[0],
+                  tdi.bit_count,
+                  tap_run_test_idle );
+
+  inst.gdb->planned_tap_state = tap_run_test_idle;
+}
+
+
+static void gdb_queue_select_module ( jtag_dpi_instance & inst, const int module )
+{
+  // Going through Test-Logic-Reset loads the IDCODE instruction.
+  if ( inst.gdb->scans.empty() &&
+       ( inst.tap_state == tap_unknown || inst.tap_state == tap_test_logic_reset ) )
+  {
+    inst.gdb->is_debug_ir_selected = false;
+  }
+
+  if ( !inst.gdb->is_debug_ir_selected )
+  {
+    bit_vector ir = bit_vector();
+    append_bits( ir, ADBG_TAP_IR_DEBUG, ADBG_TAP_IR_LENGTH );
+    gdb_queue_xr_scan( inst, true, ir, false );
+
+    inst.gdb->is_debug_ir_selected = true;
+    inst.gdb->selected_module = -1;
+  }
+
+  if ( inst.gdb->selected_module == module )
+    return;
+
+  // The top bit set means "module select".
+  bit_vector dr = bit_vector();
+  append_bits( dr, uint32_t( module ), ADBG_MODULE_ID_LENGTH );
+  append_bits( dr, 1, 1 );
+  gdb_queue_xr_scan( inst, false, dr, false );
+
+  inst.gdb->selected_module = module;
+}
+
+
+static void gdb_queue_burst_transfer ( jtag_dpi_instance & inst );
+static void gdb_burst_transfer_done ( jtag_dpi_instance & inst );
+
+static void gdb_start_burst_transfer ( jtag_dpi_instance & inst,
+                                       const int module,
+                                       const bool is_write,
+                                       const uint32_t word_bit_count,
+                                       const uint32_t address,
+                                       const uint32_t word_count,
+                                       const gdb_continuation_t continuation )
+{
+  assert( word_bit_count == 8 || word_bit_count == 32 );
+  assert( word_count > 0 && word_count <= ADBG_MAX_BURST_WORD_COUNT );
+  assert( !is_write || inst.gdb->burst_words.size() == word_count );
+
+  inst.gdb->burst_module         = module;
+  inst.gdb->burst_is_write       = is_write;
+  inst.gdb->burst_word_bit_count = word_bit_count;
+  inst.gdb->burst_address        = address;
+  inst.gdb->burst_word_count     = word_count;
+  inst.gdb->burst_retry_count    = 0;
+  inst.gdb->burst_continuation   = continuation;
+
+  gdb_queue_burst_transfer( inst );
+}
+
+
+// Reads the words into inst.gdb->burst_words.
+
+static void gdb_start_burst_read ( jtag_dpi_instance & inst,
+                                   const int module,
+                                   const uint32_t word_bit_count,
+                                   const uint32_t address,
+                                   const uint32_t word_count,
+                                   const gdb_continuation_t continuation )
+{
+  gdb_start_burst_transfer( inst, module, false, word_bit_count, address, word_count, continuation );
+}
+
+
+// Writes the words in inst.gdb->burst_words.
+
+static void gdb_start_burst_write ( jtag_dpi_instance & inst,
+                                    const int module,
+                                    const uint32_t word_bit_count,
+                                    const uint32_t address,
+                                    const gdb_continuation_t continuation )
+{
+  gdb_start_burst_transfer( inst, module, true, word_bit_count, address, uint32_t( inst.gdb->burst_words.size() ), continuation );
+}
+
+
+static void gdb_queue_burst_transfer ( jtag_dpi_instance & inst )
+{
+  gdb_queue_select_module( inst, inst.gdb->burst_module );
+
+  const bool is_byte_access = inst.gdb->burst_word_bit_count == 8;
+
+  uint32_t opcode;
+
+  if ( inst.gdb->burst_is_write )
+    opcode = is_byte_access ? ADBG_CMD_BWRITE8 : ADBG_CMD_BWRITE32;
+  else
+    opcode = is_byte_access ? ADBG_CMD_BREAD8  : ADBG_CMD_BREAD32;
+
+  bit_vector command = bit_vector();
+  append_bits( command, inst.gdb->burst_word_count, 16 );
+  append_bits( command, inst.gdb->burst_address, 32 );
+  append_bits( command, opcode, ADBG_OPCODE_LENGTH );
+  append_bits( command, 0, 1 );  // Not a module select.
+  gdb_queue_xr_scan( inst, false, command, false );
+
+  bit_vector data = bit_vector();
+
+  if ( inst.gdb->burst_is_write )
+  {
+    // A start bit, the data words, the CRC, and finally one bit to read the CRC match flag back.
+    append_bits( data, 1, 1 );
+
+    uint32_t crc = 0xFFFFFFFF;
+
+    for ( uint32_t i = 0; i < inst.gdb->burst_word_count; ++i )
+    {
+      append_bits( data, inst.gdb->burst_words[ i ], inst.gdb->burst_word_bit_count );
+      crc = adbg_update_crc( crc, inst.gdb->burst_words[ i ], inst.gdb->burst_word_bit_count );
+    }
+
+    append_bits( data, crc, 32 );
+    append_zero_bits( data, 1 );
+  }
+  else
+  {
+    append_zero_bits( data, ADBG_READ_STATUS_SLACK_BIT_COUNT + 1 +
+                            inst.gdb->burst_word_count * inst.gdb->burst_word_bit_count +
+                            32 );
+  }
+
+  gdb_queue_xr_scan( inst, false, data, true );
+
+  gdb_set_continuation( inst, gdb_burst_transfer_done, 0 );
+}
+
+
+static bool gdb_decode_burst_read ( jtag_dpi_instance & inst )
+{
+  const std::vector< uint8_t > & tdo = inst.gdb->captured_tdo;
+
+  uint32_t pos = 0;
+
+  while ( !get_packed_bit( &tdo[0], pos ) )
+  {
+    if ( ++pos > ADBG_READ_STATUS_SLACK_BIT_COUNT )
+      return false;
+  }
+
+  ++pos;
+
+  uint32_t crc = 0xFFFFFFFF;
+
+  inst.gdb->burst_words.resize( inst.gdb->burst_word_count );
+
+  for ( uint32_t i = 0; i < inst.gdb->burst_word_count; ++i )
+  {
+    const uint32_t word = get_packed_bits( tdo, pos, inst.gdb->burst_word_bit_count );
+    pos += inst.gdb->burst_word_bit_count;
+
+    inst.gdb->burst_words[ i ] = word;
+    crc = adbg_update_crc( crc, word, inst.gdb->burst_word_bit_count );
+  }
+
+  return crc == get_packed_bits( tdo, pos, 32 );
+}
+
+
+static void gdb_burst_transfer_done ( jtag_dpi_instance & inst )
+{
+  bool is_ok;
+
+  if ( inst.gdb->burst_is_write )
+  {
+    const uint32_t crc_match_bit = ( inst.gdb->burst_word_count * inst.gdb->burst_word_bit_count ) + 1 + 32;
+    is_ok = get_packed_bit( &inst.gdb->captured_tdo[0], crc_match_bit );
+  }
+  else
+  {
+    is_ok = gdb_decode_burst_read( inst );
+  }
+
+  if ( !is_ok )
+  {
+    if ( ++inst.gdb->burst_retry_count >= ADBG_MAX_RETRY_COUNT )
+    {
+      throw std::runtime_error( "The JTAG debug interface keeps reporting CRC errors, or the bus does not answer at that address." );
+    }
+
+    gdb_queue_burst_transfer( inst );
+    return;
+  }
+
+  const gdb_continuation_t continuation = inst.gdb->burst_continuation;
+
+  if ( continuation != NULL )
+    continuation( inst );
+}
+
+
+static void gdb_start_burst_write_word ( jtag_dpi_instance & inst,
+                                         const int module,
+                                         const uint32_t address,
+                                         const uint32_t value,
+                                         const gdb_continuation_t continuation )
+{
+  inst.gdb->burst_words.assign( 1, value );
+  gdb_start_burst_write( inst, module, 32, address, continuation );
+}
+
+
+// Bit 0 of the CPU status register stalls the CPU, bit 1 resets it.
+
+static void gdb_start_cpu_status_write ( jtag_dpi_instance & inst,
+                                         const uint32_t value,
+                                         const gdb_continuation_t continuation )
+{
+  gdb_queue_select_module( inst, ADBG_MODULE_CPU0 );
+
+  bit_vector dr = bit_vector();
+  append_bits( dr, value, ADBG_CPU0_STATUS_LENGTH );
+  append_bits( dr, ADBG_CPU0_REG_STATUS, ADBG_CPU0_REG_SEL_LENGTH );
+  append_bits( dr, ADBG_CMD_IREG_WR, ADBG_OPCODE_LENGTH );
+  append_bits( dr, 0, 1 );
+  gdb_queue_xr_scan( inst, false, dr, false );
+
+  gdb_set_continuation( inst, continuation, 0 );
+}
+
+
+// The continuation finds the register value with gdb_get_cpu_status().
+
+static void gdb_start_cpu_status_read ( jtag_dpi_instance & inst, const gdb_continuation_t continuation )
+{
+  gdb_queue_select_module( inst, ADBG_MODULE_CPU0 );
+
+  bit_vector select = bit_vector();
+  append_bits( select, ADBG_CPU0_REG_STATUS, ADBG_CPU0_REG_SEL_LENGTH );
+  append_bits( select, ADBG_CMD_IREG_SEL, ADBG_OPCODE_LENGTH );
+  append_bits( select, 0, 1 );
+  gdb_queue_xr_scan( inst, false, select, false );
+
+  // The register comes out first, while shifting in a no-operation command.
+  bit_vector read = bit_vector();
+  append_zero_bits( read, ADBG_CPU0_STATUS_LENGTH + ADBG_OPCODE_LENGTH + 1 );
+  gdb_queue_xr_scan( inst, false, read, true );
+
+  gdb_set_continuation( inst, continuation, 0 );
+}
+
+
+static uint32_t gdb_get_cpu_status ( jtag_dpi_instance & inst )
+{
+  return get_packed_bits( inst.gdb->captured_tdo, 0, ADBG_CPU0_STATUS_LENGTH );
+}
+
+
+static void gdb_send_packet ( jtag_dpi_instance & inst, const std::string & payload )
+{
+  uint8_t checksum = 0;
+
+  for ( size_t i = 0; i < payload.size(); ++i )
+    checksum = uint8_t( checksum + uint8_t( payload[ i ] ) );
+
+  char checksum_text[ 4 ];
+  snprintf( checksum_text, sizeof(checksum_text), "%02x", checksum );
+
+  inst.gdb->last_packet = "$" + payload + "#" + checksum_text;
+  inst.gdb->send_buffer += inst.gdb->last_packet;
+  inst.gdb->is_reply_pending = false;
+}
+
+
+static std::string format_hex_uint32 ( const uint32_t value )
+{
+  char text[ 12 ];
+  snprintf( text, sizeof(text), "%08x", value );
+  return text;
+}
+
+
+static std::string format_hex_uint8 ( const uint8_t value )
+{
+  char text[ 4 ];
+  snprintf( text, sizeof(text), "%02x", value );
+  return text;
+}
+
+
+static int parse_hex_digit ( const char c )
+{
+  if ( c >= '0' && c <= '9' )
+    return c - '0';
+
+  if ( c >= 'a' && c <= 'f' )
+    return c - 'a' + 10;
+
+  if ( c >= 'A' && c <= 'F' )
+    return c - 'A' + 10;
+
+  return -1;
+}
+
+
+// Parses a hexadecimal number starting at 'pos' and advances 'pos' past it.
+
+static uint32_t parse_hex_number ( const std::string & text,
+                                   size_t & pos,
+                                   const size_t max_digit_count )
+{
+  uint32_t value = 0;
+  size_t digit_count = 0;
+
+  while ( pos < text.size() && digit_count < max_digit_count )
+  {
+    const int digit = parse_hex_digit( text[ pos ] );
+
+    if ( digit == -1 )
+      break;
+
+    value = ( value << 4 ) | uint32_t( digit );
+    ++digit_count;
+    ++pos;
+  }
+
+  if ( digit_count == 0 )
+  {
+    throw std::runtime_error( "Invalid hexadecimal number in GDB packet." );
+  }
+
+  return value;
+}
+
+
+static void skip_packet_char ( const std::string & text,
+                               size_t & pos,
+                               const char expected_char )
+{
+  if ( pos >= text.size() || text[ pos ] != expected_char )
+  {
+    throw std::runtime_error( "Malformed GDB packet." );
+  }
+
+  ++pos;
+}
+
+
+static bool is_valid_gdb_register ( const uint32_t gdb_register_number )
+{
+  return gdb_register_number < uint32_t( GDB_REGISTER_COUNT );
+}
+
+
+static uint32_t get_register_spr ( const uint32_t gdb_register_number )
+{
+  if ( gdb_register_number < uint32_t( OR1K_GPR_COUNT ) )
+    return OR1K_SPR_GPR0 + gdb_register_number;
+
+  switch ( gdb_register_number )
+  {
+  case GDB_REG_PPC: return OR1K_SPR_PPC;
+  case GDB_REG_NPC: return OR1K_SPR_NPC;
+  case GDB_REG_SR : return OR1K_SPR_SR;
+
+  default:
+    throw std::runtime_error( "Invalid GDB register number." );
+  }
+}
+
+
+static void gdb_reply_ok ( jtag_dpi_instance & inst )
+{
+  gdb_send_packet( inst, "OK" );
+}
+
+
+// ---- Attaching and detaching
+
+static void gdb_attach_stalled ( jtag_dpi_instance & inst )
+{
+  // Make l.trap instructions stall the CPU, instead of jumping to the trap exception handler.
+  gdb_start_burst_write_word( inst, ADBG_MODULE_CPU0, OR1K_SPR_DSR, OR1K_DSR_TE, NULL );
+}
+
+
+// Leaving the target as it was before GDB attached takes these steps:
+//
+// 1) Stall the CPU, in case it is running.
+// 2) If the CPU was running and has hit a breakpoint in the meantime, move NPC back
+//    to the l.trap address, like gdb_cpu_stopped_drr_read() does.
+// 3) Write the original instruction back at every breakpoint address that GDB did not remove.
+// 4) Turn single-stepping off, clear the reason for the last stop, and let traps go
+//    to the software's trap exception handler again (clear DMR1, DRR and DSR).
+// 5) Unstall the CPU.
+//
+// GDB removes its breakpoints before detaching with 'D', but not if it crashes, if the user kills it,
+// or after 'k'. In those cases the connection is already closed, and serve_gdb() keeps running
+// the steps above without it. Memory and register writes made during the session are not undone,
+// and the CPU resumes wherever it was stopped. If the debug interface keeps failing,
+// the steps are abandoned, and the CPU may remain stalled with some l.trap instructions in memory.
+
+static void gdb_cleanup_stalled ( jtag_dpi_instance & inst );
+static void gdb_cleanup_drr_read ( jtag_dpi_instance & inst );
+static void gdb_cleanup_ppc_read ( jtag_dpi_instance & inst );
+static void gdb_cleanup_next_breakpoint ( jtag_dpi_instance & inst );
+static void gdb_cleanup_dmr1_cleared ( jtag_dpi_instance & inst );
+static void gdb_cleanup_drr_cleared ( jtag_dpi_instance & inst );
+static void gdb_cleanup_dsr_cleared ( jtag_dpi_instance & inst );
+static void gdb_cleanup_unstalled ( jtag_dpi_instance & inst );
+
+static void gdb_start_cleanup ( jtag_dpi_instance & inst, const gdb_continuation_t continuation )
+{
+  inst.gdb->cleanup_continuation = continuation;
+
+  gdb_start_cpu_status_write( inst, ADBG_CPU0_STATUS_STALL, gdb_cleanup_stalled );
+}
+
+
+static void gdb_cleanup_stalled ( jtag_dpi_instance & inst )
+{
+  // DRR is cleared every time the CPU resumes, so it only shows a breakpoint hit since then.
+  if ( inst.gdb->is_cpu_running && !inst.gdb->is_stepping )
+  {
+    gdb_start_burst_read( inst, ADBG_MODULE_CPU0, 32, OR1K_SPR_DRR, 1, gdb_cleanup_drr_read );
+    return;
+  }
+
+  gdb_cleanup_next_breakpoint( inst );
+}
+
+
+static void gdb_cleanup_drr_read ( jtag_dpi_instance & inst )
+{
+  if ( ( inst.gdb->burst_words[ 0 ] & OR1K_DRR_TE ) != 0 )
+  {
+    gdb_start_burst_read( inst, ADBG_MODULE_CPU0, 32, OR1K_SPR_PPC, 1, gdb_cleanup_ppc_read );
+    return;
+  }
+
+  gdb_cleanup_next_breakpoint( inst );
+}
+
+
+static void gdb_cleanup_ppc_read ( jtag_dpi_instance & inst )
+{
+  gdb_start_burst_write_word( inst, ADBG_MODULE_CPU0, OR1K_SPR_NPC, inst.gdb->burst_words[ 0 ], gdb_cleanup_next_breakpoint );
+}
+
+
+static void gdb_cleanup_next_breakpoint ( jtag_dpi_instance & inst )
+{
+  if ( !inst.gdb->breakpoints.empty() )
+  {
+    const std::map< uint32_t, uint32_t >::iterator it = inst.gdb->breakpoints.begin();
+
+    const uint32_t address              = it->first;
+    const uint32_t original_instruction = it->second;
+    inst.gdb->breakpoints.erase( it );
+
+    gdb_start_burst_write_word( inst, ADBG_MODULE_WISHBONE, address, original_instruction, gdb_cleanup_next_breakpoint );
+    return;
+  }
+
+  gdb_start_burst_write_word( inst, ADBG_MODULE_CPU0, OR1K_SPR_DMR1, 0, gdb_cleanup_dmr1_cleared );
+}
+
+
+static void gdb_cleanup_dmr1_cleared ( jtag_dpi_instance & inst )
+{
+  gdb_start_burst_write_word( inst, ADBG_MODULE_CPU0, OR1K_SPR_DRR, 0, gdb_cleanup_drr_cleared );
+}
+
+
+static void gdb_cleanup_drr_cleared ( jtag_dpi_instance & inst )
+{
+  gdb_start_burst_write_word( inst, ADBG_MODULE_CPU0, OR1K_SPR_DSR, 0, gdb_cleanup_dsr_cleared );
+}
+
+
+static void gdb_cleanup_dsr_cleared ( jtag_dpi_instance & inst )
+{
+  gdb_start_cpu_status_write( inst, 0, gdb_cleanup_unstalled );
+}
+
+
+static void gdb_cleanup_unstalled ( jtag_dpi_instance & inst )
+{
+  inst.gdb->is_cpu_running     = false;
+  inst.gdb->is_stepping        = false;
+  inst.gdb->is_target_attached = false;
+
+  const gdb_continuation_t continuation = inst.gdb->cleanup_continuation;
+  inst.gdb->cleanup_continuation = NULL;
+
+  if ( continuation != NULL )
+    continuation( inst );
+}
+
+
+static void gdb_detach_done ( jtag_dpi_instance & inst )
+{
+  gdb_reply_ok( inst );
+  inst.gdb->close_requested = true;
+}
+
+
+static void gdb_cleanup_after_close_done ( jtag_dpi_instance & inst )
+{
+  if ( inst.print_informational_messages )
+  {
+    printf( "%sThe breakpoints left by GDB have been removed and the CPU has been resumed.\n", INFO_MSG_PREFIX );
+    fflush( stdout );
+  }
+}
+
+
+// ---- Registers
+
+static void gdb_read_registers_gprs_done ( jtag_dpi_instance & inst );
+static void gdb_read_registers_sprs_done ( jtag_dpi_instance & inst );
+
+static void gdb_read_registers ( jtag_dpi_instance & inst )
+{
+  gdb_start_burst_read( inst, ADBG_MODULE_CPU0, 32, OR1K_SPR_GPR0, OR1K_GPR_COUNT, gdb_read_registers_gprs_done );
+}
+
+
+static void gdb_read_registers_gprs_done ( jtag_dpi_instance & inst )
+{
+  for ( int i = 0; i < OR1K_GPR_COUNT; ++i )
+    inst.gdb->registers[ i ] = inst.gdb->burst_words[ i ];
+
+  // NPC, SR and PPC are consecutive SPRs.
+  gdb_start_burst_read( inst, ADBG_MODULE_CPU0, 32, OR1K_SPR_NPC, 3, gdb_read_registers_sprs_done );
+}
+
+
+static void gdb_read_registers_sprs_done ( jtag_dpi_instance & inst )
+{
+  inst.gdb->registers[ GDB_REG_NPC ] = inst.gdb->burst_words[ 0 ];
+  inst.gdb->registers[ GDB_REG_SR  ] = inst.gdb->burst_words[ 1 ];
+  inst.gdb->registers[ GDB_REG_PPC ] = inst.gdb->burst_words[ 2 ];
+
+  std::string reply;
+
+  for ( int i = 0; i < GDB_REGISTER_COUNT; ++i )
+    reply += format_hex_uint32( inst.gdb->registers[ i ] );
+
+  gdb_send_packet( inst, reply );
+}
+
+
+static void gdb_write_registers_gprs_done ( jtag_dpi_instance & inst );
+
+static void gdb_write_registers ( jtag_dpi_instance & inst, const std::string & packet )
+{
+  size_t pos = 1;
+
+  for ( int i = 0; i < GDB_REGISTER_COUNT; ++i )
+  {
+    const size_t start_pos = pos;
+
+    inst.gdb->registers[ i ] = parse_hex_number( packet, pos, 8 );
+
+    if ( pos - start_pos != 8 )
+    {
+      throw std::runtime_error( "Malformed GDB register packet." );
+    }
+  }
+
+  inst.gdb->burst_words.assign( &inst.gdb->registers[ 0 ], &inst.gdb->registers[ OR1K_GPR_COUNT ] );
+
+  gdb_start_burst_write( inst, ADBG_MODULE_CPU0, 32, OR1K_SPR_GPR0, gdb_write_registers_gprs_done );
+}
+
+
+static void gdb_write_registers_gprs_done ( jtag_dpi_instance & inst )
+{
+  // The PPC is read only.
+  inst.gdb->burst_words.resize( 2 );
+  inst.gdb->burst_words[ 0 ] = inst.gdb->registers[ GDB_REG_NPC ];
+  inst.gdb->burst_words[ 1 ] = inst.gdb->registers[ GDB_REG_SR  ];
+
+  gdb_start_burst_write( inst, ADBG_MODULE_CPU0, 32, OR1K_SPR_NPC, gdb_reply_ok );
+}
+
+
+static void gdb_read_register_done ( jtag_dpi_instance & inst )
+{
+  gdb_send_packet( inst, format_hex_uint32( inst.gdb->burst_words[ 0 ] ) );
+}
+
+
+// ---- Memory
+//
+// Aligned words are transferred with 32-bit bursts, and the rest byte by byte.
+// OpenRISC is big endian.
+
+static void gdb_read_memory_chunk_done ( jtag_dpi_instance & inst );
+
+static void gdb_read_memory_next_chunk ( jtag_dpi_instance & inst )
+{
+  const uint32_t done_len  = uint32_t( inst.gdb->op_data.size() );
+  const uint32_t remaining = inst.gdb->op_length - done_len;
+  const uint32_t address   = inst.gdb->op_address + done_len;
+
+  if ( remaining == 0 )
+  {
+    std::string reply;
+
+    for ( size_t i = 0; i < inst.gdb->op_data.size(); ++i )
+      reply += format_hex_uint8( inst.gdb->op_data[ i ] );
+
+    gdb_send_packet( inst, reply );
+    return;
+  }
+
+  if ( address % 4 == 0 && remaining >= 4 )
+  {
+    gdb_start_burst_read( inst,
+                          ADBG_MODULE_WISHBONE, 32, address,
+                          std::min( remaining / 4, ADBG_MAX_BURST_WORD_COUNT ),
+                          gdb_read_memory_chunk_done );
+  }
+  else
+  {
+    gdb_start_burst_read( inst,
+                          ADBG_MODULE_WISHBONE, 8, address,
+                          std::min( remaining, 4 - address % 4 ),
+                          gdb_read_memory_chunk_done );
+  }
+}
+
+
+static void gdb_read_memory_chunk_done ( jtag_dpi_instance & inst )
+{
+  for ( size_t i = 0; i < inst.gdb->burst_words.size(); ++i )
+  {
+    const uint32_t word = inst.gdb->burst_words[ i ];
+
+    if ( inst.gdb->burst_word_bit_count == 8 )
+    {
+      inst.gdb->op_data.push_back( uint8_t( word ) );
+    }
+    else
+    {
+      inst.gdb->op_data.push_back( uint8_t( word >> 24 ) );
+      inst.gdb->op_data.push_back( uint8_t( word >> 16 ) );
+      inst.gdb->op_data.push_back( uint8_t( word >>  8 ) );
+      inst.gdb->op_data.push_back( uint8_t( word       ) );
+    }
+  }
+
+  gdb_read_memory_next_chunk( inst );
+}
+
+
+static void gdb_write_memory_next_chunk ( jtag_dpi_instance & inst )
+{
+  // The data already written is removed from the front of op_data.
+  const uint32_t remaining = uint32_t( inst.gdb->op_data.size() );
+  const uint32_t address   = inst.gdb->op_address;
+
+  if ( remaining == 0 )
+  {
+    gdb_reply_ok( inst );
+    return;
+  }
+
+  uint32_t byte_count;
+
+  inst.gdb->burst_words.clear();
+
+  if ( address % 4 == 0 && remaining >= 4 )
+  {
+    const uint32_t word_count = std::min( remaining / 4, ADBG_MAX_BURST_WORD_COUNT );
+
+    for ( uint32_t i = 0; i < word_count; ++i )
+    {
+      const uint8_t * const bytes = &inst.gdb->op_data[ i * 4 ];
+
+      inst.gdb->burst_words.push_back( uint32_t( bytes[0] ) << 24 |
+                                       uint32_t( bytes[1] ) << 16 |
+                                       uint32_t( bytes[2] ) <<  8 |
+                                       uint32_t( bytes[3] ) );
+    }
+
+    byte_count = word_count * 4;
+    gdb_start_burst_write( inst, ADBG_MODULE_WISHBONE, 32, address, gdb_write_memory_next_chunk );
+  }
+  else
+  {
+    byte_count = std::min( remaining, 4 - address % 4 );
+
+    inst.gdb->burst_words.assign( inst.gdb->op_data.begin(), inst.gdb->op_data.begin() + byte_count );
+    gdb_start_burst_write( inst, ADBG_MODULE_WISHBONE, 8, address, gdb_write_memory_next_chunk );
+  }
+
+  inst.gdb->op_data.erase( inst.gdb->op_data.begin(), inst.gdb->op_data.begin() + byte_count );
+  inst.gdb->op_address += byte_count;
+}
+
+
+// ---- Breakpoints
+//
+// Software breakpoints replace the instruction with l.trap.
+
+static void gdb_insert_breakpoint_read_done ( jtag_dpi_instance & inst )
+{
+  inst.gdb->breakpoints[ inst.gdb->op_address ] = inst.gdb->burst_words[ 0 ];
+
+  gdb_start_burst_write_word( inst, ADBG_MODULE_WISHBONE, inst.gdb->op_address, OR1K_TRAP_INSTRUCTION, gdb_reply_ok );
+}
+
+
+static void gdb_insert_breakpoint ( jtag_dpi_instance & inst )
+{
+  if ( inst.gdb->breakpoints.find( inst.gdb->op_address ) != inst.gdb->breakpoints.end() )
+  {
+    gdb_reply_ok( inst );
+    return;
+  }
+
+  gdb_start_burst_read( inst, ADBG_MODULE_WISHBONE, 32, inst.gdb->op_address, 1, gdb_insert_breakpoint_read_done );
+}
+
+
+static void gdb_remove_breakpoint ( jtag_dpi_instance & inst )
+{
+  const std::map< uint32_t, uint32_t >::iterator it = inst.gdb->breakpoints.find( inst.gdb->op_address );
+
+  if ( it == inst.gdb->breakpoints.end() )
+  {
+    gdb_reply_ok( inst );
+    return;
+  }
+
+  const uint32_t original_instruction = it->second;
+  inst.gdb->breakpoints.erase( it );
+
+  gdb_start_burst_write_word( inst, ADBG_MODULE_WISHBONE, inst.gdb->op_address, original_instruction, gdb_reply_ok );
+}
+
+
+// ---- Running the CPU
+
+static void gdb_resume_dmr1_written ( jtag_dpi_instance & inst );
+static void gdb_resume_drr_cleared ( jtag_dpi_instance & inst );
+static void gdb_resume_unstalled ( jtag_dpi_instance & inst );
+static void gdb_poll_cpu_status ( jtag_dpi_instance & inst );
+static void gdb_cpu_status_polled ( jtag_dpi_instance & inst );
+static void gdb_cpu_stopped ( jtag_dpi_instance & inst );
+static void gdb_cpu_stopped_drr_read ( jtag_dpi_instance & inst );
+static void gdb_cpu_stopped_ppc_read ( jtag_dpi_instance & inst );
+static void gdb_send_stop_reply ( jtag_dpi_instance & inst );
+
+static void gdb_resume_cpu ( jtag_dpi_instance & inst )
+{
+  gdb_start_burst_write_word( inst, ADBG_MODULE_CPU0, OR1K_SPR_DMR1, inst.gdb->is_stepping ? OR1K_DMR1_ST : 0, gdb_resume_dmr1_written );
+}
+
+
+static void gdb_resume_dmr1_written ( jtag_dpi_instance & inst )
+{
+  gdb_start_burst_write_word( inst, ADBG_MODULE_CPU0, OR1K_SPR_DRR, 0, gdb_resume_drr_cleared );
+}
+
+
+static void gdb_resume_drr_cleared ( jtag_dpi_instance & inst )
+{
+  gdb_start_cpu_status_write( inst, 0, gdb_resume_unstalled );
+}
+
+
+static void gdb_resume_unstalled ( jtag_dpi_instance & inst )
+{
+  inst.gdb->is_cpu_running = true;
+  inst.gdb->interrupt_requested = false;
+
+  gdb_set_continuation( inst, gdb_poll_cpu_status, inst.accept_poll_interval_tick_count );
+}
+
+
+static void gdb_poll_cpu_status ( jtag_dpi_instance & inst )
+{
+  gdb_start_cpu_status_read( inst, gdb_cpu_status_polled );
+}
+
+
+static void gdb_cpu_status_polled ( jtag_dpi_instance & inst )
+{
+  if ( gdb_get_cpu_status( inst ) & ADBG_CPU0_STATUS_STALL )
+  {
+    gdb_cpu_stopped( inst );
+  }
+  else if ( inst.gdb->interrupt_requested )
+  {
+    gdb_start_cpu_status_write( inst, ADBG_CPU0_STATUS_STALL, gdb_cpu_stopped );
+  }
+  else
+  {
+    gdb_set_continuation( inst, gdb_poll_cpu_status, inst.accept_poll_interval_tick_count );
+  }
+}
+
+
+static void gdb_cpu_stopped ( jtag_dpi_instance & inst )
+{
+  inst.gdb->is_cpu_running = false;
+
+  gdb_start_burst_read( inst, ADBG_MODULE_CPU0, 32, OR1K_SPR_DRR, 1, gdb_cpu_stopped_drr_read );
+}
+
+
+static void gdb_cpu_stopped_drr_read ( jtag_dpi_instance & inst )
+{
+  // After hitting a breakpoint, execution must resume at the l.trap address,
+  // where GDB will have restored the original instruction.
+  // After a single step, the trap comes after the instruction, so NPC is already right.
+
+  if ( ( inst.gdb->burst_words[ 0 ] & OR1K_DRR_TE ) != 0 && !inst.gdb->is_stepping )
+  {
+    gdb_start_burst_read( inst, ADBG_MODULE_CPU0, 32, OR1K_SPR_PPC, 1, gdb_cpu_stopped_ppc_read );
+    return;
+  }
+
+  gdb_send_stop_reply( inst );
+}
+
+
+static void gdb_cpu_stopped_ppc_read ( jtag_dpi_instance & inst )
+{
+  gdb_start_burst_write_word( inst, ADBG_MODULE_CPU0, OR1K_SPR_NPC, inst.gdb->burst_words[ 0 ], gdb_send_stop_reply );
+}
+
+
+static void gdb_send_stop_reply ( jtag_dpi_instance & inst )
+{
+  // SIGINT or SIGTRAP.
+  gdb_send_packet( inst, inst.gdb->interrupt_requested ? "S02" : "S05" );
+}
+
+
+static void gdb_continue ( jtag_dpi_instance & inst, const std::string & packet, const bool is_step )
+{
+  inst.gdb->is_stepping = is_step;
+
+  if ( packet.size() <= 1 )
+  {
+    gdb_resume_cpu( inst );
+    return;
+  }
+
+  // Resume at the given address.
+  size_t pos = 1;
+  const uint32_t address = parse_hex_number( packet, pos, 8 );
+
+  gdb_start_burst_write_word( inst, ADBG_MODULE_CPU0, OR1K_SPR_NPC, address, gdb_resume_cpu );
+}
+
+
+// ---- Packet processing
+
+static void gdb_process_packet ( jtag_dpi_instance & inst, const std::string & packet )
+{
+  if ( packet.empty() )
+  {
+    gdb_send_packet( inst, "" );
+    return;
+  }
+
+  size_t pos = 1;
+
+  switch ( packet[ 0 ] )
+  {
+  case '?':
+    gdb_send_packet( inst, "S05" );
+    break;
+
+  case 'g':
+    gdb_read_registers( inst );
+    break;
+
+  case 'G':
+    gdb_write_registers( inst, packet );
+    break;
+
+  case 'p':
+    inst.gdb->op_register_number = parse_hex_number( packet, pos, 8 );
+
+    // An empty reply tells GDB that the register is not available.
+    if ( !is_valid_gdb_register( inst.gdb->op_register_number ) )
+    {
+      gdb_send_packet( inst, "" );
+      break;
+    }
+
+    gdb_start_burst_read( inst, ADBG_MODULE_CPU0, 32, get_register_spr( inst.gdb->op_register_number ), 1, gdb_read_register_done );
+    break;
+
+  case 'P':
+    {
+      inst.gdb->op_register_number = parse_hex_number( packet, pos, 8 );
+      skip_packet_char( packet, pos, '=' );
+      const uint32_t value = parse_hex_number( packet, pos, 8 );
+
+      if ( !is_valid_gdb_register( inst.gdb->op_register_number ) )
+      {
+        gdb_send_packet( inst, "" );
+        break;
+      }
+
+      gdb_start_burst_write_word( inst, ADBG_MODULE_CPU0, get_register_spr( inst.gdb->op_register_number ), value, gdb_reply_ok );
+      break;
+    }
+
+  case 'm':
+    inst.gdb->op_address = parse_hex_number( packet, pos, 8 );
+    skip_packet_char( packet, pos, ',' );
+    inst.gdb->op_length = parse_hex_number( packet, pos, 8 );
+
+    // GDB accepts shorter answers.
+    inst.gdb->op_length = std::min( inst.gdb->op_length, uint32_t( GDB_MAX_PACKET_SIZE / 2 ) );
+    inst.gdb->op_data.clear();
+
+    gdb_read_memory_next_chunk( inst );
+    break;
+
+  case 'M':
+    {
+      inst.gdb->op_address = parse_hex_number( packet, pos, 8 );
+      skip_packet_char( packet, pos, ',' );
+      const uint32_t len = parse_hex_number( packet, pos, 8 );
+      skip_packet_char( packet, pos, ':' );
+
+      if ( packet.size() - pos != size_t( len ) * 2 )
+      {
+        throw std::runtime_error( "Malformed GDB memory write packet." );
+      }
+
+      inst.gdb->op_data.clear();
+
+      for ( uint32_t i = 0; i < len; ++i )
+        inst.gdb->op_data.push_back( uint8_t( parse_hex_number( packet, pos, 2 ) ) );
+
+      gdb_write_memory_next_chunk( inst );
+      break;
+    }
+
+  case 'c':
+    gdb_continue( inst, packet, false );
+    break;
+
+  case 's':
+    gdb_continue( inst, packet, true );
+    break;
+
+  case 'Z':
+  case 'z':
+    {
+      // Only software breakpoints are supported.
+      if ( packet.size() < 2 || packet[ 1 ] != '0' )
+      {
+        gdb_send_packet( inst, "" );
+        break;
+      }
+
+      pos = 2;
+      skip_packet_char( packet, pos, ',' );
+      inst.gdb->op_address = parse_hex_number( packet, pos, 8 );
+
+      if ( packet[ 0 ] == 'Z' )
+        gdb_insert_breakpoint( inst );
+      else
+        gdb_remove_breakpoint( inst );
+      break;
+    }
+
+  case 'D':
+    gdb_start_cleanup( inst, gdb_detach_done );
+    break;
+
+  case 'k':
+    // There is no reply. close_gdb_connection() restores the target after closing the connection.
+    inst.gdb->close_requested = true;
+    break;
+
+  case 'H':
+    gdb_reply_ok( inst );
+    break;
+
+  case 'q':
+    if ( packet.compare( 0, 10, "qSupported" ) == 0 )
+    {
+      char reply[ 32 ];
+      snprintf( reply, sizeof(reply), "PacketSize=%x", unsigned( GDB_MAX_PACKET_SIZE ) );
+      gdb_send_packet( inst, reply );
+    }
+    else if ( packet.compare( 0, 9, "qAttached" ) == 0 )
+    {
+      gdb_send_packet( inst, "1" );
+    }
+    else
+    {
+      gdb_send_packet( inst, "" );
+    }
+    break;
+
+  default:
+    // An empty reply means "not supported".
+    gdb_send_packet( inst, "" );
+    break;
+  }
+}
+
+
+// A failed request gets an error reply, but the session goes on.
+// The job that failed is abandoned. Its scans have all completed by then,
+// because errors are only raised before starting a job or when checking its results.
+
+static void gdb_fail_request ( jtag_dpi_instance & inst, const std::exception & e )
+{
+  fprintf( stderr,
+           "%sGDB request failed: %s\n",
+           ERROR_MSG_PREFIX_TICK,
+           e.what() );
+  fflush( stderr );
+
+  assert( !inst.gdb->is_scan_in_progress );
+  inst.gdb->scans.clear();
+  inst.gdb->continuation = NULL;
+
+  // If the CPU was running, the stall polling has stopped, so GDB must consider it stopped.
+  inst.gdb->is_cpu_running = false;
+
+  // There is no request to answer if attaching to the CPU failed.
+  if ( inst.gdb->is_reply_pending )
+    gdb_send_packet( inst, "E01" );
+}
+
+
+static void gdb_process_request ( jtag_dpi_instance & inst, const std::string & packet )
+{
+  inst.gdb->is_reply_pending = true;
+
+  try
+  {
+    gdb_process_packet( inst, packet );
+  }
+  catch ( const std::exception & e )
+  {
+    gdb_fail_request( inst, e );
+  }
+}
+
+
+// Processes complete packets, but only one at a time, because most of them start a JTAG job.
+
+static void gdb_process_received_data ( jtag_dpi_instance & inst )
+{
+  std::string & buffer = inst.gdb->receive_buffer;
+  size_t pos = 0;
+
+  while ( pos < buffer.size() && !is_gdb_job_pending( inst ) && !inst.gdb->close_requested )
+  {
+    const char c = buffer[ pos ];
+
+    if ( c == '-' )
+    {
+      // The last packet arrived corrupted.
+      inst.gdb->send_buffer += inst.gdb->last_packet;
+      ++pos;
+      continue;
+    }
+
+    if ( c != '$' )
+    {
+      // Acknowledgements, and interrupt requests while the CPU is already stopped.
+      ++pos;
+      continue;
+    }
+
+    const size_t hash_pos = buffer.find( '#', pos );
+
+    if ( hash_pos == std::string::npos || hash_pos + 2 >= buffer.size() )
+    {
+      if ( buffer.size() - pos > GDB_MAX_PACKET_SIZE + 4 )
+      {
+        throw std::runtime_error( "The GDB packet is too long." );
+      }
+
+      break;
+    }
+
+    const std::string packet = buffer.substr( pos + 1, hash_pos - pos - 1 );
+
+    uint8_t checksum = 0;
+
+    for ( size_t i = 0; i < packet.size(); ++i )
+      checksum = uint8_t( checksum + uint8_t( packet[ i ] ) );
+
+    const int checksum_high = parse_hex_digit( buffer[ hash_pos + 1 ] );
+    const int checksum_low  = parse_hex_digit( buffer[ hash_pos + 2 ] );
+
+    pos = hash_pos + 3;
+
+    if ( checksum_high == -1 || checksum_low == -1 ||
+         checksum != ( checksum_high << 4 | checksum_low ) )
+    {
+      inst.gdb->send_buffer += "-";
+      continue;
+    }
+
+    inst.gdb->send_buffer += "+";
+
+    gdb_process_request( inst, packet );
+  }
+
+  buffer.erase( 0, pos );
+}
+
+
+// ---- Connection handling
+
+static void close_gdb_connection ( jtag_dpi_instance & inst )
+{
+  assert( is_gdb_connection_open( inst ) );
+
+  close_a( inst.gdb->connection_socket );
+  inst.gdb->connection_socket = -1;
+
+  // Abandon any job in progress, but let its scans complete. A job never leaves adv_dbg_if
+  // in the middle of a burst, but stopping half-way could, and then the next scans
+  // would be taken as burst data.
+  inst.gdb->continuation = NULL;
+
+  if ( inst.print_informational_messages )
+  {
+    printf( "%sThe GDB connection has been closed.\n", INFO_MSG_PREFIX );
+    fflush( stdout );
+  }
+
+  if ( inst.gdb->is_target_attached )
+  {
+    if ( inst.print_informational_messages )
+    {
+      printf( "%sRemoving %u breakpoint(s) left by GDB and resuming the CPU.\n",
               INFO_MSG_PREFIX,
-              addr_str.c_str(),
-              ntohs( remoteAddr.sin_port ) );
+              unsigned( inst.gdb->breakpoints.size() ) );
       fflush( stdout );
     }
+
+    gdb_start_cleanup( inst, gdb_cleanup_after_close_done );
+  }
+  else
+  {
+    inst.gdb->is_cpu_running = false;
+    inst.gdb->breakpoints.clear();
+  }
+}
+
+
+static void accept_gdb_connection ( jtag_dpi_instance & inst )
+{
+  sockaddr_in remoteAddr;
+  socklen_t remoteAddrLen = sizeof( remoteAddr );
+
+  const int connectionSocket = accept4_eintr( inst.gdb->listening_socket,
+                                              (sockaddr *) &remoteAddr,
+                                              &remoteAddrLen,
+                                              SOCK_NONBLOCK | SOCK_CLOEXEC );
+
+  if ( connectionSocket == -1 )
+  {
+    if ( errno == EAGAIN || errno == EWOULDBLOCK )
+      return;
+
+    // GDB can try to reconnect at a later point in time.
+    fprintf( stderr,
+             "%s%s\n",
+             ERROR_MSG_PREFIX_TICK,
+             get_error_message( "Error accepting a GDB connection: ", errno ).c_str() );
+    fflush( stderr );
+    return;
+  }
+
+  // The acknowledgement and the reply to each packet are sent separately. With Nagle's algorithm,
+  // the reply would wait for GDB's delayed acknowledgement of the first one, for every packet.
+  const int set_to_yes = 1;
+  if ( setsockopt( connectionSocket, IPPROTO_TCP, TCP_NODELAY, &set_to_yes, sizeof(set_to_yes) ) == -1 )
+  {
+    fprintf( stderr,
+             "%s%s\n",
+             ERROR_MSG_PREFIX_TICK,
+             get_error_message( "Error disabling Nagle's algorithm on the GDB connection: ", errno ).c_str() );
+    fflush( stderr );
+    close_a( connectionSocket );
+    return;
+  }
+
+  if ( inst.print_informational_messages )
+  {
+    const std::string addr_str = ip_address_to_text( &remoteAddr.sin_addr );
+
+    printf( "%sAccepted a GDB connection from IP address %s, TCP port %d.\n",
+            INFO_MSG_PREFIX,
+            addr_str.c_str(),
+            ntohs( remoteAddr.sin_port ) );
+    fflush( stdout );
+  }
+
+  inst.gdb->connection_socket = connectionSocket;
+  inst.gdb->receive_buffer.clear();
+  inst.gdb->send_buffer.clear();
+  inst.gdb->last_packet.clear();
+  inst.gdb->close_requested = false;
+  inst.gdb->is_reply_pending = false;
+  inst.gdb->interrupt_requested = false;
+
+  // A JTAG client may have used the TAP in the meantime.
+  inst.gdb->is_debug_ir_selected = false;
+
+  inst.gdb->is_cpu_running     = false;
+  inst.gdb->is_stepping        = false;
+  inst.gdb->is_target_attached = true;
+  inst.gdb->breakpoints.clear();
+
+  gdb_start_cpu_status_write( inst, ADBG_CPU0_STATUS_STALL, gdb_attach_stalled );
+}
+
+
+// Returns false if the connection was closed at the other end.
+
+static bool receive_gdb_data ( jtag_dpi_instance & inst )
+{
+  for ( ; ; )
+  {
+    char buffer[ 4096 ];
+
+    const ssize_t received_byte_count = recv_eintr( inst.gdb->connection_socket, buffer, sizeof(buffer), 0 );
+
+    if ( received_byte_count == -1 )
+    {
+      if ( errno == EAGAIN || errno == EWOULDBLOCK )
+        return true;
+
+      throw std::runtime_error( get_error_message( "Error receiving GDB data: ", errno ) );
+    }
+
+    if ( received_byte_count == 0 )
+      return false;
+
+    inst.gdb->receive_buffer.append( buffer, received_byte_count );
+  }
+}
+
+
+static void flush_gdb_send_buffer ( jtag_dpi_instance & inst )
+{
+  while ( !inst.gdb->send_buffer.empty() )
+  {
+    const ssize_t sent_byte_count = send_eintr( inst.gdb->connection_socket,
+                                                inst.gdb->send_buffer.data(),
+                                                inst.gdb->send_buffer.size(),
+                                                MSG_NOSIGNAL );
+    if ( sent_byte_count == -1 )
+    {
+      if ( errno == EAGAIN || errno == EWOULDBLOCK )
+        return;
+
+      throw std::runtime_error( get_error_message( "Error sending GDB data: ", errno ) );
+    }
+
+    inst.gdb->send_buffer.erase( 0, sent_byte_count );
+  }
+}
+
+
+static void run_gdb_job ( jtag_dpi_instance & inst,
+                          unsigned char * const jtag_tms,
+                          unsigned char * const jtag_tck,
+                          unsigned char * const jtag_trst,
+                          unsigned char * const jtag_tdi,
+                          unsigned char * const jtag_new_data_available,
+                          const unsigned char jtag_tdo )
+{
+  while ( !inst.gdb->scans.empty() )
+  {
+    vector_scan & scan = inst.gdb->scans.front();
+
+    if ( !inst.gdb->is_scan_in_progress )
+    {
+      prepare_vector_scan_execution( scan );
+      inst.gdb->is_scan_in_progress = true;
+    }
+
+    if ( !advance_vector_scan( inst,
+                               scan,
+                               jtag_tms,
+                               jtag_tck,
+                               jtag_trst,
+                               jtag_tdi,
+                               jtag_new_data_available,
+                               jtag_tdo ) )
+    {
+      return;
+    }
+
+    if ( scan.capture_tdo )
+    {
+      inst.gdb->captured_tdo.swap( scan.tdo );
+    }
+
+    inst.gdb->scans.pop_front();
+    inst.gdb->is_scan_in_progress = false;
+  }
+
+  if ( inst.gdb->continuation == NULL )
+    return;
+
+  if ( inst.gdb->continuation_delay_tick_count > 0 )
+  {
+    --inst.gdb->continuation_delay_tick_count;
+    return;
+  }
+
+  const gdb_continuation_t continuation = inst.gdb->continuation;
+  inst.gdb->continuation = NULL;
+
+  continuation( inst );
+}
+
+
+static void serve_gdb ( jtag_dpi_instance & inst,
+                        unsigned char * const jtag_tms,
+                        unsigned char * const jtag_tck,
+                        unsigned char * const jtag_trst,
+                        unsigned char * const jtag_tdi,
+                        unsigned char * const jtag_new_data_available,
+                        const unsigned char jtag_tdo )
+{
+  if ( is_gdb_cleanup_pending( inst ) )
+  {
+    try
+    {
+      run_gdb_job( inst,
+                   jtag_tms,
+                   jtag_tck,
+                   jtag_trst,
+                   jtag_tdi,
+                   jtag_new_data_available,
+                   jtag_tdo );
+    }
+    catch ( const std::exception & e )
+    {
+      fprintf( stderr,
+               "%sCannot remove the breakpoints left by GDB and resume the CPU: %s\n",
+               ERROR_MSG_PREFIX_TICK,
+               e.what() );
+      fflush( stderr );
+
+      inst.gdb->scans.clear();
+      inst.gdb->is_scan_in_progress = false;
+      inst.gdb->continuation = NULL;
+      inst.gdb->is_cpu_running = false;
+      inst.gdb->is_target_attached = false;
+      inst.gdb->breakpoints.clear();
+    }
+
+    return;
+  }
+
+  if ( !is_gdb_connection_open( inst ) )
+  {
+    // Only one client at a time can drive the JTAG pins.
+    if ( is_connection_open( inst ) || --inst.gdb->poll_countdown > 0 )
+      return;
+
+    inst.gdb->poll_countdown = inst.accept_poll_interval_tick_count;
+
+    accept_gdb_connection( inst );
+    return;
+  }
+
+  try
+  {
+    try
+    {
+      run_gdb_job( inst,
+                   jtag_tms,
+                   jtag_tck,
+                   jtag_trst,
+                   jtag_tdi,
+                   jtag_new_data_available,
+                   jtag_tdo );
+    }
+    catch ( const std::exception & e )
+    {
+      gdb_fail_request( inst, e );
+    }
+
+    // The socket is only checked now and then, like the listening socket,
+    // because GDB waits for each answer anyway.
+    if ( --inst.gdb->poll_countdown <= 0 )
+    {
+      inst.gdb->poll_countdown = inst.accept_poll_interval_tick_count;
+
+      if ( !receive_gdb_data( inst ) )
+      {
+        close_gdb_connection( inst );
+        return;
+      }
+
+      if ( inst.gdb->is_cpu_running )
+      {
+        const size_t interrupt_pos = inst.gdb->receive_buffer.find( GDB_INTERRUPT_CHAR );
+
+        if ( interrupt_pos != std::string::npos )
+        {
+          inst.gdb->receive_buffer.erase( interrupt_pos, 1 );
+          inst.gdb->interrupt_requested = true;
+        }
+      }
+    }
+
+    if ( !is_gdb_job_pending( inst ) )
+    {
+      gdb_process_received_data( inst );
+    }
+
+    flush_gdb_send_buffer( inst );
+
+    if ( inst.gdb->close_requested && inst.gdb->send_buffer.empty() && !is_gdb_job_pending( inst ) )
+    {
+      close_gdb_connection( inst );
+    }
+  }
+  catch ( const std::exception & e )
+  {
+    fprintf( stderr,
+             "%sGDB connection closed after error: %s\n",
+             ERROR_MSG_PREFIX_TICK,
+             e.what() );
+    fflush( stderr );
+
+    close_gdb_connection( inst );
+  }
+}
+
+
+// Reads the next record into replay_next_tick and replay_next_event.
+// Returns false at the end of the log.
+
+static bool read_log_record ( jtag_dpi_instance & inst )
+{
+  uint64_t tick_delta = 0;
+
+  for ( unsigned shift = 0; ; shift += 7 )
+  {
+    const int c = getc( inst.replay_file );
+
+    if ( c == EOF )
+    {
+      if ( ferror( inst.replay_file ) )
+        throw std::runtime_error( get_error_message( "Error reading the session log file: ", errno ) );
+
+      if ( shift == 0 )
+        return false;
+
+      throw std::runtime_error( "The session log file is truncated." );
+    }
+
+    if ( shift > 63 )
+      throw std::runtime_error( "The session log file is corrupt." );
+
+    tick_delta |= uint64_t( c & 0x7F ) << shift;
+
+    if ( 0 == ( c & 0x80 ) )
+      break;
+  }
+
+  const int event = getc( inst.replay_file );
+
+  if ( event == EOF )
+    throw std::runtime_error( "The session log file is truncated." );
+
+  if ( event > ( LOG_EVENT_TDO_SAMPLE | 1 ) )
+    throw std::runtime_error( "The session log file is corrupt." );
+
+  inst.replay_next_tick += tick_delta;
+  inst.replay_next_event = uint8_t( event );
+
+  return true;
+}
+
+
+static void open_replay_file ( jtag_dpi_instance & inst, const char * const filename )
+{
+  inst.replay_file = fopen( filename, "rb" );
+
+  if ( inst.replay_file == NULL )
+  {
+    throw std::runtime_error( get_error_message( ( std::string( "Error opening session log file \"" ) + filename + "\": " ).c_str(), errno ) );
+  }
+
+  char magic[ sizeof( SESSION_LOG_MAGIC ) - 1 ];
+
+  if ( fread( magic, 1, sizeof( magic ), inst.replay_file ) != sizeof( magic ) ||
+       0 != memcmp( magic, SESSION_LOG_MAGIC, sizeof( magic ) ) )
+  {
+    throw std::runtime_error( std::string( "File \"" ) + filename + "\" is not a JTAG DPI session log." );
+  }
+
+  inst.replay_next_tick = 0;
+  inst.replay_finished  = !read_log_record( inst );
+}
+
+
+static void open_record_file ( jtag_dpi_instance & inst, const char * const filename )
+{
+  inst.record_file = fopen( filename, "wb" );
+
+  if ( inst.record_file == NULL )
+  {
+    throw std::runtime_error( get_error_message( ( std::string( "Error opening session log file \"" ) + filename + "\": " ).c_str(), errno ) );
+  }
+
+  if ( fwrite( SESSION_LOG_MAGIC, 1, sizeof( SESSION_LOG_MAGIC ) - 1, inst.record_file ) != sizeof( SESSION_LOG_MAGIC ) - 1 )
+  {
+    throw std::runtime_error( get_error_message( "Error writing to the session log file: ", errno ) );
+  }
+
+  inst.last_record_tick = 0;
+}
+
+
+// Moves the records from the ring to the stdio buffer. Returns the number of records moved.
+
+static size_t drain_trace_ring ( trace_writer_data & trace )
+{
+  const uint32_t tail = trace.tail.load( std::memory_order_relaxed );
+  const uint32_t head = trace.head.load( std::memory_order_acquire );
+
+  // Stop now and then, so that the simulation thread gets ring slots back while a long backlog is written.
+  const uint32_t record_count = std::min( head - tail, trace_writer_data::RING_CAPACITY / 4 );
+
+  uint8_t buffer[ 256 * TRACE_RECORD_LEN ];
+  size_t  buffer_len = 0;
+
+  for ( uint32_t i = 0; i < record_count; ++i )
+  {
+    const trace_record & record = trace.ring[ ( tail + i ) & ( trace_writer_data::RING_CAPACITY - 1 ) ];
+    uint8_t * const dest = &buffer[ buffer_len ];
+
+    for ( int j = 0; j < 8; ++j )
+      dest[ j ] = uint8_t( record.tick >> ( 8 * j ) );
+
+    dest[  8 ] = record.event;
+    dest[  9 ] = record.pins;
+    dest[ 10 ] = record.tdo;
+    dest[ 11 ] = 0;
+
+    for ( int j = 0; j < 4; ++j )
+      dest[ 12 + j ] = uint8_t( record.argument >> ( 8 * j ) );
+
+    buffer_len += TRACE_RECORD_LEN;
+
+    if ( buffer_len == sizeof( buffer ) || i + 1 == record_count )
+    {
+      if ( fwrite( buffer, 1, buffer_len, trace.file ) != buffer_len )
+      {
+        throw std::runtime_error( get_error_message( ( "Error writing to trace file \"" + trace.file_name + "\": " ).c_str(), errno ) );
+      }
+
+      buffer_len = 0;
+    }
+  }
+
+  trace.tail.store( tail + record_count, std::memory_order_release );
+
+  return record_count;
+}
+
+
+static void trace_writer_main ( trace_writer_data * const trace )
+{
+  try
+  {
+    bool has_unflushed_data = false;
+
+    for ( ; ; )
+    {
+      // Check first, so that the records logged before the stop request are always written.
+      const bool stop_requested = trace->stop_requested.load( std::memory_order_acquire );
+
+      if ( drain_trace_ring( *trace ) != 0 )
+      {
+        has_unflushed_data = true;
+        continue;
+      }
+
+      // Flushing when the ring runs empty keeps the file up to date, in case the simulation gets killed,
+      // and the cost of the system call falls on this thread.
+      if ( has_unflushed_data )
+      {
+        if ( fflush( trace->file ) != 0 )
+        {
+          throw std::runtime_error( get_error_message( ( "Error writing to trace file \"" + trace->file_name + "\": " ).c_str(), errno ) );
+        }
+
+        has_unflushed_data = false;
+      }
+
+      if ( stop_requested )
+        break;
+
+      // The simulation thread does not signal new records, as that would cost it a system call.
+      // Polling every millisecond keeps up with a 64K-record ring at tens of millions of records per second.
+      std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+    }
+  }
+  catch ( const std::exception & e )
+  {
+    trace->error_msg = e.what();
+    trace->failed.store( true, std::memory_order_release );
+  }
+}
+
+
+static void start_trace_writer ( jtag_dpi_instance & inst, const char * const filename )
+{
+  trace_writer_data * const trace = new trace_writer_data();
+  trace->file_name = filename;
+
+  trace->file = fopen( filename, "wb" );
+
+  if ( trace->file == NULL )
+  {
+    delete trace;
+    throw std::runtime_error( get_error_message( ( std::string( "Error opening trace file \"" ) + filename + "\": " ).c_str(), errno ) );
+  }
+
+  inst.trace = trace;
+
+  if ( fwrite( TRACE_FILE_MAGIC, 1, sizeof( TRACE_FILE_MAGIC ) - 1, trace->file ) != sizeof( TRACE_FILE_MAGIC ) - 1 )
+  {
+    throw std::runtime_error( get_error_message( "Error writing to the trace file: ", errno ) );
+  }
+
+  trace->stop_requested.store( false, std::memory_order_relaxed );
+  trace->failed.store( false, std::memory_order_relaxed );
+  trace->head.store( 0, std::memory_order_relaxed );
+  trace->tail.store( 0, std::memory_order_relaxed );
+  trace->pending_dropped_record_count = 0;
+  trace->record_count = 0;
+  trace->dropped_record_count = 0;
+
+  inst.trace_pins = 0;
+
+  trace->thread = std::thread( trace_writer_main, trace );
+}
+
+
+// Writes all records still in the ring and closes the trace file. Errors are printed, as there is
+// nobody left to report them to. Also used to clean up after a failed start_trace_writer().
+
+static void stop_trace_writer ( jtag_dpi_instance & inst )
+{
+  trace_writer_data * const trace = inst.trace;
+  inst.trace = NULL;
+
+  if ( trace->thread.joinable() )
+  {
+    trace->stop_requested.store( true, std::memory_order_release );
+    trace->thread.join();
+  }
+
+  bool success = true;
+
+  // Note the records dropped at the very end too. The writer thread has emptied the ring,
+  // and it has finished, so this thread can drain the ring itself.
+  if ( !trace->failed.load( std::memory_order_acquire ) && trace->pending_dropped_record_count != 0 )
+  {
+    const uint32_t head = trace->head.load( std::memory_order_relaxed );
+
+    trace_record & dropped = trace->ring[ head & ( trace_writer_data::RING_CAPACITY - 1 ) ];
+    dropped.tick     = inst.tick_count;
+    dropped.event    = TRACE_EVENT_RECORDS_DROPPED;
+    dropped.pins     = inst.trace_pins;
+    dropped.tdo      = 0;
+    dropped.argument = trace->pending_dropped_record_count;
+
+    trace->head.store( head + 1, std::memory_order_relaxed );
+    ++trace->record_count;
+
+    try
+    {
+      drain_trace_ring( *trace );
+    }
+    catch ( const std::exception & e )
+    {
+      trace->error_msg = e.what();
+      trace->failed.store( true, std::memory_order_relaxed );
+    }
+  }
+
+  if ( trace->failed.load( std::memory_order_acquire ) )
+  {
+    fprintf( stderr, "%s%s\n", ERROR_MSG_PREFIX_TICK, trace->error_msg.c_str() );
+    success = false;
+  }
+
+  if ( fclose( trace->file ) != 0 && success )
+  {
+    const std::string msg = get_error_message( "Error closing the trace file: ", errno );
+    fprintf( stderr, "%s%s\n", ERROR_MSG_PREFIX_TICK, msg.c_str() );
+    success = false;
+  }
+
+  if ( success && ( inst.print_informational_messages || trace->dropped_record_count != 0 ) )
+  {
+    printf( "%sTrace file %s: %llu records written, %llu dropped because the writer thread fell behind.\n",
+            INFO_MSG_PREFIX,
+            trace->file_name.c_str(),
+            (unsigned long long) trace->record_count,
+            (unsigned long long) trace->dropped_record_count );
+    fflush( stdout );
+  }
+
+  fflush( stderr );
+
+  delete trace;
+}
+
+
+static void print_replay_summary ( jtag_dpi_instance & inst )
+{
+  if ( inst.print_informational_messages || inst.replay_divergence_count != 0 )
+  {
+    printf( "%sReplay %s at tick %llu: %llu pin updates, %llu TDO samples, %llu divergences.\n",
+            INFO_MSG_PREFIX,
+            inst.replay_finished ? "finished" : "stopped before the end of the session log",
+            (unsigned long long) inst.tick_count,
+            (unsigned long long) inst.replay_pin_update_count,
+            (unsigned long long) inst.replay_tdo_sample_count,
+            (unsigned long long) inst.replay_divergence_count );
+    fflush( stdout );
+  }
+}
+
+
+// Applies all recorded events that fall on the current tick. The recorded TDO samples
+// are compared against the current TDO value, which is what the client got back then.
+
+static void replay_tick ( jtag_dpi_instance & inst,
+                          unsigned char * const jtag_tms,
+                          unsigned char * const jtag_tck,
+                          unsigned char * const jtag_trst,
+                          unsigned char * const jtag_tdi,
+                          unsigned char * const jtag_new_data_available,
+                          const unsigned char jtag_tdo )
+{
+  while ( !inst.replay_finished && inst.replay_next_tick == inst.tick_count )
+  {
+    const uint8_t event = inst.replay_next_event;
+
+    if ( event & LOG_EVENT_TDO_SAMPLE )
+    {
+      ++inst.replay_tdo_sample_count;
+
+      const unsigned expected_tdo = event & 1;
+
+      if ( expected_tdo != ( jtag_tdo ? 1u : 0u ) )
+      {
+        ++inst.replay_divergence_count;
+
+        if ( inst.replay_divergence_count <= MAX_REPORTED_REPLAY_DIVERGENCES )
+        {
+          fprintf( stderr,
+                   "%sReplay divergence at tick %llu: the recorded TDO value was %u, but now it is %u.\n",
+                   ERROR_MSG_PREFIX_TICK,
+                   (unsigned long long) inst.tick_count,
+                   expected_tdo,
+                   1 - expected_tdo );
+          fflush( stderr );
+        }
+      }
+    }
+    else
+    {
+      ++inst.replay_pin_update_count;
+
+      apply_jtag_data_byte( inst,
+                            event,
+                            jtag_tms,
+                            jtag_tck,
+                            jtag_trst,
+                            jtag_tdi,
+                            jtag_new_data_available );
+    }
+
+    if ( !read_log_record( inst ) )
+    {
+      inst.replay_finished = true;
+      print_replay_summary( inst );
+    }
+  }
+}
+
+
+// Throws if the handle does not belong to a live instance.
+
+static jtag_dpi_instance & get_instance ( void * const instance_handle )
+{
+  const uintptr_t index = reinterpret_cast< uintptr_t >( instance_handle ) - 1;
+
+  // On x86, these atomic loads are plain memory reads.
+  jtag_dpi_instance * const instance = instance_handle != NULL && index < s_instance_count.load( std::memory_order_acquire )
+                                         ? s_instances[ index ].load( std::memory_order_acquire )
+                                         : NULL;
+  if ( instance == NULL )
+  {
+    throw std::runtime_error( "Invalid JTAG DPI instance handle." );
+  }
+
+  return *instance;
+}
+
+
+// The I/O thread, if any, must have stopped already.
+
+static void delete_instance ( jtag_dpi_instance * const instance )
+{
+  if ( instance == NULL )
+    return;
+
+  if ( instance->record_file != NULL )
+    fclose( instance->record_file );
+
+  if ( instance->replay_file != NULL )
+    fclose( instance->replay_file );
+
+  if ( instance->trace != NULL )
+    stop_trace_writer( *instance );
+
+  // This also closes any connection sockets that a pending io_uring request still holds on to.
+  destroy_uring( *instance );
+
+  delete instance->io_thread;
+  delete instance->gdb;
+  delete instance;
+}
+
+
+// Initialises the runtime state of a new instance, whose configuration fields have already been set.
+
+static void init_instance_state ( jtag_dpi_instance & inst )
+{
+  inst.bound_tcp_port = 0;
+  inst.listeningSocket = -1;
+  inst.listening_message_already_printed = false;
+  inst.connectionSocket = -1;
+  inst.connectionState = cs_invalid;
+  inst.io_thread = NULL;
+  inst.uring = NULL;
+  inst.shm_area = NULL;
+  inst.shm_doorbell_fd = -1;
+  memset( &inst.stats, 0, sizeof( inst.stats ) );
+  memset( &inst.total_stats, 0, sizeof( inst.total_stats ) );
+  inst.tick_count = 0;
+  inst.last_client_command_tick = 0;
+  inst.pending_idle_tick_count = 0;
+  inst.is_extending_pin_batch = false;
+  inst.pin_batch_length = 0;
+  inst.deferred_tdo_sample_count = 0;
+  inst.is_finish_requested = false;
+
+  if ( inst.gdb_tcp_port != 0 )
+  {
+    inst.gdb = new gdb_server_data();
+    inst.gdb->listening_socket  = -1;
+    inst.gdb->connection_socket = -1;
+    inst.gdb->poll_countdown    = 0;
+  }
+
+  reset_tap_state_tracking( inst );
+}
+
+
+// Creates the listening sockets and, in IO_MODE_THREAD mode, starts the I/O thread.
+// In IO_MODE_URING mode, it creates the io_uring instance first.
+// The caller must hold s_instance_table_mutex.
+
+static void open_instance_sockets ( jtag_dpi_instance & inst )
+{
+  if ( inst.io_mode == IO_MODE_URING )
+  {
+    try
+    {
+      setup_uring( inst );
+    }
+    catch ( const std::exception & e )
+    {
+      // Containers and hardened systems often forbid io_uring, and older kernels lack some of the features needed.
+      if ( inst.print_informational_messages )
+      {
+        printf( "%sio_uring is not available, falling back to IO_MODE_POLL: %s\n", INFO_MSG_PREFIX, e.what() );
+        fflush( stdout );
+      }
+
+      inst.io_mode = IO_MODE_POLL;
+    }
+  }
+
+  if ( inst.io_mode == IO_MODE_POLL && s_epoll_fd == -1 )
+  {
+    s_epoll_fd = epoll_create1( EPOLL_CLOEXEC );
+
+    if ( s_epoll_fd == -1 )
+    {
+      throw std::runtime_error( get_error_message( "Error creating the epoll set: ", errno ) );
+    }
+  }
+
+  // Create the listening socket here even in IO_MODE_THREAD mode,
+  // so that errors like "address already in use" are reported during initialisation.
+  create_listening_socket( inst );
+
+  try
+  {
+    if ( inst.gdb_tcp_port != 0 )
+    {
+      uint16_t gdb_tcp_port = inst.gdb_tcp_port;
+      inst.gdb->listening_socket = open_listening_socket( inst, &gdb_tcp_port, " for GDB", true );
+    }
+
+    if ( inst.io_mode == IO_MODE_THREAD )
+    {
+      start_io_thread( inst );
+    }
+  }
+  catch ( ... )
+  {
+    close_listening_socket( inst );
+
+    if ( inst.gdb != NULL && inst.gdb->listening_socket != -1 )
+    {
+      close_a( inst.gdb->listening_socket );
+      inst.gdb->listening_socket = -1;
+    }
+
+    throw;
+  }
+}
+
+
+void * jtag_dpi_init ( const int tcp_port,
+                       const unsigned char listen_on_local_addr_only,
+                       const int jtag_tck_half_period_tick_count,
+                       const unsigned char print_informational_messages,
+                       const int io_mode,
+                       const int accept_poll_interval_tick_count,
+                       const int gdb_tcp_port,
+                       const int transport,
+                       const int socket_protocol,
+                       const char * const unix_socket_path,
+                       const char * const record_file_name,
+                       const char * const replay_file_name,
+                       const char * const trace_file_name,
+                       const char * const port_file_name )
+{
+  jtag_dpi_instance * instance = NULL;
+
+  try
+  {
+    // With Verilator's --threads, the initial blocks of several instances might run in parallel.
+    std::lock_guard< std::mutex > lock( s_instance_table_mutex );
+
+    const uint32_t instance_count = s_instance_count.load( std::memory_order_relaxed );
+
+    if ( instance_count == MAX_INSTANCE_COUNT )
+    {
+      throw std::runtime_error( "Too many JTAG DPI instances." );
+    }
+
+    instance = new jtag_dpi_instance();
+    jtag_dpi_instance & inst = *instance;
+
+    inst.index = instance_count;
+
+    const bool is_recording = record_file_name != NULL && record_file_name[0] != '\0';
+    const bool is_replaying = replay_file_name != NULL && replay_file_name[0] != '\0';
+
+    if ( is_recording && is_replaying )
+    {
+      throw std::runtime_error( "Recording and replaying a session at the same time is not supported." );
+    }
+
+
+    switch ( transport )
+    {
+    case TRANSPORT_TCP:
+    case TRANSPORT_UNIX:
+    case TRANSPORT_SHM:
+      inst.transport = transport_enum( transport );
+      break;
+
+    default:
+      throw std::runtime_error( "Invalid transport parameter." );
+    }
+
+
+    switch ( socket_protocol )
+    {
+    case SOCKET_PROTOCOL_ADV_JTAG_BRIDGE:
+    case SOCKET_PROTOCOL_JTAG_VPI:
+      inst.socket_protocol = socket_protocol_enum( socket_protocol );
+      break;
+
+    default:
+      throw std::runtime_error( "Invalid socket_protocol parameter." );
+    }
+
+
+    // The listening port or path is not used in replay mode.
+    if ( is_replaying )
+    {
+      inst.listening_tcp_port = 0;
+    }
+    else if ( inst.transport == TRANSPORT_TCP )
+    {
+      if ( tcp_port < 0 || tcp_port > 0xFFFF )
+      {
+        throw std::runtime_error( "Invalid TCP port." );
+      }
+
+      inst.listening_tcp_port = uint16_t( tcp_port );
+    }
+    else
+    {
+      if ( unix_socket_path == NULL ||
+           unix_socket_path[0] == '\0' ||
+           strlen( unix_socket_path ) >= sizeof( sockaddr_un().sun_path ) )
+      {
+        throw std::runtime_error( "Invalid unix_socket_path parameter." );
+      }
+
+      inst.listening_tcp_port = 0;
+      inst.unix_socket_path = unix_socket_path;
+    }
+
+
+    switch ( print_informational_messages )
+    {
+    case 0:
+      inst.print_informational_messages = false;
+      break;
+
+    case 1:
+      inst.print_informational_messages = true;
+      break;
+
+    default:
+      throw std::runtime_error( "Invalid print_informational_messages parameter." );
+    }
+
+
+    switch ( listen_on_local_addr_only )
+    {
+    case 0:
+      inst.listen_on_local_addr_only = false;
+      break;
+
+    case 1:
+      inst.listen_on_local_addr_only = true;
+      break;
+
+    default:
+      throw std::runtime_error( "Invalid listen_on_local_addr_only parameter." );
+    }
+
+
+    if ( jtag_tck_half_period_tick_count == 0 )
+    {
+      throw std::runtime_error( "Invalid jtag_tck_half_period_tick_count parameter." );
+    }
+
+    inst.jtag_tck_half_period_tick_count = jtag_tck_half_period_tick_count;
+
+
+    switch ( io_mode )
+    {
+    case IO_MODE_POLL:
+    case IO_MODE_THREAD:
+    case IO_MODE_URING:
+      inst.io_mode = io_mode_enum( io_mode );
+      break;
+
+    default:
+      throw std::runtime_error( "Invalid io_mode parameter." );
+    }
+
+    // The simulation thread accesses the shared-memory rings directly, so there is nothing for an I/O thread to do.
+    if ( inst.transport == TRANSPORT_SHM && inst.io_mode != IO_MODE_POLL )
+    {
+      throw std::runtime_error( "The shared-memory transport needs io_mode IO_MODE_POLL." );
+    }
+
+
+    if ( accept_poll_interval_tick_count <= 0 )
+    {
+      throw std::runtime_error( "Invalid accept_poll_interval_tick_count parameter." );
+    }
+
+    inst.accept_poll_interval_tick_count = accept_poll_interval_tick_count;
+    inst.accept_poll_countdown = 0;
+
+
+    if ( gdb_tcp_port < 0 || gdb_tcp_port > 0xFFFF || ( gdb_tcp_port != 0 && gdb_tcp_port == inst.listening_tcp_port ) )
+    {
+      throw std::runtime_error( "Invalid gdb_tcp_port parameter." );
+    }
+
+    inst.gdb_tcp_port = uint16_t( gdb_tcp_port );
+
+
+    if ( is_replaying && inst.gdb_tcp_port != 0 )
+    {
+      throw std::runtime_error( "The GDB server cannot be used in replay mode." );
+    }
+
+
+    if ( port_file_name != NULL && port_file_name[0] != '\0' && !is_replaying )
+    {
+      if ( inst.transport != TRANSPORT_TCP )
+      {
+        throw std::runtime_error( "A port file is only available with transport TRANSPORT_TCP." );
+      }
+
+      inst.port_file_name = port_file_name;
+
+      // A port file left behind by an earlier run would point a waiting script to the wrong port.
+      if ( unlink( port_file_name ) != 0 && errno != ENOENT )
+      {
+        throw std::runtime_error( get_error_message( ( std::string( "Error removing the old port file \"" ) + port_file_name + "\": " ).c_str(), errno ) );
+      }
+    }
+
+
+    init_instance_state( inst );
+
+    if ( is_replaying )
+    {
+      // There is no client in replay mode, so no sockets and no I/O thread either.
+      inst.io_mode = IO_MODE_POLL;
+
+      open_replay_file( inst, replay_file_name );
+
+      if ( inst.print_informational_messages )
+      {
+        printf( "%sReplaying session log %s.\n", INFO_MSG_PREFIX, replay_file_name );
+        fflush( stdout );
+      }
+    }
+    else if ( is_recording )
+    {
+      open_record_file( inst, record_file_name );
+    }
+
+    if ( trace_file_name != NULL && trace_file_name[0] != '\0' )
+    {
+      start_trace_writer( inst, trace_file_name );
+    }
+
+    if ( !is_replaying )
+    {
+      open_instance_sockets( inst );
+    }
+
+    s_instances[ inst.index ].store( instance, std::memory_order_release );
+    s_instance_count.store( inst.index + 1, std::memory_order_release );
+  }
+  catch ( const std::exception & e )
+  {
+    // We should return this error string to the caller,
+    // but Verilog does not have good support for variable-length strings.
+    fprintf( stderr, "%s%s\n", ERROR_MSG_PREFIX_INIT, e.what() );
+    fflush( stderr );
+    delete_instance( instance );
+    return NULL;
+  }
+  catch ( ... )
+  {
+    fprintf( stderr, "%sUnexpected C++ exception.\n", ERROR_MSG_PREFIX_INIT );
+    fflush( stderr );
+    delete_instance( instance );
+    return NULL;
+  }
+
+  return reinterpret_cast< void * >( uintptr_t( instance->index ) + 1 );
+}
+
+
+static void tick_instance ( jtag_dpi_instance & inst,
+                            unsigned char * const jtag_tms,
+                            unsigned char * const jtag_tck,
+                            unsigned char * const jtag_trst,
+                            unsigned char * const jtag_tdi,
+                            unsigned char * const jtag_new_data_available,
+                            const unsigned char jtag_tdo )
+{
+  ++inst.tick_count;
+
+  if ( inst.clock_notification_counter > 0 )
+    --inst.clock_notification_counter;
+
+  if ( inst.replay_file != NULL )
+  {
+    replay_tick( inst,
+                 jtag_tms,
+                 jtag_tck,
+                 jtag_trst,
+                 jtag_tdi,
+                 jtag_new_data_available,
+                 jtag_tdo );
+    return;
+  }
+
+  if ( inst.gdb_tcp_port != 0 )
+  {
+    serve_gdb( inst,
+               jtag_tms,
+               jtag_tck,
+               jtag_trst,
+               jtag_tdi,
+               jtag_new_data_available,
+               jtag_tdo );
+  }
+
+  if ( is_gdb_connection_open( inst ) || is_gdb_cleanup_pending( inst ) )
+  {
+    // Any JTAG client must wait until the GDB session is over.
+  }
+  else if ( inst.io_mode == IO_MODE_THREAD )
+  {
+    check_io_thread( inst );
+  }
+  else if ( inst.io_mode == IO_MODE_URING )
+  {
+    if ( inst.connectionSocket == -1 )
+    {
+      check_uring_accept( inst );
+    }
+  }
+  else if ( inst.connectionSocket == -1 && --inst.accept_poll_countdown <= 0 )
+  {
+    inst.accept_poll_countdown = inst.accept_poll_interval_tick_count;
+
+    // If a connection is lost, the listening socket must be created again.
+
+    if ( inst.listeningSocket == -1 )
+    {
+      create_listening_socket( inst );
+    }
+
+    accept_connection( inst, inst.stats.syscalls, inst.stats.empty_syscalls );
+
+    if ( inst.connectionSocket != -1 )
+    {
+      inst.connectionState = cs_waiting_to_receive_commands;
+      reset_connection_buffers( inst );
+      start_connection_statistics( inst );
+
+      if ( inst.transport == TRANSPORT_SHM )
+        start_shm_session( inst );
+      else
+        add_connection_socket_to_epoll_set( inst );
+    }
+  }
+
+  if ( is_connection_open( inst ) )
+  {
+    serve_connection( inst,
+                      jtag_tms,
+                      jtag_tck,
+                      jtag_trst,
+                      jtag_tdi,
+                      jtag_new_data_available,
+                      jtag_tdo );
+  }
+}
+
+
+// Any change on the JTAG pins, any connection opening or closing and any pre-roll in progress
+// counts as activity. See jtag_dpi_enable_activity_tracking().
+
+static void track_activity ( jtag_dpi_instance & inst, const bool have_pins_changed )
+{
+  const bool is_link_open = is_connection_open( inst ) || is_gdb_connection_open( inst ) || is_gdb_cleanup_pending( inst );
+
+  if ( have_pins_changed || is_link_open != inst.was_link_open || inst.activity_pre_roll_countdown != 0 )
+  {
+    inst.was_link_open      = is_link_open;
+    inst.last_activity_tick = inst.tick_count;
+    s_activity_count.fetch_add( 1, std::memory_order_relaxed );
+  }
+}
+
+
+// Runs a single tick, and takes care of tick profiling and activity tracking.
+
+static void run_tick ( jtag_dpi_instance & inst,
+                       unsigned char * const jtag_tms,
+                       unsigned char * const jtag_tck,
+                       unsigned char * const jtag_trst,
+                       unsigned char * const jtag_tdi,
+                       unsigned char * const jtag_new_data_available,
+                       const unsigned char jtag_tdo )
+{
+  *jtag_new_data_available = 0;
+
+  if ( s_is_tick_profiling_enabled.load( std::memory_order_relaxed ) && --inst.tick_profiling_countdown <= 0 )
+  {
+    inst.tick_profiling_countdown = TICK_PROFILING_SAMPLE_INTERVAL;
+
+    const std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+
+    tick_instance( inst,
+                   jtag_tms,
+                   jtag_tck,
+                   jtag_trst,
+                   jtag_tdi,
+                   jtag_new_data_available,
+                   jtag_tdo );
+
+    const uint64_t duration_ns = uint64_t( std::chrono::duration_cast< std::chrono::nanoseconds >(
+                                             std::chrono::steady_clock::now() - start_time ).count() );
+
+    if ( duration_ns > s_clock_read_overhead_ns )
+      inst.sampled_tick_time_ns += duration_ns - s_clock_read_overhead_ns;
+  }
+  else
+  {
+    tick_instance( inst,
+                   jtag_tms,
+                   jtag_tck,
+                   jtag_trst,
+                   jtag_tdi,
+                   jtag_new_data_available,
+                   jtag_tdo );
+  }
+
+  if ( s_is_activity_tracking_enabled.load( std::memory_order_relaxed ) )
+  {
+    track_activity( inst, *jtag_new_data_available != 0 );
+  }
+}
+
+
+int jtag_dpi_tick ( void * const instance_handle,
+                    unsigned char * const jtag_tms,
+                    unsigned char * const jtag_tck,
+                    unsigned char * const jtag_trst,
+                    unsigned char * const jtag_tdi,
+                    unsigned char * const jtag_new_data_available,
+                    const unsigned char jtag_tdo )
+{
+  try
+  {
+    *jtag_new_data_available = 0;
+
+    jtag_dpi_instance & inst = get_instance( instance_handle );
+
+    run_tick( inst,
+              jtag_tms,
+              jtag_tck,
+              jtag_trst,
+              jtag_tdi,
+              jtag_new_data_available,
+              jtag_tdo );
+
+    if ( inst.is_finish_requested )
+      return RET_FINISH_REQUESTED;
   }
   catch ( const std::exception & e )
   {
-    fprintf( stderr,
-             "%sError accepting a connection on the listening socket: %s\n",
-             ERROR_MSG_PREFIX_TICK,
-             e.what() );
+    fprintf( stderr, "%s%s\n", ERROR_MSG_PREFIX_TICK, e.what() );
+    fflush( stderr );
+    return RET_FAILURE;
+  }
+  catch ( ... )
+  {
+    fprintf( stderr, "%sUnexpected C++ exception.\n", ERROR_MSG_PREFIX_TICK );
     fflush( stderr );
+    return RET_FAILURE;
+  }
 
-    if ( connectionSocket != -1 )
+  return RET_SUCCESS;
+}
+
+
+// Accounts for ticks during which the RTL did not call jtag_dpi_tick_batch(). get_idle_tick_count()
+// only lets the RTL skip ticks on which tick_instance() would have done nothing but count them,
+// so this routine just does the counting in one go.
+
+static void skip_ticks ( jtag_dpi_instance & inst, const uint32_t tick_count )
+{
+  if ( tick_count == 0 )
+    return;
+
+  inst.tick_count += tick_count;
+
+  inst.clock_notification_counter -= int( std::min( uint32_t( inst.clock_notification_counter ), tick_count ) );
+
+  if ( is_connection_open( inst ) )
+  {
+    inst.stats.connected_ticks += tick_count;
+
+    if ( inst.connectionState == cs_waiting_to_send_clock_notification )
+      inst.stats.ticks_waiting_for_clock_notification += tick_count;
+
+    // get_idle_tick_count() never skips the tick on which the next attempt starts.
+    if ( inst.connectionState == cs_waiting_between_tdo_polls )
+      inst.tdo_wait_countdown -= tick_count;
+
+    if ( inst.shm_area != NULL )
+      inst.shm_close_check_countdown -= int( tick_count );
+  }
+  else if ( inst.io_mode == IO_MODE_POLL && inst.connectionSocket == -1 )
+  {
+    inst.accept_poll_countdown -= int( tick_count );
+  }
+}
+
+
+// Returns how many ticks the RTL can skip before calling jtag_dpi_tick_batch() again.
+// The JTAG pins only change on a tick where clock_notification_counter reaches zero, or when
+// a client command arrives. A command that arrives during the skipped ticks gets processed
+// up to a TCK half period later, which is no different from the client sending it that much later.
+
+static uint32_t get_idle_tick_count ( jtag_dpi_instance & inst )
+{
+  // The GDB server and replay mode have per-tick logic of their own, and the pre-roll wait counts ticks.
+  if ( inst.replay_file != NULL || inst.gdb_tcp_port != 0 || inst.activity_pre_roll_countdown != 0 )
+    return 0;
+
+  int idle_tick_count;
+
+  if ( !is_connection_open( inst ) )
+  {
+    if ( inst.io_mode != IO_MODE_POLL )
+      idle_tick_count = inst.accept_poll_interval_tick_count - 1;
+    else
+      idle_tick_count = inst.accept_poll_countdown - 1;
+  }
+  else
+  {
+    switch ( inst.connectionState )
     {
-      close_a( connectionSocket );
+    case cs_streaming:
+      if ( inst.clock_notification_counter != 0 )
+      {
+        idle_tick_count = inst.clock_notification_counter - 1;
+        break;
+      }
+
+      if ( is_send_buffer_full( inst ) )
+      {
+        idle_tick_count = 0;
+        break;
+      }
+
+      // The stream has run dry, so wait for more data like below.
+
+      // Fall through.
+
+    case cs_waiting_to_receive_commands:
+    case cs_receiving_command_payload:
+      idle_tick_count = is_input_pending( inst ) ? 0 : inst.jtag_tck_half_period_tick_count - 1;
+      break;
+
+    case cs_waiting_to_send_clock_notification:
+    case cs_executing_vector_scan:
+      // The next data byte or reply waits for the end of the current half period anyway.
+      idle_tick_count = inst.clock_notification_counter - 1;
+      break;
+
+    case cs_waiting_between_tdo_polls:
+      // Check for client data as often as while waiting for commands, so that the client can cancel the wait.
+      if ( is_input_pending( inst ) )
+        idle_tick_count = 0;
+      else
+        idle_tick_count = int( std::min( inst.tdo_wait_countdown, uint64_t( inst.jtag_tck_half_period_tick_count ) ) ) - 1;
+      break;
+
+    default:
+      idle_tick_count = 0;
+      break;
     }
 
+    if ( inst.shm_area != NULL )
+      idle_tick_count = std::min( idle_tick_count, inst.shm_close_check_countdown - 1 );
+  }
+
+  return uint32_t( std::max( idle_tick_count, 0 ) );
+}
+
+
+static uint8_t pack_jtag_data_byte ( const unsigned char jtag_tms,
+                                     const unsigned char jtag_tck,
+                                     const unsigned char jtag_trst,
+                                     const unsigned char jtag_tdi )
+{
+  return uint8_t( ( jtag_tck  ? JTAG_TCK_BIT  : 0 ) |
+                  ( jtag_trst ? JTAG_TRST_BIT : 0 ) |
+                  ( jtag_tdi  ? JTAG_TDI_BIT  : 0 ) |
+                  ( jtag_tms  ? JTAG_TMS_BIT  : 0 ) );
+}
+
+
+// A vector scan knows its next data bytes in advance, so it can hand several of them over at once.
+// This routine advances the instance to the end of each half period, as if the RTL
+// had called on that tick, and adds the next data byte to the batch. The TDO values sampled
+// at those points are only known on the next call, see deferred_tdo_sample.
+
+static void extend_pin_batch ( jtag_dpi_instance & inst, uint32_t * const pin_batch )
+{
+  // Recording writes the TDO samples in tick order, so it needs each value straight away.
+  if ( inst.record_file != NULL ||
+       inst.gdb_tcp_port != 0 ||
+       inst.activity_pre_roll_countdown != 0 ||
+       !is_connection_open( inst ) ||
+       inst.connectionState != cs_executing_vector_scan )
+  {
     return;
   }
 
-  s_connectionSocket = connectionSocket;
-  s_connectionState  = cs_waiting_to_receive_commands;
+  vector_scan & scan = inst.client_vector_scan;
+
+  inst.is_extending_pin_batch = true;
+
+  while ( inst.pin_batch_length < PIN_BATCH_MAX_LENGTH )
+  {
+    // The scan must complete on a real call, because its reply needs the last TDO value.
+    const uint32_t next_bit = scan.tck_is_high ? scan.next_bit + 1 : scan.next_bit;
+
+    if ( next_bit >= scan.bit_count )
+      break;
+
+    skip_ticks( inst, uint32_t( inst.clock_notification_counter ) );
+
+    unsigned char jtag_tms, jtag_tck, jtag_trst, jtag_tdi;
+    unsigned char jtag_new_data_available = 0;
+
+    advance_vector_scan( inst,
+                         scan,
+                         &jtag_tms,
+                         &jtag_tck,
+                         &jtag_trst,
+                         &jtag_tdi,
+                         &jtag_new_data_available,
+                         0 );  // Not used, the TDO value is deferred.
+
+    assert( jtag_new_data_available );
+
+    *pin_batch |= uint32_t( pack_jtag_data_byte( jtag_tms, jtag_tck, jtag_trst, jtag_tdi ) ) << ( 4 * inst.pin_batch_length );
+    ++inst.pin_batch_length;
+  }
+
+  inst.is_extending_pin_batch = false;
+}
+
+
+static void store_deferred_tdo_samples ( jtag_dpi_instance & inst, const uint32_t tdo_history )
+{
+  for ( int i = 0; i < inst.deferred_tdo_sample_count; ++i )
+  {
+    const deferred_tdo_sample & sample = inst.deferred_tdo_samples[ i ];
+
+    store_tdo_sample( inst,
+                      *sample.scan,
+                      sample.tdo_bit,
+                      ( tdo_history >> sample.history_bit ) & 1,
+                      sample.tick );
+  }
+
+  inst.deferred_tdo_sample_count = 0;
+}
+
+
+// Alternative to jtag_dpi_tick() that does not need to be called on every tick, see jtag_dpi.v.
+//
+// pin_batch holds pin_batch_length JTAG data bytes (0 to PIN_BATCH_MAX_LENGTH), 4 bits each,
+// with the first one in the lowest bits. The RTL applies the first one straight away and each
+// of the others jtag_tck_half_period_tick_count ticks after the previous one, but first it
+// samples TDO into tdo_history for the next call: bit 0 just before applying the second data byte, and so on.
+// The next call must take place exactly idle_tick_count + 1 ticks after this one,
+// and idle_tick_count always covers the whole batch.
+
+int jtag_dpi_tick_batch ( void * const instance_handle,
+                          const int tdo_history,
+                          const unsigned char jtag_tdo,
+                          int * const pin_batch,
+                          int * const pin_batch_length,
+                          int * const idle_tick_count )
+{
+  try
+  {
+    *pin_batch        = 0;
+    *pin_batch_length = 0;
+    *idle_tick_count  = 0;
+
+    jtag_dpi_instance & inst = get_instance( instance_handle );
+
+    store_deferred_tdo_samples( inst, uint32_t( tdo_history ) );
+
+    skip_ticks( inst, inst.pending_idle_tick_count );
+
+    unsigned char jtag_tms, jtag_tck, jtag_trst, jtag_tdi, jtag_new_data_available;
+
+    run_tick( inst,
+              &jtag_tms,
+              &jtag_tck,
+              &jtag_trst,
+              &jtag_tdi,
+              &jtag_new_data_available,
+              jtag_tdo );
+
+    uint32_t batch = 0;
+    inst.pin_batch_length = 0;
+
+    if ( jtag_new_data_available )
+    {
+      batch = pack_jtag_data_byte( jtag_tms, jtag_tck, jtag_trst, jtag_tdi );
+      inst.pin_batch_length = 1;
+
+      extend_pin_batch( inst, &batch );
+    }
+
+    inst.pending_idle_tick_count = get_idle_tick_count( inst );
+
+    *pin_batch        = int( batch );
+    *pin_batch_length = inst.pin_batch_length;
+    *idle_tick_count  = int( std::max( inst.pin_batch_length - 1, 0 ) * inst.jtag_tck_half_period_tick_count +
+                             inst.pending_idle_tick_count );
+
+    if ( inst.is_finish_requested )
+      return RET_FINISH_REQUESTED;
+  }
+  catch ( const std::exception & e )
+  {
+    fprintf( stderr, "%s%s\n", ERROR_MSG_PREFIX_TICK, e.what() );
+    fflush( stderr );
+    return RET_FAILURE;
+  }
+  catch ( ... )
+  {
+    fprintf( stderr, "%sUnexpected C++ exception.\n", ERROR_MSG_PREFIX_TICK );
+    fflush( stderr );
+    return RET_FAILURE;
+  }
+
+  return RET_SUCCESS;
+}
+
+
+void jtag_dpi_terminate ( void * const instance_handle )
+{
+  try
+  {
+    // Verilator runs the final blocks after the last eval(), so no other instance is ticking now.
+    // Otherwise, its poll of the shared epoll set could still be touching this instance.
+    std::lock_guard< std::mutex > lock( s_instance_table_mutex );
+
+    jtag_dpi_instance & inst = get_instance( instance_handle );
+
+    if ( inst.io_mode == IO_MODE_THREAD )
+    {
+      // Stop the I/O thread first, so that nothing else is running while the statistics are gathered.
+      // After this call, the sockets belong to this thread again.
+      stop_io_thread( inst );
+    }
+
+    if ( is_connection_open( inst ) )
+    {
+      end_connection_statistics( inst );
+    }
+
+    add_statistics( inst.total_stats, inst.stats );
+
+    if ( inst.print_informational_messages && inst.total_stats.connection_count != 0 )
+    {
+      print_statistics( "Statistics for all connections", inst.total_stats );
+
+      if ( inst.io_mode == IO_MODE_THREAD )
+      {
+        printf( "%s  The I/O thread made %llu system calls while waiting for connections, %llu of which found none.\n",
+                INFO_MSG_PREFIX,
+                (unsigned long long) inst.io_thread->accept_syscalls,
+                (unsigned long long) inst.io_thread->accept_empty_syscalls );
+        fflush( stdout );
+      }
+    }
+
+    if ( inst.replay_file != NULL && !inst.replay_finished )
+    {
+      print_replay_summary( inst );
+    }
+
+    if ( inst.record_file != NULL )
+    {
+      const int res = fclose( inst.record_file );
+      inst.record_file = NULL;
+
+      if ( res != 0 )
+      {
+        const std::string msg = get_error_message( "Error closing the session log file: ", errno );
+        fprintf( stderr, "%s%s\n", ERROR_MSG_PREFIX_TICK, msg.c_str() );
+        fflush( stderr );
+      }
+    }
+
+    if ( inst.trace != NULL )
+    {
+      stop_trace_writer( inst );
+    }
+
+    if ( inst.io_mode == IO_MODE_THREAD )
+    {
+      inst.io_thread->is_connection_open = false;
+    }
+
+    if ( inst.listeningSocket != -1 )
+    {
+      close_listening_socket( inst );
+    }
+
+    if ( inst.connectionSocket != -1 )
+    {
+      close_shm_session( inst );
+
+      // Closing the socket also removes it from the epoll set.
+      close_a( inst.connectionSocket );
+      inst.connectionSocket = -1;
+    }
+
+    if ( inst.transport != TRANSPORT_TCP && inst.replay_file == NULL )
+    {
+      // Do not leave the socket file behind. Errors do not matter here,
+      // as the next simulation run removes any stale socket file anyway.
+      unlink( inst.unix_socket_path.c_str() );
+    }
+
+    if ( is_gdb_connection_open( inst ) )
+    {
+      // The simulation is ending, so there is no point in restoring the target.
+      inst.gdb->is_target_attached = false;
+      close_gdb_connection( inst );
+    }
+
+    if ( inst.gdb != NULL && inst.gdb->listening_socket != -1 )
+    {
+      close_a( inst.gdb->listening_socket );
+      inst.gdb->listening_socket = -1;
+    }
+
+    s_terminated_instances_tick_time_ns += inst.sampled_tick_time_ns * TICK_PROFILING_SAMPLE_INTERVAL;
+
+    s_instances[ inst.index ].store( NULL, std::memory_order_release );
+    delete_instance( &inst );
+
+    bool is_any_instance_left = false;
+
+    for ( uint32_t i = 0; i < s_instance_count.load( std::memory_order_relaxed ); ++i )
+    {
+      if ( s_instances[ i ].load( std::memory_order_relaxed ) != NULL )
+        is_any_instance_left = true;
+    }
+
+    if ( s_epoll_fd != -1 && !is_any_instance_left )
+    {
+      close_a( s_epoll_fd );
+      s_epoll_fd = -1;
+    }
+  }
+  catch ( const std::exception & e )
+  {
+    // The user shouldn't call this routine if the module was not initialised,
+    // although it does not really matter very much.
+    assert( false );
+    fprintf( stderr, "%s%s\n", ERROR_MSG_PREFIX_TICK, e.what() );
+    fflush( stderr );
+  }
+}
+
+
+// The following routines are not DPI functions, but are meant for the simulation's main program,
+// see verilator_main.cpp for an example. They must not be called while the model is being evaluated.
+
+// After calling this routine, jtag_dpi_tick() measures how long it takes, see TICK_PROFILING_SAMPLE_INTERVAL.
+
+void jtag_dpi_enable_tick_profiling ( void )
+{
+  // An idle tick takes just a few nanoseconds, which is less than reading the clock twice.
+  // The shortest time measured between two consecutive clock reads is a good estimate
+  // of how much the measurement itself adds to each sample.
+  uint64_t min_ns = std::numeric_limits< uint64_t >::max();
+
+  for ( int i = 0; i < 1000; ++i )
+  {
+    const std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+
+    const uint64_t ns = uint64_t( std::chrono::duration_cast< std::chrono::nanoseconds >(
+                                    std::chrono::steady_clock::now() - start_time ).count() );
+    min_ns = std::min( min_ns, ns );
+  }
+
+  s_clock_read_overhead_ns = min_ns;
 
-  // If somebody else attempts to connect, he should get an error straight away.
-  // However, if the listening socket is still active, the client will land in the accept queue
-  // and he'll hopefully time-out eventually.
-  close_listening_socket();
+  s_is_tick_profiling_enabled.store( true, std::memory_order_relaxed );
 }
 
 
-static void receive_commands ( unsigned char * const jtag_tms,
-                               unsigned char * const jtag_tck,
-                               unsigned char * const jtag_trst,
-                               unsigned char * const jtag_tdi,
-                               unsigned char * const jtag_new_data_available,
-                               const unsigned char   jtag_tdo )
+// Returns an estimate of the total time that all instances have spent inside jtag_dpi_tick()
+// since jtag_dpi_enable_tick_profiling() was called.
+
+uint64_t jtag_dpi_get_tick_time_ns ( void )
 {
-  for ( ; ; )
+  std::lock_guard< std::mutex > lock( s_instance_table_mutex );
+
+  uint64_t sampled_tick_time_ns = 0;
+
+  for ( uint32_t i = 0; i < s_instance_count.load( std::memory_order_relaxed ); ++i )
   {
-    uint8_t received_data;
+    const jtag_dpi_instance * const inst = s_instances[ i ].load( std::memory_order_acquire );
 
-    const ssize_t received_byte_count = recv_eintr( s_connectionSocket,
-                                                    &received_data,
-                                                    1, // Receive just 1 byte.
-                                                    0  // No special flags.
-                                                    );
-    if ( received_byte_count == 0 )
-    {
-      if ( s_print_informational_messages )
-      {
-        printf( "%sConnection closed at the other end.\n", INFO_MSG_PREFIX );
-        fflush( stdout );
-      }
-      close_current_connection();
-      break;
-    }
+    if ( inst != NULL )
+      sampled_tick_time_ns += inst->sampled_tick_time_ns;
+  }
 
+  return s_terminated_instances_tick_time_ns + sampled_tick_time_ns * TICK_PROFILING_SAMPLE_INTERVAL;
+}
 
-    if ( received_byte_count == -1 )
-    {
-      if ( errno == EAGAIN || errno == EWOULDBLOCK )
-      {
-        // No data available yet.
-        break;
-      }
 
-      throw std::runtime_error( get_error_message( "Error receiving data: ", errno ) );
-    }
+// Meant for waveform tracing that only runs while there is JTAG activity, see verilator_main.cpp.
+// Call this routine before the model is evaluated for the first time.
+//
+// A trace can only start when the main program learns about the activity, but the interesting part
+// is often what leads up to it. Therefore, when a client sends data after being idle for more than
+// idle_tick_count ticks, this module waits pre_roll_tick_count ticks before acting upon it,
+// and that wait counts as activity too. The client just sees a slower reply.
+// The main program should stop tracing after idle_tick_count ticks without activity.
 
-    assert( received_byte_count == 1 );
+void jtag_dpi_enable_activity_tracking ( const uint64_t pre_roll_tick_count, const uint64_t idle_tick_count )
+{
+  s_activity_pre_roll_tick_count = pre_roll_tick_count;
+  s_activity_idle_tick_count     = idle_tick_count;
 
-    if ( received_data & 0x80 )
-    {
-      if ( s_print_informational_messages )
-      {
-        // printf( "%sReceived JTAG command: 0x%02X\n", INFO_MSG_PREFIX, received_data );
-        // fflush( stdout );
-      }
+  s_is_activity_tracking_enabled.store( true, std::memory_order_relaxed );
+}
 
-      switch ( received_data )
-      {
-      case 0x80:
-        send_byte( jtag_tdo ? 1 : 0 );
-        break;
 
-      case 0x81:
-        if ( s_clock_notification_counter == 0 )
-        {
-          send_byte( CLOCK_NOTIFICATION_MSG );
-        }
-        else
-        {
-          s_connectionState = cs_waiting_to_send_clock_notification;
-        }
-        break;
+// Returns a counter that increases on every tick with activity in any instance.
 
-      default:
-        {
-          char buffer[80];
-          if ( int(sizeof(buffer)) <= sprintf( buffer, "Invalid command 0x%02X received.", received_data ) )
-          {
-            assert( false );
-          }
+uint64_t jtag_dpi_get_activity_count ( void )
+{
+  return s_activity_count.load( std::memory_order_relaxed );
+}
 
-          throw std::runtime_error( buffer );
-        }
-      }
 
-      // We don't process new commands until the notification is due.
-      // We could decide otherwise, but the current client does not need it,
-      // so keep things simple.
-      if ( s_connectionState == cs_waiting_to_send_clock_notification )
-        break;
-    }
-    else
-    {
-      if ( 0 != ( received_data & 0xf0 ) )
-      {
-        char buffer[80];
-        if ( int(sizeof(buffer)) <= sprintf( buffer, "Invalid JTAG data byte 0x%02X received.", received_data ) )
-        {
-          assert( false );
-        }
-        throw std::runtime_error( buffer );
-      }
+// Provides the routine behind the backdoor memory commands (CMD_BACKDOOR_WRITE and CMD_BACKDOOR_READ).
+// Call it before the model is evaluated for the first time, see verilator_main.cpp for an example.
+//
+// The routine reads or writes byte_count bytes at the given address, normally in a Verilator public
+// memory array, and returns false if the address range is not backed by simulated memory.
+// It gets called during a tick, and in a multithreaded simulation, different instances may call it
+// at the same time. If the routine is not set, the commands always fail, and CMD_QUERY_EXTENSIONS
+// does not report EXT_BACKDOOR_MEMORY.
 
-      *jtag_tck  = ( received_data & 0x01 ) ? 1 : 0;
-      *jtag_trst = ( received_data & 0x02 ) ? 1 : 0;
-      *jtag_tdi  = ( received_data & 0x04 ) ? 1 : 0;
-      *jtag_tms  = ( received_data & 0x08 ) ? 1 : 0;
+void jtag_dpi_set_backdoor_memory_access ( const jtag_dpi_backdoor_memory_access_fn access_fn, void * const context )
+{
+  s_backdoor_memory_access         = access_fn;
+  s_backdoor_memory_access_context = context;
+}
 
-      *jtag_new_data_available = 1;
 
-      if ( s_print_informational_messages )
-      {
-        /*
-        printf( "%sReceived JTAG data 0x%02X, TCK: %d, TMS: %d, TDI: %d, TRST: %d.\n",
-                INFO_MSG_PREFIX,
-                received_data,
-                *jtag_tck,
-                *jtag_tms,
-                *jtag_tdi,
-                *jtag_trst );
-        fflush( stdout );
-        */
-      }
+static void append_checkpoint_uint ( std::vector< uint8_t > & data, const uint64_t value, const int byte_count )
+{
+  for ( int i = 0; i < byte_count; ++i )
+    data.push_back( uint8_t( value >> ( 8 * i ) ) );
+}
 
-      // Acknowledge the received data.
-      send_byte( received_data | 0x10 );
 
-      s_clock_notification_counter = s_jtag_tck_half_period_tick_count;
-    }
-  }
+static void append_checkpoint_string ( std::vector< uint8_t > & data, const std::string & str )
+{
+  append_checkpoint_uint( data, str.size(), 4 );
+  data.insert( data.end(), str.begin(), str.end() );
 }
 
 
-static void serve_connection ( unsigned char * const jtag_tms,
-                               unsigned char * const jtag_tck,
-                               unsigned char * const jtag_trst,
-                               unsigned char * const jtag_tdi,
-                               unsigned char * const jtag_new_data_available,
-                               const unsigned char jtag_tdo )
+class checkpoint_reader
 {
-  assert( s_connectionSocket != -1 );
+public:
+  checkpoint_reader ( const std::vector< uint8_t > & data )
+    : data( data )
+    , pos( 0 )
+  {
+  }
 
-  try
+  uint64_t get_uint ( const int byte_count )
   {
-    if ( s_clock_notification_counter > 0 )
-      --s_clock_notification_counter;
+    check_available( size_t( byte_count ) );
 
-    switch ( s_connectionState )
-    {
-    case cs_waiting_to_receive_commands:
-      receive_commands( jtag_tms,
-                        jtag_tck,
-                        jtag_trst,
-                        jtag_tdi,
-                        jtag_new_data_available,
-                        jtag_tdo );
-      break;
+    uint64_t value = 0;
 
-    case cs_waiting_to_send_clock_notification:
+    for ( int i = 0; i < byte_count; ++i )
+      value |= uint64_t( data[ pos++ ] ) << ( 8 * i );
 
-      if ( s_clock_notification_counter == 0 )
-      {
-        send_byte( CLOCK_NOTIFICATION_MSG );
-        s_connectionState = cs_waiting_to_receive_commands;
+    return value;
+  }
 
-        // In case there are already commands on the receive queue, process them right away.
-        receive_commands( jtag_tms,
-                          jtag_tck,
-                          jtag_trst,
-                          jtag_tdi,
-                          jtag_new_data_available,
-                          jtag_tdo );
-      }
-      break;
+  std::string get_string ( void )
+  {
+    const size_t len = size_t( get_uint( 4 ) );
+    check_available( len );
 
-    default:
-      assert( false );
-    }
+    const std::string str( data.begin() + pos, data.begin() + pos + len );
+    pos += len;
+    return str;
   }
-  catch ( const std::exception & e )
+
+  bool is_at_end ( void ) const { return pos == data.size(); }
+
+private:
+  const std::vector< uint8_t > & data;
+  size_t pos;
+
+  void check_available ( const size_t len ) const
   {
-    fprintf( stderr,
-             "%sConnection closed after error: %s\n",
-             ERROR_MSG_PREFIX_TICK,
-             e.what() );
-    fflush( stderr );
+    if ( data.size() - pos < len )
+      throw std::runtime_error( "The checkpoint data is truncated." );
+  }
+};
 
-    // Close the connection. The remote client can reconnect later.
-    close_current_connection();
+
+static void append_instance_checkpoint ( std::vector< uint8_t > & data, jtag_dpi_instance & inst )
+{
+  if ( inst.record_file != NULL || inst.replay_file != NULL )
+  {
+    throw std::runtime_error( "Checkpoints are not supported while recording or replaying a session log." );
+  }
+
+  // The configuration, as passed to jtag_dpi_init().
+  append_checkpoint_uint  ( data, inst.transport, 1 );
+  append_checkpoint_uint  ( data, inst.socket_protocol, 1 );
+  append_checkpoint_uint  ( data, inst.listening_tcp_port, 2 );
+  append_checkpoint_string( data, inst.port_file_name );
+  append_checkpoint_string( data, inst.unix_socket_path );
+  append_checkpoint_uint  ( data, inst.listen_on_local_addr_only ? 1 : 0, 1 );
+  append_checkpoint_uint  ( data, inst.print_informational_messages ? 1 : 0, 1 );
+  append_checkpoint_uint  ( data, uint32_t( inst.jtag_tck_half_period_tick_count ), 4 );
+  append_checkpoint_uint  ( data, inst.io_mode, 1 );
+  append_checkpoint_uint  ( data, uint32_t( inst.accept_poll_interval_tick_count ), 4 );
+  append_checkpoint_uint  ( data, inst.gdb_tcp_port, 2 );
+  append_checkpoint_string( data, inst.trace != NULL ? inst.trace->file_name : std::string() );
+
+  // The connection itself cannot be saved, only whether there was one.
+  append_checkpoint_uint( data, is_connection_open( inst ) || is_gdb_connection_open( inst ) || is_gdb_cleanup_pending( inst ) ? 1 : 0, 1 );
+
+  append_checkpoint_uint( data, uint32_t( inst.clock_notification_counter ), 4 );
+  append_checkpoint_uint( data, inst.tap_state, 1 );
+  append_checkpoint_uint( data, inst.tap_tck_level ? 1 : 0, 1 );
+  append_checkpoint_uint( data, uint32_t( inst.tap_consecutive_tms_high_count ), 4 );
+  append_checkpoint_uint( data, inst.tick_count, 8 );
+
+  // The RTL is skipping these ticks, see jtag_dpi_tick_batch().
+  append_checkpoint_uint( data, inst.pending_idle_tick_count, 4 );
+
+  // The statistics of an open connection count as if the connection had closed.
+  link_statistics total_stats = inst.total_stats;
+
+  if ( is_connection_open( inst ) )
+  {
+    update_connected_time( inst );
+    add_statistics( total_stats, inst.stats );
   }
+
+  const size_t counter_count = sizeof( link_statistics ) / sizeof( uint64_t );
+  const uint64_t * const counters = reinterpret_cast< const uint64_t * >( &total_stats );
+
+  for ( size_t i = 0; i < counter_count; ++i )
+    append_checkpoint_uint( data, counters[ i ], 8 );
 }
 
 
-int jtag_dpi_init ( const int tcp_port,
-                    const unsigned char listen_on_local_addr_only,
-                    const int jtag_tck_half_period_tick_count,
-                    const unsigned char print_informational_messages )
+// A tcp_port_override of -1 and an empty port_file_override keep the values saved in the checkpoint.
+
+static jtag_dpi_instance * restore_instance_checkpoint ( checkpoint_reader & reader,
+                                                         const uint32_t index,
+                                                         const int tcp_port_override,
+                                                         const std::string & port_file_override )
 {
+  jtag_dpi_instance * const instance = new jtag_dpi_instance();
+  jtag_dpi_instance & inst = *instance;
+
   try
   {
-    if ( s_already_initialized )
+    inst.index = index;
+
+    inst.transport                       = transport_enum( reader.get_uint( 1 ) );
+    inst.socket_protocol                 = socket_protocol_enum( reader.get_uint( 1 ) );
+    inst.listening_tcp_port              = uint16_t( reader.get_uint( 2 ) );
+    inst.port_file_name                  = reader.get_string();
+    inst.unix_socket_path                = reader.get_string();
+    inst.listen_on_local_addr_only       = reader.get_uint( 1 ) != 0;
+    inst.print_informational_messages    = reader.get_uint( 1 ) != 0;
+    inst.jtag_tck_half_period_tick_count = int( reader.get_uint( 4 ) );
+    inst.io_mode                         = io_mode_enum( reader.get_uint( 1 ) );
+    inst.accept_poll_interval_tick_count = int( reader.get_uint( 4 ) );
+    inst.gdb_tcp_port                    = uint16_t( reader.get_uint( 2 ) );
+
+    const std::string trace_file_name = reader.get_string();
+
+    const bool was_connection_open = reader.get_uint( 1 ) != 0;
+
+    // A corrupt checkpoint could otherwise cause trouble much later.
+    if ( ( inst.transport != TRANSPORT_TCP && inst.transport != TRANSPORT_UNIX && inst.transport != TRANSPORT_SHM ) ||
+         ( inst.socket_protocol != SOCKET_PROTOCOL_ADV_JTAG_BRIDGE && inst.socket_protocol != SOCKET_PROTOCOL_JTAG_VPI ) ||
+         ( inst.io_mode != IO_MODE_POLL && inst.io_mode != IO_MODE_THREAD && inst.io_mode != IO_MODE_URING ) ||
+         inst.jtag_tck_half_period_tick_count <= 0 ||
+         inst.accept_poll_interval_tick_count <= 0 )
     {
-      throw std::runtime_error( "The module has already been initialized." );
+      throw std::runtime_error( "The checkpoint data is corrupt." );
     }
 
-    if ( tcp_port == 0 )
+    if ( tcp_port_override != -1 )
     {
-      throw std::runtime_error( "Invalid TCP port." );
-    }
-
-    s_listening_tcp_port = tcp_port;
+      if ( tcp_port_override < 0 || tcp_port_override > 65535 )
+      {
+        throw std::runtime_error( "Invalid TCP port override." );
+      }
 
+      inst.listening_tcp_port = uint16_t( tcp_port_override );
+    }
 
-    switch ( print_informational_messages )
+    if ( !port_file_override.empty() )
     {
-    case 0:
-      s_print_informational_messages = false;
-      break;
-
-    case 1:
-      s_print_informational_messages = true;
-      break;
+      if ( inst.transport != TRANSPORT_TCP )
+      {
+        throw std::runtime_error( "A port file is only available with transport TRANSPORT_TCP." );
+      }
 
-    default:
-      throw std::runtime_error( "Invalid print_informational_messages parameter." );
+      inst.port_file_name = port_file_override;
     }
 
+    init_instance_state( inst );
+    inst.accept_poll_countdown = 0;
 
-    switch ( listen_on_local_addr_only )
-    {
-    case 0:
-      s_listen_on_local_addr_only = false;
-      break;
+    inst.clock_notification_counter     = int( reader.get_uint( 4 ) );
+    inst.tap_state                      = tap_state_enum( reader.get_uint( 1 ) );
+    inst.tap_tck_level                  = reader.get_uint( 1 ) != 0;
+    inst.tap_consecutive_tms_high_count = int( reader.get_uint( 4 ) );
+    inst.tick_count                     = reader.get_uint( 8 );
+    inst.pending_idle_tick_count        = uint32_t( reader.get_uint( 4 ) );
 
-    case 1:
-      s_listen_on_local_addr_only = true;
-      break;
+    // The connection is gone, so there is no point in waiting for the clock notification.
+    inst.last_client_command_tick = inst.tick_count;
 
-    default:
-      throw std::runtime_error( "Invalid listen_on_local_addr_only parameter." );
-    }
+    const size_t counter_count = sizeof( link_statistics ) / sizeof( uint64_t );
+    uint64_t * const counters = reinterpret_cast< uint64_t * >( &inst.total_stats );
 
+    for ( size_t i = 0; i < counter_count; ++i )
+      counters[ i ] = reader.get_uint( 8 );
 
-    if ( jtag_tck_half_period_tick_count == 0 )
+    // The trace starts again from scratch, but the ticks carry on from the checkpoint.
+    if ( !trace_file_name.empty() )
     {
-      throw std::runtime_error( "Invalid jtag_tck_half_period_tick_count parameter." );
+      start_trace_writer( inst, trace_file_name.c_str() );
     }
 
-    s_jtag_tck_half_period_tick_count = jtag_tck_half_period_tick_count;
-
-
-    s_listeningSocket = -1;
-    s_listening_message_already_printed = false;
-    s_connectionSocket = -1;
-    s_connectionState = cs_invalid;
+    // With TCP port 0, the operating system picks a new port, and the port file gets written again.
+    if ( !inst.port_file_name.empty() )
+    {
+      unlink( inst.port_file_name.c_str() );
+    }
 
-    create_listening_socket();
+    open_instance_sockets( inst );
 
-    s_already_initialized = true;
-  }
-  catch ( const std::exception & e )
-  {
-    // We should return this error string to the caller,
-    // but Verilog does not have good support for variable-length strings.
-    fprintf( stderr, "%s%s\n", ERROR_MSG_PREFIX_INIT, e.what() );
-    fflush( stderr );
-    return RET_FAILURE;
+    if ( was_connection_open && inst.print_informational_messages )
+    {
+      printf( "%sA connection was open when the checkpoint was taken. The client needs to connect again.\n",
+              INFO_MSG_PREFIX );
+      fflush( stdout );
+    }
   }
   catch ( ... )
   {
-    fprintf( stderr, "%sUnexpected C++ exception.\n", ERROR_MSG_PREFIX_INIT );
-    fflush( stderr );
-    return RET_FAILURE;
+    delete_instance( instance );
+    throw;
   }
 
-  return RET_SUCCESS;
+  return instance;
 }
 
 
-int jtag_dpi_tick ( unsigned char * const jtag_tms,
-                    unsigned char * const jtag_tck,
-                    unsigned char * const jtag_trst,
-                    unsigned char * const jtag_tdi,
-                    unsigned char * const jtag_new_data_available,
-                    const unsigned char jtag_tdo )
+// Checkpoint support, see "Checkpoints" at the beginning of this file. The simulation main program
+// stores the data returned by this routine alongside the model state. The routine returns false
+// and prints an error message if the state cannot be saved.
+
+bool jtag_dpi_save_state ( std::vector< uint8_t > & state )
 {
   try
   {
-    *jtag_new_data_available = 0;
+    std::lock_guard< std::mutex > lock( s_instance_table_mutex );
 
-    if ( !s_already_initialized )
-    {
-      throw std::runtime_error( "This module has not been initialized yet." );
-    }
+    state.clear();
 
-    // If a connection is lost, the listening socket must be created again.
+    for ( size_t i = 0; i < sizeof( CHECKPOINT_MAGIC ) - 1; ++i )
+      state.push_back( uint8_t( CHECKPOINT_MAGIC[ i ] ) );
+
+    const uint32_t instance_count = s_instance_count.load( std::memory_order_relaxed );
+
+    append_checkpoint_uint( state, instance_count, 4 );
 
-    if ( s_connectionSocket == -1 )
+    for ( uint32_t i = 0; i < instance_count; ++i )
     {
-      if ( s_listeningSocket == -1 )
-      {
-        create_listening_socket();
-      }
+      jtag_dpi_instance * const inst = s_instances[ i ].load( std::memory_order_acquire );
 
-      accept_connection();
-    }
+      // The slots of terminated instances must stay empty, so that the handles of the others remain valid.
+      append_checkpoint_uint( state, inst != NULL ? 1 : 0, 1 );
 
-   if ( s_connectionSocket != -1 )
-   {
-     serve_connection( jtag_tms,
-                       jtag_tck,
-                       jtag_trst,
-                       jtag_tdi,
-                       jtag_new_data_available,
-                       jtag_tdo );
-   }
+      if ( inst != NULL )
+        append_instance_checkpoint( state, *inst );
+    }
   }
   catch ( const std::exception & e )
   {
-    fprintf( stderr, "%s%s\n", ERROR_MSG_PREFIX_TICK, e.what() );
-    fflush( stderr );
-    return RET_FAILURE;
-  }
-  catch ( ... )
-  {
-    fprintf( stderr, "%sUnexpected C++ exception.\n", ERROR_MSG_PREFIX_TICK );
+    fprintf( stderr, "%sCannot save the checkpoint: %s\n", ERROR_MSG_PREFIX_TICK, e.what() );
     fflush( stderr );
-    return RET_FAILURE;
+    return false;
   }
 
-  return RET_SUCCESS;
+  return true;
 }
 
 
-void jtag_dpi_terminate ( void )
+// Recreates the instances saved by jtag_dpi_save_state(). Call it after restoring the model state,
+// and before the model is evaluated for the first time. No instances may exist yet.
+//
+// The restored model does not run the initial block in jtag_dpi.v again, so the run-time plusargs
+// that select the TCP port and the port file (see PORT_PLUSARG there) are not read either.
+// Instead, the main program passes their current values here, indexed by instance, so that
+// many simulations restored from the same checkpoint can run side by side. A port of -1,
+// an empty port file name, or a missing vector element keeps the value saved in the checkpoint.
+
+bool jtag_dpi_restore_state ( const std::vector< uint8_t > & state,
+                              const std::vector< int > & tcp_port_overrides,
+                              const std::vector< std::string > & port_file_overrides )
 {
-    if ( !s_already_initialized )
+  try
+  {
+    std::lock_guard< std::mutex > lock( s_instance_table_mutex );
+
+    if ( s_instance_count.load( std::memory_order_relaxed ) != 0 )
     {
-      // The user shouldn't call this routine if the module was not initialised,
-      // although it does not really matter very much.
-      assert( false );
-      return;
+      throw std::runtime_error( "Some JTAG DPI instances have already been initialised." );
+    }
+
+    checkpoint_reader reader( state );
+
+    for ( size_t i = 0; i < sizeof( CHECKPOINT_MAGIC ) - 1; ++i )
+    {
+      if ( reader.get_uint( 1 ) != uint8_t( CHECKPOINT_MAGIC[ i ] ) )
+        throw std::runtime_error( "The checkpoint data has the wrong format." );
     }
 
-    if ( s_listeningSocket != -1 )
+    const uint32_t instance_count = uint32_t( reader.get_uint( 4 ) );
+
+    if ( instance_count > MAX_INSTANCE_COUNT )
     {
-      close_listening_socket();
+      throw std::runtime_error( "The checkpoint data is corrupt." );
     }
 
-    if ( s_connectionSocket != -1 )
+    try
+    {
+      for ( uint32_t i = 0; i < instance_count; ++i )
+      {
+        if ( reader.get_uint( 1 ) != 0 )
+        {
+          const int tcp_port_override = i < tcp_port_overrides.size() ? tcp_port_overrides[ i ] : -1;
+          const std::string port_file_override = i < port_file_overrides.size() ? port_file_overrides[ i ] : std::string();
+
+          s_instances[ i ].store( restore_instance_checkpoint( reader, i, tcp_port_override, port_file_override ),
+                                  std::memory_order_release );
+        }
+
+        s_instance_count.store( i + 1, std::memory_order_release );
+      }
+
+      if ( !reader.is_at_end() )
+      {
+        throw std::runtime_error( "The checkpoint data is corrupt." );
+      }
+    }
+    catch ( ... )
     {
-      close_current_connection();
+      // Undo the instances restored so far. The simulation cannot continue anyway,
+      // but the listening sockets and I/O threads should not linger.
+      for ( uint32_t i = 0; i < s_instance_count.load( std::memory_order_relaxed ); ++i )
+      {
+        jtag_dpi_instance * const inst = s_instances[ i ].load( std::memory_order_relaxed );
+
+        if ( inst == NULL )
+          continue;
+
+        if ( inst->io_mode == IO_MODE_THREAD )
+          stop_io_thread( *inst );
+
+        if ( inst->listeningSocket != -1 )
+          close_listening_socket( *inst );
+
+        if ( inst->gdb != NULL && inst->gdb->listening_socket != -1 )
+          close_a( inst->gdb->listening_socket );
+
+        s_instances[ i ].store( NULL, std::memory_order_relaxed );
+        delete_instance( inst );
+      }
+
+      s_instance_count.store( 0, std::memory_order_release );
+      throw;
     }
+  }
+  catch ( const std::exception & e )
+  {
+    fprintf( stderr, "%sCannot restore the checkpoint: %s\n", ERROR_MSG_PREFIX_INIT, e.what() );
+    fflush( stderr );
+    return false;
+  }
 
-    s_already_initialized = false;
+  return true;
 }
@@ -51,7 +51,8 @@
 
 
 module jtag_dpi
-  #( LISTENING_TCP_PORT = 4567,
+  #( LISTENING_TCP_PORT = 4567,  // 0 lets the operating system pick a free port, see PORT_FILE.
+                                // Plusarg +jtag_dpi_port=N overrides it at run time, see PORT_PLUSARG.
      LISTEN_ON_LOCAL_ADDR_ONLY = 1,  // Whether to listen on localhost / 127.0.0.1 only. Otherwise,
                                      // it listens on all IP addresses, which means any computer
                                      // in the network can connect to the JTAG DPI module.
@@ -59,7 +60,60 @@ module jtag_dpi
      PRINT_INFORMATIONAL_MESSAGES = 1,  // The informational messages, if enabled, are printed to stdout. Error messages
                                         // cannot be turned off and get printed to stderr.
 
-     PRINT_RECEIVED_JTAG_DATA = 0
+     PRINT_RECEIVED_JTAG_DATA = 0,  // Prints every JTAG pin update with $display, which slows the simulation down a lot.
+                                    // TRACE_FILE is much cheaper.
+
+     BATCHED_DPI_CALLS = 1,  // 1: Call the DPI module only when it needs to, and let it queue several JTAG pin states
+                             //    for this module to clock out on its own. The TCK timing is the same.
+                             // 0: Call the DPI module on every system_clk cycle.
+                             // Only the GDB server and REPLAY_FILE need a call on every cycle anyway.
+
+     IO_MODE = 0,  // 0: Poll the socket from the simulation thread on every system_clk cycle.
+                   // 1: Use a separate I/O thread, so that the simulation thread does not need
+                   //    to make a system call on every cycle. You need to link with -pthread.
+                   // 2: Use io_uring on Linux 6.0 or later, so that checking for data needs no system call
+                   //    and no extra thread. Falls back to 0 if io_uring is not available.
+
+     ACCEPT_POLL_INTERVAL_TICK_COUNT = 1000,  // While no client is connected, check for incoming connections
+                                              // only every so many system_clk cycles. 1 means every cycle.
+                                              // Only relevant with IO_MODE 0, and for the GDB server,
+                                              // which also polls its connection and the CPU at this rate.
+
+     GDB_TCP_PORT = 0,  // If not 0, a built-in GDB server for the OpenRISC CPU behind adv_dbg_if listens on this port,
+                        // so that you do not need adv_jtag_bridge. See the README file for more information.
+
+     TRANSPORT = 0,  // 0: TCP socket on LISTENING_TCP_PORT.
+                     // 1: Unix-domain socket at UNIX_SOCKET_PATH. LISTENING_TCP_PORT is then ignored.
+                     // 2: Shared-memory rings, for clients linked with jtag_dpi_shm_client.cpp.
+                     //    The client connects to UNIX_SOCKET_PATH first. Only works with IO_MODE 0.
+
+     SOCKET_PROTOCOL = 0,  // 0: The adv_jtag_bridge byte protocol, with the extensions described in jtag_dpi.cpp.
+                           // 1: The protocol of OpenOCD's jtag_vpi adapter driver, which sends whole
+                           //    TMS sequences and scans at once. OpenOCD's default jtag_vpi port is 5555.
+                           //    The client can end the simulation with the stop command.
+
+     string UNIX_SOCKET_PATH = "jtag_dpi.sock",  // For TRANSPORT 1 and 2. A relative path starts
+                                                 // at the simulation's current directory.
+
+            RECORD_FILE = "",  // If not empty, all JTAG pin updates and TDO samples are recorded to this file.
+
+            REPLAY_FILE = "",  // If not empty, the JTAG pin updates are replayed from a file recorded with RECORD_FILE,
+                               // and the TDO values are checked against the recorded ones. There is no socket
+                               // and no client in this mode. The simulation must start from the same state
+                               // as when recording, and GDB_TCP_PORT must be 0.
+
+            TRACE_FILE = "",   // If not empty, all JTAG pin updates, TDO samples and connection events are logged
+                               // to this binary trace file by a background thread, which costs little simulation time.
+                               // Use tools/jtag_dpi_trace_decode to turn it into text.
+
+            PORT_FILE = "",    // If not empty, the TCP port actually listened on is written to this file,
+                               // which is mostly useful with port 0. Only for TRANSPORT 0.
+
+            // The plusargs that override LISTENING_TCP_PORT and PORT_FILE at run time, so that a job scheduler
+            // can run many simulations of the same model side by side. If a simulation has several
+            // instances of this module, give each one its own plusargs. An empty string disables the plusarg.
+            PORT_PLUSARG      = "jtag_dpi_port=%d",
+            PORT_FILE_PLUSARG = "jtag_dpi_port_file=%s"
    )
    ( input  system_clk,
      output jtag_tms_o,
@@ -76,22 +130,51 @@ module jtag_dpi
    reg    received_jtag_tdi;
    reg    received_jtag_new_data_available;
 
-   import "DPI-C" function int jtag_dpi_init ( input integer tcp_port,
-                                               input bit listen_on_local_addr_only,
-                                               input integer jtag_tck_half_period_tick_count,
-                                               input bit print_informational_messages );
+   // Each instance of this module gets its own handle, so that a simulation
+   // can have several virtual JTAG cables, each one on its own TCP port or Unix socket.
+   chandle jtag_dpi_instance;
 
-   import "DPI-C" function int jtag_dpi_tick ( output bit jtag_tms,
+   // The parameters, unless overridden with plusargs.
+   integer listening_tcp_port;
+   string  port_file;
+
+   // Returns null on failure.
+   import "DPI-C" function chandle jtag_dpi_init ( input integer tcp_port,
+                                                   input bit listen_on_local_addr_only,
+                                                   input integer jtag_tck_half_period_tick_count,
+                                                   input bit print_informational_messages,
+                                                   input integer io_mode,
+                                                   input integer accept_poll_interval_tick_count,
+                                                   input integer gdb_tcp_port,
+                                                   input integer transport,
+                                                   input integer socket_protocol,
+                                                   input string  unix_socket_path,
+                                                   input string  record_file_name,
+                                                   input string  replay_file_name,
+                                                   input string  trace_file_name,
+                                                   input string  port_file_name );
+
+   import "DPI-C" function int jtag_dpi_tick ( input chandle instance,
+                                               output bit jtag_tms,
                                                output bit jtag_tck,
                                                output bit jtag_trst,
                                                output bit jtag_tdi,
                                                output bit jtag_new_data_available,
                                                input bit  jtag_tdo );
 
-   // It is not necessary to call jtag_dpi_terminate(). However, calling it
-   // will release all resources associated with the JTAG DPI module, and that can help
-   // identify resource or memory leaks in other parts of the software.
-   import "DPI-C" function void jtag_dpi_terminate ();
+   // Used instead of jtag_dpi_tick() if BATCHED_DPI_CALLS is set. See jtag_dpi.cpp for details.
+   import "DPI-C" function int jtag_dpi_tick_batch ( input chandle instance,
+                                                     input int  tdo_history,
+                                                     input bit  jtag_tdo,
+                                                     output int pin_batch,
+                                                     output int pin_batch_length,
+                                                     output int idle_tick_count );
+
+   // jtag_dpi_terminate() must be called at the end of the simulation, see the 'final' block below.
+   // Besides releasing all resources, which can help identify resource or memory leaks
+   // in other parts of the software, it stops the background threads (IO_MODE 1 and TRACE_FILE)
+   // after they have written out any pending data, and prints the connection statistics totals.
+   import "DPI-C" function void jtag_dpi_terminate ( input chandle instance );
 
    initial
      begin
@@ -100,44 +183,148 @@ module jtag_dpi
         jtag_trst_o = 1;  // The JTAG TRST reset signal is active when low.
         jtag_tdi_o  = 0;
 
-        if ( 0 != jtag_dpi_init( LISTENING_TCP_PORT,
-                                 LISTEN_ON_LOCAL_ADDR_ONLY,
-                                 `JTAG_DPI_TCK_HALF_PERIOD_TICK_COUNT,
-                                 PRINT_INFORMATIONAL_MESSAGES ) )
+        listening_tcp_port = LISTENING_TCP_PORT;
+        port_file          = PORT_FILE;
+
+        if ( PORT_PLUSARG != "" )
+          void'( $value$plusargs( PORT_PLUSARG, listening_tcp_port ) );
+
+        if ( PORT_FILE_PLUSARG != "" )
+          void'( $value$plusargs( PORT_FILE_PLUSARG, port_file ) );
+
+        jtag_dpi_instance = jtag_dpi_init( listening_tcp_port,
+                                           LISTEN_ON_LOCAL_ADDR_ONLY,
+                                           `JTAG_DPI_TCK_HALF_PERIOD_TICK_COUNT,
+                                           PRINT_INFORMATIONAL_MESSAGES,
+                                           IO_MODE,
+                                           ACCEPT_POLL_INTERVAL_TICK_COUNT,
+                                           GDB_TCP_PORT,
+                                           TRANSPORT,
+                                           SOCKET_PROTOCOL,
+                                           UNIX_SOCKET_PATH,
+                                           RECORD_FILE,
+                                           REPLAY_FILE,
+                                           TRACE_FILE,
+                                           port_file );
+
+        if ( jtag_dpi_instance == null )
           begin
              $display("Error initializing the JTAG DPI module.");
              $finish;
           end;
      end
 
-   always @ ( posedge system_clk )
+   // Verilator runs this from top->final(), which verilator_main.cpp calls before exiting.
+   final
+     begin
+        if ( jtag_dpi_instance != null )
+          jtag_dpi_terminate( jtag_dpi_instance );
+     end
+
+   // jtag_dpi_tick() and jtag_dpi_tick_batch() return 0 on success, 1 on error
+   // and 2 if the client has asked to end the simulation.
+   int        dpi_result;
+
+   task check_dpi_result;
      begin
-        if ( 0 != jtag_dpi_tick( received_jtag_tms,
-                                 received_jtag_tck,
-                                 received_jtag_trst,
-                                 received_jtag_tdi,
-                                 received_jtag_new_data_available,
-                                 jtag_tdo_i ) )
+        if ( dpi_result == 2 )
+          $finish;
+        else if ( dpi_result != 0 )
           begin
              $display("Error receiving from the JTAG DPI module.");
              $finish;
           end;
+     end
+   endtask
+
+   // State for BATCHED_DPI_CALLS.
+   int        pin_batch;
+   int        pin_batch_length;
+   int        idle_tick_count;
+   int        dpi_call_countdown = 0;  // Cycles left until the next DPI call.
+   reg [31:0] queued_pins;             // The data bytes still to apply, 4 bits each, the next one in bits [3:0].
+   int        queued_pin_count = 0;
+   int        queued_pin_countdown;    // Cycles left until the next queued data byte.
+   reg [31:0] tdo_history = 0;         // TDO sampled before applying each queued data byte.
+   int        tdo_history_length = 0;
+
+   // The bits are the same as in a JTAG data byte of the socket protocol.
+   task apply_jtag_pins ( input [3:0] pins );
+     begin
+        if ( PRINT_RECEIVED_JTAG_DATA )
+          begin
+             $display( "JTAG DPI module: Received JTAG data: TCK: %0d, TMS: %0d, TDI: %0d, TRST: %0d.",
+                       pins[0],
+                       pins[3],
+                       pins[2],
+                       pins[1] );
+          end
+
+        jtag_tck_o  <= pins[0];
+        jtag_trst_o <= pins[1];
+        jtag_tdi_o  <= pins[2];
+        jtag_tms_o  <= pins[3];
+     end
+   endtask
 
-        if ( received_jtag_new_data_available )
+   always @ ( posedge system_clk )
+     begin
+        if ( !BATCHED_DPI_CALLS )
           begin
-             if ( PRINT_RECEIVED_JTAG_DATA )
+             dpi_result = jtag_dpi_tick( jtag_dpi_instance,
+                                         received_jtag_tms,
+                                         received_jtag_tck,
+                                         received_jtag_trst,
+                                         received_jtag_tdi,
+                                         received_jtag_new_data_available,
+                                         jtag_tdo_i );
+             check_dpi_result;
+
+             if ( received_jtag_new_data_available )
+               apply_jtag_pins( { received_jtag_tms, received_jtag_tdi, received_jtag_trst, received_jtag_tck } );
+          end
+        else if ( dpi_call_countdown != 0 )
+          begin
+             dpi_call_countdown = dpi_call_countdown - 1;
+
+             if ( queued_pin_count != 0 )
+               begin
+                  queued_pin_countdown = queued_pin_countdown - 1;
+
+                  if ( queued_pin_countdown == 0 )
+                    begin
+                       tdo_history[ tdo_history_length ] = jtag_tdo_i;
+                       tdo_history_length = tdo_history_length + 1;
+
+                       apply_jtag_pins( queued_pins[3:0] );
+                       queued_pins = queued_pins >> 4;
+                       queued_pin_count = queued_pin_count - 1;
+                       queued_pin_countdown = `JTAG_DPI_TCK_HALF_PERIOD_TICK_COUNT;
+                    end
+               end
+          end
+        else
+          begin
+             dpi_result = jtag_dpi_tick_batch( jtag_dpi_instance,
+                                               tdo_history,
+                                               jtag_tdo_i,
+                                               pin_batch,
+                                               pin_batch_length,
+                                               idle_tick_count );
+             check_dpi_result;
+
+             tdo_history = 0;
+             tdo_history_length = 0;
+
+             if ( pin_batch_length != 0 )
                begin
-                  $display( "JTAG DPI module: Received JTAG data: TCK: %0d, TMS: %0d, TDI: %0d, TRST: %0d.",
-                            received_jtag_tck,
-                            received_jtag_tms,
-                            received_jtag_tdi,
-                            received_jtag_trst );
+                  apply_jtag_pins( pin_batch[3:0] );
+                  queued_pins = pin_batch >> 4;
+                  queued_pin_count = pin_batch_length - 1;
+                  queued_pin_countdown = `JTAG_DPI_TCK_HALF_PERIOD_TICK_COUNT;
                end
 
-             jtag_tms_o  <= received_jtag_tms;
-             jtag_tck_o  <= received_jtag_tck;
-             jtag_trst_o <= received_jtag_trst;
-             jtag_tdi_o  <= received_jtag_tdi;
+             dpi_call_countdown = idle_tick_count;
           end
      end;
 
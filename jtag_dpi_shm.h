@@ -0,0 +1,186 @@
+/* Version 1.04, September 2012.
+
+   Definitions shared between jtag_dpi.cpp and the shared-memory client library
+   (jtag_dpi_shm_client.cpp): the single-producer, single-consumer byte ring,
+   and the layout of the shared-memory area for transport TRANSPORT_SHM.
+
+   See jtag_dpi.cpp for a description of the shared-memory transport.
+
+   License:
+
+   Copyright (c) 2011 R. Diez
+
+   This source file may be used and distributed without
+   restriction provided that this copyright statement is not
+   removed from the file and that any derivative work contains
+   the original copyright notice and the associated disclaimer.
+
+   This source file is free software; you can redistribute it
+   and/or modify it under the terms of the GNU Lesser General
+   Public License version 3 as published by the Free Software Foundation.
+
+   This source is distributed in the hope that it will be
+   useful, but WITHOUT ANY WARRANTY; without even the implied
+   warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+   PURPOSE.  See the GNU Lesser General Public License for more
+   details.
+
+   You should have received a copy of the GNU Lesser General
+   Public License along with this source; if not, download it
+   from http://www.gnu.org/licenses/
+*/
+
+#ifndef JTAG_DPI_SHM_H_INCLUDED
+#define JTAG_DPI_SHM_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <algorithm>
+#include <atomic>
+
+
+// Single-producer, single-consumer byte ring. Only the producer writes 'head',
+// and only the consumer writes 'tail'. Both are free-running counters.
+// The structure has no constructor, so that it can live in shared memory.
+// std::atomic< uint32_t > is lock-free on all platforms this module supports,
+// so the ring also works between processes.
+
+struct spsc_byte_ring
+{
+  static const uint32_t CAPACITY = 64 * 1024;  // Must be a power of 2.
+
+  // The padding keeps the producer and the consumer from fighting over the same cache line.
+  std::atomic< uint32_t > head;
+  uint8_t padding1[ 64 - sizeof( std::atomic< uint32_t > ) ];
+  std::atomic< uint32_t > tail;
+  uint8_t padding2[ 64 - sizeof( std::atomic< uint32_t > ) ];
+  uint8_t data[ CAPACITY ];
+};
+
+
+inline void ring_reset ( spsc_byte_ring * const ring )
+{
+  ring->head.store( 0, std::memory_order_relaxed );
+  ring->tail.store( 0, std::memory_order_relaxed );
+}
+
+
+// Returns the number of bytes written, which may be less than 'len' if the ring is full.
+
+inline size_t ring_write ( spsc_byte_ring * const ring,
+                           const void * const data,
+                           const size_t len )
+{
+  const uint32_t head = ring->head.load( std::memory_order_relaxed );
+  const uint32_t tail = ring->tail.load( std::memory_order_acquire );
+
+  const uint32_t free_space = spsc_byte_ring::CAPACITY - ( head - tail );
+  const uint32_t to_write   = uint32_t( std::min( size_t( free_space ), len ) );
+
+  for ( uint32_t i = 0; i < to_write; ++i )
+  {
+    ring->data[ ( head + i ) & ( spsc_byte_ring::CAPACITY - 1 ) ] = static_cast< const uint8_t * >( data )[ i ];
+  }
+
+  ring->head.store( head + to_write, std::memory_order_release );
+
+  return to_write;
+}
+
+
+// Returns the number of bytes read, which is 0 if the ring is empty.
+
+inline size_t ring_read ( spsc_byte_ring * const ring,
+                          void * const data,
+                          const size_t len )
+{
+  const uint32_t tail = ring->tail.load( std::memory_order_relaxed );
+  const uint32_t head = ring->head.load( std::memory_order_acquire );
+
+  const uint32_t to_read = uint32_t( std::min( size_t( head - tail ), len ) );
+
+  for ( uint32_t i = 0; i < to_read; ++i )
+  {
+    static_cast< uint8_t * >( data )[ i ] = ring->data[ ( tail + i ) & ( spsc_byte_ring::CAPACITY - 1 ) ];
+  }
+
+  ring->tail.store( tail + to_read, std::memory_order_release );
+
+  return to_read;
+}
+
+
+// The I/O thread uses these routines in order to pass the ring's memory
+// straight to recv() and send(). They return the largest contiguous area.
+
+inline uint8_t * ring_get_write_area ( spsc_byte_ring * const ring, size_t * const len )
+{
+  const uint32_t head = ring->head.load( std::memory_order_relaxed );
+  const uint32_t tail = ring->tail.load( std::memory_order_acquire );
+
+  const uint32_t offset = head & ( spsc_byte_ring::CAPACITY - 1 );
+
+  *len = std::min( spsc_byte_ring::CAPACITY - ( head - tail ),
+                   spsc_byte_ring::CAPACITY - offset );
+
+  return &ring->data[ offset ];
+}
+
+
+inline const uint8_t * ring_get_read_area ( spsc_byte_ring * const ring, size_t * const len )
+{
+  const uint32_t tail = ring->tail.load( std::memory_order_relaxed );
+  const uint32_t head = ring->head.load( std::memory_order_acquire );
+
+  const uint32_t offset = tail & ( spsc_byte_ring::CAPACITY - 1 );
+
+  *len = std::min( head - tail,
+                   spsc_byte_ring::CAPACITY - offset );
+
+  return &ring->data[ offset ];
+}
+
+
+inline void ring_commit_write ( spsc_byte_ring * const ring, const size_t len )
+{
+  ring->head.store( ring->head.load( std::memory_order_relaxed ) + uint32_t( len ), std::memory_order_release );
+}
+
+
+inline void ring_commit_read ( spsc_byte_ring * const ring, const size_t len )
+{
+  ring->tail.store( ring->tail.load( std::memory_order_relaxed ) + uint32_t( len ), std::memory_order_release );
+}
+
+
+inline bool ring_is_empty ( spsc_byte_ring * const ring )
+{
+  return ring->head.load( std::memory_order_acquire ) == ring->tail.load( std::memory_order_acquire );
+}
+
+
+// Layout of the shared-memory area for transport TRANSPORT_SHM. The simulation creates it
+// with memfd_create() for each connection and passes the file descriptor to the client,
+// together with the doorbell eventfd, over the Unix socket the client connected to.
+
+static const uint32_t JTAG_DPI_SHM_MAGIC   = 0x4D485344;  // "DSHM" in little-endian byte order.
+static const uint32_t JTAG_DPI_SHM_VERSION = 1;
+
+struct jtag_dpi_shm_area
+{
+  uint32_t magic;
+  uint32_t version;
+
+  // The client sets this flag before it blocks on the doorbell eventfd. The simulation only
+  // writes to the eventfd (which costs a system call) if the flag is set after placing data
+  // in the 'to_client' ring. Both sides need a full memory barrier between their store
+  // and their subsequent load, or a wake-up could get lost.
+  std::atomic< uint32_t > client_waiting;
+  uint8_t padding[ 64 - 2 * sizeof( uint32_t ) - sizeof( std::atomic< uint32_t > ) ];
+
+  spsc_byte_ring to_simulation;  // The client is the producer.
+  spsc_byte_ring to_client;      // The simulation is the producer.
+};
+
+#endif  // Include this header file only once.
@@ -0,0 +1,384 @@
+/* Version 1.04, September 2012.
+
+   Client library for the shared-memory transport of the JTAG DPI module.
+   See jtag_dpi_shm_client.h for more information.
+
+   License:
+
+   Copyright (c) 2011 R. Diez
+
+   This source file may be used and distributed without
+   restriction provided that this copyright statement is not
+   removed from the file and that any derivative work contains
+   the original copyright notice and the associated disclaimer.
+
+   This source file is free software; you can redistribute it
+   and/or modify it under the terms of the GNU Lesser General
+   Public License version 3 as published by the Free Software Foundation.
+
+   This source is distributed in the hope that it will be
+   useful, but WITHOUT ANY WARRANTY; without even the implied
+   warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+   PURPOSE.  See the GNU Lesser General Public License for more
+   details.
+
+   You should have received a copy of the GNU Lesser General
+   Public License along with this source; if not, download it
+   from http://www.gnu.org/licenses/
+*/
+
+#include "jtag_dpi_shm_client.h"
+#include "jtag_dpi_shm.h"
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <thread>
+
+
+// How many times to check the ring before blocking on the doorbell. The simulation
+// normally answers within a few clock cycles, and sleeping costs two system calls
+// and a context switch on both sides. On a single-CPU machine, spinning would only
+// steal time from the simulation, so the client blocks straight away there.
+static const int SPIN_COUNT_BEFORE_BLOCKING = 20000;
+
+// While the ring to the simulation is full, check this often whether the simulation has gone away.
+static const int FULL_RING_POLL_INTERVAL_MS = 1;
+
+
+struct jtag_dpi_shm_client
+{
+  int socket_fd;
+  int doorbell_fd;
+  jtag_dpi_shm_area * area;
+  int spin_count;
+};
+
+
+static void close_fd ( const int fd )
+{
+  for ( ; ; )
+  {
+    const int res = close( fd );
+
+    if ( res == -1 && errno == EINTR )
+        continue;
+
+    break;
+  }
+}
+
+
+static int poll_eintr ( pollfd * const fds, const nfds_t nfds, const int timeout_ms )
+{
+  for ( ; ; )
+  {
+    const int res = poll( fds, nfds, timeout_ms );
+
+    if ( res == -1 && errno == EINTR )
+      continue;
+
+    return res;
+  }
+}
+
+
+static int64_t get_monotonic_time_ms ( void )
+{
+  timespec now;
+  clock_gettime( CLOCK_MONOTONIC, &now );
+  return int64_t( now.tv_sec ) * 1000 + now.tv_nsec / 1000000;
+}
+
+
+// The simulation never sends anything over the socket after the handshake,
+// so a readable socket means that the simulation has closed it.
+
+static bool has_simulation_disconnected ( jtag_dpi_shm_client * const client )
+{
+  uint8_t data;
+
+  for ( ; ; )
+  {
+    const ssize_t res = recv( client->socket_fd, &data, sizeof(data), MSG_DONTWAIT );
+
+    if ( res == -1 && errno == EINTR )
+      continue;
+
+    return res == 0 || ( res == -1 && errno != EAGAIN && errno != EWOULDBLOCK );
+  }
+}
+
+
+// Receives the handshake byte with the shared-memory file and the doorbell eventfd.
+
+static bool receive_session_fds ( jtag_dpi_shm_client * const client, int * const memfd )
+{
+  uint8_t version;
+  iovec iov;
+  iov.iov_base = &version;
+  iov.iov_len  = sizeof( version );
+
+  int fds[ 2 ];
+
+  union
+  {
+    cmsghdr header;
+    uint8_t buffer[ CMSG_SPACE( sizeof( fds ) ) ];
+  } control;
+
+  msghdr msg;
+  memset( &msg, 0, sizeof(msg) );
+  msg.msg_iov        = &iov;
+  msg.msg_iovlen     = 1;
+  msg.msg_control    = control.buffer;
+  msg.msg_controllen = sizeof( control.buffer );
+
+  ssize_t res;
+  do
+  {
+    res = recvmsg( client->socket_fd, &msg, MSG_CMSG_CLOEXEC );
+  }
+  while ( res == -1 && errno == EINTR );
+
+  if ( res == -1 )
+    return false;
+
+  const cmsghdr * const cmsg = CMSG_FIRSTHDR( &msg );
+
+  if ( res != sizeof( version ) ||
+       cmsg == NULL ||
+       cmsg->cmsg_level != SOL_SOCKET ||
+       cmsg->cmsg_type  != SCM_RIGHTS ||
+       cmsg->cmsg_len   != CMSG_LEN( sizeof( fds ) ) )
+  {
+    // This is not a JTAG DPI module with the shared-memory transport.
+    errno = EPROTO;
+    return false;
+  }
+
+  memcpy( fds, CMSG_DATA( cmsg ), sizeof( fds ) );
+
+  *memfd = fds[ 0 ];
+  client->doorbell_fd = fds[ 1 ];
+
+  if ( version != JTAG_DPI_SHM_VERSION )
+  {
+    errno = EPROTO;
+    return false;
+  }
+
+  return true;
+}
+
+
+static bool map_shared_memory ( jtag_dpi_shm_client * const client, const int memfd )
+{
+  struct stat file_status;
+
+  if ( fstat( memfd, &file_status ) == -1 )
+    return false;
+
+  if ( file_status.st_size != off_t( sizeof( jtag_dpi_shm_area ) ) )
+  {
+    errno = EPROTO;
+    return false;
+  }
+
+  void * const mem = mmap( NULL, sizeof( jtag_dpi_shm_area ), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0 );
+
+  if ( mem == MAP_FAILED )
+    return false;
+
+  client->area = static_cast< jtag_dpi_shm_area * >( mem );
+
+  if ( client->area->magic != JTAG_DPI_SHM_MAGIC || client->area->version != JTAG_DPI_SHM_VERSION )
+  {
+    errno = EPROTO;
+    return false;
+  }
+
+  return true;
+}
+
+
+jtag_dpi_shm_client * jtag_dpi_shm_connect ( const char * const unix_socket_path )
+{
+  sockaddr_un addr;
+  memset( &addr, 0, sizeof(addr) );
+  addr.sun_family = AF_UNIX;
+
+  if ( strlen( unix_socket_path ) >= sizeof( addr.sun_path ) )
+  {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+
+  strcpy( addr.sun_path, unix_socket_path );
+
+  jtag_dpi_shm_client * const client = new jtag_dpi_shm_client;
+  client->doorbell_fd = -1;
+  client->area = NULL;
+  client->spin_count = std::thread::hardware_concurrency() > 1 ? SPIN_COUNT_BEFORE_BLOCKING : 0;
+  client->socket_fd = socket( PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+
+  if ( client->socket_fd == -1 )
+  {
+    delete client;
+    return NULL;
+  }
+
+  int memfd = -1;
+
+  const bool success = connect( client->socket_fd, (const sockaddr *) &addr, sizeof(addr) ) == 0 &&
+                       receive_session_fds( client, &memfd ) &&
+                       map_shared_memory( client, memfd );
+
+  const int saved_errno = errno;
+
+  if ( memfd != -1 )
+    close_fd( memfd );
+
+  if ( !success )
+  {
+    jtag_dpi_shm_disconnect( client );
+    errno = saved_errno;
+    return NULL;
+  }
+
+  return client;
+}
+
+
+void jtag_dpi_shm_disconnect ( jtag_dpi_shm_client * const client )
+{
+  if ( client == NULL )
+    return;
+
+  if ( client->area != NULL )
+    munmap( client->area, sizeof( jtag_dpi_shm_area ) );
+
+  if ( client->doorbell_fd != -1 )
+    close_fd( client->doorbell_fd );
+
+  close_fd( client->socket_fd );
+
+  delete client;
+}
+
+
+int jtag_dpi_shm_send ( jtag_dpi_shm_client * const client, const void * const data, const size_t len )
+{
+  const uint8_t * const bytes = static_cast< const uint8_t * >( data );
+  size_t sent = 0;
+
+  for ( ; ; )
+  {
+    sent += ring_write( &client->area->to_simulation, bytes + sent, len - sent );
+
+    if ( sent == len )
+      return 0;
+
+    // The simulation empties the ring on every clock cycle, so this should not take long,
+    // unless the simulation has stopped serving this connection.
+
+    pollfd polled_fd;
+    polled_fd.fd      = client->socket_fd;
+    polled_fd.events  = POLLIN;
+    polled_fd.revents = 0;
+
+    if ( poll_eintr( &polled_fd, 1, FULL_RING_POLL_INTERVAL_MS ) == -1 )
+      return -1;
+
+    if ( polled_fd.revents != 0 && has_simulation_disconnected( client ) )
+    {
+      errno = EPIPE;
+      return -1;
+    }
+  }
+}
+
+
+ssize_t jtag_dpi_shm_recv ( jtag_dpi_shm_client * const client,
+                            void * const buf,
+                            const size_t len,
+                            const int timeout_ms )
+{
+  spsc_byte_ring * const ring = &client->area->to_client;
+
+  const int64_t deadline = timeout_ms < 0 ? 0 : get_monotonic_time_ms() + timeout_ms;
+
+  for ( ; ; )
+  {
+    // Only look at the ring while spinning. ring_read() writes to the ring's 'tail',
+    // which would keep stealing the cache line from the simulation.
+    for ( int i = 0; i < client->spin_count && ring_is_empty( ring ); ++i )
+    {
+    }
+
+    const size_t received_byte_count = ring_read( ring, buf, len );
+
+    if ( received_byte_count != 0 )
+      return ssize_t( received_byte_count );
+
+    // Tell the simulation to ring the doorbell, then look at the ring once more,
+    // in case the data arrived just before the simulation could see the flag.
+    // The barrier pairs with the one in the simulation's ring_shm_doorbell().
+    client->area->client_waiting.store( 1, std::memory_order_relaxed );
+    std::atomic_thread_fence( std::memory_order_seq_cst );
+
+    if ( !ring_is_empty( ring ) )
+    {
+      client->area->client_waiting.store( 0, std::memory_order_relaxed );
+      continue;
+    }
+
+    int poll_timeout_ms = -1;
+
+    if ( timeout_ms >= 0 )
+    {
+      const int64_t remaining_ms = deadline - get_monotonic_time_ms();
+      poll_timeout_ms = remaining_ms > 0 ? int( remaining_ms ) : 0;
+    }
+
+    pollfd polled_fds[ 2 ];
+    polled_fds[ 0 ].fd      = client->doorbell_fd;
+    polled_fds[ 0 ].events  = POLLIN;
+    polled_fds[ 0 ].revents = 0;
+    polled_fds[ 1 ].fd      = client->socket_fd;
+    polled_fds[ 1 ].events  = POLLIN;
+    polled_fds[ 1 ].revents = 0;
+
+    const int poll_res = poll_eintr( polled_fds, 2, poll_timeout_ms );
+
+    client->area->client_waiting.store( 0, std::memory_order_relaxed );
+
+    if ( poll_res == -1 )
+      return -1;
+
+    if ( polled_fds[ 0 ].revents != 0 )
+    {
+      // Reset the eventfd counter, so that the next poll() blocks again.
+      uint64_t counter;
+      const ssize_t res = read( client->doorbell_fd, &counter, sizeof(counter) );
+      (void) res;
+    }
+
+    // Any data the simulation sent before closing the connection still counts.
+    if ( polled_fds[ 1 ].revents != 0 && ring_is_empty( ring ) && has_simulation_disconnected( client ) )
+      return 0;
+
+    if ( poll_res == 0 && ring_is_empty( ring ) )
+    {
+      errno = EAGAIN;
+      return -1;
+    }
+  }
+}
@@ -0,0 +1,77 @@
+/* Version 1.04, September 2012.
+
+   Client library for the shared-memory transport of the JTAG DPI module
+   (Verilog parameter TRANSPORT = 2).
+
+   A client like adv_jtag_bridge can replace its socket calls with these routines.
+   The byte protocol is exactly the same as over TCP, only the data travels through
+   two rings in shared memory instead of through the kernel. Sending never makes
+   a system call, and receiving only makes one when no reply is there yet
+   after a short busy wait.
+
+   Build it together with the client, for example:
+     g++ -O2 -c jtag_dpi_shm_client.cpp
+
+   The routines are not thread-safe: use each connection from one thread only.
+
+   License:
+
+   Copyright (c) 2011 R. Diez
+
+   This source file may be used and distributed without
+   restriction provided that this copyright statement is not
+   removed from the file and that any derivative work contains
+   the original copyright notice and the associated disclaimer.
+
+   This source file is free software; you can redistribute it
+   and/or modify it under the terms of the GNU Lesser General
+   Public License version 3 as published by the Free Software Foundation.
+
+   This source is distributed in the hope that it will be
+   useful, but WITHOUT ANY WARRANTY; without even the implied
+   warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+   PURPOSE.  See the GNU Lesser General Public License for more
+   details.
+
+   You should have received a copy of the GNU Lesser General
+   Public License along with this source; if not, download it
+   from http://www.gnu.org/licenses/
+*/
+
+#ifndef JTAG_DPI_SHM_CLIENT_H_INCLUDED
+#define JTAG_DPI_SHM_CLIENT_H_INCLUDED
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct jtag_dpi_shm_client jtag_dpi_shm_client;
+
+// Connects to the JTAG DPI module listening on the given Unix socket path (Verilog parameter UNIX_SOCKET_PATH).
+// Blocks until the simulation accepts the connection, which may take up to ACCEPT_POLL_INTERVAL_TICK_COUNT cycles.
+// Returns NULL on error, and then errno holds the reason.
+jtag_dpi_shm_client * jtag_dpi_shm_connect ( const char * unix_socket_path );
+
+// Closes the connection and releases all resources. The simulation notices
+// within ACCEPT_POLL_INTERVAL_TICK_COUNT cycles and waits for a new client.
+void jtag_dpi_shm_disconnect ( jtag_dpi_shm_client * client );
+
+// Queues all the given bytes for the simulation. If the ring is full, it waits
+// until the simulation makes room for them.
+// Returns 0 on success, or -1 if the simulation has closed the connection (errno is then EPIPE).
+int jtag_dpi_shm_send ( jtag_dpi_shm_client * client, const void * data, size_t len );
+
+// Waits until at least one byte is available, like a blocking recv().
+// Returns the number of bytes read, 0 if the simulation has closed the connection, or -1 on error (see errno).
+// A negative timeout_ms waits forever. Otherwise, the routine gives up after that many milliseconds
+// and returns -1 with errno set to EAGAIN.
+ssize_t jtag_dpi_shm_recv ( jtag_dpi_shm_client * client, void * buf, size_t len, int timeout_ms );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // Include this header file only once.
@@ -5,17 +5,69 @@
 #define __STDC_FORMAT_MACROS  // For PRIu64
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <signal.h>
 #include <limits.h>
+#include <errno.h>
 #include <inttypes.h>  // For PRIu64
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <stdexcept>
+#include <string>
+#include <vector>
+#include <chrono>
 
 #include "Vminsoc_bench_core.h"
 
+// Verilator defines VM_TRACE if the model was generated with --trace or --trace-fst,
+// see generate_verilator_bench.
+// Script generate_verilator_bench defines MINSOC_SAVABLE_MODEL when it passes option --savable to Verilator.
+#ifdef MINSOC_SAVABLE_MODEL
+  #include "verilated_save.h"
+#endif
+
+#if VM_TRACE
+  #if VM_TRACE_FST
+    #include "verilated_fst_c.h"
+    typedef VerilatedFstC trace_file_type;
+  #else
+    #include "verilated_vcd_c.h"
+    typedef VerilatedVcdC trace_file_type;
+  #endif
+#endif
+
+
+// Implemented in jtag_dpi.cpp.
+void jtag_dpi_enable_tick_profiling ( void );
+uint64_t jtag_dpi_get_tick_time_ns ( void );
+void jtag_dpi_enable_activity_tracking ( uint64_t pre_roll_tick_count, uint64_t idle_tick_count );
+uint64_t jtag_dpi_get_activity_count ( void );
+typedef bool ( * jtag_dpi_backdoor_memory_access_fn ) ( void * context,
+                                                        bool is_write,
+                                                        uint32_t address,
+                                                        uint8_t * data,
+                                                        uint32_t byte_count );
+void jtag_dpi_set_backdoor_memory_access ( jtag_dpi_backdoor_memory_access_fn access_fn, void * context );
+bool jtag_dpi_save_state ( std::vector< uint8_t > & state );
+bool jtag_dpi_restore_state ( const std::vector< uint8_t > & state,
+                              const std::vector< int > & tcp_port_overrides,
+                              const std::vector< std::string > & port_file_overrides );
+
 
 static uint64_t current_simulation_time = 0;
 
+// Where the simulation started, which is not 0 after restoring a checkpoint.
+static uint64_t start_simulation_time = 0;
+
+// Reading the clock on every iteration would slow the simulation down noticeably.
+static const uint64_t WALL_CLOCK_CHECK_INTERVAL = 4096;  // In simulation time steps (half clock cycles).
+
 double sc_time_stamp ()
 {
   return double( current_simulation_time );
@@ -44,6 +96,738 @@ static void ignore_sigpipe ( void )
 }
 
 
+// Returns the value of a plusarg like +max_cycles=1000, or the default value if the plusarg is not there.
+
+static uint64_t get_numeric_plusarg ( const char * const name, const uint64_t default_value )
+{
+  const std::string prefix = std::string( name ) + "=";
+
+  const char * const match = Verilated::commandArgsPlusMatch( prefix.c_str() );
+
+  // The match includes the leading '+'.
+  if ( match == NULL || match[0] == '\0' )
+    return default_value;
+
+  const char * const value_str = match + 1 + prefix.size();
+  char * end;
+  errno = 0;
+  const unsigned long long value = strtoull( value_str, &end, 10 );
+
+  if ( *value_str == '\0' || *end != '\0' || errno != 0 )
+    throw std::runtime_error( std::string( "Invalid value in plusarg " ) + match + " ." );
+
+  return value;
+}
+
+
+static std::string get_string_plusarg ( const char * const name )
+{
+  const std::string prefix = std::string( name ) + "=";
+
+  const char * const match = Verilated::commandArgsPlusMatch( prefix.c_str() );
+
+  if ( match == NULL || match[0] == '\0' )
+    return std::string();
+
+  return std::string( match + 1 + prefix.size() );
+}
+
+
+static double get_seconds_since ( const std::chrono::steady_clock::time_point & start_time )
+{
+  return std::chrono::duration< double >( std::chrono::steady_clock::now() - start_time ).count();
+}
+
+
+// The simulation time advances by 2 on each clock cycle.
+
+static uint64_t get_simulated_clock_cycles ( void )
+{
+  return current_simulation_time / 2;
+}
+
+
+// The clock cycles simulated by this process, for the speed figures.
+
+static uint64_t get_clock_cycles_this_run ( void )
+{
+  return ( current_simulation_time - start_simulation_time ) / 2;
+}
+
+
+#ifdef MINSOC_SAVABLE_MODEL
+
+// Checkpoints with plusargs +checkpoint_save and +checkpoint_restore. The file holds the simulation time,
+// the state of the JTAG DPI module and the Verilator model state, in this order.
+// The firmware is part of the model state, so a restored simulation needs no firmware file.
+
+static volatile sig_atomic_t is_checkpoint_requested = 0;
+
+static void sigusr1_handler ( int )
+{
+  is_checkpoint_requested = 1;
+}
+
+
+static void install_checkpoint_signal_handler ( void )
+{
+  struct sigaction act;
+
+  act.sa_handler = sigusr1_handler;
+  act.sa_flags   = SA_RESTART;
+
+  if ( 0 != sigemptyset( &act.sa_mask ) )
+    throw std::runtime_error( "Error setting signal mask." );
+
+  if ( 0 != sigaction( SIGUSR1, &act, NULL ) )
+    throw std::runtime_error( "Error setting signal handler." );
+}
+
+
+static void save_checkpoint ( Vminsoc_bench_core * const top, const std::string & filename )
+{
+  const std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+
+  std::vector< uint8_t > jtag_dpi_state;
+
+  if ( !jtag_dpi_save_state( jtag_dpi_state ) )
+    throw std::runtime_error( "Error saving the JTAG DPI state." );
+
+  VerilatedSave os;
+  os.open( filename.c_str() );
+
+  if ( !os.isOpen() )
+    throw std::runtime_error( "Cannot create checkpoint file " + filename + " ." );
+
+  const uint64_t jtag_dpi_state_len = jtag_dpi_state.size();
+
+  os.write( &current_simulation_time, sizeof( current_simulation_time ) );
+  os.write( &jtag_dpi_state_len, sizeof( jtag_dpi_state_len ) );
+  os.write( jtag_dpi_state.data(), jtag_dpi_state.size() );
+  os << *top;
+  os.close();
+
+  printf( "Checkpoint: saved clock cycle %" PRIu64 " to %s in %.2f s.\n",
+          get_simulated_clock_cycles(),
+          filename.c_str(),
+          get_seconds_since( start_time ) );
+  fflush( stdout );
+}
+
+
+static void restore_checkpoint ( Vminsoc_bench_core * const top, const std::string & filename )
+{
+  const std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+
+  VerilatedRestore os;
+  os.open( filename.c_str() );
+
+  if ( !os.isOpen() )
+    throw std::runtime_error( "Cannot open checkpoint file " + filename + " ." );
+
+  uint64_t jtag_dpi_state_len;
+
+  os.read( &current_simulation_time, sizeof( current_simulation_time ) );
+  os.read( &jtag_dpi_state_len, sizeof( jtag_dpi_state_len ) );
+
+  // The JTAG DPI state is small, so anything bigger means that the file is not a checkpoint.
+  if ( jtag_dpi_state_len > 1024 * 1024 )
+    throw std::runtime_error( "Invalid checkpoint file " + filename + " ." );
+
+  std::vector< uint8_t > jtag_dpi_state( jtag_dpi_state_len );
+  os.read( jtag_dpi_state.data(), jtag_dpi_state.size() );
+  os >> *top;
+  os.close();
+
+  // The model does not run its initial blocks again, so this recreates the JTAG DPI instances.
+  // jtag_dpi.v does not read its plusargs either, so pass them in here. The bench has a single instance,
+  // which uses the default plusarg names, see PORT_PLUSARG and PORT_FILE_PLUSARG in jtag_dpi.v.
+  const uint64_t NO_PORT_PLUSARG = UINT64_MAX;
+  const uint64_t tcp_port = get_numeric_plusarg( "jtag_dpi_port", NO_PORT_PLUSARG );
+
+  if ( tcp_port != NO_PORT_PLUSARG && tcp_port > 65535 )
+    throw std::runtime_error( "Invalid value in plusarg +jtag_dpi_port ." );
+
+  const std::vector< int > tcp_port_overrides( 1, tcp_port == NO_PORT_PLUSARG ? -1 : int( tcp_port ) );
+  const std::vector< std::string > port_file_overrides( 1, get_string_plusarg( "jtag_dpi_port_file" ) );
+
+  if ( !jtag_dpi_restore_state( jtag_dpi_state, tcp_port_overrides, port_file_overrides ) )
+    throw std::runtime_error( "Error restoring the JTAG DPI state." );
+
+  start_simulation_time = current_simulation_time;
+
+  printf( "Checkpoint: restored clock cycle %" PRIu64 " from %s in %.2f s.\n",
+          get_simulated_clock_cycles(),
+          filename.c_str(),
+          get_seconds_since( start_time ) );
+  fflush( stdout );
+}
+
+#endif  // #ifdef MINSOC_SAVABLE_MODEL
+
+
+// Backdoor memory access for tools/jtag_dpi_memory, see "Backdoor memory access" in jtag_dpi.cpp.
+// Where the memory lives in the Verilator model depends on the MinSoC configuration, so define
+// MINSOC_BACKDOOR_MEMORY( top ) as the expression that yields the memory array of 32-bit words,
+// and MINSOC_BACKDOOR_MEMORY_BASE_ADDRESS as its address on the Wishbone bus (0 by default).
+// The array must be public in the model, for example with a /*verilator public_flat_rw*/ comment
+// on its declaration. For example, with OPT="-DMINSOC_BACKDOOR_MEMORY(top)=top->minsoc_bench_core->...->mem" .
+
+#ifdef MINSOC_BACKDOOR_MEMORY
+
+#ifndef MINSOC_BACKDOOR_MEMORY_BASE_ADDRESS
+  #define MINSOC_BACKDOOR_MEMORY_BASE_ADDRESS 0
+#endif
+
+static bool access_backdoor_memory ( void * const context,
+                                     const bool is_write,
+                                     const uint32_t address,
+                                     uint8_t * const data,
+                                     const uint32_t byte_count )
+{
+  Vminsoc_bench_core * const top = static_cast< Vminsoc_bench_core * >( context );
+
+  auto & memory = MINSOC_BACKDOOR_MEMORY( top );
+
+  const uint64_t memory_byte_count = uint64_t( sizeof( memory ) / sizeof( memory[0] ) ) * 4;
+
+  // An address below the base wraps around to a huge offset, so a single comparison covers both ends.
+  const uint32_t start_offset = address - uint32_t( MINSOC_BACKDOOR_MEMORY_BASE_ADDRESS );
+
+  if ( uint64_t( start_offset ) + byte_count > memory_byte_count )
+  {
+    return false;
+  }
+
+  for ( uint32_t i = 0; i < byte_count; ++i )
+  {
+    const uint32_t offset = start_offset + i;
+
+    // The OpenRISC CPU is big endian, so the byte at the lowest address is in the most significant bits.
+    const unsigned shift = 24 - 8 * ( offset % 4 );
+
+    uint32_t & word = memory[ offset / 4 ];
+
+    if ( is_write )
+      word = ( word & ~( uint32_t( 0xFF ) << shift ) ) | ( uint32_t( data[ i ] ) << shift );
+    else
+      data[ i ] = uint8_t( word >> shift );
+  }
+
+  return true;
+}
+
+#endif  // #ifdef MINSOC_BACKDOOR_MEMORY
+
+
+// Firmware preload with plusarg +firmware=name. Instead of letting the test bench parse a hex file
+// with $readmemh(), the image is copied straight into the memory through the same backdoor access
+// as above. The file can be a raw binary (loaded at +firmware_address=N, 0 by default), an ELF file
+// (each loadable segment goes to its physical address), or a hex file like the ones run_verilator_bench
+// normally passes with +file_name (one byte per word, with optional @address lines). A hex file is converted
+// to binary on first use, and the result is cached next to it, with .bin appended to the name
+// (name.hex.bin), for later runs. The cache file starts with the size and modification time
+// of the hex file it was converted from, and it is only used if both still match.
+
+static std::string get_error_message ( const std::string & prefix, const int errno_val )
+{
+  return prefix + strerror( errno_val );
+}
+
+
+class mapped_file
+{
+public:
+  explicit mapped_file ( const std::string & filename )
+    : data( NULL )
+    , size( 0 )
+  {
+    const int fd = open( filename.c_str(), O_RDONLY );
+
+    if ( fd == -1 )
+      throw std::runtime_error( get_error_message( "Error opening file \"" + filename + "\": ", errno ) );
+
+    struct stat st;
+
+    if ( 0 != fstat( fd, &st ) )
+    {
+      const int errno_val = errno;
+      close( fd );
+      throw std::runtime_error( get_error_message( "Error reading file \"" + filename + "\": ", errno_val ) );
+    }
+
+    size = size_t( st.st_size );
+
+    // mmap() does not accept a length of zero.
+    if ( size != 0 )
+    {
+      void * const p = mmap( NULL, size, PROT_READ, MAP_PRIVATE, fd, 0 );
+
+      if ( p == MAP_FAILED )
+      {
+        const int errno_val = errno;
+        close( fd );
+        throw std::runtime_error( get_error_message( "Error mapping file \"" + filename + "\": ", errno_val ) );
+      }
+
+      data = static_cast< const uint8_t * >( p );
+    }
+
+    close( fd );
+  }
+
+  ~mapped_file ( void )
+  {
+    if ( data != NULL )
+      munmap( const_cast< uint8_t * >( data ), size );
+  }
+
+  const uint8_t * get_data ( void ) const { return data; }
+  size_t          get_size ( void ) const { return size; }
+
+private:
+  const uint8_t * data;
+  size_t          size;
+
+  mapped_file ( const mapped_file & );  // Not implemented.
+  mapped_file & operator= ( const mapped_file & );  // Not implemented.
+};
+
+
+static void write_firmware_bytes ( Vminsoc_bench_core * const top,
+                                   const uint32_t address,
+                                   const uint8_t * const data,
+                                   const size_t byte_count )
+{
+  if ( uint64_t( address ) + byte_count > uint64_t( UINT32_MAX ) + 1 )
+    throw std::runtime_error( "The firmware image does not fit in the 32-bit address space." );
+
+  #ifdef MINSOC_BACKDOOR_MEMORY
+    // The access routine only reads from the buffer when writing.
+    if ( !access_backdoor_memory( top, true, address, const_cast< uint8_t * >( data ), uint32_t( byte_count ) ) )
+    {
+      char buffer[ 120 ];
+      snprintf( buffer, sizeof(buffer), "The firmware range 0x%08X - 0x%08X is outside the backdoor memory.",
+                unsigned( address ), unsigned( address + byte_count - 1 ) );
+      throw std::runtime_error( buffer );
+    }
+  #else
+    (void) top;
+    (void) data;
+    throw std::runtime_error( "Plusarg +firmware needs MINSOC_BACKDOOR_MEMORY, see verilator_main.cpp." );
+  #endif
+}
+
+
+static uint32_t get_elf_uint ( const uint8_t * const p, const int byte_count, const bool is_big_endian )
+{
+  uint32_t value = 0;
+
+  for ( int i = 0; i < byte_count; ++i )
+  {
+    const uint8_t b = is_big_endian ? p[ i ] : p[ byte_count - 1 - i ];
+    value = ( value << 8 ) | b;
+  }
+
+  return value;
+}
+
+
+// Only 32-bit ELF files are supported, which is what the OpenRISC toolchain generates.
+// Returns the number of bytes loaded.
+
+static size_t load_elf_image ( Vminsoc_bench_core * const top, const mapped_file & file )
+{
+  const uint8_t * const elf  = file.get_data();
+  const size_t          size = file.get_size();
+
+  const size_t ELF_HEADER_LEN = 52;
+  const size_t PROGRAM_HEADER_LEN = 32;
+  const uint32_t PT_LOAD_TYPE = 1;
+
+  if ( size < ELF_HEADER_LEN || elf[ 4 ] != 1 /* ELFCLASS32 */ )
+    throw std::runtime_error( "Only 32-bit ELF firmware files are supported." );
+
+  const bool is_big_endian = elf[ 5 ] == 2;  // ELFDATA2MSB
+
+  const uint32_t ph_offset = get_elf_uint( &elf[ 28 ], 4, is_big_endian );
+  const uint32_t ph_size   = get_elf_uint( &elf[ 42 ], 2, is_big_endian );
+  const uint32_t ph_count  = get_elf_uint( &elf[ 44 ], 2, is_big_endian );
+
+  if ( ph_size < PROGRAM_HEADER_LEN || uint64_t( ph_offset ) + uint64_t( ph_size ) * ph_count > size )
+    throw std::runtime_error( "Invalid ELF program header table in the firmware file." );
+
+  size_t loaded_byte_count = 0;
+
+  for ( uint32_t i = 0; i < ph_count; ++i )
+  {
+    const uint8_t * const ph = &elf[ ph_offset + i * ph_size ];
+
+    if ( get_elf_uint( &ph[ 0 ], 4, is_big_endian ) != PT_LOAD_TYPE )
+      continue;
+
+    const uint32_t offset      = get_elf_uint( &ph[  4 ], 4, is_big_endian );
+    const uint32_t phys_addr   = get_elf_uint( &ph[ 12 ], 4, is_big_endian );
+    const uint32_t file_size   = get_elf_uint( &ph[ 16 ], 4, is_big_endian );
+    const uint32_t memory_size = get_elf_uint( &ph[ 20 ], 4, is_big_endian );
+
+    if ( uint64_t( offset ) + file_size > size || memory_size < file_size )
+      throw std::runtime_error( "Invalid ELF segment in the firmware file." );
+
+    write_firmware_bytes( top, phys_addr, &elf[ offset ], file_size );
+
+    // Clear the rest of the segment, normally the .bss section.
+    const std::vector< uint8_t > zeros( memory_size - file_size, 0 );
+
+    if ( !zeros.empty() )
+      write_firmware_bytes( top, phys_addr + file_size, &zeros[ 0 ], zeros.size() );
+
+    loaded_byte_count += memory_size;
+  }
+
+  return loaded_byte_count;
+}
+
+
+// Converts a hex file for $readmemh() with one byte per word into a flat binary image starting at address 0.
+
+static std::vector< uint8_t > convert_hex_file ( const std::string & filename )
+{
+  const mapped_file file( filename );
+  const char * p         = reinterpret_cast< const char * >( file.get_data() );
+  const char * const end = p + file.get_size();
+
+  std::vector< uint8_t > image;
+  size_t address = 0;
+
+  while ( p != end )
+  {
+    if ( isspace( uint8_t( *p ) ) )
+    {
+      ++p;
+      continue;
+    }
+
+    if ( *p == '/' && p + 1 != end && p[1] == '/' )
+    {
+      while ( p != end && *p != '\n' )
+        ++p;
+      continue;
+    }
+
+    const bool is_address = *p == '@';
+
+    if ( is_address )
+      ++p;
+
+    uint32_t value = 0;
+    int digit_count = 0;
+
+    for ( ; p != end && isxdigit( uint8_t( *p ) ); ++p, ++digit_count )
+    {
+      const char c = char( tolower( *p ) );
+      value = ( value << 4 ) | uint32_t( c <= '9' ? c - '0' : c - 'a' + 10 );
+    }
+
+    if ( digit_count == 0 || digit_count > 8 || ( p != end && !isspace( uint8_t( *p ) ) ) )
+      throw std::runtime_error( "Invalid data in hex file \"" + filename + "\"." );
+
+    if ( is_address )
+    {
+      address = value;
+      continue;
+    }
+
+    if ( digit_count > 2 )
+      throw std::runtime_error( "Hex file \"" + filename + "\" does not have one byte per word." );
+
+    if ( address >= image.size() )
+      image.resize( address + 1, 0 );
+
+    image[ address++ ] = uint8_t( value );
+  }
+
+  return image;
+}
+
+
+// Comparing the modification times of the hex file and the cache file is not enough: the times
+// may have a resolution of whole seconds, the hex file may be rewritten within the same second
+// as the conversion, or an older hex file may be copied over the one that was converted.
+// The cache therefore records which hex file it belongs to, and any difference means converting again.
+// The header is in host byte order, as the cache is not meant to be copied to other machines.
+
+static const char FIRMWARE_CACHE_MAGIC[] = "MSFWCCH1";  // The null terminator is not written.
+
+struct firmware_cache_header
+{
+  char     magic[ 8 ];
+  uint64_t source_size;
+  int64_t  source_mtime_sec;
+  int64_t  source_mtime_nsec;
+};
+
+
+static firmware_cache_header get_firmware_cache_header ( const std::string & source_filename )
+{
+  struct stat st;
+
+  if ( 0 != stat( source_filename.c_str(), &st ) )
+    throw std::runtime_error( get_error_message( "Error reading file \"" + source_filename + "\": ", errno ) );
+
+  firmware_cache_header header;
+  memset( &header, 0, sizeof(header) );
+  memcpy( header.magic, FIRMWARE_CACHE_MAGIC, sizeof(header.magic) );
+  header.source_size       = uint64_t( st.st_size );
+  header.source_mtime_sec  = int64_t( st.st_mtim.tv_sec );
+  header.source_mtime_nsec = int64_t( st.st_mtim.tv_nsec );
+
+  return header;
+}
+
+
+// Returns false if the cache file does not exist, or if it was not converted from the same hex file.
+
+static bool is_cache_file_valid ( const std::string & filename, const firmware_cache_header & expected_header )
+{
+  FILE * const f = fopen( filename.c_str(), "rb" );
+
+  if ( f == NULL )
+    return false;
+
+  firmware_cache_header header;
+  const bool is_header_read = 1 == fread( &header, sizeof(header), 1, f );
+
+  fclose( f );
+
+  return is_header_read && 0 == memcmp( &header, &expected_header, sizeof(header) );
+}
+
+
+static bool write_cache_file ( const std::string & filename,
+                               const firmware_cache_header & header,
+                               const std::vector< uint8_t > & data )
+{
+  // Write to a temporary file first, so that another simulation starting at the same time
+  // never sees a half-written cache file.
+  const std::string temp_filename = filename + ".tmp" + std::to_string( getpid() );
+
+  FILE * const f = fopen( temp_filename.c_str(), "wb" );
+
+  if ( f == NULL )
+    return false;
+
+  const bool write_failed = 1 != fwrite( &header, sizeof(header), 1, f ) ||
+                            ( !data.empty() && data.size() != fwrite( &data[ 0 ], 1, data.size(), f ) );
+
+  if ( 0 != fclose( f ) || write_failed || 0 != rename( temp_filename.c_str(), filename.c_str() ) )
+  {
+    unlink( temp_filename.c_str() );
+    return false;
+  }
+
+  return true;
+}
+
+
+static bool has_suffix ( const std::string & str, const char * const suffix )
+{
+  const size_t suffix_len = strlen( suffix );
+  return str.size() >= suffix_len && 0 == str.compare( str.size() - suffix_len, suffix_len, suffix );
+}
+
+
+static void preload_firmware ( Vminsoc_bench_core * const top, const std::string & filename, const uint32_t address )
+{
+  const std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+
+  std::string loaded_filename = filename;
+  std::string note;
+  size_t byte_count = 0;
+
+  if ( has_suffix( filename, ".hex" ) )
+  {
+    const std::string cache_filename = filename + ".bin";
+
+    // Take the hex file's size and time before converting it. If it changes in the meantime,
+    // the cache will not match anymore, and the next run converts it again.
+    const firmware_cache_header header = get_firmware_cache_header( filename );
+
+    if ( is_cache_file_valid( cache_filename, header ) )
+    {
+      const mapped_file file( cache_filename );
+
+      // The cache file is always replaced with rename(), so it cannot normally shrink after checking it.
+      if ( file.get_size() < sizeof(header) )
+        throw std::runtime_error( "The firmware cache file \"" + cache_filename + "\" is truncated." );
+
+      byte_count = file.get_size() - sizeof(header);
+
+      if ( byte_count != 0 )
+        write_firmware_bytes( top, address, file.get_data() + sizeof(header), byte_count );
+
+      loaded_filename = "";
+      note = ", cached binary used instead of parsing the hex file";
+    }
+    else
+    {
+      const std::vector< uint8_t > image = convert_hex_file( filename );
+
+      char buffer[ 200 ];
+      snprintf( buffer, sizeof(buffer), ", converting the hex file took %.1f ms, which later runs save",
+                get_seconds_since( start_time ) * 1000 );
+      note = buffer;
+
+      if ( !write_cache_file( cache_filename, header, image ) )
+      {
+        fprintf( stderr, "Warning: Cannot write the firmware cache file \"%s\".\n", cache_filename.c_str() );
+        fflush( stderr );
+        note = "";
+      }
+
+      if ( !image.empty() )
+        write_firmware_bytes( top, address, &image[ 0 ], image.size() );
+
+      loaded_filename = "";
+      byte_count = image.size();
+    }
+  }
+
+  if ( !loaded_filename.empty() )
+  {
+    const mapped_file file( loaded_filename );
+    const uint8_t * const data = file.get_data();
+
+    if ( file.get_size() >= 4 && 0 == memcmp( data, "\x7f" "ELF", 4 ) )
+    {
+      byte_count = load_elf_image( top, file );
+    }
+    else
+    {
+      if ( file.get_size() != 0 )
+        write_firmware_bytes( top, address, data, file.get_size() );
+
+      byte_count = file.get_size();
+    }
+  }
+
+  printf( "Firmware preload: %zu bytes from %s in %.1f ms%s.\n",
+          byte_count,
+          filename.c_str(),
+          get_seconds_since( start_time ) * 1000,
+          note.c_str() );
+  fflush( stdout );
+}
+
+
+#if VM_TRACE
+
+// Writes the waveforms only while the JTAG DPI module reports activity, and for a number
+// of clock cycles afterwards. The JTAG DPI module delays the start of the activity by
+// the pre-roll time, so that the trace also shows what happened just before.
+// Skipping calls to dump() is fine, as the trace file only records changes.
+
+class activity_gated_trace
+{
+public:
+  activity_gated_trace ( Vminsoc_bench_core * const top,
+                         const std::string & filename,
+                         const uint64_t post_roll_cycles )
+    : post_roll_cycles( post_roll_cycles )
+    , last_activity_count( 0 )
+    , last_activity_cycle( 0 )
+    , is_recording( false )
+    , window_count( 0 )
+  {
+    top->trace( &trace_file, 99 );  // Trace 99 levels of hierarchy.
+    trace_file.open( filename.c_str() );
+
+    if ( !trace_file.isOpen() )
+      throw std::runtime_error( "Cannot open trace file " + filename + " ." );
+  }
+
+  ~activity_gated_trace ( void )
+  {
+    trace_file.close();
+  }
+
+  void dump ( const uint64_t simulation_time, const uint64_t clock_cycle )
+  {
+    const uint64_t activity_count = jtag_dpi_get_activity_count();
+
+    if ( activity_count != last_activity_count )
+    {
+      last_activity_count = activity_count;
+      last_activity_cycle = clock_cycle;
+
+      if ( !is_recording )
+      {
+        is_recording = true;
+        ++window_count;
+        printf( "Waveform trace: recording from clock cycle %" PRIu64 ".\n", clock_cycle );
+        fflush( stdout );
+      }
+    }
+    else if ( is_recording && clock_cycle - last_activity_cycle > post_roll_cycles )
+    {
+      is_recording = false;
+      trace_file.flush();
+      printf( "Waveform trace: stopped at clock cycle %" PRIu64 ".\n", clock_cycle );
+      fflush( stdout );
+    }
+
+    if ( is_recording )
+      trace_file.dump( vluint64_t( simulation_time ) );
+  }
+
+  uint64_t get_window_count ( void ) const { return window_count; }
+
+private:
+  trace_file_type trace_file;
+  const uint64_t  post_roll_cycles;
+  uint64_t        last_activity_count;
+  uint64_t        last_activity_cycle;
+  bool            is_recording;
+  uint64_t        window_count;
+};
+
+#endif
+
+
+static void print_speed_report ( const double elapsed_seconds,
+                                 const uint64_t interval_cycles,
+                                 const double interval_seconds )
+{
+  const double jtag_dpi_seconds = double( jtag_dpi_get_tick_time_ns() ) / 1e9;
+
+  printf( "Simulation speed: %" PRIu64 " clock cycles, %.0f cycles/s now, %.0f cycles/s on average,"
+          " %.1f%% of the time inside jtag_dpi_tick().\n",
+          get_simulated_clock_cycles(),
+          double( interval_cycles ) / interval_seconds,
+          double( get_clock_cycles_this_run() ) / elapsed_seconds,
+          100.0 * jtag_dpi_seconds / elapsed_seconds );
+  fflush( stdout );
+}
+
+
+static void print_summary ( const char * const stop_reason, const double elapsed_seconds )
+{
+  // jtag_dpi_tick() runs inside eval(). The time spent here in the main loop is negligible.
+  const double jtag_dpi_seconds = double( jtag_dpi_get_tick_time_ns() ) / 1e9;
+
+  printf( "Simulation summary: %s after %" PRIu64 " clock cycles in %.2f s wall-clock time, %.0f cycles/s,"
+          " %.2f s (%.1f%%) inside jtag_dpi_tick(), %.2f s in the rest of eval().\n",
+          stop_reason,
+          get_simulated_clock_cycles(),
+          elapsed_seconds,
+          double( get_clock_cycles_this_run() ) / elapsed_seconds,
+          jtag_dpi_seconds,
+          100.0 * jtag_dpi_seconds / elapsed_seconds,
+          elapsed_seconds - jtag_dpi_seconds );
+  fflush( stdout );
+}
+
+
 int main ( int argc, char ** argv, char ** env )
 {
   // The reset level can be positive or negative.
@@ -58,16 +842,152 @@ int main ( int argc, char ** argv, char ** env )
     Verilated::commandArgs( argc, argv );  // Remember args for $value$plusargs() and the like.
     Verilated::debug( 0 );  // Comment from Verilator example: "We compiled with it on for testing, turn it back off"
 
+    // Plusargs for simulation farms:
+    //   +max_cycles=N             Stop after N clock cycles. 0 means no limit.
+    //   +timeout_seconds=N        Stop with an error after N seconds of wall-clock time. 0 means no limit.
+    //   +speed_report_interval=N  Print the simulation speed every N seconds. 0 disables the periodic report,
+    //                             but a summary line is always printed at the end.
+    // Waveform tracing, only available if the model was generated with tracing support:
+    //   +trace_file=name          Write the waveforms around JTAG activity to this VCD or FST file.
+    //   +trace_pre_roll_cycles=N  Start tracing N clock cycles before a JTAG client starts sending data.
+    //   +trace_post_roll_cycles=N Stop tracing N clock cycles after the last JTAG activity.
+    // Firmware preload, only available if MINSOC_BACKDOOR_MEMORY is defined:
+    //   +firmware=name            Copy a binary, ELF or hex file straight into memory before the simulation starts.
+    //   +firmware_address=N       Load address for raw binary and hex files, 0 by default.
+    // Checkpoints, only available if the model was generated with option --savable:
+    //   +checkpoint_save=name     Save a checkpoint to this file at +checkpoint_cycle=N,
+    //                             and whenever the process receives signal SIGUSR1.
+    //   +checkpoint_restore=name  Continue from a checkpoint instead of starting from reset.
+    const uint64_t max_cycles            = get_numeric_plusarg( "max_cycles", 0 );
+    const uint64_t timeout_seconds       = get_numeric_plusarg( "timeout_seconds", 0 );
+    const uint64_t speed_report_interval = get_numeric_plusarg( "speed_report_interval", 10 );
+
+    const std::string trace_filename = get_string_plusarg( "trace_file" );
+
+    const std::string firmware_filename = get_string_plusarg( "firmware" );
+    const uint64_t    firmware_address  = get_numeric_plusarg( "firmware_address", 0 );
+
+    if ( firmware_address > UINT32_MAX )
+      throw std::runtime_error( "Plusarg +firmware_address is out of range." );
+
+    const std::string checkpoint_save_filename    = get_string_plusarg( "checkpoint_save" );
+    const std::string checkpoint_restore_filename = get_string_plusarg( "checkpoint_restore" );
+
+    // The restored memory already contains the firmware.
+    if ( !checkpoint_restore_filename.empty() && !firmware_filename.empty() )
+      throw std::runtime_error( "Plusargs +checkpoint_restore and +firmware cannot be used together." );
+
+    #ifdef MINSOC_SAVABLE_MODEL
+      const uint64_t checkpoint_cycle = get_numeric_plusarg( "checkpoint_cycle", 0 );
+
+      if ( !checkpoint_save_filename.empty() )
+        install_checkpoint_signal_handler();
+    #else
+      if ( !checkpoint_save_filename.empty() || !checkpoint_restore_filename.empty() )
+        throw std::runtime_error( "Checkpoints require a model generated with option --savable." );
+    #endif
+
+    jtag_dpi_enable_tick_profiling();
+
+    #if VM_TRACE
+      const uint64_t trace_pre_roll_cycles  = get_numeric_plusarg( "trace_pre_roll_cycles" , 1000 );
+      const uint64_t trace_post_roll_cycles = get_numeric_plusarg( "trace_post_roll_cycles", 10000 );
+
+      if ( !trace_filename.empty() )
+      {
+        // The JTAG DPI module ticks once per clock cycle.
+        jtag_dpi_enable_activity_tracking( trace_pre_roll_cycles, trace_post_roll_cycles );
+        Verilated::traceEverOn( true );
+      }
+    #else
+      if ( !trace_filename.empty() )
+        throw std::runtime_error( "Plusarg +trace_file requires a model generated with tracing support." );
+    #endif
+
     Vminsoc_bench_core * const top = new Vminsoc_bench_core;
 
+    #ifdef MINSOC_BACKDOOR_MEMORY
+      jtag_dpi_set_backdoor_memory_access( access_backdoor_memory, top );
+    #endif
+
+    #if VM_TRACE
+      activity_gated_trace * const trace = trace_filename.empty()
+                                             ? NULL
+                                             : new activity_gated_trace( top, trace_filename, trace_post_roll_cycles );
+    #endif
+
     const uint64_t reset_duration = 10;  // Number of rising clock edges the reset signal will be asserted,
                                          // set it to 0 in order to start the simulation without asserting the reset signal
                                          // (handy to simulate FPGA designs without user reset signal).
 
     top->reset = reset_duration > 0 ? RESET_ASSERTED : RESET_DEASSERTED;
 
+    #ifdef MINSOC_SAVABLE_MODEL
+      if ( !checkpoint_restore_filename.empty() )
+        restore_checkpoint( top, checkpoint_restore_filename );
+    #endif
+
+    if ( !firmware_filename.empty() )
+    {
+      // The initial blocks run during the first eval(), so settle the model once before
+      // overwriting the memory contents, or an initial block could clear them again.
+      // The clock does not toggle here, so no simulation time passes.
+      top->eval();
+
+      preload_firmware( top, firmware_filename, uint32_t( firmware_address ) );
+    }
+
+    const std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+    double   last_report_seconds = 0;
+    uint64_t last_report_cycles  = get_simulated_clock_cycles();
+    uint64_t wall_clock_check_countdown = WALL_CLOCK_CHECK_INTERVAL;
+    const char * stop_reason = "$finish";
+    bool has_timed_out = false;
+
     while ( !Verilated::gotFinish() )
     {
+      if ( max_cycles != 0 && get_simulated_clock_cycles() >= max_cycles )
+      {
+        stop_reason = "Cycle budget (+max_cycles) reached";
+        break;
+      }
+
+      if ( --wall_clock_check_countdown == 0 )
+      {
+        wall_clock_check_countdown = WALL_CLOCK_CHECK_INTERVAL;
+
+        const double elapsed_seconds = get_seconds_since( start_time );
+
+        if ( timeout_seconds != 0 && elapsed_seconds >= double( timeout_seconds ) )
+        {
+          stop_reason = "Wall-clock timeout (+timeout_seconds) expired";
+          has_timed_out = true;
+          break;
+        }
+
+        if ( speed_report_interval != 0 && elapsed_seconds - last_report_seconds >= double( speed_report_interval ) )
+        {
+          print_speed_report( elapsed_seconds,
+                              get_simulated_clock_cycles() - last_report_cycles,
+                              elapsed_seconds - last_report_seconds );
+          last_report_seconds = elapsed_seconds;
+          last_report_cycles  = get_simulated_clock_cycles();
+        }
+      }
+
+      #ifdef MINSOC_SAVABLE_MODEL
+        // Only save between whole clock cycles, so that a restored simulation resumes with the rising edge.
+        if ( !checkpoint_save_filename.empty() && current_simulation_time % 2 == 0 )
+        {
+          if ( is_checkpoint_requested ||
+               ( checkpoint_cycle != 0 && get_simulated_clock_cycles() == checkpoint_cycle ) )
+          {
+            is_checkpoint_requested = 0;
+            save_checkpoint( top, checkpoint_save_filename );
+          }
+        }
+      #endif
+
       // printf( "Iteration, clock: current_simulation_time %" PRIu64 "\n", current_simulation_time );
       // printf( "Reset: %d\n", top->reset );
 
@@ -80,16 +1000,39 @@ int main ( int argc, char ** argv, char ** env )
 
       top->eval();
 
+      #if VM_TRACE
+        if ( trace != NULL )
+          trace->dump( current_simulation_time, get_simulated_clock_cycles() );
+      #endif
+
       ++current_simulation_time;
 
       // Provide an early warning against the remote possibility of a wrap-around.
       assert( current_simulation_time < UINT64_MAX / 100000 );
     }
 
+    print_summary( stop_reason, get_seconds_since( start_time ) );
+
     top->final();
 
+    #if VM_TRACE
+      if ( trace != NULL )
+      {
+        printf( "Waveform trace: %" PRIu64 " recording windows written to %s .\n",
+                trace->get_window_count(),
+                trace_filename.c_str() );
+        delete trace;
+      }
+    #endif
+
     delete top;
 
+    if ( has_timed_out )
+    {
+      fprintf( stderr, "%s%s\n", "ERROR: ", "The simulation did not finish within the wall-clock timeout." );
+      return 1;
+    }
+
     return 0;
   }
   catch ( const std::exception & e )
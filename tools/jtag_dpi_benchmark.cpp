@@ -0,0 +1,1686 @@
+
+// Copyright (c) 2012, R. Diez
+//
+// Standalone benchmark for the JTAG DPI module. It calls jtag_dpi_tick() in a tight loop,
+// like a Verilator simulation would do on every system_clk cycle, but without any RTL.
+// A minimal TAP model provides the TDO values, and a client thread in the same process
+// reads the TAP's IDCODE over and over, generating the same kind of traffic as adv_jtag_bridge.
+//
+// The benchmark measures the time per tick while no client is connected, while a client is connected
+// but idle, and while a client is busy, as well as the end-to-end JTAG throughput in TCK cycles per second.
+// Run it before and after touching jtag_dpi.cpp in order to catch performance regressions
+// in the tick path. See build_jtag_dpi_benchmark for instructions on how to build it.
+//
+// With --batched, it calls jtag_dpi_tick_batch() only when jtag_dpi.v would, and also reports
+// how many DPI calls per tick that takes. The client checks every IDCODE it reads,
+// so this also verifies that the TDO values sampled between calls end up in the right place.
+//
+// With --protocol=gdb, the client talks to the built-in GDB server instead, and the TAP model
+// has an adv_dbg_if debug interface with a very simple OpenRISC CPU behind it. Before the benchmark,
+// the client goes through registers, memory, breakpoints, single-stepping and interrupting the CPU,
+// and afterwards it checks that breakpoints left behind are removed when the GDB session ends abruptly.
+
+#include "../jtag_dpi.cpp"  // This also brings in the internal routines, like is_connection_open().
+#include "../jtag_dpi_shm_client.h"
+
+#include <signal.h>
+#include <stdlib.h>
+#include <netinet/tcp.h>
+
+
+static const uint32_t FAKE_IDCODE = 0x14951185;  // The same as the OpenRISC adv_dbg_sys TAP.
+
+// Each IDCODE read goes through Test-Logic-Reset (5 cycles), Run-Test/Idle, Select-DR-Scan, Capture-DR,
+// Shift-DR (32 cycles, the last one exits the state), Update-DR and back to Run-Test/Idle.
+static const int IDCODE_READ_TCK_CYCLE_COUNT = 5 + 4 + 32 + 2;
+static const int IDCODE_FIRST_TDO_BIT = 5 + 4;
+
+
+enum protocol_enum
+{
+  PROTOCOL_BYTES,   // The original byte protocol, one socket round trip per pin change, like adv_jtag_bridge.
+  PROTOCOL_VECTOR,  // One vector scan per IDCODE read.
+  PROTOCOL_STREAM,  // Streaming mode with credits.
+  PROTOCOL_JTAG_VPI, // OpenOCD's jtag_vpi protocol, with a module instance configured for it.
+  PROTOCOL_GDB       // GDB's remote protocol, through the built-in GDB server.
+};
+
+struct benchmark_options
+{
+  uint64_t       tick_count;
+  int            io_mode;
+  int            transport;
+  protocol_enum  protocol;
+  int            tcp_port;
+  int            gdb_tcp_port;
+  int            tck_half_period_tick_count;
+  int            accept_poll_interval_tick_count;
+  bool           batched;
+  bool           verbose;
+  std::string    unix_socket_path;
+  std::string    trace_file_name;
+};
+
+
+// Model of an OpenRISC system behind the Advanced Debug Interface (adv_dbg_if), for --protocol=gdb.
+// It implements the parts that jtag_dpi.cpp's GDB server uses: module selection, burst reads and writes
+// with CRC on the Wishbone and CPU0 modules, and the CPU0 stall register. The CPU executes one instruction
+// per tick and only knows l.addi, l.j (without a delay slot) and l.trap. Everything else is a no-op.
+
+static const uint32_t FAKE_MEMORY_SIZE  = 0x10000;
+static const uint32_t FAKE_RESET_VECTOR = 0x100;
+static const uint32_t FAKE_TRAP_VECTOR  = 0xE00;
+
+// The test program is an endless loop that increments r3 and r4.
+static const uint32_t FAKE_PROGRAM[] =
+{
+  0x9C630001,  // 0x100: l.addi r3,r3,1
+  0x9C840002,  // 0x104: l.addi r4,r4,2
+  0x03FFFFFE,  // 0x108: l.j    0x100
+  0x15000000,  // 0x10C: l.nop, never reached.
+};
+
+// The burst read status bit comes after this many TCK cycles, as if the bus took some time.
+static const uint32_t FAKE_READ_LATENCY_BIT_COUNT = 5;
+
+static const uint32_t TAP_IR_IDCODE  = 0x2;
+static const uint32_t TAP_IR_CAPTURE = 0x5;
+
+
+class fake_or1k_target
+{
+public:
+  fake_or1k_target ( void )
+    : memory( FAKE_MEMORY_SIZE, 0 )
+    , npc( FAKE_RESET_VECTOR )
+    , ppc( 0 )
+    , sr( 0 )
+    , dmr1( 0 )
+    , dsr( 0 )
+    , drr( 0 )
+    , cpu_status( 0 )
+    , selected_module( -1 )
+    , is_status_register_selected( false )
+    , is_in_burst( false )
+    , burst_is_write( false )
+    , burst_word_bit_count( 0 )
+    , burst_address( 0 )
+    , burst_word_count( 0 )
+    , burst_write_start_bit( -1 )
+    , tdo( 0 )
+  {
+    for ( int i = 0; i < OR1K_GPR_COUNT; ++i )
+      gpr[ i ] = 0;
+
+    for ( size_t i = 0; i < sizeof(FAKE_PROGRAM) / sizeof(FAKE_PROGRAM[0]); ++i )
+      write_memory_word( FAKE_RESET_VECTOR + uint32_t( i ) * 4, FAKE_PROGRAM[ i ] );
+  }
+
+  // The JTAG side. The TAP calls these routines while its DEBUG instruction is selected.
+
+  void reset_debug_interface ( void )
+  {
+    selected_module = -1;
+    is_in_burst = false;
+    is_status_register_selected = false;
+  }
+
+  void capture_dr ( void )
+  {
+    tdi_bits.clear();
+    tdo_bits.clear();
+    burst_write_start_bit = -1;
+
+    if ( is_in_burst && !burst_is_write )
+      prepare_burst_read();
+    else if ( is_status_register_selected )
+      append_tdo_bits( cpu_status, ADBG_CPU0_STATUS_LENGTH );
+
+    tdo = tdo_bits.empty() ? 0 : tdo_bits[ 0 ];
+  }
+
+  // Shifts one TDI bit in, and prepares the TDO value for the next one.
+
+  void shift_dr ( const bool tdi )
+  {
+    tdi_bits.push_back( tdi );
+    const size_t next_bit = tdi_bits.size();
+
+    if ( is_in_burst && burst_is_write )
+    {
+      tdo = 0;
+
+      if ( burst_write_start_bit == -1 )
+      {
+        if ( tdi )
+          burst_write_start_bit = int( next_bit - 1 );
+      }
+      else if ( next_bit == size_t( burst_write_start_bit ) + 1 + burst_word_count * burst_word_bit_count + 32 )
+      {
+        // The CRC match flag comes right after the CRC.
+        tdo = finish_burst_write() ? 1 : 0;
+      }
+
+      return;
+    }
+
+    tdo = next_bit < tdo_bits.size() ? tdo_bits[ next_bit ] : 0;
+  }
+
+  void update_dr ( void )
+  {
+    const uint32_t bit_count = uint32_t( tdi_bits.size() );
+
+    if ( bit_count == 0 )
+      return;
+
+    // The data scan ends a burst.
+    if ( is_in_burst )
+    {
+      is_in_burst = false;
+      return;
+    }
+
+    // The last bit shifted in ends up at the top of the shift register.
+    if ( tdi_bits.back() )
+    {
+      if ( bit_count > ADBG_MODULE_ID_LENGTH )
+        selected_module = int( get_tdi_bits( bit_count - 1 - ADBG_MODULE_ID_LENGTH, ADBG_MODULE_ID_LENGTH ) );
+
+      is_status_register_selected = false;
+      return;
+    }
+
+    if ( selected_module == -1 || bit_count < 1 + ADBG_OPCODE_LENGTH )
+      return;
+
+    const uint32_t opcode = get_tdi_bits( bit_count - 1 - ADBG_OPCODE_LENGTH, ADBG_OPCODE_LENGTH );
+
+    switch ( opcode )
+    {
+    case ADBG_CMD_BWRITE8:
+    case ADBG_CMD_BWRITE32:
+    case ADBG_CMD_BREAD8:
+    case ADBG_CMD_BREAD32:
+      if ( bit_count != 16 + 32 + ADBG_OPCODE_LENGTH + 1 )
+        return;
+
+      is_in_burst          = true;
+      burst_is_write       = opcode == ADBG_CMD_BWRITE8 || opcode == ADBG_CMD_BWRITE32;
+      burst_word_bit_count = ( opcode == ADBG_CMD_BWRITE8 || opcode == ADBG_CMD_BREAD8 ) ? 8 : 32;
+      burst_word_count     = get_tdi_bits( 0, 16 );
+      burst_address        = get_tdi_bits( 16, 32 );
+      break;
+
+    case ADBG_CMD_IREG_WR:
+      if ( selected_module == ADBG_MODULE_CPU0 && bit_count == ADBG_CPU0_STATUS_LENGTH + ADBG_CPU0_REG_SEL_LENGTH + ADBG_OPCODE_LENGTH + 1 &&
+           get_tdi_bits( ADBG_CPU0_STATUS_LENGTH, ADBG_CPU0_REG_SEL_LENGTH ) == ADBG_CPU0_REG_STATUS )
+      {
+        cpu_status = get_tdi_bits( 0, ADBG_CPU0_STATUS_LENGTH );
+      }
+      break;
+
+    case ADBG_CMD_IREG_SEL:
+      is_status_register_selected = selected_module == ADBG_MODULE_CPU0 &&
+                                    get_tdi_bits( bit_count - 1 - ADBG_OPCODE_LENGTH - ADBG_CPU0_REG_SEL_LENGTH,
+                                                  ADBG_CPU0_REG_SEL_LENGTH ) == ADBG_CPU0_REG_STATUS;
+      break;
+
+    default:
+      // No operation.
+      break;
+    }
+  }
+
+  unsigned char get_tdo ( void ) const { return tdo; }
+
+
+  // The system side.
+
+  void run_cpu_cycle ( void )
+  {
+    if ( cpu_status & ADBG_CPU0_STATUS_STALL )
+      return;
+
+    const uint32_t pc = npc;
+    const uint32_t instruction = read_memory_word( pc );
+
+    ppc = pc;
+    npc = pc + 4;
+
+    if ( instruction == OR1K_TRAP_INSTRUCTION )
+    {
+      if ( dsr & OR1K_DSR_TE )
+      {
+        drr |= OR1K_DRR_TE;
+        cpu_status |= ADBG_CPU0_STATUS_STALL;
+      }
+      else
+      {
+        npc = FAKE_TRAP_VECTOR;
+      }
+
+      return;
+    }
+
+    switch ( instruction >> 26 )
+    {
+    case 0x00:  // l.j
+      npc = pc + ( uint32_t( int32_t( instruction << 6 ) >> 6 ) << 2 );
+      break;
+
+    case 0x27:  // l.addi
+      {
+        const uint32_t rd = ( instruction >> 21 ) & 0x1F;
+        const uint32_t ra = ( instruction >> 16 ) & 0x1F;
+
+        if ( rd != 0 )
+          gpr[ rd ] = gpr[ ra ] + uint32_t( int32_t( int16_t( instruction & 0xFFFF ) ) );
+        break;
+      }
+
+    default:
+      break;
+    }
+
+    if ( dmr1 & OR1K_DMR1_ST )
+    {
+      drr |= OR1K_DRR_TE;
+      cpu_status |= ADBG_CPU0_STATUS_STALL;
+    }
+  }
+
+  uint32_t read_memory_word ( const uint32_t address ) const
+  {
+    return uint32_t( read_memory_byte( address     ) ) << 24 |
+           uint32_t( read_memory_byte( address + 1 ) ) << 16 |
+           uint32_t( read_memory_byte( address + 2 ) ) <<  8 |
+           uint32_t( read_memory_byte( address + 3 ) );
+  }
+
+  bool is_stalled ( void ) const { return ( cpu_status & ADBG_CPU0_STATUS_STALL ) != 0; }
+
+  uint32_t get_spr ( const uint32_t spr ) const
+  {
+    if ( spr >= OR1K_SPR_GPR0 && spr < OR1K_SPR_GPR0 + OR1K_GPR_COUNT )
+      return gpr[ spr - OR1K_SPR_GPR0 ];
+
+    switch ( spr )
+    {
+    case OR1K_SPR_NPC : return npc;
+    case OR1K_SPR_SR  : return sr;
+    case OR1K_SPR_PPC : return ppc;
+    case OR1K_SPR_DMR1: return dmr1;
+    case OR1K_SPR_DSR : return dsr;
+    case OR1K_SPR_DRR : return drr;
+    default:            return 0;
+    }
+  }
+
+private:
+  uint8_t read_memory_byte ( const uint32_t address ) const
+  {
+    return memory[ address % FAKE_MEMORY_SIZE ];
+  }
+
+  void write_memory_byte ( const uint32_t address, const uint8_t value )
+  {
+    memory[ address % FAKE_MEMORY_SIZE ] = value;
+  }
+
+  void write_memory_word ( const uint32_t address, const uint32_t value )
+  {
+    write_memory_byte( address,     uint8_t( value >> 24 ) );
+    write_memory_byte( address + 1, uint8_t( value >> 16 ) );
+    write_memory_byte( address + 2, uint8_t( value >>  8 ) );
+    write_memory_byte( address + 3, uint8_t( value       ) );
+  }
+
+  void set_spr ( const uint32_t spr, const uint32_t value )
+  {
+    if ( spr >= OR1K_SPR_GPR0 + 1 && spr < OR1K_SPR_GPR0 + OR1K_GPR_COUNT )
+    {
+      gpr[ spr - OR1K_SPR_GPR0 ] = value;
+      return;
+    }
+
+    // The PPC is read only.
+    switch ( spr )
+    {
+    case OR1K_SPR_NPC : npc  = value; break;
+    case OR1K_SPR_SR  : sr   = value; break;
+    case OR1K_SPR_DMR1: dmr1 = value; break;
+    case OR1K_SPR_DSR : dsr  = value; break;
+    case OR1K_SPR_DRR : drr  = value; break;
+    default:                          break;
+    }
+  }
+
+  // Words are 32-bit SPRs on the CPU0 module, and bytes or big-endian words on the Wishbone bus.
+
+  uint32_t read_burst_word ( const uint32_t index ) const
+  {
+    if ( selected_module == ADBG_MODULE_CPU0 )
+      return get_spr( burst_address + index );
+
+    if ( burst_word_bit_count == 8 )
+      return read_memory_byte( burst_address + index );
+
+    return read_memory_word( burst_address + index * 4 );
+  }
+
+  void write_burst_word ( const uint32_t index, const uint32_t value )
+  {
+    if ( selected_module == ADBG_MODULE_CPU0 )
+      set_spr( burst_address + index, value );
+    else if ( burst_word_bit_count == 8 )
+      write_memory_byte( burst_address + index, uint8_t( value ) );
+    else
+      write_memory_word( burst_address + index * 4, value );
+  }
+
+  uint32_t get_tdi_bits ( const uint32_t first_bit, const uint32_t bit_count ) const
+  {
+    uint32_t value = 0;
+
+    for ( uint32_t i = 0; i < bit_count; ++i )
+    {
+      if ( tdi_bits[ first_bit + i ] )
+        value |= uint32_t( 1 ) << i;
+    }
+
+    return value;
+  }
+
+  void append_tdo_bits ( const uint32_t value, const uint32_t bit_count )
+  {
+    for ( uint32_t i = 0; i < bit_count; ++i )
+      tdo_bits.push_back( ( value >> i ) & 1 );
+  }
+
+  bool is_burst_mapped ( void ) const
+  {
+    if ( selected_module == ADBG_MODULE_CPU0 )
+      return true;
+
+    return uint64_t( burst_address ) + uint64_t( burst_word_count ) * ( burst_word_bit_count / 8 ) <= FAKE_MEMORY_SIZE;
+  }
+
+  // Some idle bits, the status bit, the words and their CRC.
+  // Wishbone addresses outside the memory never answer, so the status bit never comes.
+
+  void prepare_burst_read ( void )
+  {
+    if ( !is_burst_mapped() )
+      return;
+
+    append_tdo_bits( 0, FAKE_READ_LATENCY_BIT_COUNT );
+    append_tdo_bits( 1, 1 );
+
+    uint32_t crc = 0xFFFFFFFF;
+
+    for ( uint32_t i = 0; i < burst_word_count; ++i )
+    {
+      const uint32_t word = read_burst_word( i );
+
+      append_tdo_bits( word, burst_word_bit_count );
+      crc = adbg_update_crc( crc, word, burst_word_bit_count );
+    }
+
+    append_tdo_bits( crc, 32 );
+  }
+
+  // Only writes the words if the CRC matches, and returns whether it did.
+
+  bool finish_burst_write ( void )
+  {
+    uint32_t pos = uint32_t( burst_write_start_bit ) + 1;
+    uint32_t crc = 0xFFFFFFFF;
+
+    std::vector< uint32_t > words;
+
+    for ( uint32_t i = 0; i < burst_word_count; ++i )
+    {
+      words.push_back( get_tdi_bits( pos, burst_word_bit_count ) );
+      crc = adbg_update_crc( crc, words.back(), burst_word_bit_count );
+      pos += burst_word_bit_count;
+    }
+
+    if ( crc != get_tdi_bits( pos, 32 ) )
+      return false;
+
+    if ( !is_burst_mapped() )
+      return true;
+
+    for ( uint32_t i = 0; i < burst_word_count; ++i )
+      write_burst_word( i, words[ i ] );
+
+    return true;
+  }
+
+  std::vector< uint8_t > memory;
+  uint32_t gpr[ OR1K_GPR_COUNT ];
+  uint32_t npc, ppc, sr, dmr1, dsr, drr;
+  uint32_t cpu_status;
+
+  int      selected_module;
+  bool     is_status_register_selected;
+  bool     is_in_burst;
+  bool     burst_is_write;
+  uint32_t burst_word_bit_count;
+  uint32_t burst_address;
+  uint32_t burst_word_count;
+  int      burst_write_start_bit;  // -1 until the start bit has arrived.
+
+  std::vector< bool > tdi_bits;  // Shifted in since Capture-DR.
+  std::vector< bool > tdo_bits;  // To shift out after Capture-DR, zeros afterwards.
+  unsigned char tdo;
+};
+
+static fake_or1k_target * s_or1k_target = NULL;  // Only with --protocol=gdb.
+
+
+// TAP model with the IDCODE register. The IDCODE clients never change the instruction register,
+// and the TAP comes out of Test-Logic-Reset with IDCODE selected, so that is all they need.
+// With a debug target, the DEBUG instruction connects the data register to it, like adv_dbg_sys does.
+
+class fake_tap
+{
+public:
+  explicit fake_tap ( fake_or1k_target * const debug_target )
+    : state( tap_test_logic_reset )
+    , instruction( TAP_IR_IDCODE )
+    , ir_shift_register( 0 )
+    , shift_register( 0 )
+    , tck( false )
+    , tdo( 0 )
+    , tck_cycle_count( 0 )
+    , debug_target( debug_target )
+  {
+  }
+
+  void update_pins ( const bool new_tck, const bool tms, const bool tdi, const bool trst )
+  {
+    if ( !trst )
+    {
+      reset();
+    }
+    else if ( new_tck && !tck )
+    {
+      // Rising edge: TMS and TDI are sampled.
+      ++tck_cycle_count;
+
+      if ( state == tap_capture_dr )
+      {
+        if ( is_debug_selected() )
+          debug_target->capture_dr();
+        else
+          shift_register = ( instruction == TAP_IR_IDCODE ) ? FAKE_IDCODE : 0;
+      }
+      else if ( state == tap_shift_dr )
+      {
+        if ( is_debug_selected() )
+          debug_target->shift_dr( tdi );
+        else
+          shift_register = ( shift_register >> 1 ) | ( uint32_t( tdi ) << 31 );
+      }
+      else if ( state == tap_update_dr )
+      {
+        if ( is_debug_selected() )
+          debug_target->update_dr();
+      }
+      else if ( debug_target != NULL )
+      {
+        // The IDCODE clients never get here.
+        if ( state == tap_capture_ir )
+          ir_shift_register = TAP_IR_CAPTURE;
+        else if ( state == tap_shift_ir )
+          ir_shift_register = ( ir_shift_register >> 1 ) | ( uint32_t( tdi ) << ( ADBG_TAP_IR_LENGTH - 1 ) );
+        else if ( state == tap_update_ir )
+          instruction = ir_shift_register;
+      }
+
+      state = get_next_tap_state( state, tms );
+
+      if ( state == tap_test_logic_reset )
+        reset();
+    }
+    else if ( !new_tck && tck )
+    {
+      // Falling edge: TDO changes.
+      if ( state == tap_shift_dr )
+        tdo = is_debug_selected() ? debug_target->get_tdo() : ( shift_register & 1 );
+      else if ( state == tap_shift_ir )
+        tdo = ir_shift_register & 1;
+      else
+        tdo = 0;
+    }
+
+    tck = new_tck;
+  }
+
+  unsigned char get_tdo ( void ) const { return tdo; }
+
+  uint64_t get_tck_cycle_count ( void ) const { return tck_cycle_count; }
+
+private:
+  bool is_debug_selected ( void ) const
+  {
+    return debug_target != NULL && instruction == ADBG_TAP_IR_DEBUG;
+  }
+
+  // adv_dbg_if is reset together with the TAP.
+
+  void reset ( void )
+  {
+    state = tap_test_logic_reset;
+    instruction = TAP_IR_IDCODE;
+
+    if ( debug_target != NULL )
+      debug_target->reset_debug_interface();
+  }
+
+  tap_state_enum state;
+  uint32_t       instruction;
+  uint32_t       ir_shift_register;
+  uint32_t       shift_register;
+  bool           tck;
+  unsigned char  tdo;
+  uint64_t       tck_cycle_count;
+  fake_or1k_target * const debug_target;
+};
+
+
+enum client_phase_enum
+{
+  CLIENT_IDLE,
+  CLIENT_BUSY,
+  CLIENT_STOP
+};
+
+static std::atomic< int  > s_client_phase( CLIENT_IDLE );
+static std::atomic< bool > s_client_finished( false );
+static std::atomic< uint64_t > s_client_idcode_read_count( 0 );  // Or GDB memory reads with --protocol=gdb.
+static std::string s_client_error_msg;  // Only valid after s_client_finished is set.
+
+
+class benchmark_client
+{
+public:
+  explicit benchmark_client ( const benchmark_options & options )
+    : socket_fd( -1 )
+    , shm_client( NULL )
+  {
+    if ( options.transport == TRANSPORT_SHM )
+    {
+      shm_client = jtag_dpi_shm_connect( options.unix_socket_path.c_str() );
+
+      if ( shm_client == NULL )
+        throw std::runtime_error( get_error_message( "Error connecting to the shared-memory transport: ", errno ) );
+
+      return;
+    }
+
+    sockaddr_in inet_addr;
+    sockaddr_un unix_addr;
+    const sockaddr * addr;
+    socklen_t addr_len;
+
+    if ( options.transport == TRANSPORT_UNIX )
+    {
+      memset( &unix_addr, 0, sizeof(unix_addr) );
+      unix_addr.sun_family = AF_UNIX;
+      strcpy( unix_addr.sun_path, options.unix_socket_path.c_str() );
+      addr     = (const sockaddr *) &unix_addr;
+      addr_len = sizeof( unix_addr );
+    }
+    else
+    {
+      memset( &inet_addr, 0, sizeof(inet_addr) );
+      inet_addr.sin_family      = AF_INET;
+      inet_addr.sin_port        = htons( uint16_t( options.tcp_port ) );
+      inet_addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+      addr     = (const sockaddr *) &inet_addr;
+      addr_len = sizeof( inet_addr );
+    }
+
+    socket_fd = socket( addr->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+
+    if ( socket_fd == -1 )
+      throw std::runtime_error( get_error_message( "Error creating the client socket: ", errno ) );
+
+    if ( connect( socket_fd, addr, addr_len ) == -1 )
+    {
+      const int saved_errno = errno;
+      close_a( socket_fd );
+      throw std::runtime_error( get_error_message( "Error connecting to the JTAG DPI module: ", saved_errno ) );
+    }
+
+    if ( options.transport == TRANSPORT_TCP )
+    {
+      // Like adv_jtag_bridge, disable Nagle's algorithm, or each small command would wait for the previous reply.
+      const int set_to_yes = 1;
+      setsockopt( socket_fd, IPPROTO_TCP, TCP_NODELAY, &set_to_yes, sizeof(set_to_yes) );
+    }
+  }
+
+  ~benchmark_client ( void )
+  {
+    if ( shm_client != NULL )
+      jtag_dpi_shm_disconnect( shm_client );
+    else
+      close_a( socket_fd );
+  }
+
+  void send ( const void * const data, const size_t len )
+  {
+    if ( shm_client != NULL )
+    {
+      if ( jtag_dpi_shm_send( shm_client, data, len ) != 0 )
+        throw std::runtime_error( get_error_message( "Error sending data: ", errno ) );
+
+      return;
+    }
+
+    size_t sent = 0;
+
+    while ( sent < len )
+    {
+      const ssize_t res = send_eintr( socket_fd, static_cast< const uint8_t * >( data ) + sent, len - sent, MSG_NOSIGNAL );
+
+      if ( res == -1 )
+        throw std::runtime_error( get_error_message( "Error sending data: ", errno ) );
+
+      sent += size_t( res );
+    }
+  }
+
+  void receive ( void * const buf, const size_t len )
+  {
+    size_t received = 0;
+
+    while ( received < len )
+    {
+      uint8_t * const dest = static_cast< uint8_t * >( buf ) + received;
+
+      const ssize_t res = shm_client != NULL
+                            ? jtag_dpi_shm_recv( shm_client, dest, len - received, -1 )
+                            : recv_eintr( socket_fd, dest, len - received, 0 );
+      if ( res == -1 )
+        throw std::runtime_error( get_error_message( "Error receiving data: ", errno ) );
+
+      if ( res == 0 )
+        throw std::runtime_error( "The JTAG DPI module closed the connection." );
+
+      received += size_t( res );
+    }
+  }
+
+  uint8_t receive_byte ( void )
+  {
+    uint8_t data;
+    receive( &data, 1 );
+    return data;
+  }
+
+private:
+  int socket_fd;
+  jtag_dpi_shm_client * shm_client;
+};
+
+
+static bool get_idcode_tms ( const int bit_index )
+{
+  // 5 times TMS high for Test-Logic-Reset, then Run-Test/Idle, Select-DR-Scan, Capture-DR, Shift-DR,
+  // the last shifted bit leaves Shift-DR, then Update-DR and Run-Test/Idle.
+  return bit_index < 5 ||
+         bit_index == 6 ||
+         bit_index == IDCODE_FIRST_TDO_BIT + 31 ||
+         bit_index == IDCODE_FIRST_TDO_BIT + 32;
+}
+
+
+static void check_idcode ( const uint32_t idcode )
+{
+  if ( idcode != FAKE_IDCODE )
+  {
+    char buffer[ 80 ];
+    sprintf( buffer, "Wrong IDCODE 0x%08X received.", idcode );
+    throw std::runtime_error( buffer );
+  }
+}
+
+
+// Sends a data byte and waits for the acknowledge and the clock notification, as adv_jtag_bridge does.
+
+static void send_pin_byte ( benchmark_client & client, const uint8_t data )
+{
+  const uint8_t request[ 2 ] = { data, CMD_WAIT_CLOCK_NOTIFICATION };
+  uint8_t reply[ 2 ];
+
+  client.send( &request[0], 1 );
+  client.receive( &reply[0], 1 );
+  client.send( &request[1], 1 );
+  client.receive( &reply[1], 1 );
+
+  if ( reply[0] != ( data | 0x10 ) || reply[1] != CLOCK_NOTIFICATION_MSG )
+    throw std::runtime_error( "Unexpected reply to a JTAG data byte." );
+}
+
+
+static void read_idcode_with_byte_protocol ( benchmark_client & client )
+{
+  uint32_t idcode = 0;
+
+  for ( int i = 0; i < IDCODE_READ_TCK_CYCLE_COUNT; ++i )
+  {
+    const uint8_t data = JTAG_TRST_BIT | ( get_idcode_tms( i ) ? JTAG_TMS_BIT : 0 );
+
+    send_pin_byte( client, data );
+    send_pin_byte( client, data | JTAG_TCK_BIT );
+
+    const uint8_t read_tdo = CMD_READ_TDO;
+    client.send( &read_tdo, 1 );
+    const uint8_t tdo = client.receive_byte();
+
+    if ( i >= IDCODE_FIRST_TDO_BIT && i < IDCODE_FIRST_TDO_BIT + 32 && tdo )
+      idcode |= uint32_t( 1 ) << ( i - IDCODE_FIRST_TDO_BIT );
+  }
+
+  check_idcode( idcode );
+}
+
+
+static void read_idcode_with_vector_scan ( benchmark_client & client )
+{
+  const int vector_len = ( IDCODE_READ_TCK_CYCLE_COUNT + 7 ) / 8;
+
+  // The command byte, the header with the flags and the bit count, the TMS vector and the TDI vector (all zeros).
+  uint8_t request[ 1 + VECTOR_SCAN_HEADER_LEN + 2 * vector_len ];
+  memset( request, 0, sizeof(request) );
+
+  request[0] = CMD_VECTOR_SCAN;
+  request[1] = VECTOR_SCAN_FLAG_CAPTURE_TDO;
+  request[2] = uint8_t( IDCODE_READ_TCK_CYCLE_COUNT );
+
+  for ( int i = 0; i < IDCODE_READ_TCK_CYCLE_COUNT; ++i )
+  {
+    if ( get_idcode_tms( i ) )
+      request[ 1 + VECTOR_SCAN_HEADER_LEN + i / 8 ] |= uint8_t( 1 << ( i % 8 ) );
+  }
+
+  client.send( request, sizeof(request) );
+
+  uint8_t tdo[ vector_len ];
+  client.receive( tdo, sizeof(tdo) );
+
+  uint32_t idcode = 0;
+
+  for ( int i = 0; i < 32; ++i )
+  {
+    if ( get_packed_bit( tdo, IDCODE_FIRST_TDO_BIT + i ) )
+      idcode |= uint32_t( 1 ) << i;
+  }
+
+  check_idcode( idcode );
+}
+
+
+// Reads the replies in streaming mode until the given number of TDO values have arrived,
+// collecting the credits on the way.
+
+static void receive_stream_replies ( benchmark_client & client,
+                                     const int tdo_count,
+                                     uint8_t * const tdo_values,
+                                     uint64_t * const credited_byte_count )
+{
+  int received_tdo_count = 0;
+
+  while ( received_tdo_count < tdo_count )
+  {
+    const uint8_t data = client.receive_byte();
+
+    if ( data == STREAMING_CREDIT_MSG )
+    {
+      uint8_t credit[ 2 ];
+      client.receive( credit, sizeof(credit) );
+      *credited_byte_count += credit[0] | ( credit[1] << 8 );
+    }
+    else
+    {
+      tdo_values[ received_tdo_count++ ] = data;
+    }
+  }
+}
+
+
+static void read_idcode_in_stream ( benchmark_client & client,
+                                    const uint16_t window_size,
+                                    uint64_t * const sent_byte_count,
+                                    uint64_t * const credited_byte_count )
+{
+  uint8_t request[ 3 * IDCODE_READ_TCK_CYCLE_COUNT ];
+
+  for ( int i = 0; i < IDCODE_READ_TCK_CYCLE_COUNT; ++i )
+  {
+    const uint8_t data = JTAG_TRST_BIT | ( get_idcode_tms( i ) ? JTAG_TMS_BIT : 0 );
+
+    request[ 3 * i     ] = data;
+    request[ 3 * i + 1 ] = data | JTAG_TCK_BIT;
+    request[ 3 * i + 2 ] = CMD_READ_TDO;
+  }
+
+  // This simple client waits for all TDO values of one read before sending the next one,
+  // so the credits only matter if the window is very small.
+  if ( *sent_byte_count + sizeof(request) - *credited_byte_count > window_size )
+    throw std::runtime_error( "The streaming window is too small for this benchmark." );
+
+  client.send( request, sizeof(request) );
+  *sent_byte_count += sizeof(request);
+
+  uint8_t tdo[ IDCODE_READ_TCK_CYCLE_COUNT ];
+  receive_stream_replies( client, IDCODE_READ_TCK_CYCLE_COUNT, tdo, credited_byte_count );
+
+  uint32_t idcode = 0;
+
+  for ( int i = 0; i < 32; ++i )
+  {
+    if ( tdo[ IDCODE_FIRST_TDO_BIT + i ] )
+      idcode |= uint32_t( 1 ) << i;
+  }
+
+  check_idcode( idcode );
+}
+
+
+static void send_jtag_vpi_command ( benchmark_client & client,
+                                    const uint32_t cmd,
+                                    const uint32_t bits_out,
+                                    const uint32_t nb_bits )
+{
+  uint8_t request[ JTAG_VPI_CMD_LEN ];
+  memset( request, 0, sizeof(request) );
+
+  const uint32_t length = ( nb_bits + 7 ) / 8;
+
+  for ( int i = 0; i < 4; ++i )
+  {
+    request[ i ]                             = uint8_t( cmd      >> ( 8 * i ) );
+    request[ JTAG_VPI_BUFFER_OUT_POS + i ]   = uint8_t( bits_out >> ( 8 * i ) );
+    request[ JTAG_VPI_LENGTH_POS     + i ]   = uint8_t( length   >> ( 8 * i ) );
+    request[ JTAG_VPI_NB_BITS_POS    + i ]   = uint8_t( nb_bits  >> ( 8 * i ) );
+  }
+
+  client.send( request, sizeof(request) );
+}
+
+
+// Goes through the same TAP states as the other protocols, the way OpenOCD would do it.
+
+static void read_idcode_with_jtag_vpi ( benchmark_client & client )
+{
+  send_jtag_vpi_command( client, JTAG_VPI_CMD_RESET, 0, 0 );  // Ends in Run-Test/Idle.
+  send_jtag_vpi_command( client, JTAG_VPI_CMD_TMS_SEQ, 0x1, 3 );  // Select-DR-Scan, Capture-DR, Shift-DR.
+  send_jtag_vpi_command( client, JTAG_VPI_CMD_SCAN_CHAIN_FLIP_TMS, 0, 32 );  // Ends in Exit1-DR.
+  send_jtag_vpi_command( client, JTAG_VPI_CMD_TMS_SEQ, 0x1, 2 );  // Update-DR, Run-Test/Idle.
+
+  uint8_t reply[ JTAG_VPI_CMD_LEN ];
+  client.receive( reply, sizeof(reply) );
+
+  if ( get_uint32_le( reply ) != JTAG_VPI_CMD_SCAN_CHAIN_FLIP_TMS )
+    throw std::runtime_error( "Unexpected reply to a jtag_vpi scan command." );
+
+  check_idcode( get_uint32_le( &reply[ JTAG_VPI_BUFFER_IN_POS ] ) );
+}
+
+
+// ---- GDB client for --protocol=gdb
+//
+// A minimal implementation of GDB's Remote Serial Protocol. It checks the replies against
+// what the target model must have done, and the session ends like a GDB crash would,
+// so that the breakpoint clean-up in the GDB server gets tested too.
+
+static void send_gdb_packet ( benchmark_client & client, const std::string & payload )
+{
+  uint8_t checksum = 0;
+
+  for ( size_t i = 0; i < payload.size(); ++i )
+    checksum = uint8_t( checksum + uint8_t( payload[ i ] ) );
+
+  char checksum_text[ 4 ];
+  sprintf( checksum_text, "%02x", checksum );
+
+  const std::string packet = "$" + payload + "#" + checksum_text;
+  client.send( packet.data(), packet.size() );
+}
+
+
+// Skips the acknowledgements, and acknowledges the packet.
+
+static std::string receive_gdb_packet ( benchmark_client & client )
+{
+  uint8_t c;
+
+  do
+  {
+    c = client.receive_byte();
+
+    if ( c == '-' )
+      throw std::runtime_error( "The GDB server asked for a retransmission." );
+  }
+  while ( c != '$' );
+
+  std::string payload;
+
+  for ( ; ; )
+  {
+    c = client.receive_byte();
+
+    if ( c == '#' )
+      break;
+
+    payload += char( c );
+  }
+
+  uint8_t checksum_text[ 2 ];
+  client.receive( checksum_text, sizeof(checksum_text) );
+
+  uint8_t checksum = 0;
+
+  for ( size_t i = 0; i < payload.size(); ++i )
+    checksum = uint8_t( checksum + uint8_t( payload[ i ] ) );
+
+  if ( parse_hex_digit( char( checksum_text[0] ) ) << 4 != ( checksum & 0xF0 ) ||
+       parse_hex_digit( char( checksum_text[1] ) )      != ( checksum & 0x0F ) )
+  {
+    throw std::runtime_error( "Wrong checksum in GDB packet \"" + payload + "\"." );
+  }
+
+  const uint8_t ack = '+';
+  client.send( &ack, 1 );
+
+  return payload;
+}
+
+
+static std::string run_gdb_command ( benchmark_client & client, const std::string & payload )
+{
+  send_gdb_packet( client, payload );
+  return receive_gdb_packet( client );
+}
+
+
+static void check_gdb_reply ( const std::string & command, const std::string & reply, const std::string & expected_reply )
+{
+  if ( reply != expected_reply )
+  {
+    throw std::runtime_error( "Wrong reply \"" + reply + "\" to GDB command \"" + command +
+                              "\", expected \"" + expected_reply + "\"." );
+  }
+}
+
+
+static void check_gdb_command ( benchmark_client & client, const std::string & payload, const std::string & expected_reply )
+{
+  check_gdb_reply( payload, run_gdb_command( client, payload ), expected_reply );
+}
+
+
+static uint32_t read_gdb_register ( benchmark_client & client, const int register_number )
+{
+  char command[ 16 ];
+  sprintf( command, "p%x", register_number );
+
+  const std::string reply = run_gdb_command( client, command );
+
+  size_t pos = 0;
+  const uint32_t value = parse_hex_number( reply, pos, 8 );
+
+  if ( pos != 8 || reply.size() != 8 )
+    throw std::runtime_error( "Wrong reply \"" + reply + "\" to GDB command \"" + command + "\"." );
+
+  return value;
+}
+
+
+static void check_gdb_register ( benchmark_client & client, const int register_number, const uint32_t expected_value )
+{
+  const uint32_t value = read_gdb_register( client, register_number );
+
+  if ( value != expected_value )
+  {
+    char buffer[ 100 ];
+    sprintf( buffer, "GDB register %d is 0x%08X, expected 0x%08X.", register_number, value, expected_value );
+    throw std::runtime_error( buffer );
+  }
+}
+
+
+static bool is_in_fake_program ( const uint32_t address )
+{
+  return address == FAKE_RESET_VECTOR || address == FAKE_RESET_VECTOR + 4 || address == FAKE_RESET_VECTOR + 8;
+}
+
+
+// The CPU is stalled when this starts, and stopped at a breakpoint on the second instruction when it ends.
+
+static void check_gdb_session ( benchmark_client & client )
+{
+  check_gdb_command( client, "?", "S05" );
+  check_gdb_command( client, "qAttached", "1" );
+
+  // The CPU has been running the test program.
+  const std::string registers = run_gdb_command( client, "g" );
+
+  if ( registers.size() != GDB_REGISTER_COUNT * 8 )
+    throw std::runtime_error( "Wrong reply length to GDB command \"g\"." );
+
+  size_t pos = GDB_REG_NPC * 8;
+
+  if ( !is_in_fake_program( parse_hex_number( registers, pos, 8 ) ) )
+    throw std::runtime_error( "The NPC is outside the test program." );
+
+  check_gdb_command( client, "G" + registers, "OK" );
+
+  check_gdb_command( client, "P3=00000000", "OK" );
+  check_gdb_register( client, 3, 0 );
+
+  // This needs byte and word accesses.
+  check_gdb_command( client, "M2001,9:010203040506070809", "OK" );
+  check_gdb_command( client, "m2000,c", "000102030405060708090000" );
+
+  // Failed requests must not end the session.
+  check_gdb_command( client, "p99", "" );
+  check_gdb_command( client, "m2000", "E01" );
+  check_gdb_command( client, "m80000000,4", "E01" );
+  check_gdb_command( client, "m2000,2", "0001" );
+
+  // Stop at the second instruction, after the first one has run once.
+  check_gdb_command( client, "P21=00000100", "OK" );
+  check_gdb_command( client, "Z0,104", "OK" );
+  check_gdb_command( client, "m104,4", "21000001" );
+  check_gdb_command( client, "c", "S05" );
+  check_gdb_register( client, GDB_REG_NPC, 0x104 );
+  check_gdb_register( client, 3, 1 );
+
+  check_gdb_command( client, "z0,104", "OK" );
+  check_gdb_command( client, "m104,4", "9c840002" );
+
+  check_gdb_command( client, "s", "S05" );
+  check_gdb_register( client, GDB_REG_NPC, 0x108 );
+
+  // Let the CPU run until interrupted.
+  send_gdb_packet( client, "c" );
+  usleep( 10000 );
+  const uint8_t interrupt = GDB_INTERRUPT_CHAR;
+  client.send( &interrupt, 1 );
+  check_gdb_reply( "c", receive_gdb_packet( client ), "S02" );
+
+  if ( !is_in_fake_program( read_gdb_register( client, GDB_REG_NPC ) ) )
+    throw std::runtime_error( "The NPC is outside the test program after an interrupt." );
+
+  check_gdb_command( client, "Z0,104", "OK" );
+  check_gdb_command( client, "c", "S05" );
+  check_gdb_register( client, GDB_REG_NPC, 0x104 );
+}
+
+
+static void run_gdb_client ( const benchmark_options & options )
+{
+  benchmark_options gdb_options = options;
+  gdb_options.transport = TRANSPORT_TCP;
+  gdb_options.tcp_port  = options.gdb_tcp_port;
+
+  uint32_t r3_at_breakpoint;
+
+  {
+    benchmark_client client( gdb_options );
+
+    while ( s_client_phase.load() == CLIENT_IDLE )
+    {
+      usleep( 1000 );
+    }
+
+    check_gdb_session( client );
+
+    // The benchmark itself reads the test program over and over, while the CPU remains stopped.
+    while ( s_client_phase.load() == CLIENT_BUSY )
+    {
+      check_gdb_command( client, "m100,c", "9c6300012100000103fffffe" );
+      ++s_client_idcode_read_count;
+    }
+
+    r3_at_breakpoint = read_gdb_register( client, 3 );
+
+    // Kill the session with the breakpoint still in place. There is no reply.
+    send_gdb_packet( client, "k" );
+  }
+
+  {
+    // The GDB server only accepts this connection after removing the breakpoint and resuming the CPU.
+    benchmark_client client( gdb_options );
+
+    check_gdb_command( client, "?", "S05" );
+    check_gdb_command( client, "m104,4", "9c840002" );
+
+    if ( read_gdb_register( client, 3 ) <= r3_at_breakpoint )
+      throw std::runtime_error( "The CPU did not resume after the GDB session was killed." );
+
+    // Close the connection while the CPU is running, like a GDB crash would.
+    // The instruction there never runs, see FAKE_PROGRAM.
+    check_gdb_command( client, "Z0,10c", "OK" );
+    send_gdb_packet( client, "c" );
+
+    if ( client.receive_byte() != '+' )
+      throw std::runtime_error( "The GDB server did not acknowledge the continue command." );
+
+    usleep( 10000 );
+  }
+}
+
+
+static void run_client ( const benchmark_options & options )
+{
+  if ( options.protocol == PROTOCOL_GDB )
+  {
+    run_gdb_client( options );
+    return;
+  }
+
+  benchmark_client client( options );
+
+  while ( s_client_phase.load() == CLIENT_IDLE )
+  {
+    usleep( 1000 );
+  }
+
+  uint16_t window_size = 0;
+  uint64_t sent_byte_count = 0;
+  uint64_t credited_byte_count = 0;
+
+  if ( options.protocol == PROTOCOL_STREAM )
+  {
+    const uint8_t start = CMD_START_STREAMING;
+    client.send( &start, 1 );
+
+    uint8_t reply[ 3 ];
+    client.receive( reply, sizeof(reply) );
+
+    if ( reply[0] != CMD_START_STREAMING )
+      throw std::runtime_error( "Unexpected reply to the start streaming command." );
+
+    window_size = uint16_t( reply[1] | ( reply[2] << 8 ) );
+  }
+
+  while ( s_client_phase.load() == CLIENT_BUSY )
+  {
+    switch ( options.protocol )
+    {
+    case PROTOCOL_BYTES:
+      read_idcode_with_byte_protocol( client );
+      break;
+
+    case PROTOCOL_VECTOR:
+      read_idcode_with_vector_scan( client );
+      break;
+
+    case PROTOCOL_STREAM:
+      read_idcode_in_stream( client, window_size, &sent_byte_count, &credited_byte_count );
+      break;
+
+    case PROTOCOL_JTAG_VPI:
+      read_idcode_with_jtag_vpi( client );
+      break;
+
+    case PROTOCOL_GDB:
+      assert( false );  // See run_gdb_client().
+      break;
+    }
+
+    ++s_client_idcode_read_count;
+  }
+
+  if ( options.protocol == PROTOCOL_STREAM )
+  {
+    const uint8_t stop = CMD_STOP_STREAMING;
+    client.send( &stop, 1 );
+
+    for ( ; ; )
+    {
+      const uint8_t data = client.receive_byte();
+
+      if ( data == CMD_STOP_STREAMING )
+        break;
+
+      if ( data != STREAMING_CREDIT_MSG )
+        throw std::runtime_error( "Unexpected data after the stop streaming command." );
+
+      uint8_t credit[ 2 ];
+      client.receive( credit, sizeof(credit) );
+    }
+  }
+}
+
+
+static void client_thread_main ( const benchmark_options * const options )
+{
+  try
+  {
+    run_client( *options );
+  }
+  catch ( const std::exception & e )
+  {
+    s_client_error_msg = e.what();
+  }
+
+  s_client_finished.store( true );
+}
+
+
+static void check_client_error ( void )
+{
+  if ( s_client_finished.load() && !s_client_error_msg.empty() )
+    throw std::runtime_error( "Client error: " + s_client_error_msg );
+}
+
+
+static void apply_pins ( fake_tap & tap, const uint32_t data )
+{
+  tap.update_pins( ( data & JTAG_TCK_BIT ) != 0,
+                   ( data & JTAG_TMS_BIT ) != 0,
+                   ( data & JTAG_TDI_BIT ) != 0,
+                   ( data & JTAG_TRST_BIT ) != 0 );
+}
+
+
+static uint64_t s_dpi_call_count = 0;
+
+
+// The same as jtag_dpi.v does with BATCHED_DPI_CALLS.
+
+class batched_rtl
+{
+public:
+  batched_rtl ( void )
+    : dpi_call_countdown( 0 )
+    , queued_pins( 0 )
+    , queued_pin_count( 0 )
+    , queued_pin_countdown( 0 )
+    , tdo_history( 0 )
+    , tdo_history_length( 0 )
+  {
+  }
+
+  void tick ( void * const handle, fake_tap & tap, const int tck_half_period_tick_count )
+  {
+    if ( dpi_call_countdown != 0 )
+    {
+      --dpi_call_countdown;
+
+      if ( queued_pin_count != 0 && --queued_pin_countdown == 0 )
+      {
+        tdo_history |= uint32_t( tap.get_tdo() ) << tdo_history_length;
+        ++tdo_history_length;
+
+        apply_pins( tap, queued_pins & 0x0F );
+        queued_pins >>= 4;
+        --queued_pin_count;
+        queued_pin_countdown = tck_half_period_tick_count;
+      }
+
+      return;
+    }
+
+    int pin_batch, pin_batch_length, idle_tick_count;
+
+    ++s_dpi_call_count;
+
+    if ( 0 != jtag_dpi_tick_batch( handle, int( tdo_history ), tap.get_tdo(), &pin_batch, &pin_batch_length, &idle_tick_count ) )
+      throw std::runtime_error( "jtag_dpi_tick_batch() failed." );
+
+    tdo_history = 0;
+    tdo_history_length = 0;
+
+    if ( pin_batch_length != 0 )
+    {
+      apply_pins( tap, uint32_t( pin_batch ) & 0x0F );
+      queued_pins = uint32_t( pin_batch ) >> 4;
+      queued_pin_count = pin_batch_length - 1;
+      queued_pin_countdown = tck_half_period_tick_count;
+    }
+
+    dpi_call_countdown = idle_tick_count;
+  }
+
+private:
+  int      dpi_call_countdown;
+  uint32_t queued_pins;
+  int      queued_pin_count;
+  int      queued_pin_countdown;
+  uint32_t tdo_history;
+  int      tdo_history_length;
+};
+
+static batched_rtl s_batched_rtl;
+
+
+static void tick ( void * const handle, fake_tap & tap, const benchmark_options & options )
+{
+  if ( s_or1k_target != NULL )
+    s_or1k_target->run_cpu_cycle();
+
+  if ( options.batched )
+  {
+    s_batched_rtl.tick( handle, tap, options.tck_half_period_tick_count );
+    return;
+  }
+
+  unsigned char tms, tck, trst, tdi, new_data_available;
+
+  ++s_dpi_call_count;
+
+  if ( 0 != jtag_dpi_tick( handle, &tms, &tck, &trst, &tdi, &new_data_available, tap.get_tdo() ) )
+    throw std::runtime_error( "jtag_dpi_tick() failed." );
+
+  if ( new_data_available )
+    apply_pins( tap, pack_jtag_data_byte( tms, tck, trst, tdi ) );
+}
+
+
+// Returns the elapsed time in seconds, and the number of DPI calls made.
+
+static double run_ticks ( void * const handle,
+                          fake_tap & tap,
+                          const benchmark_options & options,
+                          uint64_t * const dpi_call_count )
+{
+  const uint64_t start_dpi_call_count = s_dpi_call_count;
+
+  const std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+
+  for ( uint64_t i = 0; i < options.tick_count; ++i )
+  {
+    tick( handle, tap, options );
+  }
+
+  const double seconds = std::chrono::duration< double >( std::chrono::steady_clock::now() - start_time ).count();
+
+  *dpi_call_count = s_dpi_call_count - start_dpi_call_count;
+
+  return seconds;
+}
+
+
+static void print_result ( const char * const state_name,
+                           const uint64_t tick_count,
+                           const double seconds,
+                           const uint64_t dpi_call_count )
+{
+  printf( "%-24s %8.1f ns/tick, %8.4f DPI calls/tick\n",
+          state_name,
+          seconds * 1e9 / double( tick_count ),
+          double( dpi_call_count ) / double( tick_count ) );
+  fflush( stdout );
+}
+
+
+static void print_usage ( void )
+{
+  printf( "Usage: jtag_dpi_benchmark [options]\n"
+          "  --ticks=N              Ticks to run for each measurement (default: 20000000).\n"
+          "  --io-mode=0|1|2        IO_MODE of the JTAG DPI module (default: 0).\n"
+          "  --transport=tcp|unix|shm  (default: tcp)\n"
+          "  --protocol=bytes|vector|stream|jtag_vpi|gdb  Client traffic (default: bytes, like adv_jtag_bridge).\n"
+          "  --port=N               TCP port (default: 4567). 0 lets the operating system pick one.\n"
+          "  --gdb-port=N           TCP port for the GDB server with --protocol=gdb (default: 4568).\n"
+          "  --half-period=N        JTAG TCK half period in ticks (default: 20, as in jtag_dpi.v).\n"
+          "  --accept-interval=N    ACCEPT_POLL_INTERVAL_TICK_COUNT (default: 1000).\n"
+          "  --batched              Call jtag_dpi_tick_batch() like jtag_dpi.v with BATCHED_DPI_CALLS.\n"
+          "  --trace=file           Write a binary trace, like jtag_dpi.v's TRACE_FILE, in order to measure its cost.\n"
+          "  --verbose              Print the JTAG DPI module's informational messages.\n" );
+}
+
+
+static bool parse_option ( const char * const arg, const char * const name, std::string * const value )
+{
+  const size_t name_len = strlen( name );
+
+  if ( 0 != strncmp( arg, name, name_len ) || arg[ name_len ] != '=' )
+    return false;
+
+  *value = arg + name_len + 1;
+  return true;
+}
+
+
+static uint64_t parse_number ( const std::string & value )
+{
+  char * end;
+  errno = 0;
+  const unsigned long long number = strtoull( value.c_str(), &end, 10 );
+
+  if ( value.empty() || *end != '\0' || errno != 0 )
+    throw std::runtime_error( "Invalid number \"" + value + "\"." );
+
+  return number;
+}
+
+
+static void parse_command_line ( const int argc, char ** const argv, benchmark_options & options )
+{
+  options.tick_count                      = 20000000;
+  options.io_mode                         = IO_MODE_POLL;
+  options.transport                       = TRANSPORT_TCP;
+  options.protocol                        = PROTOCOL_BYTES;
+  options.tcp_port                        = 4567;
+  options.gdb_tcp_port                    = 4568;
+  options.tck_half_period_tick_count      = 20;
+  options.accept_poll_interval_tick_count = 1000;
+  options.batched                         = false;
+  options.verbose                         = false;
+
+  char path[ 80 ];
+  sprintf( path, "/tmp/jtag_dpi_benchmark_%d.sock", int( getpid() ) );
+  options.unix_socket_path = path;
+
+  for ( int i = 1; i < argc; ++i )
+  {
+    std::string value;
+
+    if ( parse_option( argv[i], "--ticks", &value ) )
+      options.tick_count = parse_number( value );
+    else if ( parse_option( argv[i], "--io-mode", &value ) )
+      options.io_mode = int( parse_number( value ) );
+    else if ( parse_option( argv[i], "--port", &value ) )
+      options.tcp_port = int( parse_number( value ) );
+    else if ( parse_option( argv[i], "--gdb-port", &value ) )
+      options.gdb_tcp_port = int( parse_number( value ) );
+    else if ( parse_option( argv[i], "--half-period", &value ) )
+      options.tck_half_period_tick_count = int( parse_number( value ) );
+    else if ( parse_option( argv[i], "--trace", &value ) )
+      options.trace_file_name = value;
+    else if ( parse_option( argv[i], "--accept-interval", &value ) )
+      options.accept_poll_interval_tick_count = int( parse_number( value ) );
+    else if ( parse_option( argv[i], "--transport", &value ) )
+    {
+      if ( value == "tcp" )
+        options.transport = TRANSPORT_TCP;
+      else if ( value == "unix" )
+        options.transport = TRANSPORT_UNIX;
+      else if ( value == "shm" )
+        options.transport = TRANSPORT_SHM;
+      else
+        throw std::runtime_error( "Invalid transport \"" + value + "\"." );
+    }
+    else if ( parse_option( argv[i], "--protocol", &value ) )
+    {
+      if ( value == "bytes" )
+        options.protocol = PROTOCOL_BYTES;
+      else if ( value == "vector" )
+        options.protocol = PROTOCOL_VECTOR;
+      else if ( value == "stream" )
+        options.protocol = PROTOCOL_STREAM;
+      else if ( value == "jtag_vpi" )
+        options.protocol = PROTOCOL_JTAG_VPI;
+      else if ( value == "gdb" )
+        options.protocol = PROTOCOL_GDB;
+      else
+        throw std::runtime_error( "Invalid protocol \"" + value + "\"." );
+    }
+    else if ( 0 == strcmp( argv[i], "--batched" ) )
+      options.batched = true;
+    else if ( 0 == strcmp( argv[i], "--verbose" ) )
+      options.verbose = true;
+    else if ( 0 == strcmp( argv[i], "--help" ) )
+    {
+      print_usage();
+      exit( 0 );
+    }
+    else
+      throw std::runtime_error( std::string( "Unknown option \"" ) + argv[i] + "\". Try --help." );
+  }
+
+  if ( options.tick_count == 0 )
+    throw std::runtime_error( "The number of ticks must not be zero." );
+
+  if ( options.protocol == PROTOCOL_GDB && options.gdb_tcp_port == 0 )
+    throw std::runtime_error( "The GDB server needs a fixed TCP port." );
+}
+
+
+// The client has closed the last connection while the CPU was running with a breakpoint inserted.
+
+static void check_target_after_gdb_session ( void * const handle, fake_tap & tap, const benchmark_options & options )
+{
+  while ( is_gdb_connection_open( get_instance( handle ) ) || is_gdb_cleanup_pending( get_instance( handle ) ) )
+  {
+    tick( handle, tap, options );
+  }
+
+  if ( s_or1k_target->read_memory_word( FAKE_RESET_VECTOR + 0xC ) != FAKE_PROGRAM[ 3 ] )
+    throw std::runtime_error( "The GDB server did not remove the breakpoint after the connection was lost." );
+
+  if ( s_or1k_target->is_stalled() ||
+       s_or1k_target->get_spr( OR1K_SPR_DMR1 ) != 0 ||
+       s_or1k_target->get_spr( OR1K_SPR_DSR  ) != 0 )
+  {
+    throw std::runtime_error( "The GDB server did not release the CPU after the connection was lost." );
+  }
+
+  const uint32_t r3 = s_or1k_target->get_spr( OR1K_SPR_GPR0 + 3 );
+
+  for ( int i = 0; i < 10; ++i )
+    tick( handle, tap, options );
+
+  if ( s_or1k_target->get_spr( OR1K_SPR_GPR0 + 3 ) == r3 )
+    throw std::runtime_error( "The CPU is not running after the GDB session." );
+
+  printf( "The GDB session checks passed.\n" );
+  fflush( stdout );
+}
+
+
+int main ( int argc, char ** argv )
+{
+  try
+  {
+    static benchmark_options options;  // Static, because the detached client thread uses it.
+    parse_command_line( argc, argv, options );
+
+    // See verilator_main.cpp about SIGPIPE.
+    signal( SIGPIPE, SIG_IGN );
+
+    void * const handle = jtag_dpi_init( options.tcp_port,
+                                         1,  // Listen on the local address only.
+                                         options.tck_half_period_tick_count,
+                                         options.verbose ? 1 : 0,
+                                         options.io_mode,
+                                         options.accept_poll_interval_tick_count,
+                                         options.protocol == PROTOCOL_GDB ? options.gdb_tcp_port : 0,
+                                         options.transport,
+                                         options.protocol == PROTOCOL_JTAG_VPI ? SOCKET_PROTOCOL_JTAG_VPI
+                                                                               : SOCKET_PROTOCOL_ADV_JTAG_BRIDGE,
+                                         options.unix_socket_path.c_str(),
+                                         "",   // No recording.
+                                         "",   // No replay.
+                                         options.trace_file_name.c_str(),
+                                         "" ); // No port file.
+    if ( handle == NULL )
+      throw std::runtime_error( "jtag_dpi_init() failed." );
+
+    // With --port=0, the client needs to know which port the operating system has picked.
+    options.tcp_port = get_instance( handle ).bound_tcp_port;
+
+    static fake_or1k_target target;  // Static, because it is large.
+
+    if ( options.protocol == PROTOCOL_GDB )
+      s_or1k_target = &target;
+
+    fake_tap tap( s_or1k_target );
+
+    uint64_t dpi_call_count;
+    double   seconds;
+
+    seconds = run_ticks( handle, tap, options, &dpi_call_count );
+    print_result( "Listening, no client:", options.tick_count, seconds, dpi_call_count );
+
+
+    // The thread is detached, so that an error here does not need to wait for it.
+    // After an error, exiting the process terminates the thread too.
+    std::thread( client_thread_main, &options ).detach();
+
+    while ( !is_connection_open( get_instance( handle ) ) && !is_gdb_connection_open( get_instance( handle ) ) )
+    {
+      check_client_error();
+      tick( handle, tap, options );
+    }
+
+    seconds = run_ticks( handle, tap, options, &dpi_call_count );
+    print_result( "Connected, idle client:", options.tick_count, seconds, dpi_call_count );
+
+
+    s_client_phase.store( CLIENT_BUSY );
+
+    const uint64_t start_tck_cycle_count = tap.get_tck_cycle_count();
+    const uint64_t start_read_count      = s_client_idcode_read_count.load();
+
+    const double busy_seconds = run_ticks( handle, tap, options, &dpi_call_count );
+
+    const uint64_t tck_cycle_count = tap.get_tck_cycle_count() - start_tck_cycle_count;
+    const uint64_t read_count      = s_client_idcode_read_count.load() - start_read_count;
+
+    check_client_error();
+
+    print_result( "Connected, busy client:", options.tick_count, busy_seconds, dpi_call_count );
+
+    printf( "End-to-end throughput:   %8.0f TCK cycles/s (%.0f %s/s, %.1f%% of the maximum TCK rate).\n",
+            double( tck_cycle_count ) / busy_seconds,
+            double( read_count ) / busy_seconds,
+            options.protocol == PROTOCOL_GDB ? "GDB memory reads" : "IDCODE reads",
+            100.0 * double( tck_cycle_count ) * 2 * options.tck_half_period_tick_count / double( options.tick_count ) );
+    fflush( stdout );
+
+
+    // Let the client finish its current read and disconnect.
+    s_client_phase.store( CLIENT_STOP );
+
+    while ( !s_client_finished.load() )
+    {
+      tick( handle, tap, options );
+    }
+
+    check_client_error();
+
+    if ( options.protocol == PROTOCOL_GDB )
+      check_target_after_gdb_session( handle, tap, options );
+
+    jtag_dpi_terminate( handle );
+  }
+  catch ( const std::exception & e )
+  {
+    fprintf( stderr, "%s%s\n", "ERROR: ", e.what() );
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,897 @@
+
+// Copyright (c) 2012, R. Diez
+//
+// Load generator for the JTAG DPI module. It connects to a running simulation, like
+// minsoc_bench_core.exe, and drives the virtual JTAG cable exactly as adv_jtag_bridge does:
+// with the plain byte protocol, one socket round trip for each JTAG data byte, each clock
+// notification (0x81) and each TDO read (0x80). It does not use any of the protocol extensions.
+//
+// The traffic consists of operations that GDB and adv_jtag_bridge typically generate: TAP IDCODE reads,
+// adv_dbg_if burst reads and writes over the Wishbone bus, and CPU stall polls. At the end, it reports
+// the throughput and the latency percentiles of the socket round trips and of the operations,
+// so that the effect of a change in the DPI module under realistic load can be measured.
+// Unlike tools/jtag_dpi_benchmark, it does not include the module, so it works
+// against any simulation. See build_jtag_dpi_loadgen for instructions on how to build it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <chrono>
+
+
+// These values are part of the socket protocol, see jtag_dpi.cpp.
+static const uint8_t CMD_READ_TDO                = 0x80;
+static const uint8_t CMD_WAIT_CLOCK_NOTIFICATION = 0x81;
+static const uint8_t CLOCK_NOTIFICATION_MSG      = 0xFF;
+static const uint8_t DATA_BYTE_ACK_BIT           = 0x10;
+
+// Bits in a JTAG data byte.
+static const uint8_t JTAG_TCK_BIT  = 0x01;
+static const uint8_t JTAG_TRST_BIT = 0x02;
+static const uint8_t JTAG_TDI_BIT  = 0x04;
+static const uint8_t JTAG_TMS_BIT  = 0x08;
+
+// These definitions come from adv_jtag_bridge, like the ones in jtag_dpi.cpp's GDB server.
+static const uint32_t ADBG_TAP_IR_LENGTH = 4;
+static const uint32_t ADBG_TAP_IR_DEBUG  = 0x8;
+
+static const uint32_t ADBG_MODULE_ID_LENGTH = 2;
+static const int      ADBG_MODULE_WISHBONE  = 0;
+static const int      ADBG_MODULE_CPU0      = 1;
+
+static const uint32_t ADBG_OPCODE_LENGTH = 4;
+static const uint32_t ADBG_CMD_BWRITE8   = 0x1;
+static const uint32_t ADBG_CMD_BWRITE32  = 0x3;
+static const uint32_t ADBG_CMD_BREAD8    = 0x5;
+static const uint32_t ADBG_CMD_BREAD32   = 0x7;
+static const uint32_t ADBG_CMD_IREG_SEL  = 0xD;
+
+static const uint32_t ADBG_CPU0_REG_SEL_LENGTH = 1;
+static const uint32_t ADBG_CPU0_REG_STATUS     = 0;
+static const uint32_t ADBG_CPU0_STATUS_LENGTH  = 2;
+static const uint32_t ADBG_CPU0_STATUS_STALL   = 0x1;
+
+static const uint32_t ADBG_CRC_POLY = 0xEDB88320;
+
+// A burst read answers with a '1' status bit when the first word is ready.
+static const uint32_t ADBG_READ_STATUS_SLACK_BIT_COUNT = 64;
+
+// The word count field of a burst command has 16 bits.
+static const uint32_t MAX_BURST_WORD_COUNT = 0xFFFF;
+
+static const uint32_t IDCODE_LENGTH = 32;
+
+
+enum operation_enum
+{
+  OP_IDCODE,
+  OP_READ,
+  OP_WRITE,
+  OP_STALL_POLL,
+
+  OP_COUNT
+};
+
+static const char * const OPERATION_NAMES[ OP_COUNT ] = { "idcode", "read", "write", "stall-poll" };
+
+enum round_trip_enum
+{
+  RT_DATA_BYTE_ACK,
+  RT_CLOCK_NOTIFICATION,
+  RT_TDO_READ,
+
+  RT_COUNT
+};
+
+static const char * const ROUND_TRIP_NAMES[ RT_COUNT ] = { "Data byte acknowledge", "Clock notification", "TDO read" };
+
+
+struct loadgen_options
+{
+  int         tcp_port;
+  std::string unix_socket_path;
+
+  std::vector< operation_enum > operations;  // Run in turn.
+
+  double   duration_s;
+  uint64_t operation_count;  // 0 means run for duration_s.
+
+  uint32_t address;
+  bool     is_address_set;
+  uint32_t burst_word_count;
+  uint32_t word_bit_count;
+  bool     verify;
+  uint32_t expected_idcode;
+  bool     is_expected_idcode_set;
+};
+
+
+// Bits in shift order, LSB first, packed as in jtag_dpi.cpp.
+
+struct bit_vector
+{
+  std::vector< uint8_t > bytes;
+  uint32_t bit_count;
+
+  bit_vector ( void ) : bit_count( 0 ) {}
+};
+
+
+static void append_bits ( bit_vector & bits, const uint32_t value, const uint32_t bit_count )
+{
+  for ( uint32_t i = 0; i < bit_count; ++i )
+  {
+    if ( bits.bit_count % 8 == 0 )
+      bits.bytes.push_back( 0 );
+
+    if ( ( value >> i ) & 1 )
+      bits.bytes.back() |= uint8_t( 1 << ( bits.bit_count % 8 ) );
+
+    ++bits.bit_count;
+  }
+}
+
+
+static void append_zero_bits ( bit_vector & bits, const uint32_t bit_count )
+{
+  bits.bit_count += bit_count;
+  bits.bytes.resize( ( bits.bit_count + 7 ) / 8, 0 );
+}
+
+
+static bool get_bit ( const bit_vector & bits, const uint32_t bit_index )
+{
+  return 0 != ( bits.bytes[ bit_index / 8 ] & ( 1 << ( bit_index % 8 ) ) );
+}
+
+
+static uint32_t get_bits ( const bit_vector & bits, const uint32_t first_bit, const uint32_t bit_count )
+{
+  uint32_t value = 0;
+
+  for ( uint32_t i = 0; i < bit_count; ++i )
+  {
+    if ( get_bit( bits, first_bit + i ) )
+      value |= uint32_t( 1 ) << i;
+  }
+
+  return value;
+}
+
+
+// The CRC is calculated bit by bit in the same order as the bits are shifted, LSB first.
+
+static uint32_t adbg_update_crc ( uint32_t crc, const uint32_t value, const uint32_t bit_count )
+{
+  for ( uint32_t i = 0; i < bit_count; ++i )
+  {
+    const uint32_t data_bit = ( value >> i ) & 1;
+    const uint32_t crc_bit  = crc & 1;
+
+    crc >>= 1;
+
+    if ( data_bit ^ crc_bit )
+      crc ^= ADBG_CRC_POLY;
+  }
+
+  return crc;
+}
+
+
+static std::string get_error_message ( const char * const prefix, const int errno_val )
+{
+  return std::string( prefix ) + strerror( errno_val );
+}
+
+
+static int connect_to_module ( const int tcp_port, const std::string & unix_socket_path )
+{
+  const int s = socket( unix_socket_path.empty() ? AF_INET : AF_UNIX, SOCK_STREAM, 0 );
+
+  if ( s == -1 )
+    throw std::runtime_error( get_error_message( "Error creating the socket: ", errno ) );
+
+  int res;
+
+  if ( unix_socket_path.empty() )
+  {
+    sockaddr_in addr;
+    memset( &addr, 0, sizeof(addr) );
+    addr.sin_family      = AF_INET;
+    addr.sin_port        = htons( uint16_t( tcp_port ) );
+    addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+
+    res = connect( s, reinterpret_cast< const sockaddr * >( &addr ), sizeof(addr) );
+
+    if ( res == 0 )
+    {
+      // Like adv_jtag_bridge, disable Nagle's algorithm, or each small command would wait for the previous reply.
+      const int one = 1;
+      setsockopt( s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) );
+    }
+  }
+  else
+  {
+    sockaddr_un addr;
+    memset( &addr, 0, sizeof(addr) );
+    addr.sun_family = AF_UNIX;
+
+    if ( unix_socket_path.size() >= sizeof( addr.sun_path ) )
+      throw std::runtime_error( "The Unix socket path is too long." );
+
+    strcpy( addr.sun_path, unix_socket_path.c_str() );
+
+    res = connect( s, reinterpret_cast< const sockaddr * >( &addr ), sizeof(addr) );
+  }
+
+  if ( res != 0 )
+  {
+    const int errno_val = errno;
+    close( s );
+    throw std::runtime_error( get_error_message( "Error connecting to the JTAG DPI module: ", errno_val ) );
+  }
+
+  return s;
+}
+
+
+// The client side of the virtual cable, with the counters and the latency samples.
+
+struct loadgen_client
+{
+  int socket_fd;
+
+  uint64_t tck_cycle_count;
+  std::vector< uint32_t > round_trip_latency_ns[ RT_COUNT ];
+  std::vector< uint32_t > operation_latency_ns[ OP_COUNT ];
+
+  // adv_dbg_if state, as far as the client knows it.
+  bool is_debug_ir_selected;
+  int  selected_module;
+
+  uint64_t read_crc_error_count;
+  uint64_t read_timeout_count;  // No start bit within ADBG_READ_STATUS_SLACK_BIT_COUNT bits.
+  uint64_t write_crc_error_count;
+  uint64_t idcode_mismatch_count;
+  uint64_t verify_mismatch_count;
+  uint64_t stalled_poll_count;
+  uint64_t payload_bytes_read;
+  uint64_t payload_bytes_written;
+
+  // The data written by the last burst write, for --verify.
+  std::vector< uint32_t > last_written_words;
+};
+
+
+static uint32_t get_elapsed_ns ( const std::chrono::steady_clock::time_point start_time )
+{
+  const int64_t ns = std::chrono::duration_cast< std::chrono::nanoseconds >( std::chrono::steady_clock::now() - start_time ).count();
+
+  return uint32_t( std::min< int64_t >( ns, UINT32_MAX ) );
+}
+
+
+static void send_byte ( loadgen_client & client, const uint8_t data )
+{
+  for ( ; ; )
+  {
+    const ssize_t res = send( client.socket_fd, &data, 1, MSG_NOSIGNAL );
+
+    if ( res == -1 && errno == EINTR )
+      continue;
+
+    if ( res == -1 )
+      throw std::runtime_error( get_error_message( "Error sending data: ", errno ) );
+
+    return;
+  }
+}
+
+
+static uint8_t receive_byte ( loadgen_client & client )
+{
+  for ( ; ; )
+  {
+    uint8_t data;
+    const ssize_t res = recv( client.socket_fd, &data, 1, 0 );
+
+    if ( res == -1 && errno == EINTR )
+      continue;
+
+    if ( res == -1 )
+      throw std::runtime_error( get_error_message( "Error receiving data: ", errno ) );
+
+    if ( res == 0 )
+      throw std::runtime_error( "The JTAG DPI module closed the connection." );
+
+    return data;
+  }
+}
+
+
+// Sends a single byte, waits for the single-byte reply, and records how long that took.
+
+static uint8_t round_trip ( loadgen_client & client, const uint8_t request, const round_trip_enum type )
+{
+  const std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+
+  send_byte( client, request );
+  const uint8_t reply = receive_byte( client );
+
+  client.round_trip_latency_ns[ type ].push_back( get_elapsed_ns( start_time ) );
+
+  return reply;
+}
+
+
+// Applies a JTAG data byte and waits until the pins have stayed for a TCK half period, as adv_jtag_bridge does.
+
+static void write_pins ( loadgen_client & client, const uint8_t data )
+{
+  if ( round_trip( client, data, RT_DATA_BYTE_ACK ) != ( data | DATA_BYTE_ACK_BIT ) )
+    throw std::runtime_error( "Unexpected reply to a JTAG data byte." );
+
+  if ( round_trip( client, CMD_WAIT_CLOCK_NOTIFICATION, RT_CLOCK_NOTIFICATION ) != CLOCK_NOTIFICATION_MSG )
+    throw std::runtime_error( "Unexpected reply to a clock notification request." );
+}
+
+
+// One TCK cycle: TCK low with the new TMS and TDI values, then TCK high. TRST stays deasserted.
+// If capture_tdo is set, TDO is read after the rising edge, which yields the bit
+// that the TAP shifted out in this cycle.
+
+static bool clock_tck ( loadgen_client & client, const bool tms, const bool tdi, const bool capture_tdo )
+{
+  const uint8_t data = JTAG_TRST_BIT | ( tms ? JTAG_TMS_BIT : 0 ) | ( tdi ? JTAG_TDI_BIT : 0 );
+
+  write_pins( client, data );
+  write_pins( client, data | JTAG_TCK_BIT );
+
+  ++client.tck_cycle_count;
+
+  if ( !capture_tdo )
+    return false;
+
+  const uint8_t tdo = round_trip( client, CMD_READ_TDO, RT_TDO_READ );
+
+  if ( tdo > 1 )
+    throw std::runtime_error( "Unexpected reply to a TDO read." );
+
+  return tdo != 0;
+}
+
+
+// 5 cycles with TMS high reach Test-Logic-Reset from any state, and the last one goes to Run-Test/Idle.
+// The TAP loads the IDCODE instruction on the way, so the debug instruction must be selected again.
+
+static void reset_tap ( loadgen_client & client )
+{
+  for ( int i = 0; i < 5; ++i )
+    clock_tck( client, true, false, false );
+
+  clock_tck( client, false, false, false );
+
+  client.is_debug_ir_selected = false;
+  client.selected_module = -1;
+}
+
+
+// Shifts the given bits through IR or DR, starting and ending in Run-Test/Idle.
+
+static bit_vector scan ( loadgen_client & client, const bool is_ir, const bit_vector & tdi, const bool capture_tdo )
+{
+  // Select-DR-Scan (and Select-IR-Scan), Capture, Shift.
+  clock_tck( client, true, false, false );
+
+  if ( is_ir )
+    clock_tck( client, true, false, false );
+
+  clock_tck( client, false, false, false );
+  clock_tck( client, false, false, false );
+
+  bit_vector tdo;
+
+  for ( uint32_t i = 0; i < tdi.bit_count; ++i )
+  {
+    // The last bit leaves the Shift state.
+    const bool tdo_bit = clock_tck( client, i == tdi.bit_count - 1, get_bit( tdi, i ), capture_tdo );
+
+    if ( capture_tdo )
+      append_bits( tdo, tdo_bit ? 1 : 0, 1 );
+  }
+
+  // Update, Run-Test/Idle.
+  clock_tck( client, true, false, false );
+  clock_tck( client, false, false, false );
+
+  return tdo;
+}
+
+
+static void select_module ( loadgen_client & client, const int module )
+{
+  if ( !client.is_debug_ir_selected )
+  {
+    bit_vector ir;
+    append_bits( ir, ADBG_TAP_IR_DEBUG, ADBG_TAP_IR_LENGTH );
+    scan( client, true, ir, false );
+
+    client.is_debug_ir_selected = true;
+    client.selected_module = -1;
+  }
+
+  if ( client.selected_module == module )
+    return;
+
+  // The top bit set means "module select".
+  bit_vector dr;
+  append_bits( dr, uint32_t( module ), ADBG_MODULE_ID_LENGTH );
+  append_bits( dr, 1, 1 );
+  scan( client, false, dr, false );
+
+  client.selected_module = module;
+}
+
+
+static void read_idcode ( loadgen_client & client, const loadgen_options & options, uint32_t * const first_idcode )
+{
+  // Going through Test-Logic-Reset selects the IDCODE instruction.
+  reset_tap( client );
+
+  bit_vector zeros;
+  append_zero_bits( zeros, IDCODE_LENGTH );
+
+  const uint32_t idcode = get_bits( scan( client, false, zeros, true ), 0, IDCODE_LENGTH );
+
+  if ( *first_idcode == 0 )
+  {
+    *first_idcode = idcode;
+    printf( "IDCODE: 0x%08X\n", unsigned( idcode ) );
+    fflush( stdout );
+  }
+
+  if ( idcode != ( options.is_expected_idcode_set ? options.expected_idcode : *first_idcode ) )
+    ++client.idcode_mismatch_count;
+}
+
+
+static void send_burst_command ( loadgen_client & client,
+                                 const loadgen_options & options,
+                                 const bool is_write )
+{
+  select_module( client, ADBG_MODULE_WISHBONE );
+
+  const bool is_byte_access = options.word_bit_count == 8;
+
+  uint32_t opcode;
+
+  if ( is_write )
+    opcode = is_byte_access ? ADBG_CMD_BWRITE8 : ADBG_CMD_BWRITE32;
+  else
+    opcode = is_byte_access ? ADBG_CMD_BREAD8  : ADBG_CMD_BREAD32;
+
+  bit_vector command;
+  append_bits( command, options.burst_word_count, 16 );
+  append_bits( command, options.address, 32 );
+  append_bits( command, opcode, ADBG_OPCODE_LENGTH );
+  append_bits( command, 0, 1 );  // Not a module select.
+  scan( client, false, command, false );
+}
+
+
+static void burst_read ( loadgen_client & client, const loadgen_options & options )
+{
+  send_burst_command( client, options, false );
+
+  bit_vector zeros;
+  append_zero_bits( zeros, ADBG_READ_STATUS_SLACK_BIT_COUNT + 1 +
+                           options.burst_word_count * options.word_bit_count +
+                           32 );
+
+  const bit_vector tdo = scan( client, false, zeros, true );
+
+  uint32_t pos = 0;
+
+  while ( !get_bit( tdo, pos ) )
+  {
+    if ( ++pos > ADBG_READ_STATUS_SLACK_BIT_COUNT )
+    {
+      ++client.read_timeout_count;
+      return;
+    }
+  }
+
+  ++pos;
+
+  uint32_t crc = 0xFFFFFFFF;
+  std::vector< uint32_t > words( options.burst_word_count );
+
+  for ( uint32_t i = 0; i < options.burst_word_count; ++i )
+  {
+    words[ i ] = get_bits( tdo, pos, options.word_bit_count );
+    pos += options.word_bit_count;
+    crc = adbg_update_crc( crc, words[ i ], options.word_bit_count );
+  }
+
+  if ( crc != get_bits( tdo, pos, 32 ) )
+  {
+    ++client.read_crc_error_count;
+    return;
+  }
+
+  client.payload_bytes_read += options.burst_word_count * ( options.word_bit_count / 8 );
+
+  if ( options.verify && !client.last_written_words.empty() && words != client.last_written_words )
+    ++client.verify_mismatch_count;
+}
+
+
+static void burst_write ( loadgen_client & client, const loadgen_options & options, const uint64_t operation_index )
+{
+  send_burst_command( client, options, true );
+
+  // Each write stores different data, so that --verify notices stale reads.
+  const uint32_t word_mask = options.word_bit_count == 32 ? 0xFFFFFFFF : 0xFF;
+
+  std::vector< uint32_t > words( options.burst_word_count );
+
+  for ( uint32_t i = 0; i < options.burst_word_count; ++i )
+    words[ i ] = ( uint32_t( operation_index * 0x9E3779B9 ) + i * 0x01010101 ) & word_mask;
+
+  // A start bit, the data words, the CRC, and finally one bit to read the CRC match flag back.
+  bit_vector data;
+  append_bits( data, 1, 1 );
+
+  uint32_t crc = 0xFFFFFFFF;
+
+  for ( uint32_t i = 0; i < options.burst_word_count; ++i )
+  {
+    append_bits( data, words[ i ], options.word_bit_count );
+    crc = adbg_update_crc( crc, words[ i ], options.word_bit_count );
+  }
+
+  append_bits( data, crc, 32 );
+  append_zero_bits( data, 1 );
+
+  const bit_vector tdo = scan( client, false, data, true );
+
+  if ( !get_bit( tdo, options.burst_word_count * options.word_bit_count + 1 + 32 ) )
+  {
+    ++client.write_crc_error_count;
+    client.last_written_words.clear();
+    return;
+  }
+
+  client.payload_bytes_written += options.burst_word_count * ( options.word_bit_count / 8 );
+  client.last_written_words = words;
+}
+
+
+// The same sequence as the GDB server's CPU status read in jtag_dpi.cpp, which GDB repeats
+// all the time while the CPU is running, in order to find out when it stops.
+
+static void poll_cpu_stall ( loadgen_client & client )
+{
+  select_module( client, ADBG_MODULE_CPU0 );
+
+  bit_vector select;
+  append_bits( select, ADBG_CPU0_REG_STATUS, ADBG_CPU0_REG_SEL_LENGTH );
+  append_bits( select, ADBG_CMD_IREG_SEL, ADBG_OPCODE_LENGTH );
+  append_bits( select, 0, 1 );
+  scan( client, false, select, false );
+
+  // The register comes out first, while shifting in a no-operation command.
+  bit_vector zeros;
+  append_zero_bits( zeros, ADBG_CPU0_STATUS_LENGTH + ADBG_OPCODE_LENGTH + 1 );
+
+  const uint32_t status = get_bits( scan( client, false, zeros, true ), 0, ADBG_CPU0_STATUS_LENGTH );
+
+  if ( status & ADBG_CPU0_STATUS_STALL )
+    ++client.stalled_poll_count;
+}
+
+
+// Returns the value below which the given fraction of the sorted samples lie.
+
+static double get_percentile_us ( const std::vector< uint32_t > & sorted_samples, const double fraction )
+{
+  const size_t count = sorted_samples.size();
+  size_t index = size_t( fraction * double( count ) );
+
+  if ( index >= count )
+    index = count - 1;
+
+  return sorted_samples[ index ] / 1000.0;
+}
+
+
+static void print_latency_line ( const char * const name, std::vector< uint32_t > & samples )
+{
+  if ( samples.empty() )
+    return;
+
+  std::sort( samples.begin(), samples.end() );
+
+  printf( "  %-24s %10zu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+          name,
+          samples.size(),
+          get_percentile_us( samples, 0.50 ),
+          get_percentile_us( samples, 0.90 ),
+          get_percentile_us( samples, 0.99 ),
+          get_percentile_us( samples, 0.999 ),
+          samples.back() / 1000.0 );
+}
+
+
+static void print_report ( loadgen_client & client, const double elapsed_s )
+{
+  uint64_t operation_count = 0;
+
+  for ( int i = 0; i < OP_COUNT; ++i )
+    operation_count += client.operation_latency_ns[ i ].size();
+
+  uint64_t round_trip_count = 0;
+
+  for ( int i = 0; i < RT_COUNT; ++i )
+    round_trip_count += client.round_trip_latency_ns[ i ].size();
+
+  printf( "%llu operations in %.3f s: %.1f operations/s.\n",
+          (unsigned long long) operation_count, elapsed_s, operation_count / elapsed_s );
+
+  printf( "TCK cycles: %llu, %.0f per second. Round trips: %llu, %.0f per second.\n",
+          (unsigned long long) client.tck_cycle_count, client.tck_cycle_count / elapsed_s,
+          (unsigned long long) round_trip_count, round_trip_count / elapsed_s );
+
+  if ( client.payload_bytes_read != 0 || client.payload_bytes_written != 0 )
+  {
+    printf( "Payload: %.1f bytes/s read, %.1f bytes/s written.\n",
+            client.payload_bytes_read / elapsed_s, client.payload_bytes_written / elapsed_s );
+  }
+
+  printf( "Latency in microseconds:     count        p50        p90        p99      p99.9        max\n" );
+
+  for ( int i = 0; i < RT_COUNT; ++i )
+    print_latency_line( ROUND_TRIP_NAMES[ i ], client.round_trip_latency_ns[ i ] );
+
+  for ( int i = 0; i < OP_COUNT; ++i )
+  {
+    const std::string name = std::string( "Operation " ) + OPERATION_NAMES[ i ];
+    print_latency_line( name.c_str(), client.operation_latency_ns[ i ] );
+  }
+
+  if ( !client.operation_latency_ns[ OP_STALL_POLL ].empty() )
+  {
+    printf( "CPU stall polls: %llu found the CPU stalled.\n", (unsigned long long) client.stalled_poll_count );
+  }
+
+  printf( "Errors: %llu IDCODE mismatches, %llu read CRC errors, %llu reads without a start bit, "
+          "%llu write CRC errors, %llu verify mismatches.\n",
+          (unsigned long long) client.idcode_mismatch_count,
+          (unsigned long long) client.read_crc_error_count,
+          (unsigned long long) client.read_timeout_count,
+          (unsigned long long) client.write_crc_error_count,
+          (unsigned long long) client.verify_mismatch_count );
+}
+
+
+static bool has_errors ( const loadgen_client & client )
+{
+  return client.idcode_mismatch_count != 0 ||
+         client.read_crc_error_count  != 0 ||
+         client.read_timeout_count    != 0 ||
+         client.write_crc_error_count != 0 ||
+         client.verify_mismatch_count != 0;
+}
+
+
+// Returns false if any operation failed.
+
+static bool run_load ( const loadgen_options & options )
+{
+  loadgen_client client = loadgen_client();
+  client.socket_fd = connect_to_module( options.tcp_port, options.unix_socket_path );
+
+  uint32_t first_idcode = 0;
+
+  try
+  {
+    // The TAP state is unknown after connecting.
+    reset_tap( client );
+
+    const std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+    const std::chrono::steady_clock::time_point end_time   = start_time + std::chrono::microseconds( int64_t( options.duration_s * 1e6 ) );
+
+    for ( uint64_t i = 0;
+          options.operation_count != 0 ? i < options.operation_count : std::chrono::steady_clock::now() < end_time;
+          ++i )
+    {
+      const operation_enum operation = options.operations[ i % options.operations.size() ];
+
+      const std::chrono::steady_clock::time_point operation_start_time = std::chrono::steady_clock::now();
+
+      switch ( operation )
+      {
+      case OP_IDCODE:     read_idcode( client, options, &first_idcode ); break;
+      case OP_READ:       burst_read( client, options ); break;
+      case OP_WRITE:      burst_write( client, options, i ); break;
+      case OP_STALL_POLL: poll_cpu_stall( client ); break;
+      default: throw std::runtime_error( "Internal error: invalid operation." );
+      }
+
+      client.operation_latency_ns[ operation ].push_back( get_elapsed_ns( operation_start_time ) );
+    }
+
+    print_report( client, std::chrono::duration< double >( std::chrono::steady_clock::now() - start_time ).count() );
+  }
+  catch ( ... )
+  {
+    close( client.socket_fd );
+    throw;
+  }
+
+  close( client.socket_fd );
+
+  return !has_errors( client );
+}
+
+
+static void print_usage ( void )
+{
+  printf( "Usage: jtag_dpi_loadgen [options]\n"
+          "  --port=N             TCP port of the JTAG DPI module (default: 4567).\n"
+          "  --unix=path          Connect to a JTAG DPI module with TRANSPORT 1 instead.\n"
+          "  --pattern=list       Comma-separated operations, run in turn (default: idcode):\n"
+          "                         idcode      Reset the TAP and read the IDCODE.\n"
+          "                         read        adv_dbg_if burst read over the Wishbone bus.\n"
+          "                         write       adv_dbg_if burst write over the Wishbone bus.\n"
+          "                         stall-poll  Read the CPU stall status, as GDB does while the CPU runs.\n"
+          "  --seconds=N          How long to run (default: 10).\n"
+          "  --count=N            Run this many operations instead.\n"
+          "  --address=A          Wishbone address for read and write. Required for them.\n"
+          "  --burst-words=N      Words per burst, 1 to 65535 (default: 16).\n"
+          "  --word-size=8|32     Word size in bits for the bursts (default: 32).\n"
+          "  --verify             Check that each read returns the data of the last write.\n"
+          "  --expected-idcode=X  Count IDCODE reads that do not return X. By default,\n"
+          "                       the first IDCODE read is the reference.\n"
+          "Numbers can be decimal or hexadecimal with a 0x prefix.\n"
+          "Writes modify the simulated memory, so use an address the firmware does not need.\n"
+          "The exit code is 1 if any operation failed.\n" );
+}
+
+
+static uint32_t parse_number ( const char * const value )
+{
+  char * end;
+  errno = 0;
+  const unsigned long long number = strtoull( value, &end, 0 );
+
+  if ( *value == '\0' || *end != '\0' || errno != 0 || number > UINT32_MAX )
+    throw std::runtime_error( std::string( "Invalid number \"" ) + value + "\"." );
+
+  return uint32_t( number );
+}
+
+
+static std::vector< operation_enum > parse_pattern ( const std::string & pattern )
+{
+  std::vector< operation_enum > operations;
+
+  size_t pos = 0;
+
+  for ( ; ; )
+  {
+    const size_t comma_pos = pattern.find( ',', pos );
+    const std::string name = pattern.substr( pos, comma_pos == std::string::npos ? std::string::npos : comma_pos - pos );
+
+    int i = 0;
+
+    while ( i < OP_COUNT && name != OPERATION_NAMES[ i ] )
+      ++i;
+
+    if ( i == OP_COUNT )
+      throw std::runtime_error( "Unknown operation \"" + name + "\" in the pattern. Try --help." );
+
+    operations.push_back( operation_enum( i ) );
+
+    if ( comma_pos == std::string::npos )
+      break;
+
+    pos = comma_pos + 1;
+  }
+
+  return operations;
+}
+
+
+int main ( int argc, char ** argv )
+{
+  try
+  {
+    loadgen_options options = loadgen_options();
+    options.tcp_port         = 4567;
+    options.duration_s       = 10;
+    options.burst_word_count = 16;
+    options.word_bit_count   = 32;
+    options.operations.push_back( OP_IDCODE );
+
+    for ( int i = 1; i < argc; ++i )
+    {
+      if ( 0 == strncmp( argv[i], "--port=", 7 ) )
+        options.tcp_port = int( parse_number( argv[i] + 7 ) );
+      else if ( 0 == strncmp( argv[i], "--unix=", 7 ) )
+        options.unix_socket_path = argv[i] + 7;
+      else if ( 0 == strncmp( argv[i], "--pattern=", 10 ) )
+        options.operations = parse_pattern( argv[i] + 10 );
+      else if ( 0 == strncmp( argv[i], "--seconds=", 10 ) )
+        options.duration_s = parse_number( argv[i] + 10 );
+      else if ( 0 == strncmp( argv[i], "--count=", 8 ) )
+        options.operation_count = parse_number( argv[i] + 8 );
+      else if ( 0 == strncmp( argv[i], "--address=", 10 ) )
+      {
+        options.address = parse_number( argv[i] + 10 );
+        options.is_address_set = true;
+      }
+      else if ( 0 == strncmp( argv[i], "--burst-words=", 14 ) )
+        options.burst_word_count = parse_number( argv[i] + 14 );
+      else if ( 0 == strncmp( argv[i], "--word-size=", 12 ) )
+        options.word_bit_count = parse_number( argv[i] + 12 );
+      else if ( 0 == strcmp( argv[i], "--verify" ) )
+        options.verify = true;
+      else if ( 0 == strncmp( argv[i], "--expected-idcode=", 18 ) )
+      {
+        options.expected_idcode = parse_number( argv[i] + 18 );
+        options.is_expected_idcode_set = true;
+      }
+      else if ( 0 == strcmp( argv[i], "--help" ) )
+      {
+        print_usage();
+        return 0;
+      }
+      else
+        throw std::runtime_error( std::string( "Unknown option \"" ) + argv[i] + "\". Try --help." );
+    }
+
+    if ( options.duration_s == 0 && options.operation_count == 0 )
+      throw std::runtime_error( "Invalid --seconds value." );
+
+    if ( options.burst_word_count == 0 || options.burst_word_count > MAX_BURST_WORD_COUNT )
+      throw std::runtime_error( "Invalid --burst-words value." );
+
+    if ( options.word_bit_count != 8 && options.word_bit_count != 32 )
+      throw std::runtime_error( "Invalid --word-size value." );
+
+    const bool has_bursts = options.operations.end() != std::find( options.operations.begin(), options.operations.end(), OP_READ ) ||
+                            options.operations.end() != std::find( options.operations.begin(), options.operations.end(), OP_WRITE );
+
+    // Reading from or writing to a random address could hang the Wishbone bus or overwrite the firmware.
+    if ( has_bursts && !options.is_address_set )
+      throw std::runtime_error( "The read and write operations need option --address." );
+
+    if ( has_bursts && options.word_bit_count == 32 && options.address % 4 != 0 )
+      throw std::runtime_error( "The address must be a multiple of 4 for 32-bit words." );
+
+    if ( !run_load( options ) )
+      return 1;
+  }
+  catch ( const std::exception & e )
+  {
+    fprintf( stderr, "%s%s\n", "ERROR: ", e.what() );
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,368 @@
+
+// Copyright (c) 2012, R. Diez
+//
+// Loads a binary image into simulated memory, or dumps simulated memory to a file, over the
+// JTAG DPI module's backdoor memory commands (see "Backdoor memory access" in jtag_dpi.cpp).
+// That bypasses the JTAG pins and the debug interface, so even large images load in a fraction
+// of a second, in zero simulated time. Use GDB's "load" command instead if you want
+// to exercise the debug path. See build_jtag_dpi_memory for instructions on how to build it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <chrono>
+
+
+// These values are part of the socket protocol, see jtag_dpi.cpp.
+static const uint8_t  CMD_QUERY_EXTENSIONS = 0x82;
+static const uint8_t  CMD_BACKDOOR_WRITE   = 0x8C;
+static const uint8_t  CMD_BACKDOOR_READ    = 0x8D;
+static const uint32_t EXT_BACKDOOR_MEMORY  = 0x00000010;
+static const uint8_t  BACKDOOR_STATUS_OK   = 0;
+
+// The JTAG DPI module accepts up to 1 MiB per command.
+static const uint32_t CHUNK_SIZE = 1024 * 1024;
+
+
+static std::string get_error_message ( const char * const prefix, const int errno_val )
+{
+  return std::string( prefix ) + strerror( errno_val );
+}
+
+
+static int connect_to_module ( const int tcp_port, const std::string & unix_socket_path )
+{
+  const int s = socket( unix_socket_path.empty() ? AF_INET : AF_UNIX, SOCK_STREAM, 0 );
+
+  if ( s == -1 )
+    throw std::runtime_error( get_error_message( "Error creating the socket: ", errno ) );
+
+  int res;
+
+  if ( unix_socket_path.empty() )
+  {
+    sockaddr_in addr;
+    memset( &addr, 0, sizeof(addr) );
+    addr.sin_family      = AF_INET;
+    addr.sin_port        = htons( uint16_t( tcp_port ) );
+    addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+
+    res = connect( s, reinterpret_cast< const sockaddr * >( &addr ), sizeof(addr) );
+
+    if ( res == 0 )
+    {
+      const int one = 1;
+      setsockopt( s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) );
+    }
+  }
+  else
+  {
+    sockaddr_un addr;
+    memset( &addr, 0, sizeof(addr) );
+    addr.sun_family = AF_UNIX;
+
+    if ( unix_socket_path.size() >= sizeof( addr.sun_path ) )
+      throw std::runtime_error( "The Unix socket path is too long." );
+
+    strcpy( addr.sun_path, unix_socket_path.c_str() );
+
+    res = connect( s, reinterpret_cast< const sockaddr * >( &addr ), sizeof(addr) );
+  }
+
+  if ( res != 0 )
+  {
+    const int errno_val = errno;
+    close( s );
+    throw std::runtime_error( get_error_message( "Error connecting to the JTAG DPI module: ", errno_val ) );
+  }
+
+  return s;
+}
+
+
+static void send_all ( const int s, const void * const data, const size_t len )
+{
+  const uint8_t * const bytes = static_cast< const uint8_t * >( data );
+  size_t sent = 0;
+
+  while ( sent < len )
+  {
+    const ssize_t res = send( s, bytes + sent, len - sent, MSG_NOSIGNAL );
+
+    if ( res == -1 )
+    {
+      if ( errno == EINTR )
+        continue;
+
+      throw std::runtime_error( get_error_message( "Error sending data: ", errno ) );
+    }
+
+    sent += size_t( res );
+  }
+}
+
+
+static void receive_all ( const int s, void * const data, const size_t len )
+{
+  uint8_t * const bytes = static_cast< uint8_t * >( data );
+  size_t received = 0;
+
+  while ( received < len )
+  {
+    const ssize_t res = recv( s, bytes + received, len - received, 0 );
+
+    if ( res == -1 )
+    {
+      if ( errno == EINTR )
+        continue;
+
+      throw std::runtime_error( get_error_message( "Error receiving data: ", errno ) );
+    }
+
+    if ( res == 0 )
+      throw std::runtime_error( "The JTAG DPI module closed the connection." );
+
+    received += size_t( res );
+  }
+}
+
+
+static void put_uint32_le ( uint8_t * const dest, const uint32_t value )
+{
+  dest[0] = uint8_t( value       );
+  dest[1] = uint8_t( value >>  8 );
+  dest[2] = uint8_t( value >> 16 );
+  dest[3] = uint8_t( value >> 24 );
+}
+
+
+static void check_backdoor_support ( const int s )
+{
+  send_all( s, &CMD_QUERY_EXTENSIONS, 1 );
+
+  uint8_t reply[ 4 ];
+  receive_all( s, reply, sizeof(reply) );
+
+  const uint32_t extensions = uint32_t( reply[0] ) | ( uint32_t( reply[1] ) << 8 ) |
+                              ( uint32_t( reply[2] ) << 16 ) | ( uint32_t( reply[3] ) << 24 );
+
+  if ( 0 == ( extensions & EXT_BACKDOOR_MEMORY ) )
+  {
+    throw std::runtime_error( "The simulation does not support backdoor memory access. "
+                              "See jtag_dpi_set_backdoor_memory_access() in jtag_dpi.cpp." );
+  }
+}
+
+
+static void send_backdoor_header ( const int s, const uint8_t cmd, const uint32_t address, const uint32_t byte_count )
+{
+  uint8_t header[ 9 ];
+  header[0] = cmd;
+  put_uint32_le( &header[1], address    );
+  put_uint32_le( &header[5], byte_count );
+
+  send_all( s, header, sizeof(header) );
+}
+
+
+static void receive_backdoor_status ( const int s, const uint8_t cmd, const uint32_t address, const uint32_t byte_count )
+{
+  uint8_t reply[ 2 ];
+  receive_all( s, reply, sizeof(reply) );
+
+  if ( reply[0] != cmd )
+    throw std::runtime_error( "Unexpected reply from the JTAG DPI module." );
+
+  if ( reply[1] != BACKDOOR_STATUS_OK )
+  {
+    char buffer[ 120 ];
+    snprintf( buffer, sizeof(buffer), "The address range 0x%08X - 0x%08X is not backed by simulated memory.",
+              unsigned( address ), unsigned( address + byte_count - 1 ) );
+    throw std::runtime_error( buffer );
+  }
+}
+
+
+static std::vector< uint8_t > read_file ( const std::string & filename )
+{
+  FILE * const f = fopen( filename.c_str(), "rb" );
+
+  if ( f == NULL )
+    throw std::runtime_error( get_error_message( ( "Error opening file \"" + filename + "\": " ).c_str(), errno ) );
+
+  std::vector< uint8_t > data;
+  uint8_t buffer[ 64 * 1024 ];
+  size_t len;
+
+  while ( 0 != ( len = fread( buffer, 1, sizeof(buffer), f ) ) )
+    data.insert( data.end(), buffer, buffer + len );
+
+  const bool failed = ferror( f ) != 0;
+  fclose( f );
+
+  if ( failed )
+    throw std::runtime_error( "Error reading file \"" + filename + "\"." );
+
+  return data;
+}
+
+
+static void write_file ( const std::string & filename, const std::vector< uint8_t > & data )
+{
+  FILE * const f = fopen( filename.c_str(), "wb" );
+
+  if ( f == NULL )
+    throw std::runtime_error( get_error_message( ( "Error creating file \"" + filename + "\": " ).c_str(), errno ) );
+
+  const bool failed = !data.empty() && data.size() != fwrite( &data[0], 1, data.size(), f );
+
+  if ( 0 != fclose( f ) || failed )
+    throw std::runtime_error( "Error writing file \"" + filename + "\"." );
+}
+
+
+static void load_image ( const int s, const uint32_t address, const std::vector< uint8_t > & image )
+{
+  for ( size_t offset = 0; offset < image.size(); offset += CHUNK_SIZE )
+  {
+    const uint32_t chunk_len = uint32_t( std::min( image.size() - offset, size_t( CHUNK_SIZE ) ) );
+
+    send_backdoor_header( s, CMD_BACKDOOR_WRITE, address + uint32_t( offset ), chunk_len );
+    send_all( s, &image[ offset ], chunk_len );
+    receive_backdoor_status( s, CMD_BACKDOOR_WRITE, address + uint32_t( offset ), chunk_len );
+  }
+}
+
+
+static std::vector< uint8_t > dump_memory ( const int s, const uint32_t address, const uint32_t byte_count )
+{
+  std::vector< uint8_t > data( byte_count );
+
+  for ( uint32_t offset = 0; offset < byte_count; offset += CHUNK_SIZE )
+  {
+    const uint32_t chunk_len = std::min( byte_count - offset, CHUNK_SIZE );
+
+    send_backdoor_header( s, CMD_BACKDOOR_READ, address + offset, chunk_len );
+    receive_backdoor_status( s, CMD_BACKDOOR_READ, address + offset, chunk_len );
+    receive_all( s, &data[ offset ], chunk_len );
+  }
+
+  return data;
+}
+
+
+static void print_usage ( void )
+{
+  printf( "Usage: jtag_dpi_memory [options] load <address> <file>\n"
+          "       jtag_dpi_memory [options] dump <address> <byte count> <file>\n"
+          "  --port=N        TCP port of the JTAG DPI module (default: 4567).\n"
+          "  --unix=path     Connect to a JTAG DPI module with TRANSPORT 1 instead.\n"
+          "Numbers can be decimal or hexadecimal with a 0x prefix.\n" );
+}
+
+
+static uint32_t parse_number ( const char * const value )
+{
+  char * end;
+  errno = 0;
+  const unsigned long long number = strtoull( value, &end, 0 );
+
+  if ( *value == '\0' || *end != '\0' || errno != 0 || number > UINT32_MAX )
+    throw std::runtime_error( std::string( "Invalid number \"" ) + value + "\"." );
+
+  return uint32_t( number );
+}
+
+
+int main ( int argc, char ** argv )
+{
+  try
+  {
+    int tcp_port = 4567;
+    std::string unix_socket_path;
+    std::vector< const char * > args;
+
+    for ( int i = 1; i < argc; ++i )
+    {
+      if ( 0 == strncmp( argv[i], "--port=", 7 ) )
+        tcp_port = int( parse_number( argv[i] + 7 ) );
+      else if ( 0 == strncmp( argv[i], "--unix=", 7 ) )
+        unix_socket_path = argv[i] + 7;
+      else if ( 0 == strcmp( argv[i], "--help" ) )
+      {
+        print_usage();
+        return 0;
+      }
+      else if ( 0 == strncmp( argv[i], "--", 2 ) )
+        throw std::runtime_error( std::string( "Unknown option \"" ) + argv[i] + "\". Try --help." );
+      else
+        args.push_back( argv[i] );
+    }
+
+    const bool is_load = args.size() == 3 && 0 == strcmp( args[0], "load" );
+    const bool is_dump = args.size() == 4 && 0 == strcmp( args[0], "dump" );
+
+    if ( !is_load && !is_dump )
+      throw std::runtime_error( "Invalid command-line arguments. Try --help." );
+
+    const uint32_t address = parse_number( args[1] );
+
+    const std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+
+    const int s = connect_to_module( tcp_port, unix_socket_path );
+
+    check_backdoor_support( s );
+
+    size_t byte_count;
+
+    if ( is_load )
+    {
+      const std::vector< uint8_t > image = read_file( args[2] );
+
+      if ( uint64_t( address ) + image.size() > uint64_t( UINT32_MAX ) + 1 )
+        throw std::runtime_error( "The image does not fit in the 32-bit address space." );
+
+      load_image( s, address, image );
+      byte_count = image.size();
+    }
+    else
+    {
+      const uint32_t dump_byte_count = parse_number( args[2] );
+
+      if ( uint64_t( address ) + dump_byte_count > uint64_t( UINT32_MAX ) + 1 )
+        throw std::runtime_error( "The address range does not fit in the 32-bit address space." );
+
+      write_file( args[3], dump_memory( s, address, dump_byte_count ) );
+      byte_count = dump_byte_count;
+    }
+
+    close( s );
+
+    printf( "%s %zu bytes at address 0x%08X in %.3f s.\n",
+            is_load ? "Loaded" : "Dumped",
+            byte_count,
+            unsigned( address ),
+            std::chrono::duration< double >( std::chrono::steady_clock::now() - start_time ).count() );
+  }
+  catch ( const std::exception & e )
+  {
+    fprintf( stderr, "%s%s\n", "ERROR: ", e.what() );
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,354 @@
+
+// Copyright (c) 2012, R. Diez
+//
+// Turns a binary trace file written by the JTAG DPI module (see "Binary trace" in jtag_dpi.cpp
+// and TRACE_FILE in jtag_dpi.v) into text, one line per record. Pin updates show the JTAG signals
+// and, on each rising TCK edge, the TAP state that the edge leads to. The TAP state is tracked
+// from the pins only, so it is unknown until TRST is asserted or TMS stays high for 5 TCK cycles.
+// The TDO samples taken during a pin batch come late in the file, so this tool puts them back in tick order.
+// See build_jtag_dpi_trace_decode for instructions on how to build it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include <stdexcept>
+#include <string>
+#include <deque>
+
+
+// These values are part of the trace file format, see TRACE_FILE_MAGIC in jtag_dpi.cpp.
+static const char    TRACE_FILE_MAGIC[] = "JDPITRC1";
+static const size_t  TRACE_RECORD_LEN = 16;
+
+static const uint8_t TRACE_EVENT_PIN_UPDATE        = 1;
+static const uint8_t TRACE_EVENT_TDO_SAMPLE        = 2;
+static const uint8_t TRACE_EVENT_CONNECTION_OPENED = 3;
+static const uint8_t TRACE_EVENT_CONNECTION_CLOSED = 4;
+static const uint8_t TRACE_EVENT_RECORDS_DROPPED   = 5;
+
+// Bits in a JTAG data byte.
+static const uint8_t JTAG_TCK_BIT  = 0x01;
+static const uint8_t JTAG_TRST_BIT = 0x02;
+static const uint8_t JTAG_TDI_BIT  = 0x04;
+static const uint8_t JTAG_TMS_BIT  = 0x08;
+
+// A TDO sample record comes at most one pin batch late, so this many records are plenty for sorting.
+static const size_t REORDER_WINDOW_RECORD_COUNT = 256;
+
+static const int TAP_STATE_UNKNOWN = -1;
+
+static const char * const TAP_STATE_NAMES[ 16 ] =
+{
+  "Test-Logic-Reset", "Run-Test/Idle",
+  "Select-DR-Scan", "Capture-DR", "Shift-DR", "Exit1-DR", "Pause-DR", "Exit2-DR", "Update-DR",
+  "Select-IR-Scan", "Capture-IR", "Shift-IR", "Exit1-IR", "Pause-IR", "Exit2-IR", "Update-IR"
+};
+
+// Indexed by the current state, first with TMS = 0 and then with TMS = 1. The same as in jtag_dpi.cpp.
+static const int TAP_TRANSITIONS[ 16 ][ 2 ] =
+{
+  {  1,  0 },  // Test-Logic-Reset
+  {  1,  2 },  // Run-Test/Idle
+  {  3,  9 },  // Select-DR-Scan
+  {  4,  5 },  // Capture-DR
+  {  4,  5 },  // Shift-DR
+  {  6,  8 },  // Exit1-DR
+  {  6,  7 },  // Pause-DR
+  {  4,  8 },  // Exit2-DR
+  {  1,  2 },  // Update-DR
+  { 10,  0 },  // Select-IR-Scan
+  { 11, 12 },  // Capture-IR
+  { 11, 12 },  // Shift-IR
+  { 13, 15 },  // Exit1-IR
+  { 13, 14 },  // Pause-IR
+  { 11, 15 },  // Exit2-IR
+  {  1,  2 }   // Update-IR
+};
+
+
+static std::string get_error_message ( const char * const prefix, const int errno_val )
+{
+  return std::string( prefix ) + strerror( errno_val );
+}
+
+
+static uint64_t get_uint_le ( const uint8_t * const data, const int byte_count )
+{
+  uint64_t value = 0;
+
+  for ( int i = byte_count - 1; i >= 0; --i )
+    value = ( value << 8 ) | data[ i ];
+
+  return value;
+}
+
+
+struct trace_record
+{
+  uint64_t tick;
+  uint8_t  event;
+  uint8_t  pins;
+  uint8_t  tdo;
+  uint32_t argument;
+};
+
+
+// Follows the TAP state machine like track_tap_state() in jtag_dpi.cpp.
+// Returns true on a rising TCK edge.
+
+static bool track_tap_state ( const uint8_t pins,
+                              bool * const tck_level,
+                              int * const consecutive_tms_high_count,
+                              int * const state )
+{
+  const bool tck = 0 != ( pins & JTAG_TCK_BIT );
+  const bool tms = 0 != ( pins & JTAG_TMS_BIT );
+  const bool is_rising_edge = tck && !*tck_level;
+
+  *tck_level = tck;
+
+  if ( 0 == ( pins & JTAG_TRST_BIT ) )
+  {
+    *state = 0;
+    return is_rising_edge;
+  }
+
+  if ( is_rising_edge )
+  {
+    *consecutive_tms_high_count = tms ? *consecutive_tms_high_count + 1 : 0;
+
+    if ( *state != TAP_STATE_UNKNOWN )
+      *state = TAP_TRANSITIONS[ *state ][ tms ? 1 : 0 ];
+    else if ( *consecutive_tms_high_count >= 5 )
+      *state = 0;
+  }
+
+  return is_rising_edge;
+}
+
+
+struct decoder_state
+{
+  bool pins_only;
+
+  bool tck_level;
+  int  consecutive_tms_high_count;
+  int  tap_state;
+
+  uint64_t dropped_count;
+};
+
+
+static void print_record ( FILE * const output, const trace_record & record, decoder_state & state )
+{
+  const unsigned long long tick = (unsigned long long) record.tick;
+
+  switch ( record.event )
+  {
+  case TRACE_EVENT_PIN_UPDATE:
+    {
+      const bool is_rising_edge = track_tap_state( record.pins,
+                                                   &state.tck_level,
+                                                   &state.consecutive_tms_high_count,
+                                                   &state.tap_state );
+
+      fprintf( output, "%12llu  TCK=%d TMS=%d TDI=%d TRST=%d",
+               tick,
+               ( record.pins & JTAG_TCK_BIT  ) ? 1 : 0,
+               ( record.pins & JTAG_TMS_BIT  ) ? 1 : 0,
+               ( record.pins & JTAG_TDI_BIT  ) ? 1 : 0,
+               ( record.pins & JTAG_TRST_BIT ) ? 1 : 0 );
+
+      if ( is_rising_edge )
+      {
+        fprintf( output, "  -> %s", state.tap_state == TAP_STATE_UNKNOWN ? "(unknown TAP state)"
+                                                                         : TAP_STATE_NAMES[ state.tap_state ] );
+      }
+
+      fprintf( output, "\n" );
+      break;
+    }
+
+  case TRACE_EVENT_TDO_SAMPLE:
+    if ( !state.pins_only )
+      fprintf( output, "%12llu  TDO=%d\n", tick, record.tdo ? 1 : 0 );
+    break;
+
+  case TRACE_EVENT_CONNECTION_OPENED:
+    if ( !state.pins_only )
+      fprintf( output, "%12llu  Connection opened.\n", tick );
+    break;
+
+  case TRACE_EVENT_CONNECTION_CLOSED:
+    if ( !state.pins_only )
+      fprintf( output, "%12llu  Connection closed.\n", tick );
+    break;
+
+  case TRACE_EVENT_RECORDS_DROPPED:
+    // The TAP state cannot be followed across the gap.
+    state.tap_state = TAP_STATE_UNKNOWN;
+    state.consecutive_tms_high_count = 0;
+    state.dropped_count += record.argument;
+    fprintf( output, "%12llu  %u records dropped, the TAP state is unknown again.\n", tick, unsigned( record.argument ) );
+    break;
+
+  default:
+    fprintf( output, "%12llu  Unknown event %u.\n", tick, unsigned( record.event ) );
+    break;
+  }
+}
+
+
+// Inserts the record in tick order. A TDO value was sampled just before the pin update on the same tick.
+
+static void insert_record ( std::deque< trace_record > & window, const trace_record & record )
+{
+  std::deque< trace_record >::iterator pos = window.end();
+
+  while ( pos != window.begin() )
+  {
+    const trace_record & prev = *( pos - 1 );
+
+    if ( prev.tick < record.tick )
+      break;
+
+    if ( prev.tick == record.tick &&
+         !( record.event == TRACE_EVENT_TDO_SAMPLE && prev.event == TRACE_EVENT_PIN_UPDATE ) )
+    {
+      break;
+    }
+
+    --pos;
+  }
+
+  window.insert( pos, record );
+}
+
+
+static void decode_trace ( FILE * const input, FILE * const output, const bool pins_only )
+{
+  uint8_t magic[ sizeof( TRACE_FILE_MAGIC ) - 1 ];
+
+  if ( fread( magic, 1, sizeof( magic ), input ) != sizeof( magic ) ||
+       0 != memcmp( magic, TRACE_FILE_MAGIC, sizeof( magic ) ) )
+  {
+    throw std::runtime_error( "The input is not a JTAG DPI trace file." );
+  }
+
+  decoder_state state;
+  state.pins_only = pins_only;
+  state.tck_level = false;
+  state.consecutive_tms_high_count = 0;
+  state.tap_state = TAP_STATE_UNKNOWN;
+  state.dropped_count = 0;
+
+  std::deque< trace_record > window;
+  uint64_t record_count = 0;
+
+  uint8_t data[ TRACE_RECORD_LEN ];
+  size_t  len;
+
+  while ( 0 != ( len = fread( data, 1, sizeof( data ), input ) ) )
+  {
+    if ( len != sizeof( data ) )
+      throw std::runtime_error( "The trace file ends with an incomplete record." );
+
+    ++record_count;
+
+    trace_record record;
+    record.tick     = get_uint_le( &data[ 0 ], 8 );
+    record.event    = data[  8 ];
+    record.pins     = data[  9 ];
+    record.tdo      = data[ 10 ];
+    record.argument = uint32_t( get_uint_le( &data[ 12 ], 4 ) );
+
+    insert_record( window, record );
+
+    if ( window.size() > REORDER_WINDOW_RECORD_COUNT )
+    {
+      print_record( output, window.front(), state );
+      window.pop_front();
+    }
+  }
+
+  if ( ferror( input ) )
+    throw std::runtime_error( get_error_message( "Error reading the trace file: ", errno ) );
+
+  for ( ; !window.empty(); window.pop_front() )
+    print_record( output, window.front(), state );
+
+  if ( ferror( output ) )
+    throw std::runtime_error( get_error_message( "Error writing the output: ", errno ) );
+
+  fprintf( stderr, "%llu records, %llu dropped while tracing.\n",
+           (unsigned long long) record_count,
+           (unsigned long long) state.dropped_count );
+}
+
+
+static void print_usage ( void )
+{
+  printf( "Usage: jtag_dpi_trace_decode [options] <trace file>\n"
+          "  --pins-only     Only print the pin updates.\n"
+          "The text goes to stdout, and a summary to stderr.\n" );
+}
+
+
+int main ( int argc, char ** argv )
+{
+  try
+  {
+    bool pins_only = false;
+    const char * filename = NULL;
+
+    for ( int i = 1; i < argc; ++i )
+    {
+      if ( 0 == strcmp( argv[i], "--pins-only" ) )
+        pins_only = true;
+      else if ( 0 == strcmp( argv[i], "--help" ) )
+      {
+        print_usage();
+        return 0;
+      }
+      else if ( 0 == strncmp( argv[i], "--", 2 ) )
+        throw std::runtime_error( std::string( "Unknown option \"" ) + argv[i] + "\". Try --help." );
+      else if ( filename == NULL )
+        filename = argv[i];
+      else
+        throw std::runtime_error( "Invalid command-line arguments. Try --help." );
+    }
+
+    if ( filename == NULL )
+      throw std::runtime_error( "Invalid command-line arguments. Try --help." );
+
+    FILE * const input = fopen( filename, "rb" );
+
+    if ( input == NULL )
+      throw std::runtime_error( get_error_message( ( std::string( "Error opening file \"" ) + filename + "\": " ).c_str(), errno ) );
+
+    try
+    {
+      decode_trace( input, stdout, pins_only );
+    }
+    catch ( ... )
+    {
+      fclose( input );
+      throw;
+    }
+
+    fclose( input );
+
+    if ( 0 != fflush( stdout ) )
+      throw std::runtime_error( get_error_message( "Error writing the output: ", errno ) );
+  }
+  catch ( const std::exception & e )
+  {
+    fprintf( stderr, "%s%s\n", "ERROR: ", e.what() );
+    return 1;
+  }
+
+  return 0;
+}